@@ -17,10 +17,16 @@
 #
 
 import tempfile
+import time
 import binascii
+import gc
+import json
 import os
+import pickle
 import sys
+import threading
 import unittest
+import weakref
 import yara
 # Python 2/3
 try:
@@ -1236,6 +1242,854 @@ class TestYara(unittest.TestCase):
         rules = yara.compile(source=rules)
         self.assertListEqual(rules.warnings, expected)
 
+    def testAtoms(self):
+
+        r = yara.compile(source='rule test { strings: $a = "abcdefgh" condition: $a }')
+        atoms = r.atoms()
+
+        self.assertEqual(len(atoms), 1)
+        self.assertEqual(atoms[0].namespace, 'default')
+        self.assertEqual(atoms[0].rule, 'test')
+        self.assertEqual(atoms[0].string, '$a')
+        self.assertEqual(len(atoms[0].lengths), len(atoms[0].backtracks))
+        self.assertTrue(len(atoms[0].lengths) > 0)
+
+        offset = 0
+        for length, backtrack in zip(atoms[0].lengths, atoms[0].backtracks):
+            atom = atoms[0].atoms[offset:offset + length]
+            self.assertEqual(b'abcdefgh'[backtrack:backtrack + length], atom)
+            offset += length
+
+    def testIndexCandidates(self):
+
+        tmpdir = tempfile.mkdtemp()
+        paths = []
+
+        for i, content in enumerate([b'xxabcdefghxx', b'nothing here', b'']):
+            path = os.path.join(tmpdir, 'file%d' % i)
+            with open(path, 'wb') as f:
+                f.write(content)
+            paths.append(path)
+
+        index_path = os.path.join(tmpdir, 'index')
+        yara.build_index(paths, index_path)
+        index = yara.load_index(index_path)
+
+        self.assertEqual(index.filepaths, paths)
+
+        r = yara.compile(source='''
+            rule a { strings: $a = "abcdefgh" condition: $a }
+            rule b { condition: true }
+            ''')
+
+        candidates = r.candidates(index)
+
+        self.assertEqual(candidates['default:a'], paths[:1])
+        self.assertEqual(candidates['default:b'], paths)
+
+        with open(index_path, 'rb') as f:
+            data = f.read()
+
+        # A posting referring to a file that doesn't exist, and a truncated
+        # index, must be rejected.
+        for corrupt in (data[:-4] + b'\xff\xff\xff\xff', data[:-4]):
+            with open(index_path, 'wb') as f:
+                f.write(corrupt)
+            self.assertRaises(yara.Error, yara.load_index, index_path)
+
+    def testTimeoutAndCancellation(self):
+
+        r = yara.compile(source='rule test { strings: $a = "foo" condition: $a }')
+
+        self.assertTrue(r.match(data='foo', timeout=0.5))
+        self.assertTrue(r.match(data='foo', deadline=time.time() + 60))
+        self.assertRaises(yara.TimeoutError, r.match, data='foo', deadline=time.time() - 1)
+        self.assertTrue(r.match(data='foo', timeout=float('inf')))
+        self.assertTrue(r.match(data='foo', timeout=1e300))
+
+        with self.assertRaisesRegex(TypeError, 'process_region_timeout'):
+            r.match(data='foo', process_region_timeout='x')
+
+        token = yara.CancellationToken()
+        self.assertFalse(token.cancelled)
+        self.assertTrue(r.match(data='foo', cancellation_token=token))
+
+        token.cancel()
+        self.assertTrue(token.cancelled)
+        self.assertRaises(yara.CancelledError, r.match, data='foo', cancellation_token=token)
+
+        # Cancelling from a callback aborts the scan that is running, the
+        # token is checked each time libyara calls back into the module.
+        token = yara.CancellationToken()
+        r = yara.compile(source='rule a { condition: true } rule b { condition: true }')
+
+        def cancel(data):
+            token.cancel()
+            return yara.CALLBACK_CONTINUE
+
+        self.assertRaises(
+            yara.CancelledError, r.match, data='foo', callback=cancel,
+            cancellation_token=token)
+
+        # Cancelling from another thread interrupts a scan in progress, even
+        # if it never calls back into the module.
+        token = yara.CancellationToken()
+        r = yara.compile(source='''
+            rule slow {
+              condition:
+                for any i in (0..filesize - 1) : (uint8(i) == 1)
+            }''')
+
+        timer = threading.Timer(0.1, token.cancel)
+        timer.start()
+
+        start = time.time()
+        self.assertRaises(
+            yara.CancelledError, r.match, data=b'\x00' * (64 << 20),
+            cancellation_token=token)
+        self.assertLess(time.time() - start, 2)
+
+        timer.join()
+
+    def testPerScanLimits(self):
+
+        r = yara.compile(source='rule test { strings: $a = "ab" condition: $a }')
+
+        m = r.match(data='abababab', max_matches_per_string=2, max_match_data=1)
+        instances = m[0].strings[0].instances
+        self.assertEqual(len(instances), 2)
+        self.assertEqual(instances[0].matched_data, b'a')
+        self.assertEqual(instances[0].matched_length, 2)
+
+        r.set_config(max_matches_per_string=3)
+        m = r.match(data='abababab')
+        self.assertEqual(len(m[0].strings[0].instances), 3)
+
+        m = r.match(data='abababab', max_matches_per_string=0)
+        self.assertEqual(len(m[0].strings[0].instances), 4)
+        self.assertEqual(m[0].strings[0].instances[0].matched_data, b'ab')
+
+    def testExternalsObject(self):
+
+        r = yara.compile(
+            source='rule test { condition: ext_int == 15 and ext_str contains "ssi" }',
+            externals={'ext_int': 0, 'ext_str': ''})
+
+        externals = yara.Externals(r, {'ext_int': 15, 'ext_str': 'mississippi', 'unused': 1})
+        self.assertTrue(r.match(data='dummy', externals=externals))
+
+        externals.update(ext_str='foo')
+        self.assertFalse(r.match(data='dummy', externals=externals))
+
+        externals.update({'ext_str': 'issi'})
+        self.assertTrue(r.match(data='dummy', externals=externals))
+
+        self.assertRaises(yara.Error, externals.update, ext_int='foo')
+
+        other = yara.compile(source='rule test { condition: true }')
+        self.assertRaises(TypeError, other.match, data='dummy', externals=externals)
+
+    def testLazyModuleData(self):
+
+        data = {}
+
+        def callback(module):
+            data['module'] = module.module
+            data['foo'] = module.constants.foo
+            data['one'] = module.constants['one']
+            data['string_array'] = module.string_array[0]
+            data['keys'] = module.string_dict.keys()
+            data['materialized'] = module.constants.materialize()
+            data['view'] = module
+
+        r = yara.compile(source='import "tests" rule test { condition: false }')
+        r.match(data='', modules_callback=callback, lazy_modules=True)
+
+        self.assertEqual(data['module'], 'tests')
+        self.assertEqual(data['foo'], b'foo')
+        self.assertEqual(data['one'], 1)
+        self.assertEqual(data['string_array'], b'foo')
+        self.assertTrue('foo' in data['keys'])
+        self.assertEqual(data['materialized']['two'], 2)
+
+        # The view is not usable once the scan has finished.
+        self.assertRaises(yara.Error, lambda: data['view'].constants)
+
+        self.assertRaises(
+            ValueError, r.match, data='', modules_callback=callback,
+            lazy_modules=True, modules_fields={'tests': ['constants.foo']})
+
+    def testModulesFields(self):
+
+        data = {}
+
+        def callback(module_data):
+            data.update(module_data)
+
+        r = yara.compile(source='import "tests" rule test { condition: false }')
+        r.match(
+            data='',
+            modules_callback=callback,
+            modules_fields={'tests': ['constants.foo', 'struct_array.i']})
+
+        self.assertEqual(data['module'], 'tests')
+        self.assertEqual(data['constants'], {'foo': b'foo'})
+        self.assertTrue(all(set(item.keys()) <= set(['i']) for item in data['struct_array']))
+        self.assertFalse('string_array' in data)
+
+    def testJsonOutput(self):
+
+        r = yara.compile(source='rule test : tag1 { meta: a = 1 strings: $a = "ab" condition: $a }')
+
+        result = json.loads(r.match(data='xabab', output='json'))
+
+        self.assertEqual(len(result['matches']), 1)
+        self.assertEqual(result['matches'][0]['rule'], 'test')
+        self.assertEqual(result['matches'][0]['tags'], ['tag1'])
+        self.assertEqual(result['matches'][0]['meta'], {'a': 1})
+        instances = result['matches'][0]['strings'][0]['instances']
+        self.assertEqual([i['offset'] for i in instances], [1, 3])
+        self.assertEqual(instances[0]['matched_data'], '6162')
+
+        result = json.loads(r.match(data='ab', output='json', data_encoding='base64'))
+        self.assertEqual(result['matches'][0]['strings'][0]['instances'][0]['matched_data'], 'YWI=')
+
+        # Bytes that are not printable ASCII are escaped, the document is
+        # always valid UTF-8 and round-trips through json.
+        r2 = yara.compile(source='rule test { meta: s = "caf\\xc3\\xa9 \\xff" condition: true }')
+        document = r2.match(data='', output='json')
+        document.decode('utf-8')
+        result = json.loads(document)
+        self.assertEqual(result['modules'], {})
+        self.assertEqual(result['matches'][0]['meta']['s'].encode('latin-1'), b'caf\xc3\xa9 \xff')
+
+        self.assertRaises(ValueError, r.match, data='ab', output='xml')
+
+        f = tempfile.NamedTemporaryFile(delete=False)
+        f.write(b'ab')
+        f.close()
+
+        try:
+            with tempfile.TemporaryFile() as out:
+                count = r.scan_paths_to_ndjson([f.name, f.name + '.missing'], out)
+                out.seek(0)
+                lines = [json.loads(l) for l in out.read().splitlines()]
+        finally:
+            os.unlink(f.name)
+
+        self.assertEqual(count, 2)
+        self.assertEqual(lines[0]['path'], f.name)
+        self.assertEqual(lines[0]['matches'][0]['rule'], 'test')
+        self.assertTrue('error' in lines[1])
+
+    def testModulesDataBuffers(self):
+
+        requested = []
+
+        def provider(module_name):
+            requested.append(module_name)
+            return memoryview(bytearray(b'data'))
+
+        r = yara.compile(source='import "tests" rule test { condition: true }')
+        r.match(data='', modules_data={'tests': provider})
+        self.assertEqual(requested, ['tests'])
+
+        r.match(data='', modules_data={'tests': bytearray(b'data')})
+
+        r = yara.compile(source='rule test { condition: true }')
+        r.match(data='', modules_data={'tests': provider})
+        self.assertEqual(requested, ['tests'])
+
+    def testRuleSets(self):
+
+        r = yara.compile(sets={
+            'trusted': 'global rule g { condition: false } rule a { condition: true }',
+            'untrusted': {
+                'one': 'rule a { condition: true }',
+                'two': 'rule b { strings: $a = "x" condition: $a }'},
+        })
+
+        self.assertEqual(r.rule_sets, {
+            'trusted': 'trusted',
+            'untrusted:one': 'untrusted',
+            'untrusted:two': 'untrusted'})
+
+        matches = r.match(data='x')
+        groups = r.group_matches(matches)
+
+        self.assertFalse('trusted' in groups)
+        self.assertEqual(
+            sorted((m.namespace, m.rule) for m in groups['untrusted']),
+            [('untrusted:one', 'a'), ('untrusted:two', 'b')])
+
+        self.assertRaises(TypeError, yara.compile(source='rule a { condition: true }').group_matches, [])
+
+    def testResultCache(self):
+
+        r = yara.compile(source='rule test { strings: $a = "ab" condition: $a }')
+        cache = yara.ResultCache(max_bytes=1024 * 1024)
+
+        matches = r.match(data='xxab', cache=cache)
+        self.assertEqual((cache.hits, cache.misses), (0, 1))
+
+        cached = r.match(data='xxab', cache=cache)
+        self.assertEqual((cache.hits, cache.misses), (1, 1))
+        self.assertEqual(cached, matches)
+
+        r.match(data='xxab', cache=cache, fast=True)
+        self.assertEqual(cache.misses, 2)
+        self.assertEqual(len(cache), 2)
+
+        small = yara.ResultCache(max_bytes=700)
+        r.match(data='ab', cache=small)
+        r.match(data='xab', cache=small)
+        self.assertEqual(small.evictions, 1)
+        self.assertEqual(len(small), 1)
+
+        store = {}
+
+        class DictCache(object):
+            def get(self, key):
+                return store.get(key)
+            def put(self, key, value):
+                store[key] = value
+
+        r.match(data='ab', cache=DictCache())
+        self.assertEqual(len(store), 1)
+        self.assertEqual(len(list(store.keys())[0]), 64)
+
+        self.assertRaises(ValueError, r.match, data='ab', cache=cache, callback=lambda d: 0)
+        self.assertRaises(ValueError, r.match, data='ab', cache=cache, warnings_callback=lambda w, d: 0)
+
+        # Results handed out are copies, changing them doesn't alter the cache.
+        cached = r.match(data='xxab', cache=cache)
+        cached[0].strings[0].instances.clear()
+        del cached[:]
+        cached = r.match(data='xxab', cache=cache)
+        self.assertEqual(len(cached[0].strings[0].instances), 1)
+
+        f = tempfile.NamedTemporaryFile(delete=False)
+        f.write(b'xxab')
+        f.close()
+
+        try:
+            hits = cache.hits
+            self.assertEqual(r.match(f.name, cache=cache), matches)
+            self.assertEqual(cache.hits, hits + 1)
+        finally:
+            os.unlink(f.name)
+
+        self.assertRaises(yara.Error, r.match, f.name, cache=cache)
+
+    def testDiskResultCache(self):
+
+        r = yara.compile(source='''
+            rule test : t { meta: m = "v" strings: $a = "ab" xor condition: $a }''')
+
+        matches = r.match(data='xxab')
+        restored = pickle.loads(pickle.dumps(matches))
+        self.assertEqual(restored, matches)
+        self.assertEqual(restored[0].tags, ['t'])
+        self.assertEqual(restored[0].meta, {'m': 'v'})
+        self.assertTrue(restored[0].strings[0].is_xor())
+
+        instance = restored[0].strings[0].instances[0]
+        self.assertEqual(instance.offset, 2)
+        self.assertEqual(instance.matched_data, b'ab')
+
+        root = tempfile.mkdtemp()
+        cache = yara.DiskResultCache(os.path.join(root, 'cache'))
+
+        r.match(data='xxab', cache=cache)
+        self.assertEqual((cache.hits, cache.misses), (0, 1))
+
+        # A new cache on the same directory finds the stored results.
+        cache = yara.DiskResultCache(os.path.join(root, 'cache'))
+        cached = r.match(data='xxab', cache=cache)
+        self.assertEqual((cache.hits, cache.misses), (1, 0))
+        self.assertEqual(cached, matches)
+        self.assertEqual(
+            cached[0].strings[0].instances[0].matched_data, b'ab')
+
+        document = r.match(data='xxab', output='json', cache=cache)
+        self.assertEqual(r.match(data='xxab', output='json', cache=cache), document)
+        self.assertEqual(cache.hits, 2)
+
+        for name in os.listdir(cache.path):
+            with open(os.path.join(cache.path, name), 'wb') as f:
+                f.write(b'corrupt')
+
+        self.assertEqual(r.match(data='xxab', cache=cache), matches)
+        self.assertEqual(cache.misses, 2)
+
+    def testShardedRules(self):
+
+        sources = {
+            'ns1': 'rule a { strings: $a = "foo" condition: $a }',
+            'ns2': 'private rule p { condition: true } rule b { condition: p }',
+            'ns3': 'global rule g { condition: filesize > 100 } rule c { condition: true }',
+            'ns4': 'rule d { strings: $a = "bar" condition: $a }',
+        }
+
+        sharded = yara.compile(sources=sources, shards=3)
+        self.assertTrue(isinstance(sharded, yara.ShardedRules))
+        self.assertEqual(len(sharded.shards), 3)
+
+        expected = yara.compile(sources=sources).match(data='foobar')
+        matches = sharded.match(data='foobar')
+
+        self.assertEqual(
+            [(m.namespace, m.rule) for m in matches],
+            [(m.namespace, m.rule) for m in expected])
+
+        self.assertRaises(TypeError, yara.compile, source='rule a { condition: true }', shards=2)
+        self.assertRaises(ValueError, yara.compile, sources={'ns1': sources['ns1']}, shards=2)
+        self.assertRaises(ValueError, yara.compile, sources=sources, shards=5)
+
+        with self.assertRaisesRegex(TypeError, 'callback'):
+            sharded.match(data='foobar', callback=lambda d: 0)
+
+        self.assertRaises(TypeError, sharded.match, '/nonexistent', data='foobar')
+        self.assertRaises(yara.Error, sharded.match, '/nonexistent')
+
+    def testChunkedScanning(self):
+
+        r = yara.compile(source='rule test { strings: $a = "needle" condition: #a == 2 and filesize == 40 and uint8(0) == 0x78 }')
+
+        f = tempfile.NamedTemporaryFile(delete=False)
+        f.write(b'xxxxxxxneedlexxxxxxxxxxxxxxxneedlexxxxxx')
+        f.close()
+
+        try:
+            matches = r.match(f.name, chunk_size=10, chunk_overlap=8)
+            self.assertEqual(len(matches), 1)
+            offsets = [i.offset for i in matches[0].strings[0].instances]
+            self.assertEqual(offsets, [7, 28])
+
+            # Without an explicit overlap it's derived from the chunk size.
+            self.assertEqual(len(r.match(f.name, chunk_size=16)), 1)
+
+            self.assertRaises(ValueError, r.match, f.name, chunk_size=10, chunk_overlap=10)
+            self.assertRaises(ValueError, r.match, f.name, chunk_overlap=8)
+            self.assertRaises(ValueError, r.match, f.name, chunk_size=10, cache=yara.ResultCache(max_bytes=1024))
+
+            r2 = yara.compile(source='import "tests" rule test { condition: tests.constants.one == 1 }')
+            self.assertRaises(ValueError, r2.match, f.name, chunk_size=10)
+        finally:
+            os.unlink(f.name)
+
+        self.assertRaises(TypeError, r.match, data='needle', chunk_size=10)
+        self.assertRaises(TypeError, r.match, pid=os.getpid(), chunk_size=10)
+
+    def testRangeScanning(self):
+
+        r = yara.compile(source='rule test { strings: $a = "abc" condition: $a }')
+        r2 = yara.compile(source='rule test { strings: $a = "abc" condition: $a at 95 and filesize == 100 }')
+
+        f = tempfile.NamedTemporaryFile(delete=False)
+        f.write(b'x' * 50 + b'abc' + b'x' * 42 + b'abcxx')
+        f.close()
+
+        try:
+            self.assertFalse(r.match(f.name, ranges=[(0, 10), (-4, None)]))
+            matches = r.match(f.name, ranges=[(0, 10), (-5, None)])
+            self.assertEqual(matches[0].strings[0].instances[0].offset, 95)
+            self.assertTrue(r2.match(f.name, ranges=[(-10, None)]))
+            self.assertRaises(TypeError, r.match, data='abc', ranges=[(0, 1)])
+            self.assertRaises(ValueError, r.match, f.name, ranges=[(0, 10)], cache=yara.ResultCache(max_bytes=1024))
+            self.assertRaises(ValueError, r.match, f.name, ranges=[(0, 10)], read='read')
+        finally:
+            os.unlink(f.name)
+
+    def testReadStrategies(self):
+
+        r = yara.compile(source='rule test { strings: $a = "abc" condition: $a and filesize == 6 }')
+
+        f = tempfile.NamedTemporaryFile(delete=False)
+        f.write(b'xxxabc')
+        f.close()
+
+        try:
+            for strategy in ('mmap', 'read', 'auto'):
+                self.assertTrue(r.match(f.name, read=strategy))
+                self.assertTrue(r.match(f.name, read=strategy, fadvise_dontneed=True))
+            self.assertTrue(r.match(f.name, read='auto', read_threshold=0))
+            self.assertRaises(ValueError, r.match, f.name, read='bogus')
+        finally:
+            os.unlink(f.name)
+
+    def testPrefetchedBulkScan(self):
+
+        r = yara.compile(source='rule test { strings: $a = "abc" condition: $a }')
+
+        names = []
+
+        for i in range(10):
+            f = tempfile.NamedTemporaryFile(delete=False)
+            f.write(b'abc' if i % 2 else b'xyz')
+            f.close()
+            names.append(f.name)
+
+        try:
+            with tempfile.TemporaryFile() as out:
+                r.scan_paths_to_ndjson(names + ['/nonexistent'], out, prefetch=3)
+                out.seek(0)
+                lines = [json.loads(l) for l in out.read().splitlines()]
+        finally:
+            for name in names:
+                os.unlink(name)
+
+        self.assertEqual([l['path'] for l in lines], names + ['/nonexistent'])
+        self.assertEqual([len(l['matches']) for l in lines[:-1]], [0, 1] * 5)
+        self.assertTrue('error' in lines[-1])
+
+    def testPipeline(self):
+
+        r = yara.compile(source='rule test { strings: $a = "abc" condition: $a }')
+        pipeline = yara.Pipeline(r, workers=2, max_inflight_bytes=16)
+
+        for i in range(20):
+            pipeline.submit(i, data=b'xxabcxx' if i % 2 else b'xxxxxxx')
+
+        pipeline.submit('missing', filepath='/nonexistent')
+        pipeline.close()
+
+        results = dict(pipeline)
+
+        self.assertEqual(len(results), 21)
+        self.assertEqual([len(results[i]) for i in range(20)], [0, 1] * 10)
+        self.assertTrue(isinstance(results['missing'], yara.Error))
+        self.assertEqual(pipeline.pending, 0)
+        self.assertEqual(pipeline.inflight_bytes, 0)
+        self.assertRaises(ValueError, pipeline.submit, 0, data=b'')
+
+        # Iteration ends once everything submitted was returned, even if the
+        # pipeline isn't closed, and it can be resumed after more submissions.
+        pipeline = yara.Pipeline(r, workers=2)
+        pipeline.submit('a', data=b'abc')
+        self.assertEqual([tag for tag, _ in pipeline], ['a'])
+        self.assertEqual(pipeline.get(), None)
+        pipeline.submit('b', data=b'abc')
+        self.assertEqual([tag for tag, _ in pipeline], ['b'])
+
+        # A pipeline referenced by its own results is collected.
+        class Tag(object):
+            pass
+
+        tag = Tag()
+        tag.pipeline = pipeline
+        pipeline.submit(tag, data=b'abc')
+
+        while pipeline.inflight_bytes:
+            time.sleep(0.01)
+
+        tag = weakref.ref(tag)
+        del pipeline
+        gc.collect()
+        self.assertEqual(tag(), None)
+
+    def testIterMatch(self):
+
+        r = yara.compile(source='''
+            rule a { strings: $a = "foo" condition: $a }
+            rule b { condition: false }
+            rule c { strings: $a = "bar" condition: $a }''')
+
+        self.assertEqual([m.rule for m in r.iter_match(data='foobar')], ['a', 'c'])
+
+        iterator = r.iter_match(data='foobar' * 1000)
+        self.assertEqual(next(iterator).rule, 'a')
+        iterator.close()
+        self.assertEqual(list(iterator), [])
+
+        self.assertRaises(yara.Error, list, r.iter_match(filepath='/nonexistent'))
+
+        # More matches than the queue holds, the scan waits for the consumer.
+        r = yara.compile(source=' '.join('rule r%d { condition: true }' % i for i in range(200)))
+        self.assertEqual(len(list(r.iter_match(data='foo'))), 200)
+
+        iterator = r.iter_match(data='foo')
+        self.assertEqual(next(iterator).rule, 'r0')
+        iterator.close()
+        self.assertEqual(list(iterator), [])
+
+        # Closing or dropping the iterator doesn't wait for a long scan.
+        r = yara.compile(source='''
+            rule slow {
+              condition:
+                for any i in (0..filesize - 1) : (uint8(i) == 1)
+            }''')
+
+        data = b'\x00' * (64 << 20)
+        start = time.time()
+
+        iterator = r.iter_match(data=data)
+        iterator.close()
+        self.assertEqual(list(iterator), [])
+
+        iterator = r.iter_match(data=data)
+        del iterator
+        gc.collect()
+
+        self.assertLess(time.time() - start, 2)
+
+    def testMatchRecords(self):
+
+        r = yara.compile(source='''
+            rule a { strings: $a = "foo" condition: $a }
+            rule b { condition: filesize == 3 }''')
+
+        pairs = r.match_records(b'foo\nbar\nxfoo\n', delimiter=b'\n')
+        self.assertEqual(pairs.tolist(), [[0, 0], [0, 1], [1, 1], [2, 0]])
+
+        offsets = memoryview(bytearray(b'\x00' * 16)).cast('q')
+        offsets[1] = 3
+        pairs = r.match_records(b'foobar', offsets=offsets)
+        self.assertEqual(pairs.tolist(), [[0, 0], [0, 1], [1, 1]])
+
+        pairs = r.match_records(b'xyzw\nbar', delimiter=b'\n')
+        self.assertEqual(pairs.shape, (0, 2))
+        self.assertEqual(pairs.tolist(), [])
+
+        pairs = r.match_records(b'foo', offsets=memoryview(b'').cast('q'))
+        self.assertEqual(pairs.shape, (0, 2))
+
+        self.assertRaises(TypeError, r.match_records, b'foo')
+        self.assertRaises(TypeError, r.match_records, b'foo', offsets=b'\x00')
+
+    def testMatchArrow(self):
+
+        r = yara.compile(source='''
+            rule a { strings: $a = "foo" condition: $a }
+            rule b { condition: filesize == 3 }''')
+
+        self.assertRaises(TypeError, r.match_arrow, b'foo')
+
+        try:
+            import pyarrow
+        except ImportError:
+            self.skipTest('pyarrow is not available')
+
+        for type in (pyarrow.binary(), pyarrow.large_binary()):
+            array = pyarrow.array([b'foo', None, b'xfoo', b'bar'], type=type)
+            result = pyarrow.Array._import_from_c_capsule(
+                *r.match_arrow(array, threads=2))
+            self.assertEqual(result.to_pylist(), [[0, 1], [], [0], [1]])
+
+        self.assertRaises(TypeError, r.match_arrow, pyarrow.array([1, 2]))
+
+    def testMatchTable(self):
+
+        r = yara.compile(source='''
+            rule a { strings: $a = "foo" $b = "bar" condition: any of them }
+            rule b { condition: filesize > 0 }''')
+
+        self.assertEqual(r.rule_names, (('default', 'a'), ('default', 'b')))
+        self.assertEqual(r.string_names, ((0, '$a'), (0, '$b')))
+
+        table = r.match(data=b'foobarfoo', output='table')
+
+        self.assertTrue(isinstance(table, yara.MatchTable))
+        self.assertEqual(len(table), 4)
+        self.assertEqual(table.rule_index.tolist(), [0, 0, 0, 1])
+        self.assertEqual(table.string_index.tolist(), [0, 0, 1, -1])
+        self.assertEqual(table.offset.tolist(), [0, 6, 3, -1])
+        self.assertEqual(table.length.tolist(), [3, 3, 3, 0])
+        self.assertEqual(table.xor_key.tolist(), [0, 0, 0, 0])
+        self.assertEqual(table.rule_index.format, 'I')
+
+        self.assertEqual(len(r.match(data=b'', output='table')), 0)
+        self.assertRaises(ValueError, r.match, data=b'foo', output='xml')
+
+    def testScanPids(self):
+
+        if not sys.platform.startswith('linux'):
+            self.skipTest('scan_pids is only supported on Linux')
+
+        marker = b'yara-python-' + b'scan-pids-marker'
+        r = yara.compile(source='rule a { strings: $a = "%s" condition: $a }' % marker.decode())
+
+        results = r.scan_pids([os.getpid(), 0x7fffffff], threads=2, regions='private')
+
+        self.assertEqual(len(results[os.getpid()]), 1)
+        self.assertTrue(isinstance(results[0x7fffffff], yara.Error))
+
+        self.assertEqual(r.scan_pids([]), {})
+        self.assertRaises(ValueError, r.scan_pids, [os.getpid()], regions='heap')
+
+    def testProcessLimits(self):
+
+        r = yara.compile(source='rule a { condition: true }')
+
+        self.assertRaises(TypeError, r.match, data=b'foo', region_report=True)
+
+        if not sys.platform.startswith('linux'):
+            self.skipTest('process limits are only supported on Linux')
+
+        matches, report = r.match(
+            pid=os.getpid(),
+            process_chunk_size=65536,
+            process_max_region_size=4096,
+            region_report=True)
+
+        self.assertEqual(len(matches), 1)
+        self.assertTrue(len(report) > 0)
+
+        for region in report:
+            self.assertTrue(region['scanned'] <= 4096)
+            self.assertTrue(region['end'] > region['start'])
+
+        matches, report = r.match(
+            pid=os.getpid(), process_max_bytes=4096, region_report=True)
+
+        self.assertTrue(sum(region['scanned'] for region in report) <= 4096)
+        self.assertTrue(any(region['reason'] == 'max_bytes' for region in report))
+
+    def testCompileDir(self):
+
+        root = tempfile.mkdtemp()
+        os.mkdir(os.path.join(root, 'sub'))
+
+        with open(os.path.join(root, 'a.yar'), 'w') as f:
+            f.write('rule a { strings: $a = "foo" condition: $a }')
+        with open(os.path.join(root, 'sub', 'b.yar'), 'w') as f:
+            f.write('rule b { condition: filesize == 3 }')
+        with open(os.path.join(root, 'c.txt'), 'w') as f:
+            f.write('not a rule')
+
+        r = yara.compile_dir(root, threads=2)
+        matches = r.match(data=b'foo')
+        self.assertEqual(
+            sorted((m.namespace, m.rule) for m in matches),
+            [('a', 'a'), ('b', 'b')])
+
+        r = yara.compile_dir(root, namespace_from='path')
+        self.assertEqual(
+            sorted(m.namespace for m in r.match(data=b'foo')), ['a', 'sub/b'])
+
+        r = yara.compile_dir(root, shards=2)
+        self.assertTrue(isinstance(r, yara.ShardedRules))
+        self.assertEqual(len(r.shards), 2)
+        self.assertEqual(len(r.match(data=b'foo')), 2)
+
+        bad = os.path.join(root, 'sub', 'bad.yar')
+
+        with open(bad, 'w') as f:
+            f.write('rule bad { condition: foo }')
+
+        try:
+            yara.compile_dir(root)
+            self.fail('expecting yara.SyntaxError')
+        except yara.SyntaxError as e:
+            self.assertEqual(list(e.errors.keys()), [bad])
+
+        self.assertRaises(ValueError, yara.compile_dir, root, namespace_from='x')
+
+        # Rules can use the ones defined in other files of their namespace.
+        root = tempfile.mkdtemp()
+        os.mkdir(os.path.join(root, 'x'))
+        os.mkdir(os.path.join(root, 'y'))
+
+        with open(os.path.join(root, 'x', 'r.yar'), 'w') as f:
+            f.write('rule base { condition: filesize == 3 }')
+        with open(os.path.join(root, 'y', 'r.yar'), 'w') as f:
+            f.write('rule derived { condition: base }')
+
+        r = yara.compile_dir(root, threads=2)
+        self.assertEqual(
+            sorted(m.rule for m in r.match(data=b'foo')), ['base', 'derived'])
+
+        r = yara.compile_dir(root, namespace_from='default')
+        self.assertEqual(len(r.match(data=b'foo')), 2)
+
+        r = yara.compile_dir(root, shards=1)
+        self.assertEqual(len(r.match(data=b'foo')), 2)
+
+        self.assertRaises(
+            yara.SyntaxError, yara.compile_dir, root, namespace_from='path')
+
+    def testIncludeCache(self):
+
+        calls = []
+
+        def callback(requested_filename, filename, namespace):
+            calls.append(namespace)
+            return 'rule common { condition: true }'
+
+        sources = dict(
+            ('ns%d' % i, 'include "common" rule r%d { condition: common }' % i)
+            for i in range(3))
+
+        r = yara.compile(
+            sources=sources, include_callback=callback, include_cache=True)
+        self.assertEqual(len(calls), 3)
+        self.assertEqual(r.compile_stats['include_requests'], 3)
+        self.assertEqual(r.compile_stats['include_cache_hits'], 0)
+
+        del calls[:]
+
+        r = yara.compile(
+            sources=sources,
+            include_callback=callback,
+            include_cache=True,
+            include_cache_key=lambda name, filename, namespace: name)
+
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(r.compile_stats['include_cache_hits'], 2)
+        self.assertEqual(len(r.match(data=b'dummy')), 6)
+
+        r = yara.compile(sources=sources, include_callback=callback)
+        self.assertEqual(r.compile_stats, None)
+
+        self.assertRaises(
+            ValueError,
+            yara.compile,
+            sources=sources,
+            include_callback=callback,
+            include_cache_key=lambda name, filename, namespace: name)
+
+        def failing_key(name, filename, namespace):
+            raise KeyError(name)
+
+        self.assertRaises(
+            KeyError,
+            yara.compile,
+            sources=sources,
+            include_callback=callback,
+            include_cache=True,
+            include_cache_key=failing_key)
+
+        self.assertRaises(
+            TypeError,
+            yara.compile,
+            sources=sources,
+            include_callback=callback,
+            include_cache=True,
+            include_cache_key=lambda name, filename, namespace: 1)
+
+        root = tempfile.mkdtemp()
+
+        with open(os.path.join(root, 'common.yar'), 'w') as f:
+            f.write('rule common { condition: true }')
+
+        filepaths = {}
+
+        for i in range(3):
+            filepaths['ns%d' % i] = os.path.join(root, 'r%d.yar' % i)
+            with open(filepaths['ns%d' % i], 'w') as f:
+                f.write(sources['ns%d' % i].replace('"common"', '"common.yar"'))
+
+        r = yara.compile(filepaths=filepaths, include_cache=True)
+        self.assertEqual(r.compile_stats['include_cache_hits'], 2)
+        self.assertEqual(len(r.match(data=b'dummy')), 6)
+
+        r = yara.compile_dir(root, pattern='r*.yar', include_cache=True)
+        self.assertEqual(r.compile_stats['include_cache_hits'], 2)
+
+        r = yara.compile_dir(root, pattern='r*.yar')
+        self.assertEqual(r.compile_stats, None)
+        self.assertEqual(len(r.match(data=b'dummy')), 6)
+
 
 if __name__ == "__main__":
     unittest.main()
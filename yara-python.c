@@ -68,6 +68,7 @@ static PyObject* YaraError = NULL;
 static PyObject* YaraSyntaxError = NULL;
 static PyObject* YaraTimeoutError = NULL;
 static PyObject* YaraWarningError = NULL;
+static PyObject* YaraCancelledError = NULL;
 
 
 #define YARA_DOC "\
@@ -81,6 +82,102 @@ https://yara.readthedocs.io/en/stable/yarapython.html\n"
 #define strdup _strdup
 #endif
 
+#if defined(_WIN32)
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+
+// Portable threads, mutexes and condition variables, used for running scans
+// concurrently. Thread routines are declared with THREAD_ROUTINE and must end
+// with THREAD_RETURN.
+
+#if defined(_WIN32)
+
+typedef HANDLE THREAD;
+
+#define THREAD_ROUTINE(name, arg) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+
+#define thread_create(thread, routine, arg) \
+    ((*(thread) = CreateThread(NULL, 0, routine, arg, 0, NULL)) != NULL ? 0 : -1)
+
+#define thread_join(thread) \
+    (WaitForSingleObject(thread, INFINITE), CloseHandle(thread))
+
+#define thread_detach(thread) CloseHandle(thread)
+
+typedef CRITICAL_SECTION MUTEX;
+typedef CONDITION_VARIABLE COND;
+
+#define mutex_init(mutex) InitializeCriticalSection(mutex)
+#define mutex_destroy(mutex) DeleteCriticalSection(mutex)
+#define mutex_lock(mutex) EnterCriticalSection(mutex)
+#define mutex_unlock(mutex) LeaveCriticalSection(mutex)
+
+#define cond_init(cond) InitializeConditionVariable(cond)
+#define cond_destroy(cond)
+#define cond_wait(cond, mutex) SleepConditionVariableCS(cond, mutex, INFINITE)
+#define cond_broadcast(cond) WakeAllConditionVariable(cond)
+
+typedef volatile LONG SHARED_FLAG;
+
+#define shared_flag_set(flag) InterlockedExchange(flag, 1)
+#define shared_flag_get(flag) InterlockedCompareExchange(flag, 0, 0)
+
+#define shared_uint64_set(ptr, value) \
+    InterlockedExchange64((volatile LONG64*) (ptr), (LONG64) (value))
+
+#else
+
+typedef pthread_t THREAD;
+
+#define THREAD_ROUTINE(name, arg) void* name(void* arg)
+#define THREAD_RETURN return NULL
+
+#define thread_create(thread, routine, arg) \
+    pthread_create(thread, NULL, routine, arg)
+
+#define thread_join(thread) \
+    pthread_join(thread, NULL)
+
+#define thread_detach(thread) pthread_detach(thread)
+
+typedef pthread_mutex_t MUTEX;
+typedef pthread_cond_t COND;
+
+#define mutex_init(mutex) pthread_mutex_init(mutex, NULL)
+#define mutex_destroy(mutex) pthread_mutex_destroy(mutex)
+#define mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+
+#define cond_init(cond) pthread_cond_init(cond, NULL)
+#define cond_destroy(cond) pthread_cond_destroy(cond)
+#define cond_wait(cond, mutex) pthread_cond_wait(cond, mutex)
+#define cond_broadcast(cond) pthread_cond_broadcast(cond)
+
+typedef int SHARED_FLAG;
+
+#define shared_flag_set(flag) __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST)
+#define shared_flag_get(flag) __atomic_load_n(flag, __ATOMIC_SEQ_CST)
+
+#define shared_uint64_set(ptr, value) \
+    __atomic_store_n(ptr, (uint64_t) (value), __ATOMIC_SEQ_CST)
+
+#endif
+
 // Match object
 
 typedef struct
@@ -158,9 +255,19 @@ static PyObject* Match_richcompare(
 static Py_hash_t Match_hash(
     PyObject* self);
 
+static PyObject* Match_reduce(
+    PyObject* self,
+    PyObject* args);
+
 
 static PyMethodDef Match_methods[] =
 {
+  {
+    "__reduce__",
+    (PyCFunction) Match_reduce,
+    METH_NOARGS,
+    "Return the state of the match for pickling"
+  },
   { NULL },
 };
 
@@ -258,6 +365,10 @@ static PyObject* StringMatch_is_xor(
     PyObject* self,
     PyObject* args);
 
+static PyObject* StringMatch_reduce(
+    PyObject* self,
+    PyObject* args);
+
 
 static PyMethodDef StringMatch_methods[] =
 {
@@ -267,6 +378,12 @@ static PyMethodDef StringMatch_methods[] =
     METH_NOARGS,
     "Return true if a string has the xor modifier"
   },
+  {
+    "__reduce__",
+    (PyCFunction) StringMatch_reduce,
+    METH_NOARGS,
+    "Return the state of the string match for pickling"
+  },
   { NULL },
 };
 
@@ -377,6 +494,10 @@ static PyObject* StringMatchInstance_plaintext(
     PyObject* self,
     PyObject* args);
 
+static PyObject* StringMatchInstance_reduce(
+    PyObject* self,
+    PyObject* args);
+
 
 static PyMethodDef StringMatchInstance_methods[] =
 {
@@ -386,6 +507,12 @@ static PyMethodDef StringMatchInstance_methods[] =
     METH_NOARGS,
     "Return matched data after xor key applied."
   },
+  {
+    "__reduce__",
+    (PyCFunction) StringMatchInstance_reduce,
+    METH_NOARGS,
+    "Return the state of the instance for pickling"
+  },
   { NULL },
 };
 
@@ -542,8 +669,16 @@ typedef struct
   PyObject_HEAD
   PyObject* externals;
   PyObject* warnings;
+  PyObject* rule_sets;
+  PyObject* rule_names;
+  PyObject* string_names;
+  PyObject* compile_stats;
   YR_RULES* rules;
+  uint64_t fingerprint;
+  bool has_fingerprint;
   YR_RULE* iter_current_rule;
+  uint32_t max_match_data;
+  uint32_t max_matches_per_string;
 } Rules;
 
 
@@ -557,6 +692,35 @@ static PyObject* Rules_match(
     PyObject* args,
     PyObject* keywords);
 
+static PyObject* Rules_scan_paths_to_ndjson(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyObject* Rules_group_matches(
+    PyObject* self,
+    PyObject* matches);
+
+static PyObject* Rules_iter_match(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyObject* Rules_match_records(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyObject* Rules_match_arrow(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyObject* Rules_scan_pids(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
 static PyObject* Rules_save(
     PyObject* self,
     PyObject* args,
@@ -566,6 +730,19 @@ static PyObject* Rules_profiling_info(
     PyObject* self,
     PyObject* args);
 
+static PyObject* Rules_set_config(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyObject* Rules_atoms(
+    PyObject* self,
+    PyObject* args);
+
+static PyObject* Rules_candidates(
+    PyObject* self,
+    PyObject* args);
+
 static PyObject* Rules_getattro(
     PyObject* self,
     PyObject* name);
@@ -573,6 +750,14 @@ static PyObject* Rules_getattro(
 static PyObject* Rules_next(
     PyObject* self);
 
+static PyObject* Rules_get_rule_names(
+    PyObject* self,
+    void* closure);
+
+static PyObject* Rules_get_string_names(
+    PyObject* self,
+    void* closure);
+
 static PyMemberDef Rules_members[] = {
   {
     "warnings",
@@ -581,6 +766,20 @@ static PyMemberDef Rules_members[] = {
     READONLY,
     "List of compiler warnings"
   },
+  {
+    "rule_sets",
+    T_OBJECT,
+    offsetof(Rules, rule_sets),
+    READONLY,
+    "Dictionary mapping namespaces to the rule set they belong to"
+  },
+  {
+    "compile_stats",
+    T_OBJECT,
+    offsetof(Rules, compile_stats),
+    READONLY,
+    "Dictionary with statistics about the compilation of the rules"
+  },
   { NULL } // End marker
 };
 
@@ -601,12 +800,78 @@ static PyMethodDef Rules_methods[] =
     (PyCFunction) Rules_profiling_info,
     METH_NOARGS
   },
+  {
+    "set_config",
+    (PyCFunction) Rules_set_config,
+    METH_VARARGS | METH_KEYWORDS,
+    "Set max_match_data or max_matches_per_string for scans with these rules. "
+    "They only limit what is converted to Python objects, libyara still copies "
+    "matched data up to the global limit set with yara.set_config"
+  },
+  {
+    "atoms",
+    (PyCFunction) Rules_atoms,
+    METH_NOARGS
+  },
+  {
+    "candidates",
+    (PyCFunction) Rules_candidates,
+    METH_VARARGS
+  },
+  {
+    "scan_paths_to_ndjson",
+    (PyCFunction) Rules_scan_paths_to_ndjson,
+    METH_VARARGS | METH_KEYWORDS
+  },
+  {
+    "group_matches",
+    (PyCFunction) Rules_group_matches,
+    METH_O
+  },
+  {
+    "iter_match",
+    (PyCFunction) Rules_iter_match,
+    METH_VARARGS | METH_KEYWORDS
+  },
+  {
+    "match_records",
+    (PyCFunction) Rules_match_records,
+    METH_VARARGS | METH_KEYWORDS
+  },
+  {
+    "match_arrow",
+    (PyCFunction) Rules_match_arrow,
+    METH_VARARGS | METH_KEYWORDS
+  },
+  {
+    "scan_pids",
+    (PyCFunction) Rules_scan_pids,
+    METH_VARARGS | METH_KEYWORDS
+  },
   {
     NULL,
     NULL
   }
 };
 
+static PyGetSetDef Rules_getsetters[] = {
+  {
+    "rule_names",
+    Rules_get_rule_names,
+    NULL,
+    "Tuple with the (namespace, identifier) of each rule, by rule index",
+    NULL
+  },
+  {
+    "string_names",
+    Rules_get_string_names,
+    NULL,
+    "Tuple with the (rule index, identifier) of each string, by string index",
+    NULL
+  },
+  { NULL }
+};
+
 static PyTypeObject Rules_Type = {
   PyVarObject_HEAD_INIT(NULL, 0)
   "yara.Rules",               /*tp_name*/
@@ -637,7 +902,7 @@ static PyTypeObject Rules_Type = {
   (iternextfunc) Rules_next,  /* tp_iternext */
   Rules_methods,              /* tp_methods */
   Rules_members,              /* tp_members */
-  0,                          /* tp_getset */
+  Rules_getsetters,           /* tp_getset */
   0,                          /* tp_base */
   0,                          /* tp_dict */
   0,                          /* tp_descr_get */
@@ -648,1675 +913,13582 @@ static PyTypeObject Rules_Type = {
   0,                          /* tp_new */
 };
 
-typedef struct _CALLBACK_DATA
-{
-  PyObject* matches;
-  PyObject* callback;
-  PyObject* modules_data;
-  PyObject* modules_callback;
-  PyObject* warnings_callback;
-  PyObject* console_callback;
-  int which;
-  bool allow_duplicate_metadata;
+// Index object
 
-} CALLBACK_DATA;
+#define INDEX_MAGIC "YRIX"
+#define INDEX_VERSION 1
+#define INDEX_GRAM_LENGTH 4
 
-static PyStructSequence_Field RuleString_Fields[] = {
-  {"namespace", "Namespace of the rule"},
-  {"rule", "Identifier of the rule"},
-  {"string", "Identifier of the string"},
-  {NULL}
-};
+// Layout of an index file: the header is followed by the path offsets
+// (num_files + 1 uint64_t), the path bytes, the sorted grams (num_grams
+// uint32_t), the offsets of each gram's postings (num_grams + 1 uint64_t) and
+// finally the postings themselves (uint32_t file ids). Every section starts
+// at an 8-byte aligned offset.
 
-static PyStructSequence_Desc RuleString_Desc = {
-  "RuleString",
-  "Named tuple tying together rule identifier and string identifier",
-  RuleString_Fields,
-  (sizeof(RuleString_Fields) / sizeof(RuleString_Fields[0])) - 1
-};
+typedef struct _INDEX_HEADER
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t num_files;
+  uint32_t num_grams;
+  uint64_t num_postings;
+  uint64_t paths_offset;
+  uint64_t grams_offset;
+  uint64_t starts_offset;
+  uint64_t postings_offset;
 
-static PyTypeObject RuleString_Type = {0};
+} INDEX_HEADER;
 
-// Forward declarations for handling module data.
-PyObject* convert_structure_to_python(
-    YR_OBJECT_STRUCTURE* structure);
 
+typedef struct
+{
+  PyObject_HEAD
+  PyObject* filepaths;
+  YR_MAPPED_FILE mapped_file;
+  const INDEX_HEADER* header;
+  const uint32_t* grams;
+  const uint64_t* starts;
+  const uint32_t* postings;
+} Index;
+
+static PyMemberDef Index_members[] = {
+  {
+    "filepaths",
+    T_OBJECT_EX,
+    offsetof(Index, filepaths),
+    READONLY,
+    "List of files covered by the index"
+  },
+  { NULL } // End marker
+};
 
-PyObject* convert_array_to_python(
-    YR_OBJECT_ARRAY* array);
+static void Index_dealloc(
+    PyObject* self);
 
+static PyMethodDef Index_methods[] =
+{
+  { NULL, NULL }
+};
 
-PyObject* convert_dictionary_to_python(
-    YR_OBJECT_DICTIONARY* dictionary);
+static PyTypeObject Index_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.Index",               /*tp_name*/
+  sizeof(Index),              /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) Index_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "Index class",              /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  Index_methods,              /* tp_methods */
+  Index_members,              /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  0,                          /* tp_new */
+};
 
+// ObjectView object
 
-PyObject* convert_object_to_python(
-    YR_OBJECT* object)
+typedef struct
 {
-  PyObject* result = NULL;
-
-  if (object == NULL)
-    return NULL;
-
-  switch(object->type)
-  {
-    case OBJECT_TYPE_INTEGER:
-      if (object->value.i != YR_UNDEFINED)
-        result = Py_BuildValue("l", object->value.i);
-      break;
+  PyObject_HEAD
+  YR_OBJECT* object;
+  PyObject* views;
+} ObjectView;
 
-    case OBJECT_TYPE_STRING:
-      if (object->value.ss != NULL)
-        result = PyBytes_FromStringAndSize(
-            object->value.ss->c_string,
-            object->value.ss->length);
-      break;
+static void ObjectView_dealloc(
+    PyObject* self);
 
-    case OBJECT_TYPE_STRUCTURE:
-      result = convert_structure_to_python(object_as_structure(object));
-      break;
+static PyObject* ObjectView_getattro(
+    PyObject* self,
+    PyObject* name);
 
-    case OBJECT_TYPE_ARRAY:
-      result = convert_array_to_python(object_as_array(object));
-      break;
+static Py_ssize_t ObjectView_length(
+    PyObject* self);
 
-    case OBJECT_TYPE_FUNCTION:
-      // Do nothing with functions...
-      break;
+static PyObject* ObjectView_subscript(
+    PyObject* self,
+    PyObject* key);
 
-    case OBJECT_TYPE_DICTIONARY:
-      result = convert_dictionary_to_python(object_as_dictionary(object));
-      break;
+static PyObject* ObjectView_materialize(
+    PyObject* self,
+    PyObject* args);
 
-    case OBJECT_TYPE_FLOAT:
-      if (!isnan(object->value.d))
-        result = Py_BuildValue("d", object->value.d);
-      break;
+static PyObject* ObjectView_keys(
+    PyObject* self,
+    PyObject* args);
 
-    default:
-      break;
-  }
-
-  return result;
-}
-
-
-PyObject* convert_structure_to_python(
-    YR_OBJECT_STRUCTURE* structure)
+static PyMethodDef ObjectView_methods[] =
 {
-  YR_STRUCTURE_MEMBER* member;
+  {
+    "materialize",
+    (PyCFunction) ObjectView_materialize,
+    METH_NOARGS,
+    "Convert the whole object into Python dicts, lists and values"
+  },
+  {
+    "keys",
+    (PyCFunction) ObjectView_keys,
+    METH_NOARGS,
+    "Return the names of the fields of a structure or the keys of a dictionary"
+  },
+  { NULL, NULL }
+};
 
-  PyObject* py_object;
-  PyObject* py_dict = PyDict_New();
+static PyMappingMethods ObjectView_as_mapping = {
+  ObjectView_length,          /*mp_length*/
+  ObjectView_subscript,       /*mp_subscript*/
+  0,                          /*mp_ass_subscript*/
+};
 
-  if (py_dict == NULL)
-    return py_dict;
+static PyTypeObject ObjectView_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.ObjectView",          /*tp_name*/
+  sizeof(ObjectView),         /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) ObjectView_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  &ObjectView_as_mapping,     /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  ObjectView_getattro,        /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "ObjectView class",         /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  ObjectView_methods,         /* tp_methods */
+  0,                          /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  0,                          /* tp_new */
+};
 
-  member = structure->members;
 
-  while (member != NULL)
-  {
-    py_object = convert_object_to_python(member->object);
+// Externals object
 
-    if (py_object != NULL)
-    {
-      PyDict_SetItemString(py_dict, member->object->identifier, py_object);
-      Py_DECREF(py_object);
-    }
+typedef struct _EXTERNAL_VALUE
+{
+  const char* identifier;
+  int32_t type;
+  bool defined;
 
-    member =member->next;
-  }
+  union {
+    int64_t i;
+    double f;
+    char* s;
+  } value;
 
-  return py_dict;
-}
+} EXTERNAL_VALUE;
 
 
-PyObject* convert_array_to_python(
-    YR_OBJECT_ARRAY* array)
+typedef struct
 {
-  PyObject* py_object;
-  PyObject* py_list = PyList_New(0);
+  PyObject_HEAD
+  PyObject* rules;
+  EXTERNAL_VALUE* values;
+  int num_values;
+} Externals;
 
-  if (py_list == NULL)
-    return py_list;
+static PyObject* Externals_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords);
 
-  // If there is nothing in the list, return an empty Python list
-  if (array->items == NULL)
-    return py_list;
+static void Externals_dealloc(
+    PyObject* self);
 
-  for (int i = 0; i < array->items->length; i++)
+static PyObject* Externals_update(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyMethodDef Externals_methods[] =
+{
   {
-    py_object = convert_object_to_python(array->items->objects[i]);
+    "update",
+    (PyCFunction) Externals_update,
+    METH_VARARGS | METH_KEYWORDS,
+    "Change the value of some external variables"
+  },
+  { NULL, NULL }
+};
 
-    if (py_object != NULL)
-    {
-      PyList_Append(py_list, py_object);
-      Py_DECREF(py_object);
-    }
-  }
+static PyTypeObject Externals_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.Externals",           /*tp_name*/
+  sizeof(Externals),          /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) Externals_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "Externals class",          /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  Externals_methods,          /* tp_methods */
+  0,                          /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  Externals_new,              /* tp_new */
+};
 
-  return py_list;
-}
 
+// CancellationToken object
 
-PyObject* convert_dictionary_to_python(
-    YR_OBJECT_DICTIONARY* dictionary)
+typedef struct _ACTIVE_SCAN
 {
-  PyObject* py_object;
-  PyObject* py_dict = PyDict_New();
+  YR_SCANNER* scanner;
+  struct _ACTIVE_SCAN* next;
 
-  if (py_dict == NULL)
-    return py_dict;
+} ACTIVE_SCAN;
 
-  // If there is nothing in the YARA dictionary, return an empty Python dict
-  if (dictionary->items == NULL)
-    return py_dict;
 
-  for (int i = 0; i < dictionary->items->used; i++)
-  {
-    py_object = convert_object_to_python(dictionary->items->objects[i].obj);
+typedef struct
+{
+  PyObject_HEAD
+  SHARED_FLAG cancelled;
+  ACTIVE_SCAN* active_scans;
+  MUTEX mutex;
+} CancellationToken;
 
-    if (py_object != NULL)
-    {
-      PyDict_SetItemString(
-          py_dict,
-          dictionary->items->objects[i].key->c_string,
-          py_object);
+static PyObject* CancellationToken_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords);
 
-      Py_DECREF(py_object);
-    }
-  }
+static void CancellationToken_dealloc(
+    PyObject* self);
 
-  return py_dict;
-}
+static PyObject* CancellationToken_cancel(
+    PyObject* self,
+    PyObject* args);
 
+static PyObject* CancellationToken_get_cancelled(
+    PyObject* self,
+    void* closure);
 
-static int handle_import_module(
-    YR_MODULE_IMPORT* module_import,
-    CALLBACK_DATA* data)
+static PyMethodDef CancellationToken_methods[] =
 {
-  if (data->modules_data == NULL)
-    return CALLBACK_CONTINUE;
-
-  PyGILState_STATE gil_state = PyGILState_Ensure();
-
-  PyObject* module_data = PyDict_GetItemString(
-      data->modules_data,
-      module_import->module_name);
-
-  #if PY_MAJOR_VERSION >= 3
-  if (module_data != NULL && PyBytes_Check(module_data))
-  #else
-  if (module_data != NULL && PyString_Check(module_data))
-  #endif
   {
-    Py_ssize_t data_size;
-
-    #if PY_MAJOR_VERSION >= 3
-    PyBytes_AsStringAndSize(
-        module_data,
-        (char**) &module_import->module_data,
-        &data_size);
-    #else
-    PyString_AsStringAndSize(
-        module_data,
-        (char**) &module_import->module_data,
-        &data_size);
-    #endif
+    "cancel",
+    (PyCFunction) CancellationToken_cancel,
+    METH_NOARGS,
+    "Abort the scans using this token as soon as possible"
+  },
+  { NULL, NULL }
+};
 
-    module_import->module_data_size = data_size;
-  }
+static PyGetSetDef CancellationToken_getsetters[] = {
+  {
+    "cancelled",
+    CancellationToken_get_cancelled,
+    NULL,
+    "True if cancel() has been called",
+    NULL
+  },
+  { NULL }
+};
 
-  PyGILState_Release(gil_state);
+static PyTypeObject CancellationToken_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.CancellationToken",   /*tp_name*/
+  sizeof(CancellationToken),  /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) CancellationToken_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "CancellationToken class",  /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  CancellationToken_methods,  /* tp_methods */
+  0,                          /* tp_members */
+  CancellationToken_getsetters, /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  CancellationToken_new,      /* tp_new */
+};
 
-  return CALLBACK_CONTINUE;
-}
 
+// ResultCache object
 
-static int handle_module_imported(
-    void* message_data,
-    CALLBACK_DATA* data)
+typedef struct
 {
-  if (data->modules_callback == NULL)
-    return CALLBACK_CONTINUE;
+  PyObject_HEAD
+  PyObject* entries;
+  unsigned long long max_bytes;
+  unsigned long long bytes;
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+} ResultCache;
+
+static PyObject* ResultCache_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords);
 
-  PyGILState_STATE gil_state = PyGILState_Ensure();
+static void ResultCache_dealloc(
+    PyObject* self);
 
-  PyObject* module_info_dict = convert_structure_to_python(
-      object_as_structure(message_data));
+static PyObject* ResultCache_get(
+    PyObject* self,
+    PyObject* key);
 
-  if (module_info_dict == NULL)
-  {
-    PyGILState_Release(gil_state);
-    return CALLBACK_CONTINUE;
-  }
+static PyObject* ResultCache_put(
+    PyObject* self,
+    PyObject* args);
 
-  PyObject* object = PY_STRING(object_as_structure(message_data)->identifier);
-  PyDict_SetItemString(module_info_dict, "module", object);
-  Py_DECREF(object);
+static PyObject* ResultCache_clear(
+    PyObject* self,
+    PyObject* args);
 
-  Py_INCREF(data->modules_callback);
+static Py_ssize_t ResultCache_len(
+    PyObject* self);
+
+static PyMethodDef ResultCache_methods[] =
+{
+  {
+    "get",
+    (PyCFunction) ResultCache_get,
+    METH_O,
+    "Return the cached result for a key, or None"
+  },
+  {
+    "put",
+    (PyCFunction) ResultCache_put,
+    METH_VARARGS,
+    "Store the result for a key"
+  },
+  {
+    "clear",
+    (PyCFunction) ResultCache_clear,
+    METH_NOARGS,
+    "Remove all the cached results"
+  },
+  { NULL, NULL }
+};
+
+static PyMemberDef ResultCache_members[] = {
+  {
+    "max_bytes",
+    T_ULONGLONG,
+    offsetof(ResultCache, max_bytes),
+    READONLY,
+    "Maximum estimated size of the cached results"
+  },
+  {
+    "bytes",
+    T_ULONGLONG,
+    offsetof(ResultCache, bytes),
+    READONLY,
+    "Estimated size of the cached results"
+  },
+  {
+    "hits",
+    T_ULONGLONG,
+    offsetof(ResultCache, hits),
+    READONLY,
+    "Number of lookups that found a result"
+  },
+  {
+    "misses",
+    T_ULONGLONG,
+    offsetof(ResultCache, misses),
+    READONLY,
+    "Number of lookups that didn't find a result"
+  },
+  {
+    "evictions",
+    T_ULONGLONG,
+    offsetof(ResultCache, evictions),
+    READONLY,
+    "Number of results removed to make room for new ones"
+  },
+  { NULL } // End marker
+};
+
+static PySequenceMethods ResultCache_as_sequence = {
+  ResultCache_len,            /* sq_length */
+};
+
+static PyTypeObject ResultCache_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.ResultCache",         /*tp_name*/
+  sizeof(ResultCache),        /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) ResultCache_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  &ResultCache_as_sequence,   /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "ResultCache class",        /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  ResultCache_methods,        /* tp_methods */
+  ResultCache_members,        /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  ResultCache_new,            /* tp_new */
+};
+
+
+// DiskResultCache object
+
+typedef struct
+{
+  PyObject_HEAD
+  PyObject* path;
+  unsigned long long hits;
+  unsigned long long misses;
+} DiskResultCache;
+
+static PyObject* DiskResultCache_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords);
+
+static void DiskResultCache_dealloc(
+    PyObject* self);
+
+static PyObject* DiskResultCache_get(
+    PyObject* self,
+    PyObject* key);
+
+static PyObject* DiskResultCache_put(
+    PyObject* self,
+    PyObject* args);
+
+static PyMethodDef DiskResultCache_methods[] =
+{
+  {
+    "get",
+    (PyCFunction) DiskResultCache_get,
+    METH_O,
+    "Return the cached result for a key, or None"
+  },
+  {
+    "put",
+    (PyCFunction) DiskResultCache_put,
+    METH_VARARGS,
+    "Store the result for a key"
+  },
+  { NULL, NULL }
+};
+
+static PyMemberDef DiskResultCache_members[] = {
+  {
+    "path",
+    T_OBJECT_EX,
+    offsetof(DiskResultCache, path),
+    READONLY,
+    "Directory where results are stored"
+  },
+  {
+    "hits",
+    T_ULONGLONG,
+    offsetof(DiskResultCache, hits),
+    READONLY,
+    "Number of lookups that found a result"
+  },
+  {
+    "misses",
+    T_ULONGLONG,
+    offsetof(DiskResultCache, misses),
+    READONLY,
+    "Number of lookups that didn't find a result"
+  },
+  { NULL } // End marker
+};
+
+static PyTypeObject DiskResultCache_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.DiskResultCache",     /*tp_name*/
+  sizeof(DiskResultCache),    /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) DiskResultCache_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "DiskResultCache class",    /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  DiskResultCache_methods,    /* tp_methods */
+  DiskResultCache_members,    /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  DiskResultCache_new,        /* tp_new */
+};
+
+
+// ShardedRules object
+
+typedef struct
+{
+  PyObject_HEAD
+  PyObject* shards;
+  PyObject* namespaces;
+} ShardedRules;
+
+static void ShardedRules_dealloc(
+    PyObject* self);
+
+static PyObject* ShardedRules_match(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyMethodDef ShardedRules_methods[] =
+{
+  {
+    "match",
+    (PyCFunction) ShardedRules_match,
+    METH_VARARGS | METH_KEYWORDS
+  },
+  { NULL, NULL }
+};
+
+static PyMemberDef ShardedRules_members[] = {
+  {
+    "shards",
+    T_OBJECT_EX,
+    offsetof(ShardedRules, shards),
+    READONLY,
+    "Tuple with the Rules object of each shard"
+  },
+  { NULL } // End marker
+};
+
+static PyTypeObject ShardedRules_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.ShardedRules",        /*tp_name*/
+  sizeof(ShardedRules),       /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) ShardedRules_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "ShardedRules class",       /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  ShardedRules_methods,       /* tp_methods */
+  ShardedRules_members,       /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  0,                          /* tp_new */
+};
+
+
+// Pipeline object
+
+typedef struct _PIPELINE_JOB
+{
+  PyObject* tag;
+  PyObject* result;
+  char* filepath;
+  Py_buffer buffer;
+  size_t size;
+  struct _PIPELINE_JOB* next;
+
+} PIPELINE_JOB;
+
+
+typedef struct _PIPELINE_WORKER
+{
+  struct _Pipeline* pipeline;
+  YR_SCANNER* scanner;
+
+} PIPELINE_WORKER;
+
+
+typedef struct _Pipeline
+{
+  PyObject_HEAD
+  PyObject* rules;
+  PIPELINE_WORKER* workers;
+  THREAD* threads;
+  int num_workers;
+  int num_threads;
+  PIPELINE_JOB* queue_head;
+  PIPELINE_JOB* queue_tail;
+  PIPELINE_JOB* results_head;
+  PIPELINE_JOB* results_tail;
+  unsigned long long pending;
+  unsigned long long inflight_bytes;
+  unsigned long long max_inflight_bytes;
+  bool closed;
+  MUTEX mutex;
+  COND cond;
+} Pipeline;
+
+static PyObject* Pipeline_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords);
+
+static void Pipeline_dealloc(
+    PyObject* self);
+
+static int Pipeline_traverse(
+    PyObject* self,
+    visitproc visit,
+    void* arg);
+
+static int Pipeline_clear(
+    PyObject* self);
+
+static PyObject* Pipeline_submit(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyObject* Pipeline_get(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords);
+
+static PyObject* Pipeline_close(
+    PyObject* self,
+    PyObject* args);
+
+static PyObject* Pipeline_next(
+    PyObject* self);
+
+static PyMethodDef Pipeline_methods[] =
+{
+  {
+    "submit",
+    (PyCFunction) Pipeline_submit,
+    METH_VARARGS | METH_KEYWORDS,
+    "Queue data or a file for scanning, blocks if the byte budget is exhausted"
+  },
+  {
+    "get",
+    (PyCFunction) Pipeline_get,
+    METH_VARARGS | METH_KEYWORDS,
+    "Return the next (tag, matches) pair, or None if nothing is pending"
+  },
+  {
+    "close",
+    (PyCFunction) Pipeline_close,
+    METH_NOARGS,
+    "Stop accepting submissions"
+  },
+  { NULL, NULL }
+};
+
+static PyMemberDef Pipeline_members[] = {
+  {
+    "pending",
+    T_ULONGLONG,
+    offsetof(Pipeline, pending),
+    READONLY,
+    "Number of submissions whose result has not been retrieved yet"
+  },
+  {
+    "inflight_bytes",
+    T_ULONGLONG,
+    offsetof(Pipeline, inflight_bytes),
+    READONLY,
+    "Bytes submitted and not scanned yet"
+  },
+  {
+    "max_inflight_bytes",
+    T_ULONGLONG,
+    offsetof(Pipeline, max_inflight_bytes),
+    READONLY,
+    "Maximum number of bytes submitted and not scanned yet"
+  },
+  { NULL } // End marker
+};
+
+static PyTypeObject Pipeline_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.Pipeline",            /*tp_name*/
+  sizeof(Pipeline),           /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) Pipeline_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+  "Pipeline class",           /* tp_doc */
+  Pipeline_traverse,          /* tp_traverse */
+  Pipeline_clear,             /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  PyObject_SelfIter,          /* tp_iter */
+  (iternextfunc) Pipeline_next, /* tp_iternext */
+  Pipeline_methods,           /* tp_methods */
+  Pipeline_members,           /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  Pipeline_new,               /* tp_new */
+};
+
+
+typedef struct _CALLBACK_DATA
+{
+  PyObject* matches;
+  PyObject* callback;
+  PyObject* modules_data;
+  PyObject* modules_buffers;
+  PyObject* modules_callback;
+  PyObject* warnings_callback;
+  PyObject* console_callback;
+  PyObject* module_views;
+  PyObject* modules_fields;
+  struct _JSON_OUTPUT* json;
+  struct _TABLE_OUTPUT* table;
+  struct _MatchIterator* stream;
+  CancellationToken* cancellation_token;
+  bool cancelled;
+  bool reject_modules;
+  uint32_t max_match_data;
+  uint32_t max_matches_per_string;
+  int which;
+  bool allow_duplicate_metadata;
+
+} CALLBACK_DATA;
+
+
+// MatchIterator object
+
+// Maximum number of matches found by iter_match and not consumed yet, the
+// scan pauses when the limit is reached.
+#define MATCH_QUEUE_LIMIT  64
+
+typedef struct _MATCH_QUEUE_NODE
+{
+  PyObject* match;
+  struct _MATCH_QUEUE_NODE* next;
+
+} MATCH_QUEUE_NODE;
+
+
+typedef struct _MatchIterator
+{
+  PyObject_HEAD
+  PyObject* rules;
+  CancellationToken* token;
+  YR_SCANNER* scanner;
+  CALLBACK_DATA callback_data;
+  ACTIVE_SCAN active_scan;
+  THREAD thread;
+  bool running;
+  char* filepath;
+  Py_buffer data;
+  int pid;
+  MATCH_QUEUE_NODE* head;
+  MATCH_QUEUE_NODE* tail;
+  int queued;
+  bool stopping;
+  bool detached;
+  bool done;
+  int error;
+  MUTEX mutex;
+  COND cond;
+} MatchIterator;
+
+static void MatchIterator_dealloc(
+    PyObject* self);
+
+static PyObject* MatchIterator_next(
+    PyObject* self);
+
+static PyObject* MatchIterator_close(
+    PyObject* self,
+    PyObject* args);
+
+static PyMethodDef MatchIterator_methods[] =
+{
+  {
+    "close",
+    (PyCFunction) MatchIterator_close,
+    METH_NOARGS,
+    "Abort the scan"
+  },
+  { NULL, NULL }
+};
+
+static PyTypeObject MatchIterator_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.MatchIterator",       /*tp_name*/
+  sizeof(MatchIterator),      /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) MatchIterator_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  0,                          /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "MatchIterator class",      /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  PyObject_SelfIter,          /* tp_iter */
+  (iternextfunc) MatchIterator_next, /* tp_iternext */
+  MatchIterator_methods,      /* tp_methods */
+  0,                          /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  0,                          /* tp_new */
+};
+
+
+// MatchTable object
+
+typedef struct
+{
+  PyObject_HEAD
+  PyObject* rules;
+  PyObject* rule_index;
+  PyObject* string_index;
+  PyObject* offset;
+  PyObject* length;
+  PyObject* xor_key;
+  Py_ssize_t count;
+} MatchTable;
+
+static void MatchTable_dealloc(
+    PyObject* self);
+
+static Py_ssize_t MatchTable_len(
+    PyObject* self);
+
+static PyMemberDef MatchTable_members[] = {
+  {
+    "rules",
+    T_OBJECT_EX,
+    offsetof(MatchTable, rules),
+    READONLY,
+    "Rules object whose rule_names and string_names resolve the indexes"
+  },
+  {
+    "rule_index",
+    T_OBJECT_EX,
+    offsetof(MatchTable, rule_index),
+    READONLY,
+    "Index of the matching rule in Rules.rule_names (uint32)"
+  },
+  {
+    "string_index",
+    T_OBJECT_EX,
+    offsetof(MatchTable, string_index),
+    READONLY,
+    "Index of the matching string in Rules.string_names, -1 if none (int32)"
+  },
+  {
+    "offset",
+    T_OBJECT_EX,
+    offsetof(MatchTable, offset),
+    READONLY,
+    "Offset of the match, -1 if none (int64)"
+  },
+  {
+    "length",
+    T_OBJECT_EX,
+    offsetof(MatchTable, length),
+    READONLY,
+    "Length of the match (int32)"
+  },
+  {
+    "xor_key",
+    T_OBJECT_EX,
+    offsetof(MatchTable, xor_key),
+    READONLY,
+    "XOR key of the match (uint8)"
+  },
+  { NULL } // End marker
+};
+
+static PySequenceMethods MatchTable_as_sequence = {
+  MatchTable_len,             /* sq_length */
+};
+
+static PyTypeObject MatchTable_Type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "yara.MatchTable",          /*tp_name*/
+  sizeof(MatchTable),         /*tp_basicsize*/
+  0,                          /*tp_itemsize*/
+  (destructor) MatchTable_dealloc, /*tp_dealloc*/
+  0,                          /*tp_print*/
+  0,                          /*tp_getattr*/
+  0,                          /*tp_setattr*/
+  0,                          /*tp_compare*/
+  0,                          /*tp_repr*/
+  0,                          /*tp_as_number*/
+  &MatchTable_as_sequence,    /*tp_as_sequence*/
+  0,                          /*tp_as_mapping*/
+  0,                          /*tp_hash */
+  0,                          /*tp_call*/
+  0,                          /*tp_str*/
+  PyObject_GenericGetAttr,    /*tp_getattro*/
+  0,                          /*tp_setattro*/
+  0,                          /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+  "MatchTable class",         /* tp_doc */
+  0,                          /* tp_traverse */
+  0,                          /* tp_clear */
+  0,                          /* tp_richcompare */
+  0,                          /* tp_weaklistoffset */
+  0,                          /* tp_iter */
+  0,                          /* tp_iternext */
+  0,                          /* tp_methods */
+  MatchTable_members,         /* tp_members */
+  0,                          /* tp_getset */
+  0,                          /* tp_base */
+  0,                          /* tp_dict */
+  0,                          /* tp_descr_get */
+  0,                          /* tp_descr_set */
+  0,                          /* tp_dictoffset */
+  0,                          /* tp_init */
+  0,                          /* tp_alloc */
+  0,                          /* tp_new */
+};
+
+
+// Called from yara_callback with the GIL held for every matching rule when
+// scanning with iter_match, hands the match to the iterating thread. Blocks
+// while MATCH_QUEUE_LIMIT matches are waiting to be consumed, the GIL is
+// released meanwhile so that the consumer can run. Matches found after the
+// iterator was closed are dropped.
+static int match_iterator_push(
+    MatchIterator* iterator,
+    PyObject* match)
+{
+  MATCH_QUEUE_NODE* node = (MATCH_QUEUE_NODE*) malloc(
+      sizeof(MATCH_QUEUE_NODE));
+
+  bool stopping;
+
+  if (node == NULL)
+    return -1;
+
+  Py_INCREF(match);
+
+  node->match = match;
+  node->next = NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+
+  mutex_lock(&iterator->mutex);
+
+  while (iterator->queued >= MATCH_QUEUE_LIMIT && !iterator->stopping)
+    cond_wait(&iterator->cond, &iterator->mutex);
+
+  stopping = iterator->stopping;
+
+  if (!stopping)
+  {
+    if (iterator->tail != NULL)
+      iterator->tail->next = node;
+    else
+      iterator->head = node;
+
+    iterator->tail = node;
+    iterator->queued++;
+
+    cond_broadcast(&iterator->cond);
+  }
+
+  mutex_unlock(&iterator->mutex);
+
+  Py_END_ALLOW_THREADS
+
+  if (stopping)
+  {
+    Py_DECREF(match);
+    free(node);
+  }
+
+  return 0;
+}
+
+static PyStructSequence_Field RuleString_Fields[] = {
+  {"namespace", "Namespace of the rule"},
+  {"rule", "Identifier of the rule"},
+  {"string", "Identifier of the string"},
+  {NULL}
+};
+
+static PyStructSequence_Desc RuleString_Desc = {
+  "RuleString",
+  "Named tuple tying together rule identifier and string identifier",
+  RuleString_Fields,
+  (sizeof(RuleString_Fields) / sizeof(RuleString_Fields[0])) - 1
+};
+
+static PyTypeObject RuleString_Type = {0};
+
+static PyStructSequence_Field StringAtoms_Fields[] = {
+  {"namespace", "Namespace of the rule"},
+  {"rule", "Identifier of the rule"},
+  {"string", "Identifier of the string"},
+  {"atoms", "Concatenated bytes of all the atoms chosen for the string"},
+  {"lengths", "Length of each atom in 'atoms', one byte per atom"},
+  {"backtracks", "Backtrack of each atom, as an array of unsigned shorts"},
+  {NULL}
+};
+
+static PyStructSequence_Desc StringAtoms_Desc = {
+  "StringAtoms",
+  "Named tuple with the atoms extracted by libyara for a given string",
+  StringAtoms_Fields,
+  (sizeof(StringAtoms_Fields) / sizeof(StringAtoms_Fields[0])) - 1
+};
+
+static PyTypeObject StringAtoms_Type = {0};
+
+// Forward declarations for handling module data.
+PyObject* convert_structure_to_python(
+    YR_OBJECT_STRUCTURE* structure);
+
+
+PyObject* convert_array_to_python(
+    YR_OBJECT_ARRAY* array);
+
+
+PyObject* convert_dictionary_to_python(
+    YR_OBJECT_DICTIONARY* dictionary);
+
+
+PyObject* convert_object_to_python(
+    YR_OBJECT* object)
+{
+  PyObject* result = NULL;
+
+  if (object == NULL)
+    return NULL;
+
+  switch(object->type)
+  {
+    case OBJECT_TYPE_INTEGER:
+      if (object->value.i != YR_UNDEFINED)
+        result = Py_BuildValue("l", object->value.i);
+      break;
+
+    case OBJECT_TYPE_STRING:
+      if (object->value.ss != NULL)
+        result = PyBytes_FromStringAndSize(
+            object->value.ss->c_string,
+            object->value.ss->length);
+      break;
+
+    case OBJECT_TYPE_STRUCTURE:
+      result = convert_structure_to_python(object_as_structure(object));
+      break;
+
+    case OBJECT_TYPE_ARRAY:
+      result = convert_array_to_python(object_as_array(object));
+      break;
+
+    case OBJECT_TYPE_FUNCTION:
+      // Do nothing with functions...
+      break;
+
+    case OBJECT_TYPE_DICTIONARY:
+      result = convert_dictionary_to_python(object_as_dictionary(object));
+      break;
+
+    case OBJECT_TYPE_FLOAT:
+      if (!isnan(object->value.d))
+        result = Py_BuildValue("d", object->value.d);
+      break;
+
+    default:
+      break;
+  }
+
+  return result;
+}
+
+
+PyObject* convert_structure_to_python(
+    YR_OBJECT_STRUCTURE* structure)
+{
+  YR_STRUCTURE_MEMBER* member;
+
+  PyObject* py_object;
+  PyObject* py_dict = PyDict_New();
+
+  if (py_dict == NULL)
+    return py_dict;
+
+  member = structure->members;
+
+  while (member != NULL)
+  {
+    py_object = convert_object_to_python(member->object);
+
+    if (py_object != NULL)
+    {
+      PyDict_SetItemString(py_dict, member->object->identifier, py_object);
+      Py_DECREF(py_object);
+    }
+
+    member =member->next;
+  }
+
+  return py_dict;
+}
+
+
+PyObject* convert_array_to_python(
+    YR_OBJECT_ARRAY* array)
+{
+  PyObject* py_object;
+  PyObject* py_list = PyList_New(0);
+
+  if (py_list == NULL)
+    return py_list;
+
+  // If there is nothing in the list, return an empty Python list
+  if (array->items == NULL)
+    return py_list;
+
+  for (int i = 0; i < array->items->length; i++)
+  {
+    py_object = convert_object_to_python(array->items->objects[i]);
+
+    if (py_object != NULL)
+    {
+      PyList_Append(py_list, py_object);
+      Py_DECREF(py_object);
+    }
+  }
+
+  return py_list;
+}
+
+
+PyObject* convert_dictionary_to_python(
+    YR_OBJECT_DICTIONARY* dictionary)
+{
+  PyObject* py_object;
+  PyObject* py_dict = PyDict_New();
+
+  if (py_dict == NULL)
+    return py_dict;
+
+  // If there is nothing in the YARA dictionary, return an empty Python dict
+  if (dictionary->items == NULL)
+    return py_dict;
+
+  for (int i = 0; i < dictionary->items->used; i++)
+  {
+    py_object = convert_object_to_python(dictionary->items->objects[i].obj);
+
+    if (py_object != NULL)
+    {
+      PyDict_SetItemString(
+          py_dict,
+          dictionary->items->objects[i].key->c_string,
+          py_object);
+
+      Py_DECREF(py_object);
+    }
+  }
+
+  return py_dict;
+}
+
+
+// Module data can be passed to the modules callback as ObjectView objects
+// instead of dictionaries. Views convert only the parts of the module's
+// structure that are actually accessed. The objects they point to are
+// destroyed with the scanner, so all the views created during a scan are
+// tracked in the "views" list and invalidated when the scan finishes.
+
+static PyObject* ObjectView_NEW(
+    YR_OBJECT* object,
+    PyObject* views)
+{
+  ObjectView* view = PyObject_NEW(ObjectView, &ObjectView_Type);
+
+  if (view == NULL)
+    return NULL;
+
+  view->object = object;
+  view->views = views;
+
+  Py_INCREF(views);
+
+  if (PyList_Append(views, (PyObject*) view) != 0)
+  {
+    Py_DECREF(view);
+    return NULL;
+  }
+
+  return (PyObject*) view;
+}
+
+
+static void invalidate_object_views(
+    PyObject* views)
+{
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(views); i++)
+    ((ObjectView*) PyList_GET_ITEM(views, i))->object = NULL;
+
+  // Break the reference cycles between the views and the list.
+  PyList_SetSlice(views, 0, PyList_GET_SIZE(views), NULL);
+}
+
+
+static void ObjectView_dealloc(
+    PyObject* self)
+{
+  Py_XDECREF(((ObjectView*) self)->views);
+  PyObject_Del(self);
+}
+
+
+static YR_OBJECT* object_view_get_object(
+    PyObject* self)
+{
+  YR_OBJECT* object = ((ObjectView*) self)->object;
+
+  if (object == NULL)
+    PyErr_Format(
+        YaraError,
+        "module data is not available after the scan finishes, "
+        "use materialize() to keep it");
+
+  return object;
+}
+
+
+// Returns the Python value for an object, or a new view if the object is a
+// structure, array or dictionary.
+static PyObject* object_view_wrap(
+    YR_OBJECT* object,
+    PyObject* views)
+{
+  PyObject* result;
+
+  switch(object->type)
+  {
+    case OBJECT_TYPE_STRUCTURE:
+    case OBJECT_TYPE_ARRAY:
+    case OBJECT_TYPE_DICTIONARY:
+      return ObjectView_NEW(object, views);
+  }
+
+  result = convert_object_to_python(object);
+
+  if (result == NULL && !PyErr_Occurred())
+  {
+    result = Py_None;
+    Py_INCREF(result);
+  }
+
+  return result;
+}
+
+
+static YR_OBJECT* object_view_lookup(
+    YR_OBJECT* object,
+    const char* name)
+{
+  if (object->type == OBJECT_TYPE_STRUCTURE)
+  {
+    YR_STRUCTURE_MEMBER* member = object_as_structure(object)->members;
+
+    while (member != NULL)
+    {
+      if (strcmp(member->object->identifier, name) == 0)
+        return member->object;
+
+      member = member->next;
+    }
+  }
+  else if (object->type == OBJECT_TYPE_DICTIONARY)
+  {
+    YR_DICTIONARY_ITEMS* items = object_as_dictionary(object)->items;
+
+    for (int i = 0; items != NULL && i < items->used; i++)
+    {
+      if (strcmp(items->objects[i].key->c_string, name) == 0)
+        return items->objects[i].obj;
+    }
+  }
+
+  return NULL;
+}
+
+
+static PyObject* ObjectView_getattro(
+    PyObject* self,
+    PyObject* name)
+{
+  PyObject* result = PyObject_GenericGetAttr(self, name);
+
+  if (result != NULL || !PyErr_ExceptionMatches(PyExc_AttributeError))
+    return result;
+
+  YR_OBJECT* object = ((ObjectView*) self)->object;
+  const char* identifier = PY_STRING_TO_C(name);
+
+  if (object == NULL || identifier == NULL ||
+      object->type != OBJECT_TYPE_STRUCTURE)
+  {
+    if (object == NULL)
+    {
+      PyErr_Clear();
+      object_view_get_object(self);
+    }
+
+    return NULL;
+  }
+
+  YR_OBJECT* member = object_view_lookup(object, identifier);
+
+  if (member == NULL)
+  {
+    // The root structure is the module itself, dictionaries returned to the
+    // modules callback have its name under the "module" key.
+    if (object->parent == NULL && strcmp(identifier, "module") == 0)
+    {
+      PyErr_Clear();
+      return PY_STRING(object->identifier);
+    }
+
+    return NULL;
+  }
+
+  PyErr_Clear();
+
+  return object_view_wrap(member, ((ObjectView*) self)->views);
+}
+
+
+static Py_ssize_t ObjectView_length(
+    PyObject* self)
+{
+  YR_OBJECT* object = object_view_get_object(self);
+  Py_ssize_t length = 0;
+
+  if (object == NULL)
+    return -1;
+
+  if (object->type == OBJECT_TYPE_STRUCTURE)
+  {
+    YR_STRUCTURE_MEMBER* member = object_as_structure(object)->members;
+
+    for (; member != NULL; member = member->next)
+      length++;
+  }
+  else if (object->type == OBJECT_TYPE_ARRAY)
+  {
+    if (object_as_array(object)->items != NULL)
+      length = object_as_array(object)->items->length;
+  }
+  else if (object->type == OBJECT_TYPE_DICTIONARY)
+  {
+    if (object_as_dictionary(object)->items != NULL)
+      length = object_as_dictionary(object)->items->used;
+  }
+
+  return length;
+}
+
+
+static PyObject* ObjectView_subscript(
+    PyObject* self,
+    PyObject* key)
+{
+  YR_OBJECT* object = object_view_get_object(self);
+  YR_OBJECT* item = NULL;
+
+  if (object == NULL)
+    return NULL;
+
+  if (object->type == OBJECT_TYPE_ARRAY)
+  {
+    YR_ARRAY_ITEMS* items = object_as_array(object)->items;
+    Py_ssize_t i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+
+    if (i == -1 && PyErr_Occurred())
+      return NULL;
+
+    if (items != NULL && i < 0)
+      i += items->length;
+
+    if (items == NULL || i < 0 || i >= items->length)
+      return PyErr_Format(PyExc_IndexError, "index out of range");
+
+    item = items->objects[i];
+
+    // Arrays may have holes, return None for them.
+    if (item == NULL)
+      Py_RETURN_NONE;
+  }
+  else
+  {
+    const char* name = PY_STRING_CHECK(key) ? PY_STRING_TO_C(key) : NULL;
+
+    if (name != NULL)
+      item = object_view_lookup(object, name);
+
+    if (item == NULL)
+    {
+      if (!PyErr_Occurred())
+        PyErr_SetObject(PyExc_KeyError, key);
+
+      return NULL;
+    }
+  }
+
+  return object_view_wrap(item, ((ObjectView*) self)->views);
+}
+
+
+static PyObject* ObjectView_materialize(
+    PyObject* self,
+    PyObject* args)
+{
+  YR_OBJECT* object = object_view_get_object(self);
+
+  if (object == NULL)
+    return NULL;
+
+  PyObject* result = convert_object_to_python(object);
+
+  if (result == NULL)
+  {
+    if (!PyErr_Occurred())
+      Py_RETURN_NONE;
+
+    return NULL;
+  }
+
+  if (object->parent == NULL && object->type == OBJECT_TYPE_STRUCTURE)
+  {
+    PyObject* module_name = PY_STRING(object->identifier);
+    PyDict_SetItemString(result, "module", module_name);
+    Py_DECREF(module_name);
+  }
+
+  return result;
+}
+
+
+static PyObject* ObjectView_keys(
+    PyObject* self,
+    PyObject* args)
+{
+  YR_OBJECT* object = object_view_get_object(self);
+
+  if (object == NULL)
+    return NULL;
+
+  PyObject* result = PyList_New(0);
+  PyObject* key;
+
+  if (result == NULL)
+    return NULL;
+
+  if (object->type == OBJECT_TYPE_STRUCTURE)
+  {
+    YR_STRUCTURE_MEMBER* member = object_as_structure(object)->members;
+
+    for (; member != NULL; member = member->next)
+    {
+      key = PY_STRING(member->object->identifier);
+      PyList_Append(result, key);
+      Py_DECREF(key);
+    }
+  }
+  else if (object->type == OBJECT_TYPE_DICTIONARY)
+  {
+    YR_DICTIONARY_ITEMS* items = object_as_dictionary(object)->items;
+
+    for (int i = 0; items != NULL && i < items->used; i++)
+    {
+      key = PY_STRING(items->objects[i].key->c_string);
+      PyList_Append(result, key);
+      Py_DECREF(key);
+    }
+  }
+
+  return result;
+}
+
+
+// Converts a list of dotted field paths like ["number_of_sections",
+// "sections.name"] into a tree of nested dicts where leaves are None, like
+// {"number_of_sections": None, "sections": {"name": None}}. A None leaf
+// means that the whole object must be converted.
+static int add_field_path(
+    PyObject* tree,
+    const char* path)
+{
+  PyObject* node = tree;
+  PyObject* key;
+  PyObject* child;
+
+  while (true)
+  {
+    const char* dot = strchr(path, '.');
+    size_t length = dot != NULL ? (size_t) (dot - path) : strlen(path);
+
+    key = PyUnicode_FromStringAndSize(path, length);
+
+    if (key == NULL)
+      return -1;
+
+    child = PyDict_GetItem(node, key);
+
+    if (dot == NULL)
+    {
+      int result = PyDict_SetItem(node, key, Py_None);
+      Py_DECREF(key);
+      return result;
+    }
+
+    if (child == Py_None)
+    {
+      // A parent of this field is already being converted as a whole.
+      Py_DECREF(key);
+      return 0;
+    }
+
+    if (child == NULL)
+    {
+      child = PyDict_New();
+
+      if (child == NULL || PyDict_SetItem(node, key, child) != 0)
+      {
+        Py_XDECREF(child);
+        Py_DECREF(key);
+        return -1;
+      }
+
+      Py_DECREF(child);
+    }
+
+    Py_DECREF(key);
+
+    node = child;
+    path = dot + 1;
+  }
+}
+
+
+static PyObject* build_modules_fields(
+    PyObject* modules_fields)
+{
+  PyObject* module_name;
+  PyObject* paths;
+  Py_ssize_t pos = 0;
+
+  PyObject* result = PyDict_New();
+
+  if (result == NULL)
+    return NULL;
+
+  while (PyDict_Next(modules_fields, &pos, &module_name, &paths))
+  {
+    PyObject* tree = PyDict_New();
+    PyObject* sequence = PySequence_Fast(
+        paths, "'modules_fields' values must be lists of strings");
+
+    if (tree == NULL || sequence == NULL ||
+        PyDict_SetItem(result, module_name, tree) != 0)
+    {
+      Py_XDECREF(tree);
+      Py_XDECREF(sequence);
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    Py_DECREF(tree);
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(sequence); i++)
+    {
+      PyObject* path = PySequence_Fast_GET_ITEM(sequence, i);
+      const char* c_path = PY_STRING_CHECK(path) ? PY_STRING_TO_C(path) : NULL;
+
+      if (c_path == NULL || add_field_path(tree, c_path) != 0)
+      {
+        if (!PyErr_Occurred())
+          PyErr_Format(
+              PyExc_TypeError,
+              "'modules_fields' values must be lists of strings");
+
+        Py_DECREF(sequence);
+        Py_DECREF(result);
+        return NULL;
+      }
+    }
+
+    Py_DECREF(sequence);
+  }
+
+  return result;
+}
+
+
+// Like convert_object_to_python, but only converts the fields present in
+// "fields", a tree built by build_modules_fields. Arrays and dictionaries
+// apply the same fields to each one of their items. Returns NULL without an
+// exception set for undefined or missing fields, and NULL with an exception
+// set if the conversion fails.
+static PyObject* convert_object_fields_to_python(
+    YR_OBJECT* object,
+    PyObject* fields)
+{
+  PyObject* result = NULL;
+  PyObject* py_object;
+
+  if (object == NULL)
+    return NULL;
+
+  if (fields == NULL || fields == Py_None)
+    return convert_object_to_python(object);
+
+  switch(object->type)
+  {
+    case OBJECT_TYPE_STRUCTURE:
+    {
+      PyObject* key;
+      PyObject* subfields;
+      Py_ssize_t pos = 0;
+
+      result = PyDict_New();
+
+      while (result != NULL && PyDict_Next(fields, &pos, &key, &subfields))
+      {
+        YR_OBJECT* member = object_view_lookup(object, PY_STRING_TO_C(key));
+
+        py_object = convert_object_fields_to_python(member, subfields);
+
+        if (py_object == NULL && PyErr_Occurred())
+        {
+          Py_CLEAR(result);
+        }
+        else if (py_object != NULL)
+        {
+          if (PyDict_SetItem(result, key, py_object) != 0)
+            Py_CLEAR(result);
+
+          Py_DECREF(py_object);
+        }
+      }
+
+      break;
+    }
+
+    case OBJECT_TYPE_ARRAY:
+    {
+      YR_ARRAY_ITEMS* items = object_as_array(object)->items;
+
+      result = PyList_New(0);
+
+      for (int i = 0; result != NULL && items != NULL && i < items->length; i++)
+      {
+        py_object = convert_object_fields_to_python(items->objects[i], fields);
+
+        if (py_object == NULL && PyErr_Occurred())
+        {
+          Py_CLEAR(result);
+        }
+        else if (py_object != NULL)
+        {
+          if (PyList_Append(result, py_object) != 0)
+            Py_CLEAR(result);
+
+          Py_DECREF(py_object);
+        }
+      }
+
+      break;
+    }
+
+    case OBJECT_TYPE_DICTIONARY:
+    {
+      YR_DICTIONARY_ITEMS* items = object_as_dictionary(object)->items;
+
+      result = PyDict_New();
+
+      for (int i = 0; result != NULL && items != NULL && i < items->used; i++)
+      {
+        py_object = convert_object_fields_to_python(
+            items->objects[i].obj, fields);
+
+        if (py_object == NULL && PyErr_Occurred())
+        {
+          Py_CLEAR(result);
+        }
+        else if (py_object != NULL)
+        {
+          if (PyDict_SetItemString(
+                  result, items->objects[i].key->c_string, py_object) != 0)
+            Py_CLEAR(result);
+
+          Py_DECREF(py_object);
+        }
+      }
+
+      break;
+    }
+
+    default:
+      result = convert_object_to_python(object);
+      break;
+  }
+
+  return result;
+}
+
+
+// Values in modules_data can be any object supporting the buffer protocol,
+// or a callable that receives the module name and returns such an object. In
+// the latter case the callable is invoked only if some rule actually imports
+// the module. Objects other than bytes are pinned with a memoryview that is
+// kept in data->modules_buffers and released after the scan.
+static int handle_import_module(
+    YR_MODULE_IMPORT* module_import,
+    CALLBACK_DATA* data)
+{
+  if (data->modules_data == NULL)
+    return CALLBACK_CONTINUE;
+
+  PyGILState_STATE gil_state = PyGILState_Ensure();
+
+  int result = CALLBACK_CONTINUE;
+
+  PyObject* view = NULL;
+  PyObject* module_data = PyDict_GetItemString(
+      data->modules_data,
+      module_import->module_name);
+
+  if (module_data == NULL)
+  {
+    PyGILState_Release(gil_state);
+    return CALLBACK_CONTINUE;
+  }
+
+  Py_INCREF(module_data);
+
+  if (PyCallable_Check(module_data))
+  {
+    PyObject* provided = PyObject_CallFunction(
+        module_data, "s", module_import->module_name);
+
+    Py_DECREF(module_data);
+    module_data = provided;
+
+    if (module_data == NULL)
+    {
+      PyGILState_Release(gil_state);
+      return CALLBACK_ERROR;
+    }
+
+    if (module_data != Py_None && !PyObject_CheckBuffer(module_data))
+    {
+      PyErr_Format(
+          PyExc_TypeError,
+          "data for module \"%s\" must be a bytes-like object",
+          module_import->module_name);
+
+      result = CALLBACK_ERROR;
+    }
+  }
+
+  #if PY_MAJOR_VERSION >= 3
+  if (result == CALLBACK_CONTINUE && PyBytes_Check(module_data))
+  #else
+  if (result == CALLBACK_CONTINUE && PyString_Check(module_data))
+  #endif
+  {
+    Py_ssize_t data_size;
+
+    #if PY_MAJOR_VERSION >= 3
+    PyBytes_AsStringAndSize(
+        module_data,
+        (char**) &module_import->module_data,
+        &data_size);
+    #else
+    PyString_AsStringAndSize(
+        module_data,
+        (char**) &module_import->module_data,
+        &data_size);
+    #endif
+
+    module_import->module_data_size = data_size;
+
+    // A bytes object returned by a callable must outlive the scan too.
+    view = module_data;
+    Py_INCREF(view);
+  }
+  else if (result == CALLBACK_CONTINUE && PyObject_CheckBuffer(module_data))
+  {
+    view = PyMemoryView_FromObject(module_data);
+
+    if (view == NULL)
+    {
+      result = CALLBACK_ERROR;
+    }
+    else if (!PyBuffer_IsContiguous(PyMemoryView_GET_BUFFER(view), 'C'))
+    {
+      PyErr_Format(
+          PyExc_TypeError,
+          "data for module \"%s\" must be a contiguous buffer",
+          module_import->module_name);
+
+      Py_CLEAR(view);
+      result = CALLBACK_ERROR;
+    }
+    else
+    {
+      module_import->module_data = PyMemoryView_GET_BUFFER(view)->buf;
+      module_import->module_data_size = PyMemoryView_GET_BUFFER(view)->len;
+    }
+  }
+
+  if (view != NULL)
+  {
+    if (data->modules_buffers == NULL)
+      data->modules_buffers = PyList_New(0);
+
+    if (data->modules_buffers == NULL ||
+        PyList_Append(data->modules_buffers, view) != 0)
+    {
+      module_import->module_data = NULL;
+      module_import->module_data_size = 0;
+      result = CALLBACK_ERROR;
+    }
+
+    Py_DECREF(view);
+  }
+
+  Py_DECREF(module_data);
+  PyGILState_Release(gil_state);
+
+  return result;
+}
+
+
+// Releases the buffers pinned by handle_import_module during a scan.
+static void release_modules_buffers(
+    CALLBACK_DATA* data)
+{
+  if (data->modules_buffers == NULL)
+    return;
+
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(data->modules_buffers); i++)
+  {
+    PyObject* view = PyList_GET_ITEM(data->modules_buffers, i);
+
+    if (PyMemoryView_Check(view))
+    {
+      PyObject* result = PyObject_CallMethod(view, "release", NULL);
+
+      if (result == NULL)
+        PyErr_Clear();
+
+      Py_XDECREF(result);
+    }
+  }
+
+  Py_CLEAR(data->modules_buffers);
+}
+
+
+static int handle_module_imported(
+    void* message_data,
+    CALLBACK_DATA* data)
+{
+  if (data->modules_callback == NULL)
+    return CALLBACK_CONTINUE;
+
+  PyGILState_STATE gil_state = PyGILState_Ensure();
+
+  PyObject* module_info_dict;
+
+  if (data->module_views != NULL)
+  {
+    module_info_dict = ObjectView_NEW(
+        (YR_OBJECT*) message_data, data->module_views);
+  }
+  else
+  {
+    PyObject* fields = NULL;
+
+    if (data->modules_fields != NULL)
+      fields = PyDict_GetItemString(
+          data->modules_fields,
+          object_as_structure(message_data)->identifier);
+
+    if (fields != NULL)
+      module_info_dict = convert_object_fields_to_python(
+          (YR_OBJECT*) message_data, fields);
+    else
+      module_info_dict = convert_structure_to_python(
+          object_as_structure(message_data));
+
+    if (module_info_dict != NULL)
+    {
+      PyObject* object = PY_STRING(
+          object_as_structure(message_data)->identifier);
+
+      if (object == NULL ||
+          PyDict_SetItemString(module_info_dict, "module", object) != 0)
+        Py_CLEAR(module_info_dict);
+
+      Py_XDECREF(object);
+    }
+  }
+
+  // A conversion error is reported as a callback error, leaving the Python
+  // exception set so that match() raises it.
+  if (module_info_dict == NULL)
+  {
+    int result = PyErr_Occurred() ? CALLBACK_ERROR : CALLBACK_CONTINUE;
+    PyGILState_Release(gil_state);
+    return result;
+  }
+
+  Py_INCREF(data->modules_callback);
+
+  PyObject* callback_result = PyObject_CallFunctionObjArgs(
+      data->modules_callback,
+      module_info_dict,
+      NULL);
+
+  int result = CALLBACK_CONTINUE;
+
+  if (callback_result != NULL)
+  {
+    #if PY_MAJOR_VERSION >= 3
+    if (PyLong_Check(callback_result))
+    #else
+    if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
+    #endif
+    {
+      result = (int) PyLong_AsLong(callback_result);
+    }
+  }
+  else
+  {
+    result = CALLBACK_ERROR;
+  }
+
+  Py_XDECREF(callback_result);
+  Py_DECREF(module_info_dict);
+  Py_DECREF(data->modules_callback);
+
+  PyGILState_Release(gil_state);
+
+  return result;
+}
+
+
+static int handle_console_log(
+    void* message_data,
+    CALLBACK_DATA* data)
+{
+  PyGILState_STATE gil_state = PyGILState_Ensure();
+  int result = CALLBACK_CONTINUE;
+
+  if (data->console_callback == NULL)
+  {
+    // If the user does not specify a console callback we dump to stdout.
+    // If we want to support 3.2 and newer only we can use
+    // https://docs.python.org/3/c-api/sys.html?highlight=stdout#c.PySys_FormatStdout
+    // instead of this call with the limit.
+    PySys_WriteStdout("%.1000s\n", (char*) message_data);
+  }
+  else
+  {
+    PyObject* log_string = PY_STRING((char*) message_data);
+    Py_INCREF(data->console_callback);
+
+    PyObject* callback_result = PyObject_CallFunctionObjArgs(
+        data->console_callback,
+        log_string,
+        NULL);
+
+    if (callback_result != NULL)
+    {
+      #if PY_MAJOR_VERSION >= 3
+      if (PyLong_Check(callback_result))
+      #else
+      if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
+      #endif
+      {
+        result = (int) PyLong_AsLong(callback_result);
+      }
+    }
+    else
+    {
+      result = CALLBACK_ERROR;
+    }
+
+    Py_DECREF(log_string);
+    Py_XDECREF(callback_result);
+    Py_DECREF(data->console_callback);
+  }
+
+  PyGILState_Release(gil_state);
+
+  return result;
+}
+
+
+static int handle_too_many_matches(
+    YR_SCAN_CONTEXT* context,
+    YR_STRING* string,
+    CALLBACK_DATA* data)
+{
+  PyGILState_STATE gil_state = PyGILState_Ensure();
+
+  PyObject* warning_type = NULL;
+  PyObject* string_identifier = NULL;
+  PyObject* rule_identifier = NULL;
+  PyObject* namespace_identifier = NULL;
+  PyObject* rule_string = NULL;
+  YR_RULE* rule = NULL;
+
+  int result = CALLBACK_CONTINUE;
+
+  if (data->warnings_callback == NULL)
+  {
+    char message[200];
+
+    snprintf(
+        message,
+        sizeof(message),
+        "too many matches for string %s in rule \"%s\"",
+        string->identifier,
+        context->rules->rules_table[string->rule_idx].identifier);
+
+    if (PyErr_WarnEx(PyExc_RuntimeWarning, message, 1) == -1)
+      result = CALLBACK_ERROR;
+  }
+  else
+  {
+    Py_INCREF(data->warnings_callback);
+
+    string_identifier = PY_STRING(string->identifier);
+
+    if (string_identifier == NULL)
+    {
+      result = CALLBACK_ERROR;
+      goto _exit;
+    }
+
+    rule = &context->rules->rules_table[string->rule_idx];
+    rule_identifier = PY_STRING(rule->identifier);
+
+    if (rule_identifier == NULL)
+    {
+      result = CALLBACK_ERROR;
+      goto _exit;
+    }
+
+    namespace_identifier = PY_STRING(rule->ns->name);
+
+    if (namespace_identifier == NULL)
+    {
+      result = CALLBACK_ERROR;
+      goto _exit;
+    }
+
+    rule_string = PyStructSequence_New(&RuleString_Type);
+
+    if (rule_string == NULL)
+    {
+      result = CALLBACK_ERROR;
+      goto _exit;
+    }
+
+    PyStructSequence_SET_ITEM(rule_string, 0, namespace_identifier);
+    PyStructSequence_SET_ITEM(rule_string, 1, rule_identifier);
+    PyStructSequence_SET_ITEM(rule_string, 2, string_identifier);
+
+    // PyStructSequenece steals the reference so we NULL these
+    // so that Py_XDECREF() can be used in _exit label
+    namespace_identifier = NULL;
+    rule_identifier = NULL;
+    string_identifier = NULL;
+
+    warning_type = PyLong_FromLong(CALLBACK_MSG_TOO_MANY_MATCHES);
+
+    if (warning_type == NULL)
+    {
+      result = CALLBACK_ERROR;
+      goto _exit;
+    }
+
+    PyObject* callback_result = PyObject_CallFunctionObjArgs(
+        data->warnings_callback,
+        warning_type,
+        rule_string,
+        NULL);
+
+    if (callback_result != NULL)
+    {
+      #if PY_MAJOR_VERSION >= 3
+      if (PyLong_Check(callback_result))
+      #else
+      if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
+      #endif
+      {
+        result = (int) PyLong_AsLong(callback_result);
+      }
+    }
+    else
+    {
+      result = CALLBACK_ERROR;
+    }
+
+    Py_XDECREF(callback_result);
+  }
+
+_exit:
+
+  Py_XDECREF(namespace_identifier);
+  Py_XDECREF(rule_identifier);
+  Py_XDECREF(string_identifier);
+  Py_XDECREF(rule_string);
+  Py_XDECREF(warning_type);
+  Py_XDECREF(data->warnings_callback);
+
+  PyGILState_Release(gil_state);
+
+  return result;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+// JSON output. When match() is called with output="json" the results are
+// serialized directly from libyara's structures into a buffer, without
+// creating the intermediate Match objects or module dictionaries.
+
+#define JSON_ENCODING_HEX     0
+#define JSON_ENCODING_BASE64  1
+
+
+typedef struct _JSON_BUFFER
+{
+  char* data;
+  size_t length;
+  size_t capacity;
+  bool failed;
+
+} JSON_BUFFER;
+
+
+typedef struct _JSON_OUTPUT
+{
+  JSON_BUFFER matches;
+  JSON_BUFFER modules;
+  int encoding;
+
+} JSON_OUTPUT;
+
+
+static bool json_reserve(
+    JSON_BUFFER* buffer,
+    size_t size)
+{
+  if (buffer->failed)
+    return false;
+
+  if (buffer->length + size <= buffer->capacity)
+    return true;
+
+  size_t capacity = buffer->capacity == 0 ? 1024 : buffer->capacity;
+
+  while (capacity < buffer->length + size)
+    capacity *= 2;
+
+  char* data = (char*) realloc(buffer->data, capacity);
+
+  if (data == NULL)
+  {
+    buffer->failed = true;
+    return false;
+  }
+
+  buffer->data = data;
+  buffer->capacity = capacity;
+
+  return true;
+}
+
+
+static void json_append(
+    JSON_BUFFER* buffer,
+    const char* str,
+    size_t length)
+{
+  if (json_reserve(buffer, length))
+  {
+    memcpy(buffer->data + buffer->length, str, length);
+    buffer->length += length;
+  }
+}
+
+
+static void json_append_raw(
+    JSON_BUFFER* buffer,
+    const char* str)
+{
+  json_append(buffer, str, strlen(str));
+}
+
+
+// Strings in YARA are arbitrary bytes, not necessarily valid UTF-8. To keep
+// the document valid every byte outside the printable ASCII range is escaped
+// as \u00XX, so a string decoded from the JSON can be turned back into the
+// original bytes by encoding it as latin-1.
+static void json_append_string(
+    JSON_BUFFER* buffer,
+    const char* str,
+    size_t length)
+{
+  static const char hex_digits[] = "0123456789abcdef";
+
+  // In the worst case every character is escaped as \u00XX.
+  if (!json_reserve(buffer, length * 6 + 2))
+    return;
+
+  char* out = buffer->data + buffer->length;
+
+  *out++ = '"';
+
+  for (size_t i = 0; i < length; i++)
+  {
+    unsigned char c = (unsigned char) str[i];
+
+    if (c == '"' || c == '\\')
+    {
+      *out++ = '\\';
+      *out++ = c;
+    }
+    else if (c == '\n')
+    {
+      *out++ = '\\';
+      *out++ = 'n';
+    }
+    else if (c == '\r')
+    {
+      *out++ = '\\';
+      *out++ = 'r';
+    }
+    else if (c == '\t')
+    {
+      *out++ = '\\';
+      *out++ = 't';
+    }
+    else if (c < 0x20 || c >= 0x7f)
+    {
+      *out++ = '\\';
+      *out++ = 'u';
+      *out++ = '0';
+      *out++ = '0';
+      *out++ = hex_digits[c >> 4];
+      *out++ = hex_digits[c & 0xf];
+    }
+    else
+    {
+      *out++ = c;
+    }
+  }
+
+  *out++ = '"';
+
+  buffer->length = out - buffer->data;
+}
+
+
+static void json_append_cstring(
+    JSON_BUFFER* buffer,
+    const char* str)
+{
+  json_append_string(buffer, str, strlen(str));
+}
+
+
+static void json_append_int(
+    JSON_BUFFER* buffer,
+    int64_t value)
+{
+  char str[32];
+  snprintf(str, sizeof(str), "%" PRId64, value);
+  json_append_raw(buffer, str);
+}
+
+
+static void json_append_double(
+    JSON_BUFFER* buffer,
+    double value)
+{
+  char str[32];
+
+  if (isnan(value) || isinf(value))
+  {
+    json_append_raw(buffer, "null");
+    return;
+  }
+
+  snprintf(str, sizeof(str), "%.17g", value);
+  json_append_raw(buffer, str);
+}
+
+
+static void json_append_data(
+    JSON_BUFFER* buffer,
+    const uint8_t* data,
+    size_t length,
+    int encoding)
+{
+  static const char hex_digits[] = "0123456789abcdef";
+  static const char base64_digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  if (!json_reserve(buffer, length * 2 + 6))
+    return;
+
+  char* out = buffer->data + buffer->length;
+
+  *out++ = '"';
+
+  if (encoding == JSON_ENCODING_HEX)
+  {
+    for (size_t i = 0; i < length; i++)
+    {
+      *out++ = hex_digits[data[i] >> 4];
+      *out++ = hex_digits[data[i] & 0xf];
+    }
+  }
+  else
+  {
+    size_t i = 0;
+
+    for (; i + 2 < length; i += 3)
+    {
+      uint32_t n = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+
+      *out++ = base64_digits[(n >> 18) & 0x3f];
+      *out++ = base64_digits[(n >> 12) & 0x3f];
+      *out++ = base64_digits[(n >> 6) & 0x3f];
+      *out++ = base64_digits[n & 0x3f];
+    }
+
+    if (i < length)
+    {
+      uint32_t n = data[i] << 16;
+
+      if (i + 1 < length)
+        n |= data[i + 1] << 8;
+
+      *out++ = base64_digits[(n >> 18) & 0x3f];
+      *out++ = base64_digits[(n >> 12) & 0x3f];
+      *out++ = i + 1 < length ? base64_digits[(n >> 6) & 0x3f] : '=';
+      *out++ = '=';
+    }
+  }
+
+  *out++ = '"';
+
+  buffer->length = out - buffer->data;
+}
+
+
+static void json_append_rule(
+    JSON_BUFFER* buffer,
+    YR_SCAN_CONTEXT* context,
+    YR_RULE* rule,
+    CALLBACK_DATA* data)
+{
+  YR_STRING* string;
+  YR_MATCH* m;
+  YR_META* meta;
+
+  const char* tag;
+  bool first;
+
+  int encoding = data->json->encoding;
+
+  if (buffer->length > 1)
+    json_append_raw(buffer, ",");
+
+  json_append_raw(buffer, "{\"rule\":");
+  json_append_cstring(buffer, rule->identifier);
+  json_append_raw(buffer, ",\"namespace\":");
+  json_append_cstring(buffer, rule->ns->name);
+  json_append_raw(buffer, ",\"tags\":[");
+
+  first = true;
+
+  yr_rule_tags_foreach(rule, tag)
+  {
+    if (!first)
+      json_append_raw(buffer, ",");
+
+    json_append_cstring(buffer, tag);
+    first = false;
+  }
+
+  json_append_raw(buffer, "],\"meta\":{");
+
+  first = true;
+
+  yr_rule_metas_foreach(rule, meta)
+  {
+    if (!first)
+      json_append_raw(buffer, ",");
+
+    json_append_cstring(buffer, meta->identifier);
+    json_append_raw(buffer, ":");
+
+    if (meta->type == META_TYPE_INTEGER)
+      json_append_int(buffer, meta->integer);
+    else if (meta->type == META_TYPE_BOOLEAN)
+      json_append_raw(buffer, meta->integer ? "true" : "false");
+    else
+      json_append_cstring(buffer, meta->string);
+
+    first = false;
+  }
+
+  json_append_raw(buffer, "},\"strings\":[");
+
+  first = true;
+
+  yr_rule_strings_foreach(rule, string)
+  {
+    uint32_t count = 0;
+
+    if (context->matches[string->idx].head == NULL)
+      continue;
+
+    if (!first)
+      json_append_raw(buffer, ",");
+
+    json_append_raw(buffer, "{\"identifier\":");
+    json_append_cstring(buffer, string->identifier);
+    json_append_raw(buffer, ",\"instances\":[");
+
+    yr_string_matches_foreach(context, string, m)
+    {
+      uint32_t data_length = m->data_length;
+
+      if (data->max_matches_per_string != 0 &&
+          count == data->max_matches_per_string)
+        break;
+
+      if (data->max_match_data != 0 && data_length > data->max_match_data)
+        data_length = data->max_match_data;
+
+      if (count++ > 0)
+        json_append_raw(buffer, ",");
+
+      json_append_raw(buffer, "{\"offset\":");
+      json_append_int(buffer, m->base + m->offset);
+      json_append_raw(buffer, ",\"matched_length\":");
+      json_append_int(buffer, m->match_length);
+      json_append_raw(buffer, ",\"xor_key\":");
+      json_append_int(buffer, m->xor_key);
+      json_append_raw(buffer, ",\"matched_data\":");
+      json_append_data(buffer, m->data, data_length, encoding);
+      json_append_raw(buffer, "}");
+    }
+
+    json_append_raw(buffer, "]}");
+    first = false;
+  }
+
+  json_append_raw(buffer, "]}");
+}
+
+
+// Serializes a module's object. "fields" has the same meaning than in
+// convert_object_fields_to_python, when it's not NULL the GIL must be held.
+static void json_append_object(
+    JSON_BUFFER* buffer,
+    YR_OBJECT* object,
+    PyObject* fields)
+{
+  bool first = true;
+
+  if (fields == Py_None)
+    fields = NULL;
+
+  switch(object->type)
+  {
+    case OBJECT_TYPE_INTEGER:
+      if (object->value.i != YR_UNDEFINED)
+        json_append_int(buffer, object->value.i);
+      else
+        json_append_raw(buffer, "null");
+      break;
+
+    case OBJECT_TYPE_FLOAT:
+      json_append_double(buffer, object->value.d);
+      break;
+
+    case OBJECT_TYPE_STRING:
+      if (object->value.ss != NULL)
+        json_append_string(
+            buffer,
+            object->value.ss->c_string,
+            object->value.ss->length);
+      else
+        json_append_raw(buffer, "null");
+      break;
+
+    case OBJECT_TYPE_STRUCTURE:
+    {
+      json_append_raw(buffer, "{");
+
+      if (fields != NULL)
+      {
+        PyObject* key;
+        PyObject* subfields;
+        Py_ssize_t pos = 0;
+
+        while (PyDict_Next(fields, &pos, &key, &subfields))
+        {
+          YR_OBJECT* member = object_view_lookup(object, PY_STRING_TO_C(key));
+
+          if (member == NULL || member->type == OBJECT_TYPE_FUNCTION)
+            continue;
+
+          if (!first)
+            json_append_raw(buffer, ",");
+
+          json_append_cstring(buffer, member->identifier);
+          json_append_raw(buffer, ":");
+          json_append_object(buffer, member, subfields);
+          first = false;
+        }
+      }
+      else
+      {
+        YR_STRUCTURE_MEMBER* member = object_as_structure(object)->members;
+
+        for (; member != NULL; member = member->next)
+        {
+          if (member->object->type == OBJECT_TYPE_FUNCTION)
+            continue;
+
+          if (!first)
+            json_append_raw(buffer, ",");
+
+          json_append_cstring(buffer, member->object->identifier);
+          json_append_raw(buffer, ":");
+          json_append_object(buffer, member->object, NULL);
+          first = false;
+        }
+      }
+
+      json_append_raw(buffer, "}");
+      break;
+    }
+
+    case OBJECT_TYPE_ARRAY:
+    {
+      YR_ARRAY_ITEMS* items = object_as_array(object)->items;
+
+      json_append_raw(buffer, "[");
+
+      for (int i = 0; items != NULL && i < items->length; i++)
+      {
+        if (i > 0)
+          json_append_raw(buffer, ",");
+
+        if (items->objects[i] != NULL)
+          json_append_object(buffer, items->objects[i], fields);
+        else
+          json_append_raw(buffer, "null");
+      }
+
+      json_append_raw(buffer, "]");
+      break;
+    }
+
+    case OBJECT_TYPE_DICTIONARY:
+    {
+      YR_DICTIONARY_ITEMS* items = object_as_dictionary(object)->items;
+
+      json_append_raw(buffer, "{");
+
+      for (int i = 0; items != NULL && i < items->used; i++)
+      {
+        if (i > 0)
+          json_append_raw(buffer, ",");
+
+        json_append_string(
+            buffer,
+            items->objects[i].key->c_string,
+            items->objects[i].key->length);
+
+        json_append_raw(buffer, ":");
+        json_append_object(buffer, items->objects[i].obj, fields);
+      }
+
+      json_append_raw(buffer, "}");
+      break;
+    }
+
+    default:
+      json_append_raw(buffer, "null");
+      break;
+  }
+}
+
+
+static void json_append_module(
+    JSON_BUFFER* buffer,
+    YR_OBJECT* module,
+    CALLBACK_DATA* data)
+{
+  PyObject* fields = NULL;
+  PyGILState_STATE gil_state;
+
+  if (data->modules_fields != NULL)
+  {
+    gil_state = PyGILState_Ensure();
+
+    fields = PyDict_GetItemString(data->modules_fields, module->identifier);
+
+    if (fields == NULL)
+      PyGILState_Release(gil_state);
+  }
+
+  if (buffer->length > 1)
+    json_append_raw(buffer, ",");
+
+  json_append_cstring(buffer, module->identifier);
+  json_append_raw(buffer, ":");
+  json_append_object(buffer, module, fields);
+
+  if (fields != NULL)
+    PyGILState_Release(gil_state);
+}
+
+
+static void json_output_init(
+    JSON_OUTPUT* output,
+    int encoding)
+{
+  memset(output, 0, sizeof(JSON_OUTPUT));
+
+  output->encoding = encoding;
+
+  json_append_raw(&output->matches, "[");
+  json_append_raw(&output->modules, "{");
+}
+
+
+static void json_output_reset(
+    JSON_OUTPUT* output)
+{
+  output->matches.length = 0;
+  output->modules.length = 0;
+
+  json_append_raw(&output->matches, "[");
+  json_append_raw(&output->modules, "{");
+}
+
+
+// Appends to "buffer" the "matches" and "modules" members of the JSON object
+// for a scan and closes the object. The caller writes the opening brace, and
+// possibly other members followed by a comma, before calling this function.
+static void json_output_finish(
+    JSON_OUTPUT* output,
+    JSON_BUFFER* buffer)
+{
+  json_append_raw(buffer, "\"matches\":");
+  json_append(buffer, output->matches.data, output->matches.length);
+  json_append_raw(buffer, "],\"modules\":");
+  json_append(buffer, output->modules.data, output->modules.length);
+  json_append_raw(buffer, "}}");
+
+  if (output->matches.failed || output->modules.failed)
+    buffer->failed = true;
+}
+
+
+static void json_output_destroy(
+    JSON_OUTPUT* output)
+{
+  free(output->matches.data);
+  free(output->modules.data);
+}
+
+
+static int parse_json_encoding(
+    const char* encoding)
+{
+  if (encoding == NULL || strcmp(encoding, "hex") == 0)
+    return JSON_ENCODING_HEX;
+
+  if (strcmp(encoding, "base64") == 0)
+    return JSON_ENCODING_BASE64;
+
+  PyErr_Format(
+      PyExc_ValueError,
+      "'data_encoding' must be either \"hex\" or \"base64\"");
+
+  return -1;
+}
+
+
+// Columns of the MatchTable produced by match(output="table"). Rows are
+// appended from yara_callback without holding the GIL, one per string match.
+// Matching rules without any string match get a single row with string_index
+// and offset set to -1.
+
+typedef struct _TABLE_OUTPUT
+{
+  uint32_t* rule_index;
+  int32_t* string_index;
+  int64_t* offset;
+  int32_t* length;
+  uint8_t* xor_key;
+  size_t count;
+  size_t capacity;
+  bool failed;
+
+} TABLE_OUTPUT;
+
+
+static bool table_output_append(
+    TABLE_OUTPUT* table,
+    uint32_t rule_index,
+    int32_t string_index,
+    int64_t offset,
+    int32_t length,
+    uint8_t xor_key)
+{
+  if (table->failed)
+    return false;
+
+  if (table->count == table->capacity)
+  {
+    size_t capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+
+    uint32_t* rule_index = (uint32_t*) realloc(
+        table->rule_index, capacity * sizeof(uint32_t));
+
+    if (rule_index != NULL)
+      table->rule_index = rule_index;
+
+    int32_t* string_index = (int32_t*) realloc(
+        table->string_index, capacity * sizeof(int32_t));
+
+    if (string_index != NULL)
+      table->string_index = string_index;
+
+    int64_t* offset = (int64_t*) realloc(
+        table->offset, capacity * sizeof(int64_t));
+
+    if (offset != NULL)
+      table->offset = offset;
+
+    int32_t* length = (int32_t*) realloc(
+        table->length, capacity * sizeof(int32_t));
+
+    if (length != NULL)
+      table->length = length;
+
+    uint8_t* xor_key = (uint8_t*) realloc(
+        table->xor_key, capacity * sizeof(uint8_t));
+
+    if (xor_key != NULL)
+      table->xor_key = xor_key;
+
+    if (rule_index == NULL || string_index == NULL || offset == NULL ||
+        length == NULL || xor_key == NULL)
+    {
+      table->failed = true;
+      return false;
+    }
+
+    table->capacity = capacity;
+  }
+
+  table->rule_index[table->count] = rule_index;
+  table->string_index[table->count] = string_index;
+  table->offset[table->count] = offset;
+  table->length[table->count] = length;
+  table->xor_key[table->count] = xor_key;
+  table->count++;
+
+  return true;
+}
+
+
+static void table_output_append_rule(
+    TABLE_OUTPUT* table,
+    YR_SCAN_CONTEXT* context,
+    YR_RULE* rule,
+    CALLBACK_DATA* data)
+{
+  YR_STRING* string;
+  YR_MATCH* m;
+
+  uint32_t rule_index = (uint32_t) (rule - context->rules->rules_table);
+  size_t count = table->count;
+
+  yr_rule_strings_foreach(rule, string)
+  {
+    uint32_t string_count = 0;
+
+    yr_string_matches_foreach(context, string, m)
+    {
+      if (data->max_matches_per_string != 0 &&
+          string_count == data->max_matches_per_string)
+        break;
+
+      table_output_append(
+          table,
+          rule_index,
+          (int32_t) (string - context->rules->strings_table),
+          m->base + m->offset,
+          m->match_length,
+          m->xor_key);
+
+      string_count++;
+    }
+  }
+
+  if (table->count == count)
+    table_output_append(table, rule_index, -1, -1, 0, 0);
+}
+
+
+static void table_output_destroy(
+    TABLE_OUTPUT* table)
+{
+  free(table->rule_index);
+  free(table->string_index);
+  free(table->offset);
+  free(table->length);
+  free(table->xor_key);
+}
+
+
+// Copies a column into a bytes object and returns a memoryview of it with
+// the given struct format, so that it can be consumed through the buffer
+// protocol.
+static PyObject* table_column(
+    const void* data,
+    size_t count,
+    size_t item_size,
+    const char* format)
+{
+  PyObject* result = NULL;
+  PyObject* bytes = PyBytes_FromStringAndSize(
+      (const char*) data, count * item_size);
+
+  if (bytes != NULL)
+  {
+    PyObject* view = PyMemoryView_FromObject(bytes);
+
+    if (view != NULL)
+    {
+      result = PyObject_CallMethod(view, "cast", "s", format);
+      Py_DECREF(view);
+    }
+
+    Py_DECREF(bytes);
+  }
+
+  return result;
+}
+
+
+static PyObject* match_table_new(
+    PyObject* rules,
+    TABLE_OUTPUT* table)
+{
+  MatchTable* object;
+
+  if (table->failed)
+    return PyErr_NoMemory();
+
+  object = PyObject_NEW(MatchTable, &MatchTable_Type);
+
+  if (object == NULL)
+    return NULL;
+
+  Py_INCREF(rules);
+
+  object->rules = rules;
+  object->count = (Py_ssize_t) table->count;
+  object->rule_index = table_column(
+      table->rule_index, table->count, sizeof(uint32_t), "I");
+  object->string_index = table_column(
+      table->string_index, table->count, sizeof(int32_t), "i");
+  object->offset = table_column(
+      table->offset, table->count, sizeof(int64_t), "q");
+  object->length = table_column(
+      table->length, table->count, sizeof(int32_t), "i");
+  object->xor_key = table_column(
+      table->xor_key, table->count, sizeof(uint8_t), "B");
+
+  if (object->rule_index == NULL ||
+      object->string_index == NULL ||
+      object->offset == NULL ||
+      object->length == NULL ||
+      object->xor_key == NULL)
+  {
+    Py_DECREF(object);
+    return NULL;
+  }
+
+  return (PyObject*) object;
+}
+
+
+static void MatchTable_dealloc(
+    PyObject* self)
+{
+  MatchTable* object = (MatchTable*) self;
+
+  Py_XDECREF(object->rules);
+  Py_XDECREF(object->rule_index);
+  Py_XDECREF(object->string_index);
+  Py_XDECREF(object->offset);
+  Py_XDECREF(object->length);
+  Py_XDECREF(object->xor_key);
+
+  PyObject_Del(self);
+}
+
+
+static Py_ssize_t MatchTable_len(
+    PyObject* self)
+{
+  return ((MatchTable*) self)->count;
+}
+
+
+#define CALLBACK_MATCHES 0x01
+#define CALLBACK_NON_MATCHES 0x02
+#define CALLBACK_ALL CALLBACK_MATCHES | CALLBACK_NON_MATCHES
+
+int yara_callback(
+    YR_SCAN_CONTEXT* context,
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  YR_STRING* string;
+  YR_MATCH* m;
+  YR_META* meta;
+  YR_RULE* rule;
+
+  const char* tag;
+
+  PyObject* tag_list = NULL;
+  PyObject* string_instance_list = NULL;
+  PyObject* string_list = NULL;
+  PyObject* meta_list = NULL;
+  PyObject* string_match_instance = NULL;
+  PyObject* match;
+  PyObject* callback_dict;
+  PyObject* object;
+  PyObject* matches = ((CALLBACK_DATA*) user_data)->matches;
+  PyObject* callback = ((CALLBACK_DATA*) user_data)->callback;
+  PyObject* callback_result;
+
+  int which = ((CALLBACK_DATA*) user_data)->which;
+
+  CancellationToken* cancellation_token =
+      ((CALLBACK_DATA*) user_data)->cancellation_token;
+
+  if (cancellation_token != NULL &&
+      shared_flag_get(&cancellation_token->cancelled))
+  {
+    ((CALLBACK_DATA*) user_data)->cancelled = true;
+    return CALLBACK_ABORT;
+  }
+
+  switch(message)
+  {
+  case CALLBACK_MSG_IMPORT_MODULE:
+    // Modules like pe or elf keep pointers into the block where they found
+    // their headers, chunked scans reuse the same buffer for every block.
+    if (((CALLBACK_DATA*) user_data)->reject_modules)
+    {
+      PyGILState_STATE gil_state = PyGILState_Ensure();
+      PyErr_Format(
+          PyExc_ValueError,
+          "'chunk_size' and 'ranges' can't be used with rules importing "
+          "modules (\"%s\")",
+          ((YR_MODULE_IMPORT*) message_data)->module_name);
+      PyGILState_Release(gil_state);
+      return CALLBACK_ERROR;
+    }
+
+    return handle_import_module(message_data, user_data);
+
+  case CALLBACK_MSG_MODULE_IMPORTED:
+    if (((CALLBACK_DATA*) user_data)->json != NULL)
+      json_append_module(
+          &((CALLBACK_DATA*) user_data)->json->modules,
+          (YR_OBJECT*) message_data,
+          (CALLBACK_DATA*) user_data);
+
+    return handle_module_imported(message_data, user_data);
+
+  case CALLBACK_MSG_TOO_MANY_MATCHES:
+    return handle_too_many_matches(context, message_data, user_data);
+
+  case CALLBACK_MSG_SCAN_FINISHED:
+    return CALLBACK_CONTINUE;
+
+  case CALLBACK_MSG_RULE_NOT_MATCHING:
+    // In cases where the rule doesn't match and the user didn't provided a
+    // callback function or is not interested in getting notified about
+    // non-matches, there's nothing more do to here, keep executing the function
+    // if otherwise.
+
+    if (callback == NULL ||
+        (which & CALLBACK_NON_MATCHES) != CALLBACK_NON_MATCHES)
+      return CALLBACK_CONTINUE;
+    break;
+
+  case CALLBACK_MSG_CONSOLE_LOG:
+    return handle_console_log(message_data, user_data);
+  }
+
+  // At this point we have handled all the other cases of when this callback
+  // can be called. The only things left are:
+  //
+  // 1. A matching rule.
+  //
+  // 2 A non-matching rule and the user has requested to see non-matching rules.
+  //
+  // In both cases, we need to create the data that will be either passed back
+  // to the python callback or stored in the matches list.
+
+  int result = CALLBACK_CONTINUE;
+
+  rule = (YR_RULE*) message_data;
+
+  // With JSON output matching rules are serialized without holding the GIL,
+  // Match objects are built only if there's a callback that needs them.
+  if (((CALLBACK_DATA*) user_data)->json != NULL)
+  {
+    if (message == CALLBACK_MSG_RULE_MATCHING)
+      json_append_rule(
+          &((CALLBACK_DATA*) user_data)->json->matches,
+          context,
+          rule,
+          (CALLBACK_DATA*) user_data);
+
+    if (callback == NULL)
+      return CALLBACK_CONTINUE;
+  }
+
+  // Same for table output, rows are appended to the columns directly.
+  if (((CALLBACK_DATA*) user_data)->table != NULL)
+  {
+    if (message == CALLBACK_MSG_RULE_MATCHING)
+      table_output_append_rule(
+          ((CALLBACK_DATA*) user_data)->table,
+          context,
+          rule,
+          (CALLBACK_DATA*) user_data);
+
+    if (callback == NULL)
+      return CALLBACK_CONTINUE;
+  }
+
+  PyGILState_STATE gil_state = PyGILState_Ensure();
+
+  tag_list = PyList_New(0);
+  string_list = PyList_New(0);
+  meta_list = PyDict_New();
+
+  if (tag_list == NULL || string_list == NULL || meta_list == NULL)
+  {
+    Py_XDECREF(tag_list);
+    Py_XDECREF(string_list);
+    Py_XDECREF(meta_list);
+    PyGILState_Release(gil_state);
+
+    return CALLBACK_ERROR;
+  }
+
+  yr_rule_tags_foreach(rule, tag)
+  {
+    object = PY_STRING(tag);
+    PyList_Append(tag_list, object);
+    Py_DECREF(object);
+  }
+
+  yr_rule_metas_foreach(rule, meta)
+  {
+    if (meta->type == META_TYPE_INTEGER)
+      object = Py_BuildValue("i", meta->integer);
+    else if (meta->type == META_TYPE_BOOLEAN)
+      object = PyBool_FromLong((long) meta->integer);
+    else
+      object = PY_STRING(meta->string);
+
+    if (((CALLBACK_DATA*) user_data)->allow_duplicate_metadata){
+      // Check if we already have an array under this key
+      PyObject* existing_item = PyDict_GetItemString(meta_list, meta->identifier);
+      // Append object to existing list
+      if (existing_item)
+        PyList_Append(existing_item, object);
+      else{
+        //Otherwise, instantiate array and append object as first item
+        PyObject* new_list = PyList_New(0);
+        PyList_Append(new_list, object);
+        PyDict_SetItemString(meta_list, meta->identifier, new_list);
+        Py_DECREF(new_list);
+      }
+    }
+    else{
+      PyDict_SetItemString(meta_list, meta->identifier, object);
+      Py_DECREF(object);
+    }
+  }
+
+  yr_rule_strings_foreach(rule, string)
+  {
+    // If this string is not a match, skip it. We have to check for this here
+    // and not rely on it in yr_string_matches_foreach macro because we need
+    // to create the string match instance list before we make the items that
+    // go in it.
+    if (context->matches[string->idx].head == NULL)
+      continue;
+
+    string_instance_list = PyList_New(0);
+
+    if (string_instance_list == NULL)
+    {
+        PyErr_Format(PyExc_TypeError, "out of memory");
+        return CALLBACK_ERROR;
+    }
+
+
+    yr_string_matches_foreach(context, string, m)
+    {
+      CALLBACK_DATA* data = (CALLBACK_DATA*) user_data;
+      uint32_t data_length = m->data_length;
+
+      if (data->max_matches_per_string != 0 &&
+          PyList_GET_SIZE(string_instance_list) >= data->max_matches_per_string)
+        break;
+
+      if (data->max_match_data != 0 && data_length > data->max_match_data)
+        data_length = data->max_match_data;
+
+      object = PyBytes_FromStringAndSize((char*) m->data, data_length);
+
+      string_match_instance = StringMatchInstance_NEW(
+          m->base + m->offset,
+          object,
+          m->match_length,
+          m->xor_key);
+
+      if (string_match_instance == NULL)
+      {
+        Py_DECREF(object);
+        PyErr_Format(PyExc_TypeError, "out of memory");
+        return CALLBACK_ERROR;
+      }
+
+      PyList_Append(string_instance_list, string_match_instance);
+
+      Py_DECREF(object);
+      Py_DECREF(string_match_instance);
+    }
+
+    object = StringMatch_NEW(
+        string->identifier,
+        string->flags,
+        string_instance_list);
+
+    if (object == NULL)
+    {
+        PyErr_Format(PyExc_TypeError, "out of memory");
+        return CALLBACK_ERROR;
+    }
+
+
+    Py_DECREF(string_instance_list);
+
+    PyList_Append(string_list, object);
+    Py_DECREF(object);
+  }
+
+  if (message == CALLBACK_MSG_RULE_MATCHING)
+  {
+    match = Match_NEW(
+        rule->identifier,
+        rule->ns->name,
+        tag_list,
+        meta_list,
+        string_list);
+
+    if (match != NULL)
+    {
+      if (((CALLBACK_DATA*) user_data)->stream != NULL)
+      {
+        if (match_iterator_push(((CALLBACK_DATA*) user_data)->stream, match))
+          result = CALLBACK_ERROR;
+      }
+      else
+      {
+        PyList_Append(matches, match);
+      }
+
+      Py_DECREF(match);
+    }
+    else
+    {
+      Py_DECREF(tag_list);
+      Py_DECREF(string_list);
+      Py_DECREF(meta_list);
+      PyGILState_Release(gil_state);
+
+      return CALLBACK_ERROR;
+    }
+  }
+
+  if (callback != NULL &&
+      ((message == CALLBACK_MSG_RULE_MATCHING && (which & CALLBACK_MATCHES)) ||
+       (message == CALLBACK_MSG_RULE_NOT_MATCHING && (which & CALLBACK_NON_MATCHES))))
+  {
+    Py_INCREF(callback);
+
+    callback_dict = PyDict_New();
+
+    object = PyBool_FromLong(message == CALLBACK_MSG_RULE_MATCHING);
+    PyDict_SetItemString(callback_dict, "matches", object);
+    Py_DECREF(object);
+
+    object = PY_STRING(rule->identifier);
+    PyDict_SetItemString(callback_dict, "rule", object);
+    Py_DECREF(object);
+
+    object = PY_STRING(rule->ns->name);
+    PyDict_SetItemString(callback_dict, "namespace", object);
+    Py_DECREF(object);
+
+    PyDict_SetItemString(callback_dict, "tags", tag_list);
+    PyDict_SetItemString(callback_dict, "meta", meta_list);
+    PyDict_SetItemString(callback_dict, "strings", string_list);
+
+    callback_result = PyObject_CallFunctionObjArgs(
+        callback,
+        callback_dict,
+        NULL);
+
+    if (callback_result != NULL)
+    {
+      #if PY_MAJOR_VERSION >= 3
+      if (PyLong_Check(callback_result))
+      #else
+      if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
+      #endif
+      {
+        result = (int) PyLong_AsLong(callback_result);
+      }
+
+      Py_DECREF(callback_result);
+    }
+    else
+    {
+      result = CALLBACK_ERROR;
+    }
+
+    Py_DECREF(callback_dict);
+    Py_DECREF(callback);
+  }
+
+  Py_DECREF(tag_list);
+  Py_DECREF(string_list);
+  Py_DECREF(meta_list);
+  PyGILState_Release(gil_state);
+
+  return result;
+}
+
+
+/* YR_STREAM read method for "file-like objects" */
+
+static size_t flo_read(
+    void* ptr,
+    size_t size,
+    size_t count,
+    void* user_data)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    PyGILState_STATE gil_state = PyGILState_Ensure();
+
+    PyObject* bytes = PyObject_CallMethod(
+        (PyObject*) user_data, "read", "n", (Py_ssize_t) size);
+
+    if (bytes == NULL) 
+    {
+      PyGILState_Release(gil_state);
+      return i;
+    }
+
+    Py_ssize_t len;
+    char* buffer;
+
+    int result = PyBytes_AsStringAndSize(bytes, &buffer, &len);
+
+    if (result == -1 || (size_t) len < size)
+    {
+      Py_DECREF(bytes);
+      PyGILState_Release(gil_state);
+      return i;
+    }
+
+    memcpy((char*) ptr + i * size, buffer, size);
+
+    Py_DECREF(bytes);
+    PyGILState_Release(gil_state);
+  }
+
+  return count;
+}
+
+
+/* YR_STREAM write method for "file-like objects" */
+
+static size_t flo_write(
+    const void* ptr,
+    size_t size,
+    size_t count,
+    void* user_data)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    PyGILState_STATE gil_state = PyGILState_Ensure();
+
+    PyObject* result = PyObject_CallMethod(
+    #if PY_MAJOR_VERSION >= 3
+        (PyObject*) user_data, "write", "y#", (char*) ptr + i * size, size);
+    #else
+        (PyObject*) user_data, "write", "s#", (char*) ptr + i * size, size);
+    #endif
+
+    Py_XDECREF(result);
+    PyGILState_Release(gil_state);
+
+    if (result == NULL)
+      return i;
+  }
+
+  return count;
+}
+
+
+PyObject* handle_error(
+    int error,
+    char* extra)
+{
+  switch(error)
+  {
+    case ERROR_COULD_NOT_ATTACH_TO_PROCESS:
+      return PyErr_Format(
+          YaraError,
+          "access denied");
+    case ERROR_INSUFFICIENT_MEMORY:
+      return PyErr_NoMemory();
+    case ERROR_COULD_NOT_OPEN_FILE:
+      return PyErr_Format(
+          YaraError,
+          "could not open file \"%s\"",
+          extra);
+    case ERROR_COULD_NOT_MAP_FILE:
+      return PyErr_Format(
+          YaraError,
+          "could not map file \"%s\" into memory",
+          extra);
+    case ERROR_INVALID_FILE:
+      return PyErr_Format(
+          YaraError,
+          "invalid rules file \"%s\"",
+          extra);
+    case ERROR_CORRUPT_FILE:
+      return PyErr_Format(
+          YaraError,
+          "corrupt rules file \"%s\"",
+          extra);
+    case ERROR_SCAN_TIMEOUT:
+      return PyErr_Format(
+          YaraTimeoutError,
+          "scanning timed out");
+    case ERROR_INVALID_EXTERNAL_VARIABLE_TYPE:
+      return PyErr_Format(
+          YaraError,
+          "external variable \"%s\" was already defined with a different type",
+          extra);
+    case ERROR_UNSUPPORTED_FILE_VERSION:
+      return PyErr_Format(
+          YaraError,
+          "rules file \"%s\" is incompatible with this version of YARA",
+          extra);
+    default:
+      return PyErr_Format(
+          YaraError,
+          "internal error: %d",
+          error);
+  }
+}
+
+
+int process_compile_externals(
+    PyObject* externals,
+    YR_COMPILER* compiler)
+{
+  PyObject* key;
+  PyObject* value;
+  Py_ssize_t pos = 0;
+
+  char* identifier = NULL;
+  int result;
+
+  while (PyDict_Next(externals, &pos, &key, &value))
+  {
+    if (!PY_STRING_CHECK(key)) {
+      PyErr_Format(
+          PyExc_TypeError,
+          "keys of externals dict must be strings");
+
+      return ERROR_INVALID_ARGUMENT;
+    }
+    identifier = PY_STRING_TO_C(key);
+
+    if (PyBool_Check(value))
+    {
+      result = yr_compiler_define_boolean_variable(
+          compiler,
+          identifier,
+          PyObject_IsTrue(value));
+    }
+#if PY_MAJOR_VERSION >= 3
+    else if (PyLong_Check(value))
+#else
+    else if (PyLong_Check(value) || PyInt_Check(value))
+#endif
+    {
+      result = yr_compiler_define_integer_variable(
+          compiler,
+          identifier,
+          PyLong_AsLongLong(value));
+    }
+    else if (PyFloat_Check(value))
+    {
+      result = yr_compiler_define_float_variable(
+          compiler,
+          identifier,
+          PyFloat_AsDouble(value));
+    }
+    else if (PY_STRING_CHECK(value))
+    {
+      char* str = PY_STRING_TO_C(value);
+
+      if (str == NULL)
+        return ERROR_INVALID_ARGUMENT;
+
+      result = yr_compiler_define_string_variable(
+          compiler, identifier, str);
+    }
+    else
+    {
+      PyErr_Format(
+          PyExc_TypeError,
+          "external values must be of type integer, float, boolean or string");
+
+      return ERROR_INVALID_ARGUMENT;
+    }
+
+    if (result != ERROR_SUCCESS)
+    {
+      handle_error(result, identifier);
+      return result;
+    }
+  }
+
+  return ERROR_SUCCESS;
+}
+
+
+int process_match_externals(
+    PyObject* externals,
+    YR_SCANNER* scanner)
+{
+  PyObject* key;
+  PyObject* value;
+  Py_ssize_t pos = 0;
+
+  char* identifier = NULL;
+  int result;
+
+  while (PyDict_Next(externals, &pos, &key, &value))
+  {
+    if (!PY_STRING_CHECK(key)) {
+      PyErr_Format(
+          PyExc_TypeError,
+          "keys of externals dict must be strings");
+
+      return ERROR_INVALID_ARGUMENT;
+    }
+    identifier = PY_STRING_TO_C(key);
+
+    if (PyBool_Check(value))
+    {
+      result = yr_scanner_define_boolean_variable(
+          scanner,
+          identifier,
+          PyObject_IsTrue(value));
+    }
+#if PY_MAJOR_VERSION >= 3
+    else if (PyLong_Check(value))
+#else
+    else if (PyLong_Check(value) || PyInt_Check(value))
+#endif
+    {
+      result = yr_scanner_define_integer_variable(
+          scanner,
+          identifier,
+          PyLong_AsLongLong(value));
+    }
+    else if (PyFloat_Check(value))
+    {
+      result = yr_scanner_define_float_variable(
+          scanner,
+          identifier,
+          PyFloat_AsDouble(value));
+    }
+    else if (PY_STRING_CHECK(value))
+    {
+      char* str = PY_STRING_TO_C(value);
+
+      if (str == NULL)
+        return ERROR_INVALID_ARGUMENT;
+
+      result = yr_scanner_define_string_variable(
+          scanner, identifier, str);
+    }
+    else
+    {
+      PyErr_Format(
+          PyExc_TypeError,
+          "external values must be of type integer, float, boolean or string");
+
+      return ERROR_INVALID_ARGUMENT;
+    }
+
+    // yr_scanner_define_xxx_variable returns ERROR_INVALID_ARGUMENT if the
+    // variable wasn't previously defined in the compilation phase. Ignore
+    // those errors because we don't want the "scan" method being aborted
+    // because of the "externals" dictionary having more keys than those used
+    // during compilation.
+
+    if (result != ERROR_SUCCESS &&
+        result != ERROR_INVALID_ARGUMENT)
+    {
+      handle_error(result, identifier);
+      return result;
+    }
+  }
+
+  return ERROR_SUCCESS;
+}
+
+
+// Externals objects hold the values for the external variables of a given
+// Rules object already converted to C types, so that they don't need to be
+// validated and converted from a Python dict on every scan.
+static int externals_set_value(
+    Externals* externals,
+    PyObject* key,
+    PyObject* value)
+{
+  EXTERNAL_VALUE* external = NULL;
+  const char* identifier;
+
+  if (!PY_STRING_CHECK(key))
+  {
+    PyErr_Format(
+        PyExc_TypeError,
+        "keys of externals dict must be strings");
+
+    return -1;
+  }
+
+  identifier = PY_STRING_TO_C(key);
+
+  if (identifier == NULL)
+    return -1;
+
+  for (int i = 0; i < externals->num_values; i++)
+  {
+    if (strcmp(externals->values[i].identifier, identifier) == 0)
+    {
+      external = &externals->values[i];
+      break;
+    }
+  }
+
+  // Just like match() does with dictionaries, ignore variables that were not
+  // defined at compile time.
+  if (external == NULL)
+    return 0;
+
+  if (external->type == EXTERNAL_VARIABLE_TYPE_BOOLEAN && PyBool_Check(value))
+  {
+    external->value.i = PyObject_IsTrue(value);
+  }
+#if PY_MAJOR_VERSION >= 3
+  else if (external->type == EXTERNAL_VARIABLE_TYPE_INTEGER &&
+           PyLong_Check(value) && !PyBool_Check(value))
+#else
+  else if (external->type == EXTERNAL_VARIABLE_TYPE_INTEGER &&
+           (PyLong_Check(value) || PyInt_Check(value)) && !PyBool_Check(value))
+#endif
+  {
+    external->value.i = PyLong_AsLongLong(value);
+
+    if (external->value.i == -1 && PyErr_Occurred())
+      return -1;
+  }
+  else if (external->type == EXTERNAL_VARIABLE_TYPE_FLOAT &&
+           PyFloat_Check(value))
+  {
+    external->value.f = PyFloat_AsDouble(value);
+  }
+  else if ((external->type == EXTERNAL_VARIABLE_TYPE_STRING ||
+            external->type == EXTERNAL_VARIABLE_TYPE_MALLOC_STRING) &&
+           PY_STRING_CHECK(value))
+  {
+    const char* str = PY_STRING_TO_C(value);
+
+    if (str == NULL)
+      return -1;
+
+    char* copy = strdup(str);
+
+    if (copy == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+
+    free(external->value.s);
+    external->value.s = copy;
+  }
+  else
+  {
+    handle_error(
+        ERROR_INVALID_EXTERNAL_VARIABLE_TYPE,
+        (char*) external->identifier);
+
+    return -1;
+  }
+
+  external->defined = true;
+
+  return 0;
+}
+
+
+static int externals_set_values(
+    Externals* externals,
+    PyObject* values)
+{
+  PyObject* key;
+  PyObject* value;
+  Py_ssize_t pos = 0;
+
+  while (PyDict_Next(values, &pos, &key, &value))
+  {
+    if (externals_set_value(externals, key, value) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+
+static int externals_apply(
+    Externals* externals,
+    YR_SCANNER* scanner)
+{
+  int result = ERROR_SUCCESS;
+
+  for (int i = 0; i < externals->num_values && result == ERROR_SUCCESS; i++)
+  {
+    EXTERNAL_VALUE* external = &externals->values[i];
+
+    if (!external->defined)
+      continue;
+
+    switch (external->type)
+    {
+      case EXTERNAL_VARIABLE_TYPE_BOOLEAN:
+        result = yr_scanner_define_boolean_variable(
+            scanner, external->identifier, (int) external->value.i);
+        break;
+      case EXTERNAL_VARIABLE_TYPE_INTEGER:
+        result = yr_scanner_define_integer_variable(
+            scanner, external->identifier, external->value.i);
+        break;
+      case EXTERNAL_VARIABLE_TYPE_FLOAT:
+        result = yr_scanner_define_float_variable(
+            scanner, external->identifier, external->value.f);
+        break;
+      default:
+        result = yr_scanner_define_string_variable(
+            scanner, external->identifier, external->value.s);
+        break;
+    }
+  }
+
+  return result;
+}
+
+
+static PyObject* Externals_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "rules", "values", NULL
+      };
+
+  PyObject* rules = NULL;
+  PyObject* values = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "O!|O!",
+        kwlist,
+        &Rules_Type,
+        &rules,
+        &PyDict_Type,
+        &values))
+  {
+    return NULL;
+  }
+
+  YR_EXTERNAL_VARIABLE* external = ((Rules*) rules)->rules->ext_vars_table;
+  int num_values = 0;
+
+  while (!EXTERNAL_VARIABLE_IS_NULL(external + num_values))
+    num_values++;
+
+  Externals* externals = (Externals*) type->tp_alloc(type, 0);
+
+  if (externals == NULL)
+    return NULL;
+
+  externals->rules = rules;
+  externals->num_values = num_values;
+  externals->values = (EXTERNAL_VALUE*) calloc(
+      num_values + 1, sizeof(EXTERNAL_VALUE));
+
+  Py_INCREF(rules);
+
+  if (externals->values == NULL)
+  {
+    Py_DECREF(externals);
+    return PyErr_NoMemory();
+  }
+
+  // The identifiers point to the rules' arena, which is kept alive by the
+  // reference to the Rules object.
+  for (int i = 0; i < num_values; i++)
+  {
+    externals->values[i].identifier = external[i].identifier;
+    externals->values[i].type = external[i].type;
+  }
+
+  if (values != NULL && externals_set_values(externals, values) != 0)
+  {
+    Py_DECREF(externals);
+    return NULL;
+  }
+
+  return (PyObject*) externals;
+}
+
+
+static void Externals_dealloc(
+    PyObject* self)
+{
+  Externals* externals = (Externals*) self;
+
+  if (externals->values != NULL)
+  {
+    for (int i = 0; i < externals->num_values; i++)
+    {
+      if (externals->values[i].type == EXTERNAL_VARIABLE_TYPE_STRING ||
+          externals->values[i].type == EXTERNAL_VARIABLE_TYPE_MALLOC_STRING)
+        free(externals->values[i].value.s);
+    }
+
+    free(externals->values);
+  }
+
+  Py_XDECREF(externals->rules);
+  Py_TYPE(self)->tp_free(self);
+}
+
+
+static PyObject* Externals_update(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  PyObject* values = NULL;
+
+  if (!PyArg_ParseTuple(args, "|O!", &PyDict_Type, &values))
+    return NULL;
+
+  if (values != NULL && externals_set_values((Externals*) self, values) != 0)
+    return NULL;
+
+  if (keywords != NULL && externals_set_values((Externals*) self, keywords) != 0)
+    return NULL;
+
+  Py_RETURN_NONE;
+}
+
+
+// libyara keeps the scan timeout in nanoseconds but yr_scanner_set_timeout
+// only accepts whole seconds.
+static void scanner_set_timeout_ns(
+    YR_SCANNER* scanner,
+    uint64_t timeout_ns)
+{
+  scanner->timeout = timeout_ns;
+}
+
+
+static PyObject* CancellationToken_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = { NULL };
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywords, "", kwlist))
+    return NULL;
+
+  CancellationToken* token = (CancellationToken*) type->tp_alloc(type, 0);
+
+  if (token == NULL)
+    return NULL;
+
+  token->cancelled = 0;
+  token->active_scans = NULL;
+
+  mutex_init(&token->mutex);
+
+  return (PyObject*) token;
+}
+
+
+static void CancellationToken_dealloc(
+    PyObject* self)
+{
+  mutex_destroy(&((CancellationToken*) self)->mutex);
+
+  Py_TYPE(self)->tp_free(self);
+}
+
+
+// libyara checks the scan timeout periodically while scanning data and
+// evaluating conditions, which is the only way of interrupting a scan in
+// progress. Setting it to the minimum makes the scan fail with a timeout
+// error at the next check. The store is atomic, as the scanner is running
+// in another thread.
+static void scanner_cancel(
+    YR_SCANNER* scanner)
+{
+  shared_uint64_set(&scanner->timeout, 1);
+}
+
+
+static PyObject* CancellationToken_cancel(
+    PyObject* self,
+    PyObject* args)
+{
+  CancellationToken* token = (CancellationToken*) self;
+
+  // The flag is set with the lock held, so scans registering concurrently
+  // are either in the list or see the flag.
+  mutex_lock(&token->mutex);
+
+  shared_flag_set(&token->cancelled);
+
+  for (ACTIVE_SCAN* scan = token->active_scans; scan != NULL; scan = scan->next)
+    scanner_cancel(scan->scanner);
+
+  mutex_unlock(&token->mutex);
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* CancellationToken_get_cancelled(
+    PyObject* self,
+    void* closure)
+{
+  return PyBool_FromLong(
+      shared_flag_get(&((CancellationToken*) self)->cancelled));
+}
+
+
+// Adds a scan to the ones aborted by the token, it must be removed with
+// cancellation_token_unregister before its scanner is destroyed. Neither
+// function needs the GIL.
+static void cancellation_token_register(
+    CancellationToken* token,
+    ACTIVE_SCAN* scan)
+{
+  mutex_lock(&token->mutex);
+
+  scan->next = token->active_scans;
+  token->active_scans = scan;
+
+  if (shared_flag_get(&token->cancelled))
+    scanner_cancel(scan->scanner);
+
+  mutex_unlock(&token->mutex);
+}
+
+
+static void cancellation_token_unregister(
+    CancellationToken* token,
+    ACTIVE_SCAN* scan)
+{
+  mutex_lock(&token->mutex);
+
+  ACTIVE_SCAN** current = &token->active_scans;
+
+  while (*current != NULL && *current != scan)
+    current = &(*current)->next;
+
+  if (*current != NULL)
+    *current = scan->next;
+
+  mutex_unlock(&token->mutex);
+}
+
+
+// Returns true if a scan that failed with "error" was aborted by the token,
+// which is reported by libyara as a timeout.
+static bool cancellation_token_aborted(
+    CancellationToken* token,
+    int error)
+{
+  return token != NULL &&
+         error == ERROR_SCAN_TIMEOUT &&
+         shared_flag_get(&token->cancelled);
+}
+
+
+// Converts the "timeout" and "deadline" arguments of match() into a timeout
+// in nanoseconds. "timeout" is a number of seconds, possibly fractional, and
+// "deadline" is an absolute time as returned by time.time(). "timeout_name"
+// is the name of the argument "timeout" comes from, for error messages.
+// Returns -1 with an exception set if arguments are invalid or the deadline
+// already passed.
+static int parse_timeout(
+    PyObject* timeout,
+    const char* timeout_name,
+    PyObject* deadline,
+    uint64_t* timeout_ns)
+{
+  static PyObject* time_module = NULL;
+
+  double seconds = 0;
+
+  *timeout_ns = 0;
+
+  if (timeout != NULL && timeout != Py_None)
+  {
+    seconds = PyFloat_AsDouble(timeout);
+
+    if (seconds == -1 && PyErr_Occurred())
+    {
+      PyErr_Format(PyExc_TypeError, "'%s' must be a number", timeout_name);
+      return -1;
+    }
+
+    if (seconds < 0)
+      seconds = 0;
+  }
+
+  if (deadline != NULL && deadline != Py_None)
+  {
+    double deadline_secs = PyFloat_AsDouble(deadline);
+
+    if (deadline_secs == -1 && PyErr_Occurred())
+    {
+      PyErr_Format(PyExc_TypeError, "'deadline' must be a number");
+      return -1;
+    }
+
+    if (time_module == NULL)
+      time_module = PyImport_ImportModule("time");
+
+    PyObject* now = time_module != NULL
+        ? PyObject_CallMethod(time_module, "time", NULL)
+        : NULL;
+
+    if (now == NULL)
+      return -1;
+
+    double remaining = deadline_secs - PyFloat_AsDouble(now);
+    Py_DECREF(now);
+
+    if (remaining <= 0)
+    {
+      PyErr_Format(YaraTimeoutError, "scanning timed out");
+      return -1;
+    }
+
+    if (seconds == 0 || remaining < seconds)
+      seconds = remaining;
+  }
+
+  if (seconds > 0)
+  {
+    // Converting a double that doesn't fit in an uint64_t is undefined, huge
+    // and infinite timeouts are clamped to the largest one.
+    if (seconds * 1000000000.0 >= 18446744073709551615.0)
+      *timeout_ns = UINT64_MAX;
+    else
+      *timeout_ns = (uint64_t) (seconds * 1000000000.0);
+
+    // A zero timeout means no timeout at all.
+    if (*timeout_ns == 0)
+      *timeout_ns = 1;
+  }
+
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+// XXH64, used for identifying the content of scanned data in result caches.
+// It's fast enough for hashing the data to cost much less than scanning it.
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+static uint64_t xxh64_read64(
+    const uint8_t* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+static uint32_t xxh64_read32(
+    const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+static uint64_t xxh64_round(
+    uint64_t acc,
+    uint64_t input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = XXH_ROTL64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+
+static uint64_t xxh64_merge_round(
+    uint64_t acc,
+    uint64_t val)
+{
+  acc ^= xxh64_round(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+// Assumes a little-endian platform, on big-endian ones hashes are different
+// but still consistent within the platform, which is enough for caching.
+static uint64_t xxh64(
+    const uint8_t* p,
+    size_t length,
+    uint64_t seed)
+{
+  const uint8_t* end = p + length;
+  uint64_t h;
+
+  if (length >= 32)
+  {
+    const uint8_t* limit = end - 32;
+
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+
+    do
+    {
+      v1 = xxh64_round(v1, xxh64_read64(p));
+      v2 = xxh64_round(v2, xxh64_read64(p + 8));
+      v3 = xxh64_round(v3, xxh64_read64(p + 16));
+      v4 = xxh64_round(v4, xxh64_read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) +
+        XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+
+    h = xxh64_merge_round(h, v1);
+    h = xxh64_merge_round(h, v2);
+    h = xxh64_merge_round(h, v3);
+    h = xxh64_merge_round(h, v4);
+  }
+  else
+  {
+    h = seed + XXH_PRIME64_5;
+  }
+
+  h += (uint64_t) length;
+
+  while (p + 8 <= end)
+  {
+    h ^= xxh64_round(0, xxh64_read64(p));
+    h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+
+  if (p + 4 <= end)
+  {
+    h ^= (uint64_t) xxh64_read32(p) * XXH_PRIME64_1;
+    h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+
+  while (p < end)
+  {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+
+static size_t hash_stream_write(
+    const void* ptr,
+    size_t size,
+    size_t count,
+    void* user_data)
+{
+  json_append((JSON_BUFFER*) user_data, (const char*) ptr, size * count);
+  return ((JSON_BUFFER*) user_data)->failed ? 0 : count;
+}
+
+
+// Returns a hash of the compiled rules, computed from their serialized form
+// so that it's the same for rules loaded from the same file in different
+// processes. Called with the GIL held, it's computed only once per object.
+static int rules_fingerprint(
+    Rules* rules,
+    uint64_t* fingerprint)
+{
+  JSON_BUFFER buffer = {0};
+  YR_STREAM stream;
+
+  int error;
+
+  if (!rules->has_fingerprint)
+  {
+    stream.user_data = &buffer;
+    stream.write = hash_stream_write;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    error = yr_rules_save_stream(rules->rules, &stream);
+
+    if (error == ERROR_SUCCESS)
+      rules->fingerprint = xxh64(
+          (const uint8_t*) buffer.data, buffer.length, 0);
+
+    Py_END_ALLOW_THREADS
+
+    free(buffer.data);
+
+    if (error != ERROR_SUCCESS)
+    {
+      handle_error(error, NULL);
+      return -1;
+    }
+
+    rules->has_fingerprint = true;
+  }
+
+  *fingerprint = rules->fingerprint;
+
+  return 0;
+}
+
+
+static uint64_t hash_python_repr(
+    PyObject* object,
+    uint64_t seed,
+    int* error)
+{
+  PyObject* repr = PyObject_Repr(object);
+  PyObject* encoded;
+
+  uint64_t hash = seed;
+
+  if (repr == NULL)
+  {
+    *error = -1;
+    return 0;
+  }
+
+  #if PY_MAJOR_VERSION >= 3
+  encoded = PyUnicode_AsUTF8String(repr);
+  #else
+  encoded = repr;
+  Py_INCREF(encoded);
+  #endif
+
+  if (encoded != NULL)
+  {
+    hash = xxh64(
+        (const uint8_t*) PyBytes_AS_STRING(encoded),
+        PyBytes_GET_SIZE(encoded),
+        seed);
+
+    Py_DECREF(encoded);
+  }
+  else
+  {
+    *error = -1;
+  }
+
+  Py_DECREF(repr);
+
+  return hash;
+}
+
+
+// Builds a list of (identifier, value) tuples describing the values in an
+// externals dictionary or Externals object, sorted by identifier.
+static PyObject* externals_items(
+    PyObject* externals)
+{
+  PyObject* items;
+
+  if (externals == NULL || externals == Py_None)
+    return PyList_New(0);
+
+  if (PyDict_Check(externals))
+  {
+    items = PyDict_Items(externals);
+  }
+  else
+  {
+    Externals* object = (Externals*) externals;
+
+    items = PyList_New(0);
+
+    for (int i = 0; items != NULL && i < object->num_values; i++)
+    {
+      EXTERNAL_VALUE* external = &object->values[i];
+      PyObject* value;
+      PyObject* item;
+
+      if (!external->defined)
+        value = Py_None, Py_INCREF(value);
+      else if (external->type == EXTERNAL_VARIABLE_TYPE_FLOAT)
+        value = PyFloat_FromDouble(external->value.f);
+      else if (external->type == EXTERNAL_VARIABLE_TYPE_STRING ||
+               external->type == EXTERNAL_VARIABLE_TYPE_MALLOC_STRING)
+        value = PY_STRING(external->value.s);
+      else if (external->type == EXTERNAL_VARIABLE_TYPE_BOOLEAN)
+        value = PyBool_FromLong((long) external->value.i);
+      else
+        value = PyLong_FromLongLong(external->value.i);
+
+      item = Py_BuildValue("(sN)", external->identifier, value);
+
+      if (item == NULL || PyList_Append(items, item) != 0)
+        Py_CLEAR(items);
+
+      Py_XDECREF(item);
+    }
+  }
+
+  if (items != NULL && PyList_Sort(items) != 0)
+    Py_CLEAR(items);
+
+  return items;
+}
+
+
+// Returns the key identifying the result of a scan in a result cache. The key
+// is a string with the hex representation of the hash and size of the
+// scanned content, the rules fingerprint and a hash of everything else that
+// can change the result (externals and scan options). Files are mapped with
+// map_file_buffer before computing the key, so "data" is always the scanned
+// content.
+static PyObject* result_cache_key(
+    Rules* rules,
+    Py_buffer* data,
+    PyObject* externals,
+    PyObject* options)
+{
+  PyObject* items;
+
+  uint64_t content_hash = 0;
+  uint64_t content_size = 0;
+  uint64_t rules_hash;
+  uint64_t options_hash;
+
+  int error = 0;
+
+  char key[4 * 16 + 1];
+
+  if (rules_fingerprint(rules, &rules_hash) != 0)
+    return NULL;
+
+  items = externals_items(externals);
+
+  if (items == NULL)
+    return NULL;
+
+  options_hash = hash_python_repr(items, 0, &error);
+  options_hash = hash_python_repr(options, options_hash, &error);
+
+  Py_DECREF(items);
+
+  if (error != 0)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+
+  content_hash = xxh64((const uint8_t*) data->buf, data->len, 0);
+  content_size = data->len;
+
+  Py_END_ALLOW_THREADS
+
+  snprintf(
+      key,
+      sizeof(key),
+      "%016" PRIx64 "%016" PRIx64 "%016" PRIx64 "%016" PRIx64,
+      content_hash,
+      content_size,
+      rules_hash,
+      options_hash);
+
+  return PY_STRING(key);
+}
+
+
+// Maps a file in memory through Python's mmap module and exposes it as a
+// buffer, the mapping is kept alive until the buffer is released. Used when
+// scanning with a result cache, so that the bytes hashed for the cache key
+// are exactly the bytes being scanned.
+static int map_file_buffer(
+    const char* filepath,
+    Py_buffer* buffer)
+{
+  PyObject* io_module = PyImport_ImportModule("io");
+  PyObject* mmap_module = NULL;
+  PyObject* file = NULL;
+  PyObject* size = NULL;
+  PyObject* mapping = NULL;
+  PyObject* result;
+
+  int error = -1;
+
+  if (io_module == NULL)
+    return -1;
+
+  file = PyObject_CallMethod(io_module, "open", "ss", filepath, "rb");
+
+  if (file == NULL)
+  {
+    PyErr_Clear();
+    handle_error(ERROR_COULD_NOT_OPEN_FILE, (char*) filepath);
+    goto _exit;
+  }
+
+  size = PyObject_CallMethod(file, "seek", "ii", 0, 2);
+
+  if (size == NULL)
+    goto _exit;
+
+  // Empty files can't be mapped.
+  if (PyObject_IsTrue(size) != 1)
+  {
+    if (PyErr_Occurred())
+      goto _exit;
+
+    mapping = PyBytes_FromStringAndSize(NULL, 0);
+  }
+  else
+  {
+    PyObject* mmap_args = NULL;
+    PyObject* mmap_keywords = NULL;
+    PyObject* mmap_type = NULL;
+
+    mmap_module = PyImport_ImportModule("mmap");
+
+    if (mmap_module != NULL)
+    {
+      mmap_type = PyObject_GetAttrString(mmap_module, "mmap");
+      mmap_args = Py_BuildValue(
+          "(Ni)", PyObject_CallMethod(file, "fileno", NULL), 0);
+      mmap_keywords = Py_BuildValue(
+          "{sN}", "access",
+          PyObject_GetAttrString(mmap_module, "ACCESS_READ"));
+    }
+
+    if (mmap_type != NULL && mmap_args != NULL && mmap_keywords != NULL)
+      mapping = PyObject_Call(mmap_type, mmap_args, mmap_keywords);
+
+    Py_XDECREF(mmap_type);
+    Py_XDECREF(mmap_args);
+    Py_XDECREF(mmap_keywords);
+  }
+
+  if (mapping != NULL)
+    error = PyObject_GetBuffer(mapping, buffer, PyBUF_SIMPLE);
+
+_exit:
+
+  if (file != NULL)
+  {
+    result = PyObject_CallMethod(file, "close", NULL);
+
+    if (result == NULL && error == 0)
+    {
+      PyBuffer_Release(buffer);
+      error = -1;
+    }
+
+    Py_XDECREF(result);
+  }
+
+  Py_XDECREF(mapping);
+  Py_XDECREF(size);
+  Py_XDECREF(file);
+  Py_XDECREF(mmap_module);
+  Py_DECREF(io_module);
+
+  return error;
+}
+
+
+static PyObject* match_copy(
+    Match* match)
+{
+  Match* copy;
+  PyObject* key;
+  PyObject* value;
+  PyObject* strings;
+  Py_ssize_t pos = 0;
+
+  strings = PyList_New(PyList_GET_SIZE(match->strings));
+
+  for (Py_ssize_t i = 0; strings != NULL && i < PyList_GET_SIZE(strings); i++)
+  {
+    StringMatch* string = (StringMatch*) PyList_GET_ITEM(match->strings, i);
+    StringMatch* string_copy = PyObject_NEW(StringMatch, &StringMatch_Type);
+
+    if (string_copy == NULL)
+    {
+      Py_CLEAR(strings);
+      break;
+    }
+
+    string_copy->identifier = string->identifier;
+    string_copy->flags = string->flags;
+    string_copy->instances = PyList_GetSlice(
+        string->instances, 0, PY_SSIZE_T_MAX);
+
+    Py_INCREF(string_copy->identifier);
+
+    if (string_copy->instances == NULL)
+    {
+      // StringMatch_dealloc expects a valid instances list.
+      string_copy->instances = Py_None;
+      Py_INCREF(Py_None);
+      Py_DECREF(string_copy);
+      Py_CLEAR(strings);
+      break;
+    }
+
+    PyList_SET_ITEM(strings, i, (PyObject*) string_copy);
+  }
+
+  if (strings == NULL)
+    return NULL;
+
+  copy = PyObject_NEW(Match, &Match_Type);
+
+  if (copy == NULL)
+  {
+    Py_DECREF(strings);
+    return NULL;
+  }
+
+  copy->rule = match->rule;
+  copy->ns = match->ns;
+  copy->tags = PyList_GetSlice(match->tags, 0, PY_SSIZE_T_MAX);
+  copy->meta = PyDict_Copy(match->meta);
+  copy->strings = strings;
+
+  Py_INCREF(copy->rule);
+  Py_INCREF(copy->ns);
+
+  if (copy->tags == NULL || copy->meta == NULL)
+  {
+    if (copy->tags == NULL)
+      copy->tags = Py_None, Py_INCREF(Py_None);
+
+    if (copy->meta == NULL)
+      copy->meta = Py_None, Py_INCREF(Py_None);
+
+    Py_DECREF(copy);
+    return NULL;
+  }
+
+  // With allow_duplicate_metadata the values are lists, which are copied too.
+  while (PyDict_Next(copy->meta, &pos, &key, &value))
+  {
+    if (PyList_Check(value))
+    {
+      PyObject* list = PyList_GetSlice(value, 0, PY_SSIZE_T_MAX);
+
+      if (list == NULL || PyDict_SetItem(copy->meta, key, list) != 0)
+      {
+        Py_XDECREF(list);
+        Py_DECREF(copy);
+        return NULL;
+      }
+
+      Py_DECREF(list);
+    }
+  }
+
+  return (PyObject*) copy;
+}
+
+
+// Matches are mutable, the tags, meta and strings of each match are regular
+// lists and dictionaries. Cached results are copied when stored and when
+// returned, so that changes made by the caller don't alter the cache. Other
+// results, like JSON documents, are immutable and returned as they are.
+static PyObject* result_cache_copy(
+    PyObject* value)
+{
+  PyObject* copy;
+
+  if (!PyList_Check(value))
+  {
+    Py_INCREF(value);
+    return value;
+  }
+
+  copy = PyList_New(PyList_GET_SIZE(value));
+
+  for (Py_ssize_t i = 0; copy != NULL && i < PyList_GET_SIZE(value); i++)
+  {
+    PyObject* item = PyList_GET_ITEM(value, i);
+
+    if (PyObject_TypeCheck(item, &Match_Type))
+    {
+      item = match_copy((Match*) item);
+    }
+    else
+    {
+      Py_INCREF(item);
+    }
+
+    if (item == NULL)
+      Py_CLEAR(copy);
+    else
+      PyList_SET_ITEM(copy, i, item);
+  }
+
+  return copy;
+}
+
+
+// Rough estimate of the memory used by a cached result, it doesn't need to
+// be exact, only proportional to the real size.
+static unsigned long long result_cache_entry_size(
+    PyObject* value)
+{
+  unsigned long long size = 64;
+
+  if (PyBytes_Check(value))
+    return size + PyBytes_GET_SIZE(value);
+
+  if (!PyList_Check(value))
+    return size;
+
+  for (Py_ssize_t i = 0; i < PyList_GET_SIZE(value); i++)
+  {
+    PyObject* match = PyList_GET_ITEM(value, i);
+
+    size += 256;
+
+    if (!PyObject_TypeCheck(match, &Match_Type))
+      continue;
+
+    PyObject* strings = ((Match*) match)->strings;
+
+    for (Py_ssize_t j = 0; j < PyList_GET_SIZE(strings); j++)
+    {
+      PyObject* instances = ((StringMatch*) PyList_GET_ITEM(strings, j))->instances;
+
+      size += 128;
+
+      for (Py_ssize_t k = 0; k < PyList_GET_SIZE(instances); k++)
+      {
+        StringMatchInstance* instance =
+            (StringMatchInstance*) PyList_GET_ITEM(instances, k);
+
+        size += 96 + PyBytes_GET_SIZE(instance->matched_data);
+      }
+    }
+  }
+
+  return size;
+}
+
+
+static PyObject* ResultCache_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {"max_bytes", NULL};
+
+  unsigned long long max_bytes;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args, keywords, "K", kwlist, &max_bytes))
+    return NULL;
+
+  ResultCache* self = (ResultCache*) type->tp_alloc(type, 0);
+
+  if (self == NULL)
+    return NULL;
+
+  self->entries = PyDict_New();
+
+  if (self->entries == NULL)
+  {
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  self->max_bytes = max_bytes;
+  self->bytes = 0;
+  self->hits = 0;
+  self->misses = 0;
+  self->evictions = 0;
+
+  return (PyObject*) self;
+}
+
+
+static void ResultCache_dealloc(
+    PyObject* self)
+{
+  Py_XDECREF(((ResultCache*) self)->entries);
+  Py_TYPE(self)->tp_free(self);
+}
+
+
+// Entries are kept in a dictionary as (result, size) tuples. Dictionaries
+// preserve insertion order, so moving an entry to the end on every hit keeps
+// the least recently used one at the beginning.
+static PyObject* ResultCache_get(
+    PyObject* self,
+    PyObject* key)
+{
+  ResultCache* cache = (ResultCache*) self;
+  PyObject* entry = PyDict_GetItem(cache->entries, key);
+
+  if (entry == NULL)
+  {
+    if (PyErr_Occurred())
+      return NULL;
+
+    cache->misses++;
+    Py_RETURN_NONE;
+  }
+
+  Py_INCREF(entry);
+
+  if (PyDict_DelItem(cache->entries, key) != 0 ||
+      PyDict_SetItem(cache->entries, key, entry) != 0)
+  {
+    Py_DECREF(entry);
+    return NULL;
+  }
+
+  cache->hits++;
+
+  // Return a copy of cached lists, callers may modify them.
+  PyObject* result = PyTuple_GET_ITEM(entry, 0);
+
+  if (PyList_Check(result))
+    result = PyList_GetSlice(result, 0, PyList_GET_SIZE(result));
+  else
+    Py_INCREF(result);
+
+  Py_DECREF(entry);
+
+  return result;
+}
+
+
+static PyObject* ResultCache_put(
+    PyObject* self,
+    PyObject* args)
+{
+  ResultCache* cache = (ResultCache*) self;
+
+  PyObject* key;
+  PyObject* value;
+  PyObject* entry;
+  PyObject* old_entry;
+
+  if (!PyArg_ParseTuple(args, "OO", &key, &value))
+    return NULL;
+
+  unsigned long long size = result_cache_entry_size(value);
+
+  if (size > cache->max_bytes)
+    Py_RETURN_NONE;
+
+  old_entry = PyDict_GetItem(cache->entries, key);
+
+  if (old_entry != NULL)
+  {
+    cache->bytes -= PyLong_AsUnsignedLongLong(PyTuple_GET_ITEM(old_entry, 1));
+
+    if (PyDict_DelItem(cache->entries, key) != 0)
+      return NULL;
+  }
+
+  while (cache->bytes + size > cache->max_bytes &&
+         PyDict_Size(cache->entries) > 0)
+  {
+    Py_ssize_t pos = 0;
+    PyObject* oldest_key;
+    PyObject* oldest_entry;
+
+    PyDict_Next(cache->entries, &pos, &oldest_key, &oldest_entry);
+
+    cache->bytes -= PyLong_AsUnsignedLongLong(
+        PyTuple_GET_ITEM(oldest_entry, 1));
+    cache->evictions++;
+
+    if (PyDict_DelItem(cache->entries, oldest_key) != 0)
+      return NULL;
+  }
+
+  if (PyList_Check(value))
+    value = PyList_GetSlice(value, 0, PyList_GET_SIZE(value));
+  else
+    Py_INCREF(value);
+
+  if (value == NULL)
+    return NULL;
+
+  entry = Py_BuildValue("(NK)", value, size);
+
+  if (entry == NULL)
+    return NULL;
+
+  if (PyDict_SetItem(cache->entries, key, entry) != 0)
+  {
+    Py_DECREF(entry);
+    return NULL;
+  }
+
+  Py_DECREF(entry);
+
+  cache->bytes += size;
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* ResultCache_clear(
+    PyObject* self,
+    PyObject* args)
+{
+  ResultCache* cache = (ResultCache*) self;
+
+  PyDict_Clear(cache->entries);
+  cache->bytes = 0;
+
+  Py_RETURN_NONE;
+}
+
+
+static Py_ssize_t ResultCache_len(
+    PyObject* self)
+{
+  return PyDict_Size(((ResultCache*) self)->entries);
+}
+
+
+// DiskResultCache stores each result pickled in its own file, named after
+// the key, so it survives the process and can be shared by several of them.
+// Files are written to a temporary name first and then renamed, readers
+// never see a partially written result.
+static PyObject* DiskResultCache_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {"path", NULL};
+
+  PyObject* path;
+  PyObject* result = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywords, "O", kwlist, &path))
+    return NULL;
+
+  path = PyOS_FSPath(path);
+
+  if (path == NULL)
+    return NULL;
+
+  PyObject* os_module = PyImport_ImportModule("os");
+  PyObject* makedirs = NULL;
+  PyObject* makedirs_args = Py_BuildValue("(O)", path);
+  PyObject* makedirs_keywords = Py_BuildValue("{sO}", "exist_ok", Py_True);
+
+  if (os_module != NULL)
+    makedirs = PyObject_GetAttrString(os_module, "makedirs");
+
+  if (makedirs != NULL && makedirs_args != NULL && makedirs_keywords != NULL)
+    result = PyObject_Call(makedirs, makedirs_args, makedirs_keywords);
+
+  Py_XDECREF(os_module);
+  Py_XDECREF(makedirs);
+  Py_XDECREF(makedirs_args);
+  Py_XDECREF(makedirs_keywords);
+
+  if (result == NULL)
+  {
+    Py_DECREF(path);
+    return NULL;
+  }
+
+  Py_DECREF(result);
+
+  DiskResultCache* self = (DiskResultCache*) type->tp_alloc(type, 0);
+
+  if (self == NULL)
+  {
+    Py_DECREF(path);
+    return NULL;
+  }
+
+  self->path = path;
+  self->hits = 0;
+  self->misses = 0;
+
+  return (PyObject*) self;
+}
+
+
+static void DiskResultCache_dealloc(
+    PyObject* self)
+{
+  Py_XDECREF(((DiskResultCache*) self)->path);
+  Py_TYPE(self)->tp_free(self);
+}
+
+
+// Returns the path of the file holding the result for "key".
+static PyObject* disk_result_cache_file(
+    DiskResultCache* cache,
+    PyObject* key)
+{
+  PyObject* os_path = PyImport_ImportModule("os.path");
+  PyObject* file = NULL;
+
+  if (os_path == NULL)
+    return NULL;
+
+  if (!PY_STRING_CHECK(key))
+    PyErr_Format(PyExc_TypeError, "cache keys must be strings");
+  else
+    file = PyObject_CallMethod(os_path, "join", "OO", cache->path, key);
+
+  Py_DECREF(os_path);
+
+  return file;
+}
+
+
+// Missing files are cache misses, and so are files that can't be read or
+// unpickled, like those written by incompatible versions. They are
+// overwritten when the result is stored again.
+static PyObject* DiskResultCache_get(
+    PyObject* self,
+    PyObject* key)
+{
+  DiskResultCache* cache = (DiskResultCache*) self;
+
+  PyObject* io_module = NULL;
+  PyObject* pickle_module = NULL;
+  PyObject* fh = NULL;
+  PyObject* data = NULL;
+  PyObject* result = NULL;
+  PyObject* closed;
+
+  PyObject* path = disk_result_cache_file(cache, key);
+
+  if (path == NULL)
+    return NULL;
+
+  io_module = PyImport_ImportModule("io");
+  pickle_module = PyImport_ImportModule("pickle");
+
+  if (io_module == NULL || pickle_module == NULL)
+    goto _exit;
+
+  fh = PyObject_CallMethod(io_module, "open", "Os", path, "rb");
+
+  if (fh != NULL)
+  {
+    data = PyObject_CallMethod(fh, "read", NULL);
+    closed = PyObject_CallMethod(fh, "close", NULL);
+
+    if (closed == NULL)
+      Py_CLEAR(data);
+
+    Py_XDECREF(closed);
+  }
+
+  if (data != NULL)
+    result = PyObject_CallMethod(pickle_module, "loads", "O", data);
+
+  if (result == NULL)
+  {
+    PyErr_Clear();
+    cache->misses++;
+
+    result = Py_None;
+    Py_INCREF(result);
+  }
+  else
+  {
+    cache->hits++;
+  }
+
+_exit:
+
+  Py_XDECREF(io_module);
+  Py_XDECREF(pickle_module);
+  Py_XDECREF(fh);
+  Py_XDECREF(data);
+  Py_DECREF(path);
+
+  return result;
+}
+
+
+static PyObject* DiskResultCache_put(
+    PyObject* self,
+    PyObject* args)
+{
+  DiskResultCache* cache = (DiskResultCache*) self;
+
+  PyObject* key;
+  PyObject* value;
+  PyObject* path;
+  PyObject* os_module = NULL;
+  PyObject* tempfile_module = NULL;
+  PyObject* pickle_module = NULL;
+  PyObject* data = NULL;
+  PyObject* temp = NULL;
+  PyObject* fh = NULL;
+  PyObject* result = NULL;
+
+  int fd;
+  PyObject* temp_path;
+
+  if (!PyArg_ParseTuple(args, "OO", &key, &value))
+    return NULL;
+
+  path = disk_result_cache_file(cache, key);
+
+  if (path == NULL)
+    return NULL;
+
+  os_module = PyImport_ImportModule("os");
+  tempfile_module = PyImport_ImportModule("tempfile");
+  pickle_module = PyImport_ImportModule("pickle");
+
+  if (os_module == NULL || tempfile_module == NULL || pickle_module == NULL)
+    goto _exit;
+
+  data = PyObject_CallMethod(pickle_module, "dumps", "Oi", value, -1);
+
+  if (data == NULL)
+    goto _exit;
+
+  temp = PyObject_CallMethod(
+      tempfile_module, "mkstemp", "sOO", ".tmp", Py_None, cache->path);
+
+  if (temp == NULL || !PyArg_ParseTuple(temp, "iO", &fd, &temp_path))
+    goto _exit;
+
+  fh = PyObject_CallMethod(os_module, "fdopen", "is", fd, "wb");
+
+  if (fh == NULL)
+  {
+    Py_XDECREF(PyObject_CallMethod(os_module, "close", "i", fd));
+  }
+  else
+  {
+    PyObject* written = PyObject_CallMethod(fh, "write", "O", data);
+    PyObject* closed = PyObject_CallMethod(fh, "close", NULL);
+
+    if (written != NULL && closed != NULL)
+      result = PyObject_CallMethod(
+          os_module, "replace", "OO", temp_path, path);
+
+    Py_XDECREF(written);
+    Py_XDECREF(closed);
+  }
+
+  if (result == NULL)
+  {
+    PyObject* error_type;
+    PyObject* error_value;
+    PyObject* error_traceback;
+
+    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+    Py_XDECREF(PyObject_CallMethod(os_module, "remove", "O", temp_path));
+    PyErr_Restore(error_type, error_value, error_traceback);
+  }
+
+_exit:
+
+  Py_XDECREF(os_module);
+  Py_XDECREF(tempfile_module);
+  Py_XDECREF(pickle_module);
+  Py_XDECREF(data);
+  Py_XDECREF(temp);
+  Py_XDECREF(fh);
+  Py_DECREF(path);
+
+  if (result == NULL)
+    return NULL;
+
+  Py_DECREF(result);
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* Match_NEW(
+    const char* rule,
+    const char* ns,
+    PyObject* tags,
+    PyObject* meta,
+    PyObject* strings)
+{
+  Match* object = PyObject_NEW(Match, &Match_Type);
+
+  if (object != NULL)
+  {
+    object->rule = PY_STRING(rule);
+    object->ns = PY_STRING(ns);
+    object->tags = tags;
+    object->meta = meta;
+    object->strings = strings;
+
+    Py_INCREF(tags);
+    Py_INCREF(meta);
+    Py_INCREF(strings);
+  }
+
+  return (PyObject*) object;
+}
+
+
+static void Match_dealloc(
+    PyObject* self)
+{
+  Match* object = (Match*) self;
+
+  Py_DECREF(object->rule);
+  Py_DECREF(object->ns);
+  Py_DECREF(object->tags);
+  Py_DECREF(object->meta);
+  Py_DECREF(object->strings);
+
+  PyObject_Del(self);
+}
+
+
+static PyObject* Match_repr(
+    PyObject* self)
+{
+  Match* object = (Match*) self;
+  Py_INCREF(object->rule);
+  return object->rule;
+}
+
+
+static PyObject* Match_getattro(
+    PyObject* self,
+    PyObject* name)
+{
+  return PyObject_GenericGetAttr(self, name);
+}
+
+
+static PyObject* Match_richcompare(
+    PyObject* self,
+    PyObject* other,
+    int op)
+{
+  PyObject* result = NULL;
+
+  Match* a = (Match*) self;
+  Match* b = (Match*) other;
+
+  if(PyObject_TypeCheck(other, &Match_Type))
+  {
+    switch(op)
+    {
+    case Py_EQ:
+      if (PyObject_RichCompareBool(a->rule, b->rule, Py_EQ) &&
+          PyObject_RichCompareBool(a->ns, b->ns, Py_EQ))
+        result = Py_True;
+      else
+        result = Py_False;
+
+      Py_INCREF(result);
+      break;
+
+    case Py_NE:
+      if (PyObject_RichCompareBool(a->rule, b->rule, Py_NE) ||
+          PyObject_RichCompareBool(a->ns, b->ns, Py_NE))
+          result = Py_True;
+      else
+          result = Py_False;
+
+      Py_INCREF(result);
+      break;
+
+    case Py_LT:
+    case Py_LE:
+    case Py_GT:
+    case Py_GE:
+      if (PyObject_RichCompareBool(a->rule, b->rule, Py_EQ))
+        result = PyObject_RichCompare(a->ns, b->ns, op);
+      else
+        result = PyObject_RichCompare(a->rule, b->rule, op);
+
+      break;
+    }
+  }
+  else
+  {
+    result = PyErr_Format(
+        PyExc_TypeError,
+        "'Match' objects must be compared with objects of the same class");
+  }
+
+  return result;
+}
+
+
+static Py_hash_t Match_hash(
+    PyObject* self)
+{
+  Match* match = (Match*) self;
+  return PyObject_Hash(match->rule) + PyObject_Hash(match->ns);
+}
+
+
+// Match, StringMatch and StringMatchInstance objects can't be created from
+// Python, they are pickled as a call to yara._restore_match with their type
+// and fields.
+static PyObject* match_reduce(
+    PyTypeObject* type,
+    PyObject* state)
+{
+  PyObject* module = PyImport_ImportModule("yara");
+  PyObject* restore = NULL;
+  PyObject* result = NULL;
+
+  if (module != NULL)
+    restore = PyObject_GetAttrString(module, "_restore_match");
+
+  if (restore != NULL && state != NULL)
+    result = Py_BuildValue("(O(OO))", restore, type, state);
+
+  Py_XDECREF(module);
+  Py_XDECREF(restore);
+  Py_XDECREF(state);
+
+  return result;
+}
+
+
+static PyObject* Match_reduce(
+    PyObject* self,
+    PyObject* args)
+{
+  Match* match = (Match*) self;
+
+  return match_reduce(
+      &Match_Type,
+      Py_BuildValue(
+          "(OOOOO)",
+          match->rule,
+          match->ns,
+          match->tags,
+          match->meta,
+          match->strings));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+static PyObject* StringMatch_NEW(
+    const char* identifier,
+    uint64_t flags,
+    PyObject* instance_list)
+{
+  StringMatch* object = PyObject_NEW(StringMatch, &StringMatch_Type);
+
+  if (object != NULL)
+  {
+    object->identifier = PY_STRING(identifier);
+    object->flags = flags;
+    object->instances = instance_list;
+
+    Py_INCREF(instance_list);
+  }
+
+  return (PyObject*) object;
+}
+
+
+static void StringMatch_dealloc(
+    PyObject* self)
+{
+  StringMatch* object = (StringMatch*) self;
+
+  Py_DECREF(object->identifier);
+  Py_DECREF(object->instances);
+
+  PyObject_Del(self);
+}
+
+
+static PyObject* StringMatch_repr(
+    PyObject* self)
+{
+  StringMatch* object = (StringMatch*) self;
+  Py_INCREF(object->identifier);
+  return object->identifier;
+}
+
+
+static PyObject* StringMatch_getattro(
+    PyObject* self,
+    PyObject* name)
+{
+  return PyObject_GenericGetAttr(self, name);
+}
+
+
+// Hashing on just identifiers can be tricky as there can be duplicate
+// identifiers between rules and there are anonymous strings too. Be careful
+// when using this!
+static Py_hash_t StringMatch_hash(
+    PyObject* self)
+{
+  return PyObject_Hash(((StringMatch*) self)->identifier);
+}
+
+
+static PyObject* StringMatch_is_xor(
+    PyObject* self,
+    PyObject* args)
+{
+  if (((StringMatch*) self)->flags & STRING_FLAGS_XOR)
+    Py_RETURN_TRUE;
+
+  Py_RETURN_FALSE;
+}
+
+
+static PyObject* StringMatch_reduce(
+    PyObject* self,
+    PyObject* args)
+{
+  StringMatch* string = (StringMatch*) self;
+
+  return match_reduce(
+      &StringMatch_Type,
+      Py_BuildValue(
+          "(OKO)",
+          string->identifier,
+          (unsigned long long) string->flags,
+          string->instances));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+static PyObject* StringMatchInstance_NEW(
+    uint64_t offset,
+    PyObject* matched_data,
+    int32_t match_length,
+    uint8_t xor_key)
+{
+  StringMatchInstance* object = PyObject_NEW(StringMatchInstance, &StringMatchInstance_Type);
+
+  if (object != NULL)
+  {
+    object->offset = PyLong_FromLongLong(offset);
+    object->matched_data = matched_data;
+    object->matched_length = PyLong_FromLong(match_length);
+    object->xor_key = PyLong_FromUnsignedLong((uint32_t) xor_key);
+
+    Py_INCREF(matched_data);
+  }
+
+  return (PyObject*) object;
+}
+
+
+static void StringMatchInstance_dealloc(
+    PyObject* self)
+{
+  StringMatchInstance* object = (StringMatchInstance*) self;
+
+  Py_DECREF(object->offset);
+  Py_DECREF(object->matched_data);
+  Py_DECREF(object->matched_length);
+  Py_DECREF(object->xor_key);
+
+  PyObject_Del(self);
+}
+
+
+static PyObject* StringMatchInstance_repr(
+    PyObject* self)
+{
+  StringMatchInstance* object = (StringMatchInstance*) self;
+  return PyCodec_Decode(object->matched_data, "utf-8", "backslashreplace");
+}
+
+
+static PyObject* StringMatchInstance_getattro(
+    PyObject* self,
+    PyObject* name)
+{
+  return PyObject_GenericGetAttr(self, name);
+}
+
+
+static Py_hash_t StringMatchInstance_hash(
+    PyObject* self)
+{
+  return PyObject_Hash(((StringMatchInstance*) self)->matched_data);
+}
+
+
+static PyObject* StringMatchInstance_reduce(
+    PyObject* self,
+    PyObject* args)
+{
+  StringMatchInstance* instance = (StringMatchInstance*) self;
+
+  return match_reduce(
+      &StringMatchInstance_Type,
+      Py_BuildValue(
+          "(OOOO)",
+          instance->offset,
+          instance->matched_data,
+          instance->matched_length,
+          instance->xor_key));
+}
+
+
+static PyObject* yara_restore_match(
+    PyObject* self,
+    PyObject* args)
+{
+  PyObject* type;
+  PyObject* state;
+
+  if (!PyArg_ParseTuple(args, "OO!", &type, &PyTuple_Type, &state))
+    return NULL;
+
+  if (type == (PyObject*) &Match_Type)
+  {
+    PyObject* rule;
+    PyObject* ns;
+    PyObject* tags;
+    PyObject* meta;
+    PyObject* strings;
+
+    if (!PyArg_ParseTuple(
+          state, "UUO!O!O!", &rule, &ns, &PyList_Type, &tags,
+          &PyDict_Type, &meta, &PyList_Type, &strings))
+      return NULL;
+
+    Match* match = PyObject_NEW(Match, &Match_Type);
+
+    if (match == NULL)
+      return NULL;
+
+    match->rule = rule;
+    match->ns = ns;
+    match->tags = tags;
+    match->meta = meta;
+    match->strings = strings;
+
+    Py_INCREF(rule);
+    Py_INCREF(ns);
+    Py_INCREF(tags);
+    Py_INCREF(meta);
+    Py_INCREF(strings);
+
+    return (PyObject*) match;
+  }
+
+  if (type == (PyObject*) &StringMatch_Type)
+  {
+    PyObject* identifier;
+    PyObject* instances;
+    unsigned long long flags;
+
+    if (!PyArg_ParseTuple(
+          state, "UKO!", &identifier, &flags, &PyList_Type, &instances))
+      return NULL;
+
+    StringMatch* string = PyObject_NEW(StringMatch, &StringMatch_Type);
+
+    if (string == NULL)
+      return NULL;
+
+    string->identifier = identifier;
+    string->flags = (uint64_t) flags;
+    string->instances = instances;
+
+    Py_INCREF(identifier);
+    Py_INCREF(instances);
+
+    return (PyObject*) string;
+  }
+
+  if (type == (PyObject*) &StringMatchInstance_Type)
+  {
+    PyObject* offset;
+    PyObject* matched_data;
+    PyObject* matched_length;
+    PyObject* xor_key;
+
+    if (!PyArg_ParseTuple(
+          state, "O!SO!O!", &PyLong_Type, &offset, &matched_data,
+          &PyLong_Type, &matched_length, &PyLong_Type, &xor_key))
+      return NULL;
+
+    StringMatchInstance* instance = PyObject_NEW(
+        StringMatchInstance, &StringMatchInstance_Type);
+
+    if (instance == NULL)
+      return NULL;
+
+    instance->offset = offset;
+    instance->matched_data = matched_data;
+    instance->matched_length = matched_length;
+    instance->xor_key = xor_key;
+
+    Py_INCREF(offset);
+    Py_INCREF(matched_data);
+    Py_INCREF(matched_length);
+    Py_INCREF(xor_key);
+
+    return (PyObject*) instance;
+  }
+
+  return PyErr_Format(PyExc_TypeError, "can't restore objects of this type");
+}
+
+
+static PyObject* StringMatchInstance_plaintext(
+    PyObject* self,
+    PyObject* args)
+{
+  char* pb;
+  Py_ssize_t length;
+
+  StringMatchInstance* instance = (StringMatchInstance*) self;
+  uint64_t xor_key = PyLong_AsUnsignedLongLong(instance->xor_key);
+  if (xor_key == 0)
+  {
+      Py_INCREF(instance->matched_data);
+      return instance->matched_data;
+  }
+
+  int result = PyBytes_AsStringAndSize(instance->matched_data, &pb, &length);
+  if (result == -1)
+    return NULL;
+
+  // pb points to an internal buffer of the bytes object which we can not
+  // modify. Allocate a new buffer, copy the contents over and do the xor, then
+  // create a new bytes object to return.
+  uint8_t* buf = (uint8_t*) calloc(length, sizeof(uint8_t));
+  if (buf == NULL)
+    return PyErr_Format(PyExc_TypeError, "Out of memory");
+
+  memcpy(buf, pb, length);
+  for (size_t i = 0; i < length; i++) {
+    buf[i] = ((uint8_t) pb[i]) ^ xor_key;
+  }
+
+  PyObject* object = PyBytes_FromStringAndSize((char*) buf, length);
+  free(buf);
+
+  return object;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+static void Rule_dealloc(
+    PyObject* self)
+{
+  Rule* object = (Rule*) self;
+  Py_XDECREF(object->identifier);
+  Py_XDECREF(object->tags);
+  Py_XDECREF(object->meta);
+  Py_XDECREF(object->global);
+  Py_XDECREF(object->private);
+  PyObject_Del(self);
+}
+
+static PyObject* Rule_getattro(
+    PyObject* self,
+    PyObject* name)
+{
+  return PyObject_GenericGetAttr(self, name);
+}
+
+
+static Rules* Rules_NEW(void)
+{
+  Rules* rules = PyObject_NEW(Rules, &Rules_Type);
+
+  if (rules != NULL)
+  {
+    rules->rules = NULL;
+    rules->externals = NULL;
+    rules->warnings = NULL;
+    rules->rule_sets = NULL;
+    rules->rule_names = NULL;
+    rules->string_names = NULL;
+    rules->compile_stats = NULL;
+    rules->has_fingerprint = false;
+    rules->max_match_data = 0;
+    rules->max_matches_per_string = 0;
+  }
+
+  return rules;
+}
+
+static void Rules_dealloc(
+    PyObject* self)
+{
+  Rules* object = (Rules*) self;
+
+  Py_XDECREF(object->externals);
+  Py_XDECREF(object->warnings);
+  Py_XDECREF(object->rule_sets);
+  Py_XDECREF(object->rule_names);
+  Py_XDECREF(object->string_names);
+  Py_XDECREF(object->compile_stats);
+
+  if (object->rules != NULL)
+    yr_rules_destroy(object->rules);
+
+  PyObject_Del(self);
+}
+
+static PyObject* Rules_next(
+    PyObject* self)
+{
+  PyObject* tag_list;
+  PyObject* object;
+  PyObject* meta_list;
+
+  YR_META* meta;
+  const char* tag;
+
+  Rule* rule;
+  Rules* rules = (Rules *) self;
+
+  // Generate new Rule object based upon iter_current_rule and increment
+  // iter_current_rule.
+
+  if (RULE_IS_NULL(rules->iter_current_rule))
+  {
+    rules->iter_current_rule = rules->rules->rules_table;
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+  }
+
+  rule = PyObject_NEW(Rule, &Rule_Type);
+  tag_list = PyList_New(0);
+  meta_list = PyDict_New();
+
+  if (rule != NULL && tag_list != NULL && meta_list != NULL)
+  {
+    yr_rule_tags_foreach(rules->iter_current_rule, tag)
+    {
+      object = PY_STRING(tag);
+      PyList_Append(tag_list, object);
+      Py_DECREF(object);
+    }
+
+    yr_rule_metas_foreach(rules->iter_current_rule, meta)
+    {
+      if (meta->type == META_TYPE_INTEGER)
+        object = Py_BuildValue("i", meta->integer);
+      else if (meta->type == META_TYPE_BOOLEAN)
+        object = PyBool_FromLong((long) meta->integer);
+      else
+        object = PY_STRING(meta->string);
+
+        PyDict_SetItemString(meta_list, meta->identifier, object);
+        Py_DECREF(object);
+
+    }
+
+    rule->global = PyBool_FromLong(rules->iter_current_rule->flags & RULE_FLAGS_GLOBAL);
+    rule->private = PyBool_FromLong(rules->iter_current_rule->flags & RULE_FLAGS_PRIVATE);
+    rule->identifier = PY_STRING(rules->iter_current_rule->identifier);
+    rule->tags = tag_list;
+    rule->meta = meta_list;
+    rules->iter_current_rule++;
+    return (PyObject*) rule;
+  }
+  else
+  {
+    Py_XDECREF(tag_list);
+    Py_XDECREF(meta_list);
+    return PyErr_Format(PyExc_TypeError, "Out of memory");
+  }
+}
+
+// Chunked file scanning. Instead of mapping the whole file, it's read in
+// windows of "chunk_size" bytes, each one extended with "overlap" bytes from
+// the next window so that matches crossing the boundary between windows are
+// found. Windows are exposed to libyara as the blocks of a memory block
+// iterator, which gives global offsets for every match and drops duplicate
+// matches found at the same offset in two overlapping windows. The iterator
+// reports the real file size, so "filesize" works as usual, and functions
+// reading at absolute offsets like uint32(x) fetch the right window again.
+// Only one window is kept in memory at any time, which is why rules importing
+// modules are rejected: modules keep pointers into the data of the block
+// they parsed, and that data is overwritten by the next window.
+//
+// Scans can also be limited to some ranges of the file, in which case only
+// those ranges are read, split in windows as described above. Blocks keep
+// their real offsets, so "at" and "in" conditions work as expected.
+
+#if defined(_WIN32)
+#define file_seek(fh, offset) _fseeki64(fh, (__int64) (offset), SEEK_SET)
+#else
+#define file_seek(fh, offset) fseeko(fh, (off_t) (offset), SEEK_SET)
+#endif
+
+// Value of chunk_overlap when it's not passed to match(), the overlap is then
+// 64KB or half the chunk size, whatever is smaller.
+#define CHUNK_OVERLAP_DEFAULT  ((unsigned long long) -1)
+
+
+// Ranges as passed by the user, an "end" equal to INT64_MAX means the end of
+// the file and negative values are relative to the end of the file.
+typedef struct _FILE_RANGE
+{
+  int64_t start;
+  int64_t end;
+
+} FILE_RANGE;
+
+
+typedef struct _CHUNKED_FILE
+{
+  FILE* fh;
+  uint64_t size;
+  uint64_t chunk_size;
+  uint64_t overlap;
+  uint64_t next_base;
+  uint64_t* extents;
+  int num_extents;
+  int current_extent;
+  int error;
+  uint8_t* buffer;
+  YR_MEMORY_BLOCK block;
+
+} CHUNKED_FILE;
+
+
+static const uint8_t* chunked_file_fetch_data(
+    YR_MEMORY_BLOCK* block)
+{
+  CHUNKED_FILE* file = (CHUNKED_FILE*) block->context;
+
+  // libyara skips blocks whose data can't be fetched, the error is recorded
+  // so that the scan fails instead of silently missing part of the file.
+  if (file_seek(file->fh, block->base) != 0 ||
+      fread(file->buffer, 1, block->size, file->fh) != block->size)
+  {
+    file->error = ERROR_COULD_NOT_MAP_FILE;
+    return NULL;
+  }
+
+  return file->buffer;
+}
+
+
+static YR_MEMORY_BLOCK* chunked_file_next(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  CHUNKED_FILE* file = (CHUNKED_FILE*) iterator->context;
+
+  iterator->last_error = file->error;
+
+  if (file->error != ERROR_SUCCESS)
+    return NULL;
+
+  while (file->current_extent < file->num_extents)
+  {
+    uint64_t start = file->extents[file->current_extent * 2];
+    uint64_t end = file->extents[file->current_extent * 2 + 1];
+
+    if (file->next_base < start)
+      file->next_base = start;
+
+    if (file->next_base >= end)
+    {
+      file->current_extent++;
+      continue;
+    }
+
+    file->block.base = file->next_base;
+    file->block.size = (size_t) yr_min(
+        file->chunk_size + file->overlap, end - file->next_base);
+    file->block.context = file;
+    file->block.fetch_data = chunked_file_fetch_data;
+
+    file->next_base += file->chunk_size;
+
+    return &file->block;
+  }
+
+  return NULL;
+}
+
+
+static YR_MEMORY_BLOCK* chunked_file_first(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  ((CHUNKED_FILE*) iterator->context)->next_base = 0;
+  ((CHUNKED_FILE*) iterator->context)->current_extent = 0;
+
+  return chunked_file_next(iterator);
+}
+
+
+static uint64_t chunked_file_size(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  return ((CHUNKED_FILE*) iterator->context)->size;
+}
+
+
+static int compare_extents(
+    const void* a,
+    const void* b)
+{
+  uint64_t start_a = *(const uint64_t*) a;
+  uint64_t start_b = *(const uint64_t*) b;
+
+  return (start_a > start_b) - (start_a < start_b);
+}
+
+
+// Converts the ranges requested by the user into sorted and non-overlapping
+// [start, end) extents, now that the file size is known. Without ranges the
+// whole file is a single extent.
+static int chunked_file_set_extents(
+    CHUNKED_FILE* file,
+    FILE_RANGE* ranges,
+    int num_ranges)
+{
+  int count = 0;
+
+  file->extents = (uint64_t*) malloc(
+      2 * yr_max(num_ranges, 1) * sizeof(uint64_t));
+
+  if (file->extents == NULL)
+    return ERROR_INSUFFICIENT_MEMORY;
+
+  if (ranges == NULL)
+  {
+    file->extents[0] = 0;
+    file->extents[1] = file->size;
+    file->num_extents = 1;
+    return ERROR_SUCCESS;
+  }
+
+  for (int i = 0; i < num_ranges; i++)
+  {
+    int64_t size = (int64_t) file->size;
+    int64_t start = ranges[i].start;
+    int64_t end = ranges[i].end;
+
+    if (start < 0)
+      start = yr_max(size + start, 0);
+
+    if (end == INT64_MAX)
+      end = size;
+    else if (end < 0)
+      end = size + end;
+
+    end = yr_min(end, size);
+
+    if (start < end)
+    {
+      file->extents[count * 2] = (uint64_t) start;
+      file->extents[count * 2 + 1] = (uint64_t) end;
+      count++;
+    }
+  }
+
+  // Sorting pairs of uint64_t by their first element, then merging the ones
+  // that overlap or touch each other.
+  qsort(file->extents, count, 2 * sizeof(uint64_t), compare_extents);
+
+  file->num_extents = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    uint64_t start = file->extents[i * 2];
+    uint64_t end = file->extents[i * 2 + 1];
+    int last = file->num_extents - 1;
+
+    if (last >= 0 && start <= file->extents[last * 2 + 1])
+    {
+      file->extents[last * 2 + 1] = yr_max(file->extents[last * 2 + 1], end);
+    }
+    else
+    {
+      file->extents[file->num_extents * 2] = start;
+      file->extents[file->num_extents * 2 + 1] = end;
+      file->num_extents++;
+    }
+  }
+
+  return ERROR_SUCCESS;
+}
+
+
+// Scans a file in chunks, optionally limited to some ranges of it. If
+// "chunk_size" is zero each extent is read as a single block. Must be called
+// without the GIL.
+static int scan_file_chunked(
+    YR_SCANNER* scanner,
+    const char* filepath,
+    uint64_t chunk_size,
+    uint64_t overlap,
+    FILE_RANGE* ranges,
+    int num_ranges)
+{
+  YR_MEMORY_BLOCK_ITERATOR iterator;
+  CHUNKED_FILE file;
+
+  uint64_t largest_extent = 1;
+
+  int error;
+
+  memset(&file, 0, sizeof(file));
+
+  file.fh = fopen(filepath, "rb");
+
+  if (file.fh == NULL)
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  if (fseek(file.fh, 0, SEEK_END) != 0)
+  {
+    fclose(file.fh);
+    return ERROR_COULD_NOT_MAP_FILE;
+  }
+
+  #if defined(_WIN32)
+  file.size = (uint64_t) _ftelli64(file.fh);
+  #else
+  file.size = (uint64_t) ftello(file.fh);
+  #endif
+
+  error = chunked_file_set_extents(&file, ranges, num_ranges);
+
+  if (error != ERROR_SUCCESS)
+  {
+    fclose(file.fh);
+    return error;
+  }
+
+  for (int i = 0; i < file.num_extents; i++)
+    largest_extent = yr_max(
+        largest_extent, file.extents[i * 2 + 1] - file.extents[i * 2]);
+
+  if (chunk_size == 0)
+  {
+    chunk_size = largest_extent;
+    overlap = 0;
+  }
+
+  file.chunk_size = chunk_size;
+  file.overlap = overlap;
+  file.buffer = (uint8_t*) malloc(
+      (size_t) yr_min(chunk_size + overlap, largest_extent));
+
+  if (file.buffer == NULL)
+  {
+    free(file.extents);
+    fclose(file.fh);
+    return ERROR_INSUFFICIENT_MEMORY;
+  }
+
+  iterator.context = &file;
+  iterator.first = chunked_file_first;
+  iterator.next = chunked_file_next;
+  iterator.file_size = chunked_file_size;
+  iterator.last_error = ERROR_SUCCESS;
+
+  error = yr_scanner_scan_mem_blocks(scanner, &iterator);
+
+  if (error == ERROR_SUCCESS)
+    error = file.error;
+
+  free(file.buffer);
+  free(file.extents);
+  fclose(file.fh);
+
+  return error;
+}
+
+
+// Parses the "ranges" argument of match(), a sequence of (start, end) tuples
+// where "end" can be None. Returns NULL with an exception set on error.
+static FILE_RANGE* parse_file_ranges(
+    PyObject* ranges,
+    int* num_ranges)
+{
+  PyObject* sequence = PySequence_Fast(
+      ranges, "'ranges' must be a sequence of (start, end) tuples");
+
+  FILE_RANGE* result;
+
+  if (sequence == NULL)
+    return NULL;
+
+  *num_ranges = (int) PySequence_Fast_GET_SIZE(sequence);
+
+  result = (FILE_RANGE*) PyMem_Malloc(
+      yr_max(*num_ranges, 1) * sizeof(FILE_RANGE));
+
+  if (result == NULL)
+  {
+    Py_DECREF(sequence);
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  for (int i = 0; i < *num_ranges; i++)
+  {
+    PyObject* start;
+    PyObject* end;
+
+    if (!PyArg_ParseTuple(
+          PySequence_Fast_GET_ITEM(sequence, i), "OO", &start, &end))
+      break;
+
+    result[i].start = PyLong_AsLongLong(start);
+    result[i].end = end == Py_None ? INT64_MAX : PyLong_AsLongLong(end);
+
+    if (PyErr_Occurred())
+      break;
+  }
+
+  Py_DECREF(sequence);
+
+  if (PyErr_Occurred())
+  {
+    PyMem_Free(result);
+    return NULL;
+  }
+
+  return result;
+}
+
+
+// Strategies for reading files. FILE_READ_DEFAULT lets libyara map the file,
+// FILE_READ_MMAP maps it here so that access pattern hints can be given to
+// the kernel, FILE_READ_READ reads it into a buffer kept in the options and
+// reused by all the scans done with them, avoiding the cost of mapping and
+// unmapping small files, and FILE_READ_AUTO reads files up to a given size
+// and maps larger ones. The buffer is freed by read_options_destroy.
+
+#define FILE_READ_DEFAULT  0
+#define FILE_READ_MMAP     1
+#define FILE_READ_READ     2
+#define FILE_READ_AUTO     3
+
+// Read buffers larger than this are freed after the scan instead of being
+// kept for the next one.
+#define MAX_CACHED_READ_BUFFER  (16 * 1024 * 1024)
+
+
+typedef struct _FILE_READ_OPTIONS
+{
+  int strategy;
+  uint64_t threshold;
+  bool dontneed;
+  uint8_t* buffer;
+  size_t buffer_size;
+
+} FILE_READ_OPTIONS;
+
+
+static int parse_read_options(
+    const char* strategy,
+    unsigned long long threshold,
+    PyObject* dontneed,
+    FILE_READ_OPTIONS* options)
+{
+  options->threshold = threshold;
+  options->dontneed = dontneed != NULL && PyObject_IsTrue(dontneed) == 1;
+  options->buffer = NULL;
+  options->buffer_size = 0;
+
+  if (strategy == NULL)
+    options->strategy = options->dontneed ? FILE_READ_MMAP : FILE_READ_DEFAULT;
+  else if (strcmp(strategy, "mmap") == 0)
+    options->strategy = FILE_READ_MMAP;
+  else if (strcmp(strategy, "read") == 0)
+    options->strategy = FILE_READ_READ;
+  else if (strcmp(strategy, "auto") == 0)
+    options->strategy = FILE_READ_AUTO;
+  else
+  {
+    PyErr_Format(
+        PyExc_ValueError,
+        "'read' must be \"mmap\", \"read\" or \"auto\"");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static void read_options_destroy(
+    FILE_READ_OPTIONS* options)
+{
+  free(options->buffer);
+
+  options->buffer = NULL;
+  options->buffer_size = 0;
+}
+
+
+static void file_advise(
+    FILE* fh,
+    int advice)
+{
+  #if defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(fileno(fh), 0, 0, advice);
+  #endif
+}
+
+
+static int scan_file_read(
+    YR_SCANNER* scanner,
+    FILE* fh,
+    size_t size,
+    FILE_READ_OPTIONS* options)
+{
+  size_t length;
+  int error;
+
+  if (size > options->buffer_size)
+  {
+    uint8_t* buffer = (uint8_t*) realloc(options->buffer, size);
+
+    if (buffer == NULL)
+      return ERROR_INSUFFICIENT_MEMORY;
+
+    options->buffer = buffer;
+    options->buffer_size = size;
+  }
+
+  length = fread(options->buffer, 1, size, fh);
+
+  if (length != size)
+    return ERROR_COULD_NOT_MAP_FILE;
+
+  error = yr_scanner_scan_mem(scanner, options->buffer, length);
+
+  if (options->buffer_size > MAX_CACHED_READ_BUFFER)
+    read_options_destroy(options);
+
+  return error;
+}
+
+
+static int scan_file_mmap(
+    YR_SCANNER* scanner,
+    const char* filepath,
+    FILE* fh,
+    size_t size)
+{
+  #if defined(_WIN32)
+
+  return yr_scanner_scan_file(scanner, filepath);
+
+  #else
+
+  void* data;
+  int error;
+
+  if (size == 0)
+    return yr_scanner_scan_mem(scanner, NULL, 0);
+
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+
+  if (data == MAP_FAILED)
+    return ERROR_COULD_NOT_MAP_FILE;
+
+  #if defined(MADV_SEQUENTIAL)
+  madvise(data, size, MADV_SEQUENTIAL);
+  #endif
+
+  error = yr_scanner_scan_mem(scanner, (const uint8_t*) data, size);
+
+  munmap(data, size);
+
+  return error;
+
+  #endif
+}
+
+
+// Scans a file using the given read strategy, must be called without the
+// GIL. With "dontneed" the pages of the file are dropped from the page cache
+// after the scan, so that sweeping through lots of files doesn't evict more
+// useful data.
+static int scan_file_with_options(
+    YR_SCANNER* scanner,
+    const char* filepath,
+    FILE_READ_OPTIONS* options)
+{
+  FILE* fh;
+  uint64_t size;
+  int error;
+
+  if (options->strategy == FILE_READ_DEFAULT)
+    return yr_scanner_scan_file(scanner, filepath);
+
+  fh = fopen(filepath, "rb");
+
+  if (fh == NULL)
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  // The file is read with a single fread into a buffer of its size, stdio
+  // buffering would only add a copy. setvbuf must be called before any other
+  // operation on the stream.
+  setvbuf(fh, NULL, _IONBF, 0);
+
+  if (fseek(fh, 0, SEEK_END) != 0)
+  {
+    fclose(fh);
+    return ERROR_COULD_NOT_MAP_FILE;
+  }
+
+  #if defined(_WIN32)
+  size = (uint64_t) _ftelli64(fh);
+  #else
+  size = (uint64_t) ftello(fh);
+  #endif
+
+  rewind(fh);
+
+  #if defined(POSIX_FADV_SEQUENTIAL)
+  file_advise(fh, POSIX_FADV_SEQUENTIAL);
+  #endif
+
+  if (options->strategy == FILE_READ_READ ||
+      (options->strategy == FILE_READ_AUTO && size <= options->threshold))
+    error = scan_file_read(scanner, fh, (size_t) size, options);
+  else
+    error = scan_file_mmap(scanner, filepath, fh, (size_t) size);
+
+  #if defined(POSIX_FADV_DONTNEED)
+  if (options->dontneed)
+    file_advise(fh, POSIX_FADV_DONTNEED);
+  #endif
+
+  fclose(fh);
+
+  return error;
+}
+
+
+// File prefetcher for bulk scans. A few reader threads keep up to "depth"
+// files loaded in memory ahead of the scanning thread, so that waiting for
+// storage overlaps with scanning. File i is loaded into slot i % depth, which
+// is reused once the scanning thread is done with file i - depth. Files
+// larger than "max_size" aren't loaded, the scanning thread reads them
+// itself when their turn comes.
+
+typedef struct _PREFETCH_SLOT
+{
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+  Py_ssize_t ready;
+  bool skipped;
+  int error;
+
+} PREFETCH_SLOT;
+
+
+typedef struct _PREFETCHER
+{
+  const char** paths;
+  Py_ssize_t count;
+  Py_ssize_t next_to_read;
+  Py_ssize_t next_to_scan;
+  uint64_t max_size;
+  bool stop;
+  int depth;
+  int num_threads;
+  PREFETCH_SLOT* slots;
+  THREAD* threads;
+  MUTEX mutex;
+  COND cond;
+
+} PREFETCHER;
+
+
+static void prefetch_file(
+    PREFETCHER* prefetcher,
+    PREFETCH_SLOT* slot,
+    const char* path)
+{
+  FILE* fh = fopen(path, "rb");
+  uint64_t size;
+
+  slot->error = ERROR_SUCCESS;
+  slot->skipped = false;
+  slot->size = 0;
+
+  if (fh == NULL)
+  {
+    slot->error = ERROR_COULD_NOT_OPEN_FILE;
+    return;
+  }
+
+  setvbuf(fh, NULL, _IONBF, 0);
+
+  if (fseek(fh, 0, SEEK_END) != 0)
+  {
+    slot->error = ERROR_COULD_NOT_MAP_FILE;
+    fclose(fh);
+    return;
+  }
+
+  #if defined(_WIN32)
+  size = (uint64_t) _ftelli64(fh);
+  #else
+  size = (uint64_t) ftello(fh);
+  #endif
+
+  rewind(fh);
+
+  if (size > prefetcher->max_size)
+  {
+    slot->skipped = true;
+    fclose(fh);
+    return;
+  }
+
+  if (size > slot->capacity)
+  {
+    uint8_t* data = (uint8_t*) realloc(slot->data, (size_t) size);
+
+    if (data == NULL)
+    {
+      slot->skipped = true;
+      fclose(fh);
+      return;
+    }
+
+    slot->data = data;
+    slot->capacity = (size_t) size;
+  }
+
+  #if defined(POSIX_FADV_SEQUENTIAL)
+  file_advise(fh, POSIX_FADV_SEQUENTIAL);
+  #endif
+
+  slot->size = fread(slot->data, 1, (size_t) size, fh);
+
+  if (slot->size != size)
+    slot->error = ERROR_COULD_NOT_MAP_FILE;
+
+  fclose(fh);
+}
+
+
+static THREAD_ROUTINE(prefetcher_thread, arg)
+{
+  PREFETCHER* prefetcher = (PREFETCHER*) arg;
+
+  mutex_lock(&prefetcher->mutex);
+
+  while (true)
+  {
+    while (!prefetcher->stop &&
+           prefetcher->next_to_read < prefetcher->count &&
+           prefetcher->next_to_read >=
+               prefetcher->next_to_scan + prefetcher->depth)
+      cond_wait(&prefetcher->cond, &prefetcher->mutex);
+
+    if (prefetcher->stop || prefetcher->next_to_read >= prefetcher->count)
+      break;
+
+    Py_ssize_t index = prefetcher->next_to_read++;
+    PREFETCH_SLOT* slot = &prefetcher->slots[index % prefetcher->depth];
+
+    mutex_unlock(&prefetcher->mutex);
+
+    prefetch_file(prefetcher, slot, prefetcher->paths[index]);
+
+    mutex_lock(&prefetcher->mutex);
+
+    slot->ready = index + 1;
+    cond_broadcast(&prefetcher->cond);
+  }
+
+  mutex_unlock(&prefetcher->mutex);
+
+  THREAD_RETURN;
+}
+
+
+// Starts the reader threads, returns false if none could be started.
+static bool prefetcher_start(
+    PREFETCHER* prefetcher,
+    const char** paths,
+    Py_ssize_t count,
+    int depth,
+    int num_threads,
+    uint64_t max_size)
+{
+  memset(prefetcher, 0, sizeof(PREFETCHER));
+
+  prefetcher->paths = paths;
+  prefetcher->count = count;
+  prefetcher->depth = depth;
+  prefetcher->max_size = max_size;
+  prefetcher->slots = (PREFETCH_SLOT*) calloc(depth, sizeof(PREFETCH_SLOT));
+  prefetcher->threads = (THREAD*) calloc(num_threads, sizeof(THREAD));
+
+  if (prefetcher->slots == NULL || prefetcher->threads == NULL)
+  {
+    free(prefetcher->slots);
+    free(prefetcher->threads);
+    return false;
+  }
+
+  mutex_init(&prefetcher->mutex);
+  cond_init(&prefetcher->cond);
+
+  for (; prefetcher->num_threads < num_threads; prefetcher->num_threads++)
+  {
+    if (thread_create(
+          &prefetcher->threads[prefetcher->num_threads],
+          prefetcher_thread,
+          prefetcher) != 0)
+      break;
+  }
+
+  if (prefetcher->num_threads == 0)
+  {
+    mutex_destroy(&prefetcher->mutex);
+    cond_destroy(&prefetcher->cond);
+    free(prefetcher->slots);
+    free(prefetcher->threads);
+    return false;
+  }
+
+  return true;
+}
+
+
+// Waits until file "index" is loaded and returns its slot. The slot must be
+// released with prefetcher_release once the file has been scanned.
+static PREFETCH_SLOT* prefetcher_wait(
+    PREFETCHER* prefetcher,
+    Py_ssize_t index)
+{
+  PREFETCH_SLOT* slot = &prefetcher->slots[index % prefetcher->depth];
+
+  mutex_lock(&prefetcher->mutex);
+
+  while (slot->ready != index + 1)
+    cond_wait(&prefetcher->cond, &prefetcher->mutex);
+
+  mutex_unlock(&prefetcher->mutex);
+
+  return slot;
+}
+
+
+static void prefetcher_release(
+    PREFETCHER* prefetcher,
+    Py_ssize_t index)
+{
+  mutex_lock(&prefetcher->mutex);
+  prefetcher->next_to_scan = index + 1;
+  cond_broadcast(&prefetcher->cond);
+  mutex_unlock(&prefetcher->mutex);
+}
+
+
+static void prefetcher_stop(
+    PREFETCHER* prefetcher)
+{
+  mutex_lock(&prefetcher->mutex);
+  prefetcher->stop = true;
+  cond_broadcast(&prefetcher->cond);
+  mutex_unlock(&prefetcher->mutex);
+
+  for (int i = 0; i < prefetcher->num_threads; i++)
+    thread_join(prefetcher->threads[i]);
+
+  for (int i = 0; i < prefetcher->depth; i++)
+    free(prefetcher->slots[i].data);
+
+  mutex_destroy(&prefetcher->mutex);
+  cond_destroy(&prefetcher->cond);
+
+  free(prefetcher->slots);
+  free(prefetcher->threads);
+}
+
+
+// Sets the external variables for a scan, "externals" can be either a
+// dictionary or an Externals object created for the same rules. Returns -1
+// with an exception set on failure.
+static int apply_externals(
+    PyObject* self,
+    YR_SCANNER* scanner,
+    PyObject* externals)
+{
+  int error;
+
+  if (externals == NULL || externals == Py_None)
+    return 0;
+
+  if (PyDict_Check(externals))
+  {
+    if (process_match_externals(externals, scanner) != ERROR_SUCCESS)
+      return -1;
+  }
+  else if (PyObject_TypeCheck(externals, &Externals_Type) &&
+           ((Externals*) externals)->rules == self)
+  {
+    error = externals_apply((Externals*) externals, scanner);
+
+    if (error != ERROR_SUCCESS)
+    {
+      handle_error(error, NULL);
+      return -1;
+    }
+  }
+  else
+  {
+    PyErr_Format(
+        PyExc_TypeError,
+        "'externals' must be a dictionary or an Externals object "
+        "created for these rules");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// iter_match runs the scan in a background thread and yields matches as
+// soon as they are found. Closing or destroying the iterator cancels the
+// scan through a CancellationToken owned by the iterator and discards the
+// matches that were not consumed, so a closed iterator is always exhausted.
+// Destroying it never waits for the scan, if it's still running the thread
+// is detached and releases the iterator when it ends.
+
+static void match_iterator_free(
+    MatchIterator* iterator);
+
+static THREAD_ROUTINE(match_iterator_thread, arg)
+{
+  MatchIterator* iterator = (MatchIterator*) arg;
+  bool detached;
+  int error;
+
+  iterator->active_scan.scanner = iterator->scanner;
+  cancellation_token_register(iterator->token, &iterator->active_scan);
+
+  if (iterator->filepath != NULL)
+    error = yr_scanner_scan_file(iterator->scanner, iterator->filepath);
+  else if (iterator->data.buf != NULL)
+    error = yr_scanner_scan_mem(
+        iterator->scanner,
+        (const uint8_t*) iterator->data.buf,
+        (size_t) iterator->data.len);
+  else
+    error = yr_scanner_scan_proc(iterator->scanner, iterator->pid);
+
+  cancellation_token_unregister(iterator->token, &iterator->active_scan);
+
+  if (cancellation_token_aborted(iterator->token, error))
+    iterator->callback_data.cancelled = true;
+
+  mutex_lock(&iterator->mutex);
+  iterator->error = error;
+  iterator->done = true;
+  detached = iterator->detached;
+  cond_broadcast(&iterator->cond);
+  mutex_unlock(&iterator->mutex);
+
+  if (detached)
+  {
+    PyGILState_STATE gil_state = PyGILState_Ensure();
+    match_iterator_free(iterator);
+    PyGILState_Release(gil_state);
+  }
+
+  THREAD_RETURN;
+}
+
+
+// Stops the scan and discards the matches that were not consumed. Unless
+// "wait" is true a scan still running is not waited for, its thread is
+// detached and becomes the owner of the iterator, which can't be used
+// anymore. Returns true in that case.
+static bool match_iterator_stop(
+    MatchIterator* iterator,
+    bool wait)
+{
+  MATCH_QUEUE_NODE* node;
+  bool detached = false;
+
+  if (iterator->running)
+  {
+    THREAD thread = iterator->thread;
+    PyObject* result = PyObject_CallMethod(
+        (PyObject*) iterator->token, "cancel", NULL);
+
+    Py_XDECREF(result);
+    PyErr_Clear();
+
+    iterator->running = false;
+
+    // Wake up the scanning thread if it's waiting for room in the queue.
+    Py_BEGIN_ALLOW_THREADS
+
+    mutex_lock(&iterator->mutex);
+    iterator->stopping = true;
+    iterator->detached = !wait && !iterator->done;
+    detached = iterator->detached;
+    cond_broadcast(&iterator->cond);
+    mutex_unlock(&iterator->mutex);
+
+    if (detached)
+      thread_detach(thread);
+    else
+      thread_join(thread);
+
+    Py_END_ALLOW_THREADS
+
+    if (detached)
+      return true;
+  }
+
+  while ((node = iterator->head) != NULL)
+  {
+    iterator->head = node->next;
+    Py_DECREF(node->match);
+    free(node);
+  }
+
+  iterator->tail = NULL;
+  iterator->queued = 0;
+
+  return false;
+}
+
+
+static void match_iterator_free(
+    MatchIterator* iterator)
+{
+  match_iterator_stop(iterator, true);
+
+  if (iterator->scanner != NULL)
+    yr_scanner_destroy(iterator->scanner);
+
+  if (iterator->data.obj != NULL)
+    PyBuffer_Release(&iterator->data);
+
+  mutex_destroy(&iterator->mutex);
+  cond_destroy(&iterator->cond);
+
+  free(iterator->filepath);
+
+  Py_XDECREF(iterator->token);
+  Py_XDECREF(iterator->rules);
+
+  PyObject_Del(iterator);
+}
+
+
+static void MatchIterator_dealloc(
+    PyObject* self)
+{
+  MatchIterator* iterator = (MatchIterator*) self;
+
+  if (!match_iterator_stop(iterator, false))
+    match_iterator_free(iterator);
+}
+
+
+static PyObject* MatchIterator_next(
+    PyObject* self)
+{
+  MatchIterator* iterator = (MatchIterator*) self;
+  MATCH_QUEUE_NODE* node;
+
+  bool done;
+  int error;
+
+  Py_BEGIN_ALLOW_THREADS
+
+  mutex_lock(&iterator->mutex);
+
+  while (iterator->head == NULL && !iterator->done)
+    cond_wait(&iterator->cond, &iterator->mutex);
+
+  node = iterator->head;
+
+  if (node != NULL)
+  {
+    iterator->head = node->next;
+
+    if (iterator->head == NULL)
+      iterator->tail = NULL;
+
+    iterator->queued--;
+    cond_broadcast(&iterator->cond);
+  }
+
+  done = iterator->done;
+  error = iterator->error;
+
+  mutex_unlock(&iterator->mutex);
+
+  Py_END_ALLOW_THREADS
+
+  if (node != NULL)
+  {
+    PyObject* match = node->match;
+    free(node);
+    return match;
+  }
+
+  // The scan is done and all the matches were consumed. Errors are raised
+  // only once, a cancelled scan just ends the iteration.
+  if (done && iterator->running)
+  {
+    thread_join(iterator->thread);
+    iterator->running = false;
+
+    if (error != ERROR_SUCCESS && !iterator->callback_data.cancelled)
+    {
+      if (error == ERROR_CALLBACK_ERROR)
+        return PyErr_Format(YaraError, "error while processing matches");
+
+      if (iterator->filepath != NULL)
+        return handle_error(error, iterator->filepath);
+      else if (iterator->data.buf != NULL)
+        return handle_error(error, "<data>");
+      else
+        return handle_error(error, "<proc>");
+    }
+  }
+
+  return NULL;
+}
+
+
+static PyObject* MatchIterator_close(
+    PyObject* self,
+    PyObject* args)
+{
+  match_iterator_stop((MatchIterator*) self, true);
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* Rules_iter_match(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "filepath", "pid", "data", "externals", "fast", "timeout", NULL
+      };
+
+  Rules* rules = (Rules*) self;
+  MatchIterator* iterator;
+
+  char* filepath = NULL;
+  int pid = -1;
+  Py_buffer data = {0};
+
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
+
+  uint64_t timeout_ns;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "|sis*OOO",
+        kwlist,
+        &filepath,
+        &pid,
+        &data,
+        &externals,
+        &fast,
+        &timeout))
+  {
+    return NULL;
+  }
+
+  if (filepath == NULL && data.buf == NULL && pid == -1)
+    return PyErr_Format(
+        PyExc_TypeError,
+        "iter_match() takes at least one argument");
+
+  if (parse_timeout(timeout, "timeout", NULL, &timeout_ns) != 0)
+  {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  iterator = PyObject_NEW(MatchIterator, &MatchIterator_Type);
+
+  if (iterator == NULL)
+  {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  memset(
+      (char*) iterator + sizeof(PyObject),
+      0,
+      sizeof(MatchIterator) - sizeof(PyObject));
+
+  mutex_init(&iterator->mutex);
+  cond_init(&iterator->cond);
+
+  Py_INCREF(self);
+
+  iterator->rules = self;
+  iterator->data = data;
+  iterator->pid = pid;
+
+  iterator->callback_data.which = CALLBACK_ALL;
+  iterator->callback_data.max_match_data = rules->max_match_data;
+  iterator->callback_data.max_matches_per_string =
+      rules->max_matches_per_string;
+  iterator->callback_data.stream = iterator;
+
+  iterator->token = (CancellationToken*) PyObject_CallObject(
+      (PyObject*) &CancellationToken_Type, NULL);
+
+  if (iterator->token == NULL)
+  {
+    Py_DECREF(iterator);
+    return NULL;
+  }
+
+  iterator->callback_data.cancellation_token = iterator->token;
+
+  if (filepath != NULL)
+  {
+    iterator->filepath = strdup(filepath);
+
+    if (iterator->filepath == NULL)
+    {
+      Py_DECREF(iterator);
+      return PyErr_NoMemory();
+    }
+  }
+
+  if (yr_scanner_create(rules->rules, &iterator->scanner) != ERROR_SUCCESS)
+  {
+    iterator->scanner = NULL;
+    Py_DECREF(iterator);
+    return PyErr_Format(PyExc_Exception, "could not create scanner");
+  }
+
+  if (apply_externals(self, iterator->scanner, externals) != 0)
+  {
+    Py_DECREF(iterator);
+    return NULL;
+  }
+
+  if (fast != NULL && PyObject_IsTrue(fast) == 1)
+    yr_scanner_set_flags(iterator->scanner, SCAN_FLAGS_FAST_MODE);
+
+  scanner_set_timeout_ns(iterator->scanner, timeout_ns);
+  yr_scanner_set_callback(
+      iterator->scanner, yara_callback, &iterator->callback_data);
+
+  if (thread_create(
+        &iterator->thread, match_iterator_thread, iterator) != 0)
+  {
+    Py_DECREF(iterator);
+    return PyErr_Format(PyExc_Exception, "could not start scanning thread");
+  }
+
+  iterator->running = true;
+
+  return (PyObject*) iterator;
+}
+
+
+// Record-oriented scanning. A single buffer holds many small records, each
+// one scanned as an independent input with its own filesize. The results are
+// collected by a callback that doesn't need the GIL, as (record, rule) pairs
+// of int64 where "rule" is the index of the rule in the Rules object, the
+// same order used when iterating it.
+
+typedef struct _RECORD_MATCHES
+{
+  YR_RULES* rules;
+  int64_t* pairs;
+  size_t count;
+  size_t capacity;
+  int64_t record;
+
+} RECORD_MATCHES;
+
+
+static int record_callback(
+    YR_SCAN_CONTEXT* context,
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  RECORD_MATCHES* matches = (RECORD_MATCHES*) user_data;
+
+  if (message != CALLBACK_MSG_RULE_MATCHING)
+    return CALLBACK_CONTINUE;
+
+  if (matches->count == matches->capacity)
+  {
+    size_t capacity = matches->capacity == 0 ? 256 : matches->capacity * 2;
+    int64_t* pairs = (int64_t*) realloc(
+        matches->pairs, capacity * 2 * sizeof(int64_t));
+
+    if (pairs == NULL)
+      return CALLBACK_ERROR;
+
+    matches->pairs = pairs;
+    matches->capacity = capacity;
+  }
+
+  matches->pairs[matches->count * 2] = matches->record;
+  matches->pairs[matches->count * 2 + 1] =
+      (YR_RULE*) message_data - matches->rules->rules_table;
+
+  matches->count++;
+
+  return CALLBACK_CONTINUE;
+}
+
+
+static const uint8_t* find_delimiter(
+    const uint8_t* data,
+    size_t length,
+    const uint8_t* delimiter,
+    size_t delimiter_length)
+{
+  const uint8_t* end = data + length;
+
+  while (length >= delimiter_length)
+  {
+    const uint8_t* p = (const uint8_t*) memchr(
+        data, delimiter[0], length - delimiter_length + 1);
+
+    if (p == NULL)
+      return NULL;
+
+    if (memcmp(p, delimiter, delimiter_length) == 0)
+      return p;
+
+    data = p + 1;
+    length = end - data;
+  }
+
+  return NULL;
+}
+
+
+// Checks that "offsets" is a contiguous buffer of 64-bit integers.
+static bool is_int64_buffer(
+    Py_buffer* buffer)
+{
+  const char* format = buffer->format != NULL ? buffer->format : "B";
+
+  if (*format == '@' || *format == '=' || *format == '<')
+    format++;
+
+  return buffer->itemsize == 8 &&
+         (strcmp(format, "q") == 0 || strcmp(format, "Q") == 0 ||
+          strcmp(format, "l") == 0 || strcmp(format, "L") == 0);
+}
+
+
+static PyObject* Rules_match_records(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "data", "offsets", "delimiter", "externals", "fast", "timeout", NULL
+      };
+
+  Rules* rules = (Rules*) self;
+
+  Py_buffer data = {0};
+  Py_buffer offsets = {0};
+  Py_buffer delimiter = {0};
+
+  PyObject* offsets_object = NULL;
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
+  PyObject* result = NULL;
+
+  YR_SCANNER* scanner = NULL;
+  RECORD_MATCHES matches;
+
+  uint64_t timeout_ns;
+  int error = ERROR_SUCCESS;
+
+  memset(&matches, 0, sizeof(matches));
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "s*|Os*OOO",
+        kwlist,
+        &data,
+        &offsets_object,
+        &delimiter,
+        &externals,
+        &fast,
+        &timeout))
+  {
+    return NULL;
+  }
+
+  if ((offsets_object == NULL || offsets_object == Py_None) ==
+      (delimiter.buf == NULL))
+  {
+    PyErr_Format(
+        PyExc_TypeError,
+        "match_records() takes either 'offsets' or 'delimiter'");
+    goto _exit;
+  }
+
+  if (delimiter.buf != NULL && delimiter.len == 0)
+  {
+    PyErr_Format(PyExc_ValueError, "'delimiter' can't be empty");
+    goto _exit;
+  }
+
+  if (offsets_object != NULL && offsets_object != Py_None)
+  {
+    if (PyObject_GetBuffer(
+          offsets_object,
+          &offsets,
+          PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0)
+      goto _exit;
+
+    if (!is_int64_buffer(&offsets))
+    {
+      PyErr_Format(
+          PyExc_TypeError,
+          "'offsets' must be a contiguous array of 64-bit integers");
+      goto _exit;
+    }
+
+    // Records start at the given offsets and end where the next one starts,
+    // so offsets must be sorted and within the buffer.
+    const int64_t* starts = (const int64_t*) offsets.buf;
+    Py_ssize_t num_records = offsets.len / 8;
+
+    for (Py_ssize_t i = 0; i < num_records; i++)
+    {
+      if (starts[i] < 0 || starts[i] > data.len ||
+          (i > 0 && starts[i] < starts[i - 1]))
+      {
+        PyErr_Format(
+            PyExc_ValueError,
+            "'offsets' must be sorted and within the data");
+        goto _exit;
+      }
+    }
+  }
+
+  if (parse_timeout(timeout, "timeout", NULL, &timeout_ns) != 0)
+    goto _exit;
+
+  if (yr_scanner_create(rules->rules, &scanner) != ERROR_SUCCESS)
+  {
+    scanner = NULL;
+    PyErr_Format(PyExc_Exception, "could not create scanner");
+    goto _exit;
+  }
+
+  if (apply_externals(self, scanner, externals) != 0)
+    goto _exit;
+
+  if (fast != NULL && PyObject_IsTrue(fast) == 1)
+    yr_scanner_set_flags(scanner, SCAN_FLAGS_FAST_MODE);
+
+  scanner_set_timeout_ns(scanner, timeout_ns);
+
+  matches.rules = rules->rules;
+  yr_scanner_set_callback(scanner, record_callback, &matches);
+
+  Py_BEGIN_ALLOW_THREADS
+
+  const uint8_t* buffer = (const uint8_t*) data.buf;
+  size_t length = (size_t) data.len;
+
+  if (offsets.buf != NULL)
+  {
+    const int64_t* starts = (const int64_t*) offsets.buf;
+    int64_t num_records = offsets.len / 8;
+
+    for (int64_t i = 0; i < num_records && error == ERROR_SUCCESS; i++)
+    {
+      size_t end = i + 1 < num_records ? (size_t) starts[i + 1] : length;
+
+      matches.record = i;
+
+      error = yr_scanner_scan_mem(
+          scanner, buffer + starts[i], end - (size_t) starts[i]);
+    }
+  }
+  else
+  {
+    const uint8_t* start = buffer;
+    const uint8_t* end = buffer + length;
+
+    matches.record = 0;
+
+    // A delimiter at the very end doesn't start a new record.
+    while (start < end && error == ERROR_SUCCESS)
+    {
+      const uint8_t* next = find_delimiter(
+          start, end - start, (const uint8_t*) delimiter.buf, delimiter.len);
+
+      if (next == NULL)
+        next = end;
+
+      error = yr_scanner_scan_mem(scanner, start, next - start);
+
+      matches.record++;
+      start = next + (next < end ? delimiter.len : 0);
+    }
+  }
+
+  Py_END_ALLOW_THREADS
+
+  if (error != ERROR_SUCCESS)
+  {
+    if (error == ERROR_CALLBACK_ERROR)
+      PyErr_NoMemory();
+    else
+      handle_error(error, "<data>");
+
+    goto _exit;
+  }
+
+  // memoryview.cast doesn't accept shapes with zeros, so the empty result is
+  // a view of a static buffer with its shape set directly.
+  if (matches.count == 0)
+  {
+    static int64_t empty[2];
+    static char format[] = "q";
+
+    Py_ssize_t shape[2] = {0, 2};
+    Py_ssize_t strides[2] = {2 * sizeof(int64_t), sizeof(int64_t)};
+    Py_buffer empty_view;
+
+    memset(&empty_view, 0, sizeof(empty_view));
+
+    empty_view.buf = empty;
+    empty_view.len = 0;
+    empty_view.readonly = 1;
+    empty_view.itemsize = sizeof(int64_t);
+    empty_view.format = format;
+    empty_view.ndim = 2;
+    empty_view.shape = shape;
+    empty_view.strides = strides;
+
+    result = PyMemoryView_FromBuffer(&empty_view);
+    goto _exit;
+  }
+
+  PyObject* bytes = PyBytes_FromStringAndSize(
+      (const char*) matches.pairs, matches.count * 2 * sizeof(int64_t));
+
+  if (bytes != NULL)
+  {
+    PyObject* view = PyMemoryView_FromObject(bytes);
+
+    if (view != NULL)
+    {
+      PyObject* shape = Py_BuildValue("(nn)", (Py_ssize_t) matches.count, 2);
+
+      if (shape != NULL)
+        result = PyObject_CallMethod(view, "cast", "sO", "q", shape);
+
+      Py_XDECREF(shape);
+      Py_DECREF(view);
+    }
+
+    Py_DECREF(bytes);
+  }
+
+_exit:
+
+  if (scanner != NULL)
+    yr_scanner_destroy(scanner);
+
+  free(matches.pairs);
+
+  PyBuffer_Release(&data);
+  PyBuffer_Release(&offsets);
+  PyBuffer_Release(&delimiter);
+
+  return result;
+}
+
+
+// Arrow C Data Interface. These structures are defined by the interface
+// specification and are ABI-stable, so they are declared here instead of
+// depending on any Arrow library.
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema
+{
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+  void (*release)(struct ArrowSchema*);
+  void* private_data;
+};
+
+struct ArrowArray
+{
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+  void (*release)(struct ArrowArray*);
+  void* private_data;
+};
+
+#endif
+
+
+// Scans the elements of a binary or string Arrow array in parallel. Each
+// worker scans a contiguous range of elements, so concatenating the results
+// of all the workers keeps them sorted by element.
+
+typedef struct _ARROW_SCAN_WORKER
+{
+  YR_SCANNER* scanner;
+  RECORD_MATCHES matches;
+  struct ArrowArray* array;
+  bool large_offsets;
+  int64_t start;
+  int64_t end;
+  int error;
+
+} ARROW_SCAN_WORKER;
+
+
+static THREAD_ROUTINE(arrow_scan_thread, arg)
+{
+  ARROW_SCAN_WORKER* worker = (ARROW_SCAN_WORKER*) arg;
+  struct ArrowArray* array = worker->array;
+
+  const uint8_t* validity = (const uint8_t*) array->buffers[0];
+  const uint8_t* data = (const uint8_t*) array->buffers[2];
+
+  for (int64_t i = worker->start; i < worker->end; i++)
+  {
+    int64_t index = array->offset + i;
+    int64_t start, end;
+
+    if (validity != NULL && !(validity[index >> 3] & (1 << (index & 7))))
+      continue;
+
+    if (worker->large_offsets)
+    {
+      start = ((const int64_t*) array->buffers[1])[index];
+      end = ((const int64_t*) array->buffers[1])[index + 1];
+    }
+    else
+    {
+      start = ((const int32_t*) array->buffers[1])[index];
+      end = ((const int32_t*) array->buffers[1])[index + 1];
+    }
+
+    worker->matches.record = i;
+    worker->error = yr_scanner_scan_mem(
+        worker->scanner, data + start, (size_t) (end - start));
+
+    if (worker->error != ERROR_SUCCESS)
+      break;
+  }
+
+  THREAD_RETURN;
+}
+
+
+// Memory backing the list<uint32> array returned by match_arrow, freed by
+// the release callback of the parent array.
+typedef struct _ARROW_RESULT
+{
+  struct ArrowArray child;
+  struct ArrowArray* children[1];
+  const void* buffers[2];
+  const void* child_buffers[2];
+  int32_t* offsets;
+  uint32_t* values;
+
+} ARROW_RESULT;
+
+
+typedef struct _ARROW_RESULT_SCHEMA
+{
+  struct ArrowSchema child;
+  struct ArrowSchema* children[1];
+
+} ARROW_RESULT_SCHEMA;
+
+
+static void arrow_release_child_array(
+    struct ArrowArray* array)
+{
+  array->release = NULL;
+}
+
+
+static void arrow_release_result_array(
+    struct ArrowArray* array)
+{
+  ARROW_RESULT* result = (ARROW_RESULT*) array->private_data;
+
+  if (result->child.release != NULL)
+    result->child.release(&result->child);
+
+  free(result->offsets);
+  free(result->values);
+  free(result);
+
+  array->release = NULL;
+}
+
+
+static void arrow_release_child_schema(
+    struct ArrowSchema* schema)
+{
+  schema->release = NULL;
+}
+
+
+static void arrow_release_result_schema(
+    struct ArrowSchema* schema)
+{
+  ARROW_RESULT_SCHEMA* result = (ARROW_RESULT_SCHEMA*) schema->private_data;
+
+  if (result->child.release != NULL)
+    result->child.release(&result->child);
+
+  free(result);
+
+  schema->release = NULL;
+}
+
+
+static void arrow_array_capsule_destructor(
+    PyObject* capsule)
+{
+  struct ArrowArray* array = (struct ArrowArray*) PyCapsule_GetPointer(
+      capsule, "arrow_array");
+
+  if (array != NULL && array->release != NULL)
+    array->release(array);
+
+  free(array);
+}
+
+
+static void arrow_schema_capsule_destructor(
+    PyObject* capsule)
+{
+  struct ArrowSchema* schema = (struct ArrowSchema*) PyCapsule_GetPointer(
+      capsule, "arrow_schema");
+
+  if (schema != NULL && schema->release != NULL)
+    schema->release(schema);
+
+  free(schema);
+}
+
+
+// Builds the (schema, array) capsules for a list<uint32> array with "length"
+// elements, where the rules matching element i are at values[offsets[i]] to
+// values[offsets[i + 1]]. Takes ownership of "offsets" and "values".
+static PyObject* arrow_export_result(
+    int64_t length,
+    int32_t* offsets,
+    uint32_t* values)
+{
+  struct ArrowSchema* schema = (struct ArrowSchema*) calloc(
+      1, sizeof(struct ArrowSchema));
+  struct ArrowArray* array = (struct ArrowArray*) calloc(
+      1, sizeof(struct ArrowArray));
+
+  ARROW_RESULT_SCHEMA* schema_data = (ARROW_RESULT_SCHEMA*) calloc(
+      1, sizeof(ARROW_RESULT_SCHEMA));
+  ARROW_RESULT* array_data = (ARROW_RESULT*) calloc(
+      1, sizeof(ARROW_RESULT));
+
+  PyObject* schema_capsule = NULL;
+  PyObject* array_capsule = NULL;
+
+  if (schema == NULL || array == NULL ||
+      schema_data == NULL || array_data == NULL)
+  {
+    free(schema);
+    free(array);
+    free(schema_data);
+    free(array_data);
+    free(offsets);
+    free(values);
+    return PyErr_NoMemory();
+  }
+
+  schema_data->child.format = "I";
+  schema_data->child.name = "item";
+  schema_data->child.flags = ARROW_FLAG_NULLABLE;
+  schema_data->child.release = arrow_release_child_schema;
+  schema_data->children[0] = &schema_data->child;
+
+  schema->format = "+l";
+  schema->name = "";
+  schema->flags = ARROW_FLAG_NULLABLE;
+  schema->n_children = 1;
+  schema->children = schema_data->children;
+  schema->release = arrow_release_result_schema;
+  schema->private_data = schema_data;
+
+  array_data->offsets = offsets;
+  array_data->values = values;
+  array_data->child_buffers[1] = values;
+  array_data->child.length = offsets[length];
+  array_data->child.n_buffers = 2;
+  array_data->child.buffers = array_data->child_buffers;
+  array_data->child.release = arrow_release_child_array;
+  array_data->children[0] = &array_data->child;
+  array_data->buffers[1] = offsets;
+
+  array->length = length;
+  array->n_buffers = 2;
+  array->n_children = 1;
+  array->buffers = array_data->buffers;
+  array->children = array_data->children;
+  array->release = arrow_release_result_array;
+  array->private_data = array_data;
+
+  schema_capsule = PyCapsule_New(
+      schema, "arrow_schema", arrow_schema_capsule_destructor);
+
+  if (schema_capsule == NULL)
+  {
+    arrow_release_result_schema(schema);
+    free(schema);
+  }
+
+  array_capsule = PyCapsule_New(
+      array, "arrow_array", arrow_array_capsule_destructor);
+
+  if (array_capsule == NULL)
+  {
+    arrow_release_result_array(array);
+    free(array);
+  }
+
+  if (schema_capsule == NULL || array_capsule == NULL)
+  {
+    Py_XDECREF(schema_capsule);
+    Py_XDECREF(array_capsule);
+    return NULL;
+  }
+
+  return Py_BuildValue("(NN)", schema_capsule, array_capsule);
+}
+
+
+// match_arrow accepts any object implementing the Arrow PyCapsule interface
+// (__arrow_c_array__), like pyarrow arrays, or a (schema, array) tuple of
+// capsules. The array must be of binary, large_binary, string or
+// large_string type and its buffers are scanned in place. The result is a
+// list<uint32> array with the indexes of the rules matching each element,
+// returned as a (schema, array) tuple of capsules; null elements produce
+// empty lists.
+static PyObject* Rules_match_arrow(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "array", "threads", "externals", "fast", "timeout", NULL
+      };
+
+  Rules* rules = (Rules*) self;
+
+  PyObject* input;
+  PyObject* capsules = NULL;
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
+  PyObject* result = NULL;
+
+  struct ArrowSchema* schema;
+  struct ArrowArray* array;
+
+  ARROW_SCAN_WORKER* workers = NULL;
+  THREAD* threads = NULL;
+
+  int num_workers = 4;
+  int num_ready = 0;
+  int error = ERROR_SUCCESS;
+
+  uint64_t timeout_ns;
+  bool large_offsets;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "O|iOOO",
+        kwlist,
+        &input,
+        &num_workers,
+        &externals,
+        &fast,
+        &timeout))
+  {
+    return NULL;
+  }
+
+  if (PyObject_HasAttrString(input, "__arrow_c_array__"))
+  {
+    capsules = PyObject_CallMethod(input, "__arrow_c_array__", NULL);
+  }
+  else
+  {
+    capsules = input;
+    Py_INCREF(capsules);
+  }
+
+  if (capsules == NULL)
+    return NULL;
+
+  if (!PyTuple_Check(capsules) || PyTuple_GET_SIZE(capsules) != 2)
+  {
+    PyErr_Format(
+        PyExc_TypeError,
+        "expecting an Arrow array or a (schema, array) tuple of capsules");
+    goto _exit;
+  }
+
+  schema = (struct ArrowSchema*) PyCapsule_GetPointer(
+      PyTuple_GET_ITEM(capsules, 0), "arrow_schema");
+  array = (struct ArrowArray*) PyCapsule_GetPointer(
+      PyTuple_GET_ITEM(capsules, 1), "arrow_array");
+
+  if (schema == NULL || array == NULL)
+    goto _exit;
+
+  if (strcmp(schema->format, "z") == 0 || strcmp(schema->format, "u") == 0)
+    large_offsets = false;
+  else if (strcmp(schema->format, "Z") == 0 ||
+           strcmp(schema->format, "U") == 0)
+    large_offsets = true;
+  else
+  {
+    PyErr_Format(
+        PyExc_TypeError,
+        "Arrow array must be of binary or string type, not \"%s\"",
+        schema->format);
+    goto _exit;
+  }
+
+  if (array->release == NULL || array->n_buffers != 3)
+  {
+    PyErr_Format(PyExc_ValueError, "invalid Arrow array");
+    goto _exit;
+  }
+
+  if (parse_timeout(timeout, "timeout", NULL, &timeout_ns) != 0)
+    goto _exit;
+
+  if (num_workers < 1)
+    num_workers = 1;
+
+  if (num_workers > array->length)
+    num_workers = (int) yr_max(array->length, 1);
+
+  workers = (ARROW_SCAN_WORKER*) calloc(
+      num_workers, sizeof(ARROW_SCAN_WORKER));
+  threads = (THREAD*) calloc(num_workers, sizeof(THREAD));
+
+  if (workers == NULL || threads == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
+  }
+
+  for (; num_ready < num_workers; num_ready++)
+  {
+    ARROW_SCAN_WORKER* worker = &workers[num_ready];
+
+    if (yr_scanner_create(rules->rules, &worker->scanner) != ERROR_SUCCESS)
+    {
+      PyErr_Format(PyExc_Exception, "could not create scanner");
+      goto _exit;
+    }
+
+    if (apply_externals(self, worker->scanner, externals) != 0)
+    {
+      num_ready++;
+      goto _exit;
+    }
+
+    if (fast != NULL && PyObject_IsTrue(fast) == 1)
+      yr_scanner_set_flags(worker->scanner, SCAN_FLAGS_FAST_MODE);
+
+    scanner_set_timeout_ns(worker->scanner, timeout_ns);
+
+    worker->matches.rules = rules->rules;
+    worker->array = array;
+    worker->large_offsets = large_offsets;
+    worker->start = array->length * num_ready / num_workers;
+    worker->end = array->length * (num_ready + 1) / num_workers;
+
+    yr_scanner_set_callback(
+        worker->scanner, record_callback, &worker->matches);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+
+  int num_threads = 1;
+
+  for (; num_threads < num_workers; num_threads++)
+  {
+    if (thread_create(
+          &threads[num_threads], arrow_scan_thread, &workers[num_threads]) != 0)
+      break;
+  }
+
+  arrow_scan_thread(&workers[0]);
+
+  for (int i = 1; i < num_threads; i++)
+    thread_join(threads[i]);
+
+  for (int i = num_threads; i < num_workers; i++)
+    arrow_scan_thread(&workers[i]);
+
+  Py_END_ALLOW_THREADS
+
+  for (int i = 0; i < num_workers && error == ERROR_SUCCESS; i++)
+    error = workers[i].error;
+
+  if (error != ERROR_SUCCESS)
+  {
+    if (error == ERROR_CALLBACK_ERROR)
+      PyErr_NoMemory();
+    else
+      handle_error(error, "<arrow>");
+
+    goto _exit;
+  }
+
+  size_t total = 0;
+
+  for (int i = 0; i < num_workers; i++)
+    total += workers[i].matches.count;
+
+  if (total > INT32_MAX)
+  {
+    PyErr_Format(PyExc_OverflowError, "too many matches");
+    goto _exit;
+  }
+
+  int32_t* offsets = (int32_t*) calloc(array->length + 1, sizeof(int32_t));
+  uint32_t* values = (uint32_t*) malloc(yr_max(total, 1) * sizeof(uint32_t));
+
+  if (offsets == NULL || values == NULL)
+  {
+    free(offsets);
+    free(values);
+    PyErr_NoMemory();
+    goto _exit;
+  }
+
+  size_t n = 0;
+
+  for (int i = 0; i < num_workers; i++)
+  {
+    RECORD_MATCHES* matches = &workers[i].matches;
+
+    for (size_t j = 0; j < matches->count; j++)
+    {
+      offsets[matches->pairs[j * 2] + 1]++;
+      values[n++] = (uint32_t) matches->pairs[j * 2 + 1];
+    }
+  }
+
+  for (int64_t i = 0; i < array->length; i++)
+    offsets[i + 1] += offsets[i];
+
+  result = arrow_export_result(array->length, offsets, values);
+
+_exit:
+
+  for (int i = 0; i < num_ready; i++)
+  {
+    yr_scanner_destroy(workers[i].scanner);
+    free(workers[i].matches.pairs);
+  }
+
+  free(workers);
+  free(threads);
+
+  Py_XDECREF(capsules);
+
+  return result;
+}
+
+
+// Process memory scanning through /proc/<pid>/maps and /proc/<pid>/mem,
+// used by scan_pids. Unlike yr_scanner_scan_proc, the regions to scan are
+// selected up front and the process is not stopped while scanning.
+
+#define PROC_REGIONS_ALL      0
+#define PROC_REGIONS_EXEC     1
+#define PROC_REGIONS_PRIVATE  2
+
+#define PROC_REGION_COMPLETE         0
+#define PROC_REGION_UNREADABLE       1
+#define PROC_REGION_MAX_REGION_SIZE  2
+#define PROC_REGION_MAX_BYTES        3
+#define PROC_REGION_TIMEOUT          4
+
+
+typedef struct _PROC_REGION
+{
+  uint64_t start;
+  uint64_t end;
+  uint64_t scanned;
+  int status;
+
+} PROC_REGION;
+
+
+// Limits for process memory scans, zero means no limit. When "chunk_size"
+// is zero YR_CONFIG_MAX_PROCESS_MEMORY_CHUNK is used, like libyara does.
+// The region timeout is checked between chunks, so a region can exceed it
+// by the time it takes to scan one chunk.
+typedef struct _PROC_SCAN_OPTIONS
+{
+  uint64_t chunk_size;
+  uint64_t max_bytes;
+  uint64_t max_region_size;
+  uint64_t region_timeout_ns;
+
+} PROC_SCAN_OPTIONS;
+
+
+// Identifies a file-backed mapping. Mappings with the same key in different
+// processes have the same contents unless they were written to, which can't
+// happen for the read-only and executable mappings where sharing matters.
+typedef struct _PROC_MAPPING_KEY
+{
+  uint64_t device;
+  uint64_t inode;
+  uint64_t offset;
+  uint64_t size;
+
+} PROC_MAPPING_KEY;
+
+
+typedef struct _PROC_MAPPING_SET
+{
+  PROC_MAPPING_KEY* keys;
+  size_t count;
+  size_t capacity;
+  MUTEX mutex;
+
+} PROC_MAPPING_SET;
+
+
+typedef struct _PROC_MEMORY
+{
+  int fd;
+  PROC_REGION* regions;
+  int num_regions;
+  int current_region;
+  uint64_t next_base;
+  uint64_t chunk_size;
+  uint64_t scanned;
+  uint64_t region_started_ns;
+  const PROC_SCAN_OPTIONS* options;
+  uint8_t* buffer;
+  YR_MEMORY_BLOCK block;
+
+} PROC_MEMORY;
+
+
+static int parse_proc_regions(
+    const char* regions)
+{
+  if (regions == NULL || strcmp(regions, "all") == 0)
+    return PROC_REGIONS_ALL;
+
+  if (strcmp(regions, "exec") == 0)
+    return PROC_REGIONS_EXEC;
+
+  if (strcmp(regions, "private") == 0)
+    return PROC_REGIONS_PRIVATE;
+
+  PyErr_Format(
+      PyExc_ValueError,
+      "'regions' must be \"all\", \"exec\" or \"private\"");
+
+  return -1;
+}
+
+
+#if defined(__linux__)
+
+// Adds a mapping to the set, returns false if it was already there. Must be
+// called with the set's mutex held.
+static bool proc_mapping_set_add(
+    PROC_MAPPING_SET* set,
+    PROC_MAPPING_KEY* key)
+{
+  if (set->count * 2 >= set->capacity)
+  {
+    size_t capacity = set->capacity == 0 ? 256 : set->capacity * 2;
+    PROC_MAPPING_KEY* keys = (PROC_MAPPING_KEY*) calloc(
+        capacity, sizeof(PROC_MAPPING_KEY));
+
+    // If the set can't grow the mapping is scanned again, which is slower
+    // but still correct.
+    if (keys == NULL)
+      return true;
+
+    for (size_t i = 0; i < set->capacity; i++)
+    {
+      if (set->keys[i].size == 0)
+        continue;
+
+      size_t j = xxh64(
+          (const uint8_t*) &set->keys[i], sizeof(PROC_MAPPING_KEY), 0);
+
+      while (keys[j & (capacity - 1)].size != 0)
+        j++;
+
+      keys[j & (capacity - 1)] = set->keys[i];
+    }
+
+    free(set->keys);
+
+    set->keys = keys;
+    set->capacity = capacity;
+  }
+
+  size_t i = xxh64((const uint8_t*) key, sizeof(PROC_MAPPING_KEY), 0);
+
+  while (set->keys[i & (set->capacity - 1)].size != 0)
+  {
+    if (memcmp(
+          &set->keys[i & (set->capacity - 1)],
+          key,
+          sizeof(PROC_MAPPING_KEY)) == 0)
+      return false;
+
+    i++;
+  }
+
+  set->keys[i & (set->capacity - 1)] = *key;
+  set->count++;
+
+  return true;
+}
+
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+// Reads /proc/<pid>/maps and returns the readable regions matching the
+// filter in "regions". File-backed mappings are skipped if "skip_file_backed"
+// is true, otherwise the read-only ones already present in "seen" are skipped
+// and the rest are added to it. Writable mappings are never deduplicated, as
+// private ones (like .data and .bss) diverge from the file once written to.
+// With a NULL "seen" no mapping is deduplicated.
+static int proc_load_regions(
+    int pid,
+    int regions,
+    bool skip_file_backed,
+    PROC_MAPPING_SET* seen,
+    PROC_MEMORY* memory)
+{
+  char path[64];
+  char line[4096];
+  int capacity = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+
+  FILE* maps = fopen(path, "r");
+
+  if (maps == NULL)
+    return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
+
+  while (fgets(line, sizeof(line), maps) != NULL)
+  {
+    unsigned long long start, end, offset, inode;
+    unsigned int major, minor;
+    char perms[5];
+
+    if (sscanf(
+          line,
+          "%llx-%llx %4s %llx %x:%x %llu",
+          &start,
+          &end,
+          perms,
+          &offset,
+          &major,
+          &minor,
+          &inode) != 7)
+      continue;
+
+    if (perms[0] != 'r' || start >= end)
+      continue;
+
+    if (regions == PROC_REGIONS_EXEC && perms[2] != 'x')
+      continue;
+
+    if (regions == PROC_REGIONS_PRIVATE && perms[3] != 'p')
+      continue;
+
+    if (strstr(line, "[vvar]") != NULL)
+      continue;
+
+    if (inode != 0)
+    {
+      PROC_MAPPING_KEY key;
+      bool added;
+
+      if (skip_file_backed)
+        continue;
+
+      if (seen == NULL || perms[1] == 'w')
+        goto _add;
+
+      memset(&key, 0, sizeof(key));
+
+      key.device = ((uint64_t) major << 32) | minor;
+      key.inode = inode;
+      key.offset = offset;
+      key.size = end - start;
+
+      mutex_lock(&seen->mutex);
+      added = proc_mapping_set_add(seen, &key);
+      mutex_unlock(&seen->mutex);
+
+      if (!added)
+        continue;
+    }
+
+_add:
+
+    if (memory->num_regions == capacity)
+    {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+
+      PROC_REGION* grown = (PROC_REGION*) realloc(
+          memory->regions, capacity * sizeof(PROC_REGION));
+
+      if (grown == NULL)
+      {
+        fclose(maps);
+        return ERROR_INSUFFICIENT_MEMORY;
+      }
+
+      memory->regions = grown;
+    }
+
+    memset(&memory->regions[memory->num_regions], 0, sizeof(PROC_REGION));
+
+    memory->regions[memory->num_regions].start = start;
+    memory->regions[memory->num_regions].end = end;
+    memory->num_regions++;
+  }
+
+  fclose(maps);
+
+  return ERROR_SUCCESS;
+}
+
+
+static const uint8_t* proc_memory_fetch_data(
+    YR_MEMORY_BLOCK* block)
+{
+  PROC_MEMORY* memory = (PROC_MEMORY*) block->context;
+
+  // Regions can be unmapped or become unreadable while scanning, in that
+  // case the block is skipped.
+  if (pread(
+        memory->fd,
+        memory->buffer,
+        block->size,
+        (off_t) block->base) != (ssize_t) block->size)
+  {
+    memory->regions[memory->current_region].status = PROC_REGION_UNREADABLE;
+    return NULL;
+  }
+
+  return memory->buffer;
+}
+
+
+static YR_MEMORY_BLOCK* proc_memory_next(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  PROC_MEMORY* memory = (PROC_MEMORY*) iterator->context;
+
+  iterator->last_error = ERROR_SUCCESS;
+
+  const PROC_SCAN_OPTIONS* options = memory->options;
+
+  while (memory->current_region < memory->num_regions)
+  {
+    PROC_REGION* region = &memory->regions[memory->current_region];
+    uint64_t end = region->end;
+    uint64_t size;
+
+    if (memory->next_base < region->start)
+      memory->next_base = region->start;
+
+    if (options->max_region_size != 0 &&
+        end - region->start > options->max_region_size)
+    {
+      end = region->start + options->max_region_size;
+      region->status = PROC_REGION_MAX_REGION_SIZE;
+    }
+
+    if (memory->next_base >= end)
+    {
+      memory->current_region++;
+      memory->region_started_ns = 0;
+      continue;
+    }
+
+    if (options->max_bytes != 0 && memory->scanned >= options->max_bytes)
+    {
+      region->status = PROC_REGION_MAX_BYTES;
+      memory->current_region++;
+      memory->region_started_ns = 0;
+      continue;
+    }
+
+    if (options->region_timeout_ns != 0)
+    {
+      uint64_t now = monotonic_ns();
+
+      if (memory->region_started_ns == 0)
+      {
+        memory->region_started_ns = now;
+      }
+      else if (now - memory->region_started_ns > options->region_timeout_ns)
+      {
+        region->status = PROC_REGION_TIMEOUT;
+        memory->current_region++;
+        memory->region_started_ns = 0;
+        continue;
+      }
+    }
+
+    size = yr_min(memory->chunk_size, end - memory->next_base);
+
+    if (options->max_bytes != 0)
+      size = yr_min(size, options->max_bytes - memory->scanned);
+
+    region->scanned += size;
+    memory->scanned += size;
+
+    memory->block.base = memory->next_base;
+    memory->block.size = (size_t) size;
+    memory->block.context = memory;
+    memory->block.fetch_data = proc_memory_fetch_data;
+
+    memory->next_base += size;
+
+    return &memory->block;
+  }
+
+  return NULL;
+}
+
+
+static YR_MEMORY_BLOCK* proc_memory_first(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  ((PROC_MEMORY*) iterator->context)->next_base = 0;
+  ((PROC_MEMORY*) iterator->context)->current_region = 0;
+  ((PROC_MEMORY*) iterator->context)->scanned = 0;
+  ((PROC_MEMORY*) iterator->context)->region_started_ns = 0;
+
+  return proc_memory_next(iterator);
+}
+
+
+static uint64_t proc_memory_size(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  return YR_UNDEFINED;
+}
+
+
+// Scans the memory of a process, see proc_load_regions for the meaning of
+// the arguments. The regions are left in "memory", which must be zeroed by
+// the caller, so that the caller can inspect how they were scanned. The
+// caller must free memory->regions. Must be called without the GIL.
+static int scan_proc_regions(
+    YR_SCANNER* scanner,
+    int pid,
+    int regions,
+    bool skip_file_backed,
+    PROC_MAPPING_SET* seen,
+    const PROC_SCAN_OPTIONS* options,
+    PROC_MEMORY* memory)
+{
+  YR_MEMORY_BLOCK_ITERATOR iterator;
+
+  uint64_t largest_region = 1;
+  char path[64];
+  int error;
+
+  error = proc_load_regions(pid, regions, skip_file_backed, seen, memory);
+
+  if (error != ERROR_SUCCESS)
+    return error;
+
+  snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+
+  memory->fd = open(path, O_RDONLY);
+
+  if (memory->fd < 0)
+    return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
+
+  for (int i = 0; i < memory->num_regions; i++)
+    largest_region = yr_max(
+        largest_region, memory->regions[i].end - memory->regions[i].start);
+
+  if (options->chunk_size != 0)
+    memory->chunk_size = options->chunk_size;
+  else
+    yr_get_configuration_uint64(
+        YR_CONFIG_MAX_PROCESS_MEMORY_CHUNK, &memory->chunk_size);
+
+  memory->chunk_size = yr_min(memory->chunk_size, largest_region);
+  memory->options = options;
+  memory->buffer = (uint8_t*) malloc((size_t) memory->chunk_size);
+
+  if (memory->buffer == NULL)
+  {
+    close(memory->fd);
+    return ERROR_INSUFFICIENT_MEMORY;
+  }
+
+  iterator.context = memory;
+  iterator.first = proc_memory_first;
+  iterator.next = proc_memory_next;
+  iterator.file_size = proc_memory_size;
+  iterator.last_error = ERROR_SUCCESS;
+
+  error = yr_scanner_scan_mem_blocks(scanner, &iterator);
+
+  free(memory->buffer);
+  close(memory->fd);
+
+  memory->buffer = NULL;
+
+  return error;
+}
+
+
+// Returns a list describing the regions that were not fully scanned.
+static PyObject* proc_region_report(
+    PROC_MEMORY* memory)
+{
+  static const char* reasons[] = {
+      NULL, "unreadable", "max_region_size", "max_bytes", "timeout"
+      };
+
+  PyObject* report = PyList_New(0);
+
+  for (int i = 0; report != NULL && i < memory->num_regions; i++)
+  {
+    PROC_REGION* region = &memory->regions[i];
+
+    if (region->status == PROC_REGION_COMPLETE)
+      continue;
+
+    PyObject* entry = Py_BuildValue(
+        "{s:K,s:K,s:K,s:s}",
+        "start", (unsigned long long) region->start,
+        "end", (unsigned long long) region->end,
+        "scanned", (unsigned long long) region->scanned,
+        "reason", reasons[region->status]);
+
+    if (entry == NULL || PyList_Append(report, entry) != 0)
+      Py_CLEAR(report);
+
+    Py_XDECREF(entry);
+  }
+
+  return report;
+}
+
+#endif
+
+
+typedef struct _PID_SCAN
+{
+  int pid;
+  int error;
+  CALLBACK_DATA callback_data;
+
+} PID_SCAN;
+
+
+typedef struct _PID_SWEEP
+{
+  PID_SCAN* scans;
+  Py_ssize_t num_scans;
+  Py_ssize_t next;
+  int regions;
+  bool skip_file_backed;
+  PROC_SCAN_OPTIONS options;
+  PROC_MAPPING_SET seen;
+  MUTEX mutex;
+
+} PID_SWEEP;
+
+
+typedef struct _PID_SCAN_WORKER
+{
+  YR_SCANNER* scanner;
+  PID_SWEEP* sweep;
+
+} PID_SCAN_WORKER;
+
+
+static THREAD_ROUTINE(pid_scan_thread, arg)
+{
+  PID_SCAN_WORKER* worker = (PID_SCAN_WORKER*) arg;
+  PID_SWEEP* sweep = worker->sweep;
+
+  while (true)
+  {
+    mutex_lock(&sweep->mutex);
+    Py_ssize_t i = sweep->next++;
+    mutex_unlock(&sweep->mutex);
+
+    if (i >= sweep->num_scans)
+      break;
+
+    PID_SCAN* scan = &sweep->scans[i];
+
+    yr_scanner_set_callback(
+        worker->scanner, yara_callback, &scan->callback_data);
+
+    #if defined(__linux__)
+    PROC_MEMORY memory;
+
+    memset(&memory, 0, sizeof(memory));
+
+    scan->error = scan_proc_regions(
+        worker->scanner,
+        scan->pid,
+        sweep->regions,
+        sweep->skip_file_backed,
+        &sweep->seen,
+        &sweep->options,
+        &memory);
+
+    free(memory.regions);
+    #else
+    scan->error = ERROR_COULD_NOT_ATTACH_TO_PROCESS;
+    #endif
+  }
+
+  THREAD_RETURN;
+}
+
+
+// scan_pids scans many processes at once with a pool of threads, each one
+// with its own scanner. Returns a dictionary mapping each pid to its list of
+// matches, or to the yara.Error describing why it couldn't be scanned, as
+// processes come and go during a sweep. Read-only file-backed mappings shared
+// by several processes are scanned only once, and are not scanned at all with
+// skip_file_backed=True. Matches in such a mapping are reported only for the
+// process in which it was scanned, which is whichever one a thread reaches
+// first, so with more than one thread it can differ from one sweep to the
+// next.
+static PyObject* Rules_scan_pids(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "pids", "threads", "regions", "skip_file_backed", "externals", "fast",
+      "timeout", NULL
+      };
+
+  Rules* rules = (Rules*) self;
+
+  PyObject* pids;
+  PyObject* sequence = NULL;
+  PyObject* skip_file_backed = NULL;
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
+  PyObject* result = NULL;
+
+  char* regions = NULL;
+
+  PID_SWEEP sweep;
+  PID_SCAN_WORKER* workers = NULL;
+  THREAD* threads = NULL;
+
+  int num_workers = 4;
+  int num_ready = 0;
+
+  uint64_t timeout_ns;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "O|izOOOO",
+        kwlist,
+        &pids,
+        &num_workers,
+        &regions,
+        &skip_file_backed,
+        &externals,
+        &fast,
+        &timeout))
+  {
+    return NULL;
+  }
+
+  #if !defined(__linux__)
+  return PyErr_Format(
+      PyExc_NotImplementedError,
+      "scan_pids is only supported on Linux");
+  #endif
+
+  memset(&sweep, 0, sizeof(sweep));
+  mutex_init(&sweep.mutex);
+  mutex_init(&sweep.seen.mutex);
+
+  sweep.regions = parse_proc_regions(regions);
+  sweep.skip_file_backed =
+      skip_file_backed == NULL || PyObject_IsTrue(skip_file_backed) == 1;
+
+  if (sweep.regions < 0 ||
+      parse_timeout(timeout, "timeout", NULL, &timeout_ns) != 0)
+    goto _exit;
+
+  sequence = PySequence_Fast(pids, "'pids' must be a sequence of integers");
+
+  if (sequence == NULL)
+    goto _exit;
+
+  sweep.num_scans = PySequence_Fast_GET_SIZE(sequence);
+  sweep.scans = (PID_SCAN*) calloc(
+      yr_max(sweep.num_scans, 1), sizeof(PID_SCAN));
+
+  if (sweep.scans == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
+  }
+
+  for (Py_ssize_t i = 0; i < sweep.num_scans; i++)
+  {
+    PID_SCAN* scan = &sweep.scans[i];
+
+    scan->pid = (int) PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence, i));
+
+    if (scan->pid == -1 && PyErr_Occurred())
+      goto _exit;
+
+    scan->callback_data.matches = PyList_New(0);
+    scan->callback_data.which = CALLBACK_ALL;
+    scan->callback_data.max_match_data = rules->max_match_data;
+    scan->callback_data.max_matches_per_string =
+        rules->max_matches_per_string;
+
+    if (scan->callback_data.matches == NULL)
+      goto _exit;
+  }
+
+  if (num_workers < 1)
+    num_workers = 1;
+
+  if (num_workers > sweep.num_scans)
+    num_workers = (int) yr_max(sweep.num_scans, 1);
+
+  workers = (PID_SCAN_WORKER*) calloc(num_workers, sizeof(PID_SCAN_WORKER));
+  threads = (THREAD*) calloc(num_workers, sizeof(THREAD));
+
+  if (workers == NULL || threads == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
+  }
+
+  for (; num_ready < num_workers; num_ready++)
+  {
+    PID_SCAN_WORKER* worker = &workers[num_ready];
+    int flags = SCAN_FLAGS_PROCESS_MEMORY;
+
+    if (yr_scanner_create(rules->rules, &worker->scanner) != ERROR_SUCCESS)
+    {
+      PyErr_Format(PyExc_Exception, "could not create scanner");
+      goto _exit;
+    }
+
+    if (apply_externals(self, worker->scanner, externals) != 0)
+    {
+      num_ready++;
+      goto _exit;
+    }
+
+    if (fast != NULL && PyObject_IsTrue(fast) == 1)
+      flags |= SCAN_FLAGS_FAST_MODE;
+
+    yr_scanner_set_flags(worker->scanner, flags);
+    scanner_set_timeout_ns(worker->scanner, timeout_ns);
+
+    worker->sweep = &sweep;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+
+  int num_threads = 1;
+
+  for (; num_threads < num_workers; num_threads++)
+  {
+    if (thread_create(
+          &threads[num_threads], pid_scan_thread, &workers[num_threads]) != 0)
+      break;
+  }
+
+  pid_scan_thread(&workers[0]);
+
+  for (int i = 1; i < num_threads; i++)
+    thread_join(threads[i]);
+
+  Py_END_ALLOW_THREADS
+
+  result = PyDict_New();
+
+  for (Py_ssize_t i = 0; result != NULL && i < sweep.num_scans; i++)
+  {
+    PID_SCAN* scan = &sweep.scans[i];
+    PyObject* pid = PyLong_FromLong(scan->pid);
+    PyObject* value = scan->callback_data.matches;
+
+    Py_INCREF(value);
+
+    if (scan->error != ERROR_SUCCESS)
+    {
+      PyObject* type;
+      PyObject* traceback;
+
+      Py_DECREF(value);
+
+      if (scan->error == ERROR_CALLBACK_ERROR)
+        PyErr_NoMemory();
+      else
+        handle_error(scan->error, "<proc>");
+
+      PyErr_Fetch(&type, &value, &traceback);
+      PyErr_NormalizeException(&type, &value, &traceback);
+
+      Py_XDECREF(type);
+      Py_XDECREF(traceback);
+    }
+
+    if (pid == NULL || value == NULL || PyDict_SetItem(result, pid, value) != 0)
+      Py_CLEAR(result);
+
+    Py_XDECREF(pid);
+    Py_XDECREF(value);
+  }
+
+_exit:
+
+  for (int i = 0; i < num_ready; i++)
+    yr_scanner_destroy(workers[i].scanner);
+
+  if (sweep.scans != NULL)
+  {
+    for (Py_ssize_t i = 0; i < sweep.num_scans; i++)
+      Py_XDECREF(sweep.scans[i].callback_data.matches);
+  }
+
+  free(sweep.scans);
+  free(sweep.seen.keys);
+  free(workers);
+  free(threads);
+
+  mutex_destroy(&sweep.mutex);
+  mutex_destroy(&sweep.seen.mutex);
+
+  Py_XDECREF(sequence);
+
+  return result;
+}
+
+
+static PyObject* Rules_match(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "filepath", "pid", "data", "externals",
+      "callback", "fast", "timeout", "modules_data",
+      "modules_callback", "which_callbacks", "warnings_callback",
+      "console_callback", "allow_duplicate_metadata", "deadline",
+      "cancellation_token", "max_match_data", "max_matches_per_string",
+      "lazy_modules", "modules_fields", "output", "data_encoding", "cache",
+      "chunk_size", "chunk_overlap", "ranges", "read", "read_threshold",
+      "fadvise_dontneed", "process_chunk_size", "process_max_bytes",
+      "process_max_region_size", "process_region_timeout", "region_report",
+      NULL
+      };
+
+  char* filepath = NULL;
+  char* output = NULL;
+  char* data_encoding = NULL;
+  Py_buffer data = {0};
+
+  int json_encoding = JSON_ENCODING_HEX;
+
+  int pid = -1;
+  int error = ERROR_SUCCESS;
+
+  uint64_t timeout_ns = 0;
+
+  unsigned long long chunk_size = 0;
+  unsigned long long chunk_overlap = CHUNK_OVERLAP_DEFAULT;
+
+  FILE_RANGE* file_ranges = NULL;
+  int num_file_ranges = 0;
+
+  char* read_strategy = NULL;
+  unsigned long long read_threshold = 1024 * 1024;
+
+  FILE_READ_OPTIONS read_options;
+
+  unsigned long long process_chunk_size = 0;
+  unsigned long long process_max_bytes = 0;
+  unsigned long long process_max_region_size = 0;
+
+  PROC_SCAN_OPTIONS proc_options;
+  bool proc_limits = false;
+  bool want_report = false;
+
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
+  PyObject* deadline = NULL;
+  PyObject* lazy_modules = NULL;
+  PyObject* modules_fields = NULL;
+  PyObject* cache = NULL;
+  PyObject* cache_key = NULL;
+  PyObject* ranges = NULL;
+  char* mapped_path = NULL;
+  PyObject* fadvise_dontneed = NULL;
+  PyObject* process_region_timeout = NULL;
+  PyObject* region_report = NULL;
+  PyObject* report = NULL;
+
+  Rules* object = (Rules*) self;
+
+  YR_SCANNER* scanner;
+  CALLBACK_DATA callback_data;
+  ACTIVE_SCAN active_scan;
+  JSON_OUTPUT json_output;
+  TABLE_OUTPUT table_output;
+
+  callback_data.matches = NULL;
+  callback_data.callback = NULL;
+  callback_data.modules_data = NULL;
+  callback_data.modules_buffers = NULL;
+  callback_data.modules_callback = NULL;
+  callback_data.warnings_callback = NULL;
+  callback_data.console_callback = NULL;
+  callback_data.module_views = NULL;
+  callback_data.modules_fields = NULL;
+  callback_data.json = NULL;
+  callback_data.table = NULL;
+  callback_data.cancellation_token = NULL;
+  callback_data.cancelled = false;
+  callback_data.reject_modules = false;
+  callback_data.max_match_data = object->max_match_data;
+  callback_data.max_matches_per_string = object->max_matches_per_string;
+  callback_data.which = CALLBACK_ALL;
+  callback_data.allow_duplicate_metadata = false;
+
+  if (PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "|sis*OOOOOOiOObOOIIOOzzOKKOzKOKKKOO",
+        kwlist,
+        &filepath,
+        &pid,
+        &data,
+        &externals,
+        &callback_data.callback,
+        &fast,
+        &timeout,
+        &callback_data.modules_data,
+        &callback_data.modules_callback,
+        &callback_data.which,
+        &callback_data.warnings_callback,
+        &callback_data.console_callback,
+        &callback_data.allow_duplicate_metadata,
+        &deadline,
+        &callback_data.cancellation_token,
+        &callback_data.max_match_data,
+        &callback_data.max_matches_per_string,
+        &lazy_modules,
+        &modules_fields,
+        &output,
+        &data_encoding,
+        &cache,
+        &chunk_size,
+        &chunk_overlap,
+        &ranges,
+        &read_strategy,
+        &read_threshold,
+        &fadvise_dontneed,
+        &process_chunk_size,
+        &process_max_bytes,
+        &process_max_region_size,
+        &process_region_timeout,
+        &region_report))
+  {
+    if (filepath == NULL && data.buf == NULL && pid == -1)
+    {
+      return PyErr_Format(
+          PyExc_TypeError,
+          "match() takes at least one argument");
+    }
+
+    if (callback_data.callback != NULL)
+    {
+      if (!PyCallable_Check(callback_data.callback))
+      {
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'callback' must be callable");
+      }
+    }
+
+    if (callback_data.modules_callback != NULL)
+    {
+      if (!PyCallable_Check(callback_data.modules_callback))
+      {
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'modules_callback' must be callable");
+      }
+    }
+
+    if (callback_data.warnings_callback != NULL)
+    {
+      if (!PyCallable_Check(callback_data.warnings_callback))
+      {
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'warnings_callback' must be callable");
+      }
+    }
+
+    if (callback_data.console_callback != NULL)
+    {
+      if (!PyCallable_Check(callback_data.console_callback))
+      {
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'console_callback' must be callable");
+      }
+    }
+
+    if (callback_data.modules_data != NULL)
+    {
+      if (!PyDict_Check(callback_data.modules_data))
+      {
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'modules_data' must be a dictionary");
+      }
+    }
+
+    if (callback_data.allow_duplicate_metadata == NULL)
+      callback_data.allow_duplicate_metadata = false;
+
+    if ((PyObject*) callback_data.cancellation_token == Py_None)
+      callback_data.cancellation_token = NULL;
+
+    if (callback_data.cancellation_token != NULL &&
+        !PyObject_TypeCheck(
+            callback_data.cancellation_token, &CancellationToken_Type))
+    {
+      PyBuffer_Release(&data);
+      return PyErr_Format(
+          PyExc_TypeError,
+          "'cancellation_token' must be a CancellationToken");
+    }
+
+    if (lazy_modules != NULL && PyObject_IsTrue(lazy_modules) == 1 &&
+        modules_fields != NULL && modules_fields != Py_None)
+    {
+      PyBuffer_Release(&data);
+      return PyErr_Format(
+          PyExc_ValueError,
+          "'lazy_modules' and 'modules_fields' can't be used together");
+    }
+
+    // A token cancelled before the scan starts aborts it right away, there
+    // is no point in reading the data only to discard the results.
+    if (callback_data.cancellation_token != NULL &&
+        shared_flag_get(&callback_data.cancellation_token->cancelled))
+    {
+      PyBuffer_Release(&data);
+      return PyErr_Format(YaraCancelledError, "scanning was cancelled");
+    }
+
+    if (parse_timeout(timeout, "timeout", deadline, &timeout_ns) != 0)
+    {
+      PyBuffer_Release(&data);
+      return NULL;
+    }
+
+    if (output != NULL &&
+        strcmp(output, "json") != 0 &&
+        strcmp(output, "table") != 0)
+    {
+      PyBuffer_Release(&data);
+      return PyErr_Format(
+          PyExc_ValueError,
+          "'output' must be \"json\" or \"table\"");
+    }
+
+    json_encoding = parse_json_encoding(data_encoding);
+
+    if (json_encoding < 0)
+    {
+      PyBuffer_Release(&data);
+      return NULL;
+    }
+
+    if (parse_read_options(
+          read_strategy, read_threshold, fadvise_dontneed, &read_options) != 0)
+    {
+      PyBuffer_Release(&data);
+      return NULL;
+    }
+
+    memset(&proc_options, 0, sizeof(proc_options));
+
+    proc_options.chunk_size = process_chunk_size;
+    proc_options.max_bytes = process_max_bytes;
+    proc_options.max_region_size = process_max_region_size;
+
+    if (parse_timeout(
+          process_region_timeout,
+          "process_region_timeout",
+          NULL,
+          &proc_options.region_timeout_ns) != 0)
+    {
+      PyBuffer_Release(&data);
+      return NULL;
+    }
+
+    want_report = region_report != NULL && PyObject_IsTrue(region_report) == 1;
+
+    proc_limits = want_report ||
+        proc_options.chunk_size != 0 ||
+        proc_options.max_bytes != 0 ||
+        proc_options.max_region_size != 0 ||
+        proc_options.region_timeout_ns != 0;
+
+    if (proc_limits && pid == -1)
+    {
+      PyBuffer_Release(&data);
+      return PyErr_Format(
+          PyExc_TypeError,
+          "process limits and 'region_report' can only be used with 'pid'");
+    }
+
+    #if !defined(__linux__)
+    if (proc_limits)
+    {
+      PyBuffer_Release(&data);
+      return PyErr_Format(
+          PyExc_NotImplementedError,
+          "process limits and 'region_report' are only supported on Linux");
+    }
+    #endif
+
+    if (ranges != NULL && ranges != Py_None)
+    {
+      if (filepath == NULL)
+      {
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'ranges' can only be used with 'filepath'");
+      }
+
+      file_ranges = parse_file_ranges(ranges, &num_file_ranges);
+
+      if (file_ranges == NULL)
+      {
+        PyBuffer_Release(&data);
+        return NULL;
+      }
+    }
+
+    if (chunk_size != 0 || chunk_overlap != CHUNK_OVERLAP_DEFAULT)
+    {
+      if (filepath == NULL)
+      {
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'chunk_size' and 'chunk_overlap' can only be used with "
+            "'filepath'");
+      }
+
+      if (chunk_overlap == CHUNK_OVERLAP_DEFAULT)
+        chunk_overlap = yr_min(64 * 1024, chunk_size / 2);
+
+      if (chunk_size == 0 || chunk_overlap >= chunk_size)
+      {
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_ValueError,
+            "'chunk_overlap' must be smaller than a non-zero 'chunk_size'");
+      }
+    }
+
+    callback_data.reject_modules = chunk_size != 0 || file_ranges != NULL;
+
+    if ((chunk_size != 0 || file_ranges != NULL) &&
+        read_options.strategy != FILE_READ_DEFAULT)
+    {
+      PyMem_Free(file_ranges);
+      PyBuffer_Release(&data);
+      return PyErr_Format(
+          PyExc_ValueError,
+          "'read' and 'fadvise_dontneed' can't be used with 'chunk_size' or "
+          "'ranges'");
+    }
+
+    if (cache == Py_None)
+      cache = NULL;
+
+    // Cached results are returned without scanning, which is only correct
+    // when the scan has no side effects and depends only on the content.
+    // Besides ResultCache and DiskResultCache, any object with get(key) and
+    // put(key, value) methods can be used as cache. Values are lists of Match
+    // objects, or bytes with the "json" output, and can be pickled.
+    if (cache != NULL)
+    {
+      PyObject* cached;
+
+      if (pid != -1 ||
+          callback_data.callback != NULL ||
+          callback_data.modules_callback != NULL ||
+          callback_data.warnings_callback != NULL ||
+          callback_data.console_callback != NULL ||
+          callback_data.modules_data != NULL)
+      {
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_ValueError,
+            "'cache' can't be used with 'pid', 'modules_data' or callbacks");
+      }
+
+      if (read_options.strategy != FILE_READ_DEFAULT)
+      {
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_ValueError,
+            "'cache' can't be used with 'read' or 'fadvise_dontneed'");
+      }
+
+      if (chunk_size != 0 || file_ranges != NULL)
+      {
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        return PyErr_Format(
+            PyExc_ValueError,
+            "'cache' can't be used with 'chunk_size' or 'ranges'");
+      }
+
+      // The file is mapped once and scanned as data, hashing it and then
+      // scanning it separately would read it twice and could produce a key
+      // that doesn't correspond to the scanned content.
+      if (filepath != NULL)
+      {
+        PyBuffer_Release(&data);
+
+        if (map_file_buffer(filepath, &data) != 0)
+          return NULL;
+
+        mapped_path = filepath;
+        filepath = NULL;
+      }
+
+      PyObject* options = Py_BuildValue(
+          "(iIIzzOi)",
+          fast != NULL && PyObject_IsTrue(fast) == 1,
+          callback_data.max_match_data,
+          callback_data.max_matches_per_string,
+          output,
+          data_encoding,
+          modules_fields != NULL ? modules_fields : Py_None,
+          (int) callback_data.allow_duplicate_metadata);
+
+      if (options != NULL)
+      {
+        cache_key = result_cache_key(object, &data, externals, options);
+
+        Py_DECREF(options);
+      }
+
+      if (cache_key == NULL)
+      {
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        return NULL;
+      }
+
+      cached = PyObject_CallMethod(cache, "get", "O", cache_key);
+
+      if (cached == NULL || cached != Py_None)
+      {
+        Py_DECREF(cache_key);
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+
+        if (cached == NULL)
+          return NULL;
+
+        PyObject* copy = result_cache_copy(cached);
+        Py_DECREF(cached);
+        return copy;
+      }
+
+      Py_DECREF(cached);
+    }
+
+    if (yr_scanner_create(object->rules, &scanner) != 0)
+    {
+      Py_XDECREF(cache_key);
+      PyMem_Free(file_ranges);
+      PyBuffer_Release(&data);
+      return PyErr_Format(
+          PyExc_Exception,
+          "could not create scanner");
+    }
+
+    if (apply_externals(self, scanner, externals) != 0)
+    {
+      Py_XDECREF(cache_key);
+      PyMem_Free(file_ranges);
+      PyBuffer_Release(&data);
+      yr_scanner_destroy(scanner);
+      return NULL;
+    }
+
+    if (lazy_modules != NULL && PyObject_IsTrue(lazy_modules) == 1)
+    {
+      callback_data.module_views = PyList_New(0);
+
+      if (callback_data.module_views == NULL)
+      {
+        Py_XDECREF(cache_key);
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        yr_scanner_destroy(scanner);
+        return NULL;
+      }
+    }
+    else if (modules_fields != NULL && modules_fields != Py_None)
+    {
+      if (PyDict_Check(modules_fields))
+        callback_data.modules_fields = build_modules_fields(modules_fields);
+      else
+        PyErr_Format(
+            PyExc_TypeError,
+            "'modules_fields' must be a dictionary");
+
+      if (callback_data.modules_fields == NULL)
+      {
+        Py_XDECREF(cache_key);
+        PyMem_Free(file_ranges);
+        PyBuffer_Release(&data);
+        yr_scanner_destroy(scanner);
+        return NULL;
+      }
+    }
+
+    if (output != NULL && strcmp(output, "table") == 0)
+    {
+      memset(&table_output, 0, sizeof(table_output));
+      callback_data.table = &table_output;
+    }
+    else if (output != NULL)
+    {
+      json_output_init(&json_output, json_encoding);
+      callback_data.json = &json_output;
+    }
+
+    if (fast != NULL && PyObject_IsTrue(fast) == 1)
+    {
+      yr_scanner_set_flags(scanner, SCAN_FLAGS_FAST_MODE);
+    }
+
+    scanner_set_timeout_ns(scanner, timeout_ns);
+    yr_scanner_set_callback(scanner, yara_callback, &callback_data);
+
+    if (callback_data.cancellation_token != NULL)
+    {
+      active_scan.scanner = scanner;
+      cancellation_token_register(
+          callback_data.cancellation_token, &active_scan);
+    }
+
+    if (filepath != NULL)
+    {
+      callback_data.matches = PyList_New(0);
+
+      Py_BEGIN_ALLOW_THREADS
+
+      if (chunk_size > 0 || file_ranges != NULL)
+        error = scan_file_chunked(
+            scanner,
+            filepath,
+            chunk_size,
+            chunk_overlap,
+            file_ranges,
+            num_file_ranges);
+      else
+        error = scan_file_with_options(scanner, filepath, &read_options);
+
+      read_options_destroy(&read_options);
+
+      Py_END_ALLOW_THREADS
+    }
+    else if (data.buf != NULL)
+    {
+      callback_data.matches = PyList_New(0);
+
+      Py_BEGIN_ALLOW_THREADS
+
+      error = yr_scanner_scan_mem(
+          scanner,
+          (unsigned char*) data.buf,
+          (size_t) data.len);
+
+      Py_END_ALLOW_THREADS
+    }
+    else if (pid != -1)
+    {
+      callback_data.matches = PyList_New(0);
+
+      #if defined(__linux__)
+      PROC_MEMORY proc_memory;
+
+      memset(&proc_memory, 0, sizeof(proc_memory));
+
+      if (proc_limits)
+        yr_scanner_set_flags(
+            scanner,
+            SCAN_FLAGS_PROCESS_MEMORY |
+            (fast != NULL && PyObject_IsTrue(fast) == 1 ?
+                SCAN_FLAGS_FAST_MODE : 0));
+      #endif
+
+      Py_BEGIN_ALLOW_THREADS
+
+      #if defined(__linux__)
+      if (proc_limits)
+        error = scan_proc_regions(
+            scanner,
+            pid,
+            PROC_REGIONS_ALL,
+            false,
+            NULL,
+            &proc_options,
+            &proc_memory);
+      else
+      #endif
+        error = yr_scanner_scan_proc(scanner, pid);
+
+      Py_END_ALLOW_THREADS
+
+      #if defined(__linux__)
+      if (want_report && error == ERROR_SUCCESS)
+      {
+        report = proc_region_report(&proc_memory);
+
+        if (report == NULL)
+          Py_CLEAR(callback_data.matches);
+      }
+
+      free(proc_memory.regions);
+      #endif
+    }
+
+    if (callback_data.cancellation_token != NULL)
+    {
+      cancellation_token_unregister(
+          callback_data.cancellation_token, &active_scan);
+
+      if (cancellation_token_aborted(callback_data.cancellation_token, error))
+        callback_data.cancelled = true;
+    }
+
+    if (callback_data.module_views != NULL)
+    {
+      invalidate_object_views(callback_data.module_views);
+      Py_DECREF(callback_data.module_views);
+    }
+
+    Py_XDECREF(callback_data.modules_fields);
+
+    PyBuffer_Release(&data);
+    yr_scanner_destroy(scanner);
+    release_modules_buffers(&callback_data);
+    PyMem_Free(file_ranges);
+
+    if (callback_data.json != NULL &&
+        error == ERROR_SUCCESS &&
+        callback_data.matches != NULL)
+    {
+      JSON_BUFFER document = {0};
+
+      json_append_raw(&document, "{");
+      json_output_finish(&json_output, &document);
+
+      Py_DECREF(callback_data.matches);
+
+      if (document.failed)
+        callback_data.matches = PyErr_NoMemory();
+      else
+        callback_data.matches = PyBytes_FromStringAndSize(
+            document.data, document.length);
+
+      free(document.data);
+    }
+
+    if (callback_data.json != NULL)
+      json_output_destroy(&json_output);
+
+    if (callback_data.table != NULL &&
+        error == ERROR_SUCCESS &&
+        callback_data.matches != NULL)
+    {
+      Py_DECREF(callback_data.matches);
+      callback_data.matches = match_table_new(self, &table_output);
+    }
+
+    if (callback_data.table != NULL)
+      table_output_destroy(&table_output);
+
+    if (cache_key != NULL)
+    {
+      if (error == ERROR_SUCCESS &&
+          callback_data.matches != NULL &&
+          !callback_data.cancelled)
+      {
+        PyObject* copy = result_cache_copy(callback_data.matches);
+        PyObject* result = NULL;
+
+        if (copy != NULL)
+          result = PyObject_CallMethod(cache, "put", "ON", cache_key, copy);
+
+        if (result == NULL)
+          Py_CLEAR(callback_data.matches);
+
+        Py_XDECREF(result);
+      }
+
+      Py_DECREF(cache_key);
+    }
+
+    if (callback_data.cancelled)
+    {
+      Py_XDECREF(callback_data.matches);
+      Py_XDECREF(report);
+      return PyErr_Format(YaraCancelledError, "scanning was cancelled");
+    }
+
+    if (error != ERROR_SUCCESS)
+    {
+      Py_DECREF(callback_data.matches);
+
+      if (error != ERROR_CALLBACK_ERROR)
+      {
+        if (filepath != NULL)
+        {
+          handle_error(error, filepath);
+        }
+        else if (mapped_path != NULL)
+        {
+          handle_error(error, mapped_path);
+        }
+        else if (pid != -1)
+        {
+          handle_error(error, "<proc>");
+        }
+        else
+        {
+          handle_error(error, "<data>");
+        }
+
+        #ifdef PROFILING_ENABLED
+        PyObject* exception = PyErr_Occurred();
+
+        if (exception != NULL && error == ERROR_SCAN_TIMEOUT)
+        {
+          PyObject_SetAttrString(
+              exception,
+              "profiling_info",
+              Rules_profiling_info(self, NULL));
+        }
+        #endif
+      }
+
+      return NULL;
+    }
+  }
+
+  if (report != NULL)
+    return Py_BuildValue("(NN)", callback_data.matches, report);
+
+  return callback_data.matches;
+}
+
+
+static bool write_all(
+    int fd,
+    const char* data,
+    size_t length)
+{
+  while (length > 0)
+  {
+    int written = (int) write(fd, data, (unsigned int) length);
+
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return false;
+    }
+
+    data += written;
+    length -= written;
+  }
+
+  return true;
+}
+
+
+// Scans a list of files and writes one JSON document per line to the given
+// file descriptor. The whole loop runs without the GIL and reuses the same
+// scanner, so this is the cheapest way of producing results for consumers
+// that don't need Python objects. Files that can't be scanned produce a line
+// with an "error" key holding the libyara error code.
+static PyObject* Rules_scan_paths_to_ndjson(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "filepaths", "fd", "externals", "fast", "timeout", "data_encoding",
+      "modules_fields", "read", "read_threshold", "fadvise_dontneed",
+      "prefetch", "prefetch_threads", NULL
+      };
+
+  PyObject* filepaths;
+  PyObject* file;
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
+  PyObject* modules_fields = NULL;
+  PyObject* encoded_paths = NULL;
+  PyObject* result = NULL;
+
+  char* data_encoding = NULL;
+  char* read_strategy = NULL;
+  const char** paths = NULL;
+
+  unsigned long long read_threshold = 1024 * 1024;
+
+  PyObject* fadvise_dontneed = NULL;
+
+  FILE_READ_OPTIONS read_options;
+
+  Py_ssize_t count = 0;
+  Py_ssize_t scanned = 0;
+
+  uint64_t timeout_ns = 0;
+
+  int fd;
+  int json_encoding;
+  int prefetch = 0;
+  int prefetch_threads = 0;
+  bool write_failed = false;
+  bool prefetching = false;
+
+  PREFETCHER prefetcher;
+
+  YR_SCANNER* scanner;
+  CALLBACK_DATA callback_data;
+  JSON_OUTPUT json_output;
+  JSON_BUFFER line = {0};
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "OO|OOOzOzKOii",
+        kwlist,
+        &filepaths,
+        &file,
+        &externals,
+        &fast,
+        &timeout,
+        &data_encoding,
+        &modules_fields,
+        &read_strategy,
+        &read_threshold,
+        &fadvise_dontneed,
+        &prefetch,
+        &prefetch_threads))
+  {
+    return NULL;
+  }
+
+  if (parse_read_options(
+        read_strategy, read_threshold, fadvise_dontneed, &read_options) != 0)
+    return NULL;
+
+  fd = PyObject_AsFileDescriptor(file);
+
+  if (fd < 0)
+    return NULL;
+
+  json_encoding = parse_json_encoding(data_encoding);
+
+  if (json_encoding < 0)
+    return NULL;
+
+  if (parse_timeout(timeout, "timeout", NULL, &timeout_ns) != 0)
+    return NULL;
+
+  memset(&callback_data, 0, sizeof(callback_data));
+
+  callback_data.max_match_data = ((Rules*) self)->max_match_data;
+  callback_data.max_matches_per_string =
+      ((Rules*) self)->max_matches_per_string;
+  callback_data.which = CALLBACK_ALL;
+  callback_data.json = &json_output;
+
+  if (modules_fields != NULL && modules_fields != Py_None)
+  {
+    if (!PyDict_Check(modules_fields))
+      return PyErr_Format(
+          PyExc_TypeError,
+          "'modules_fields' must be a dictionary");
+
+    callback_data.modules_fields = build_modules_fields(modules_fields);
+
+    if (callback_data.modules_fields == NULL)
+      return NULL;
+  }
+
+  // Paths are converted up front, the encoded bytes objects are kept alive
+  // in a list while their buffers are used without the GIL.
+  encoded_paths = PySequence_Fast(filepaths, "'filepaths' must be a sequence");
+
+  if (encoded_paths == NULL)
+    goto _exit;
+
+  count = PySequence_Fast_GET_SIZE(encoded_paths);
+  paths = (const char**) PyMem_Malloc((count + 1) * sizeof(const char*));
+
+  if (paths == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
+  }
+
+  for (Py_ssize_t i = 0; i < count; i++)
+  {
+    PyObject* path = PySequence_Fast_GET_ITEM(encoded_paths, i);
+
+    if (!PY_STRING_CHECK(path))
+    {
+      PyErr_Format(PyExc_TypeError, "'filepaths' must contain strings");
+      goto _exit;
+    }
+
+    paths[i] = PY_STRING_TO_C(path);
+
+    if (paths[i] == NULL)
+      goto _exit;
+  }
+
+  if (yr_scanner_create(((Rules*) self)->rules, &scanner) != ERROR_SUCCESS)
+  {
+    PyErr_Format(PyExc_Exception, "could not create scanner");
+    goto _exit;
+  }
+
+  if (apply_externals(self, scanner, externals) != 0)
+  {
+    yr_scanner_destroy(scanner);
+    goto _exit;
+  }
+
+  if (fast != NULL && PyObject_IsTrue(fast) == 1)
+    yr_scanner_set_flags(scanner, SCAN_FLAGS_FAST_MODE);
+
+  scanner_set_timeout_ns(scanner, timeout_ns);
+  yr_scanner_set_callback(scanner, yara_callback, &callback_data);
+
+  json_output_init(&json_output, json_encoding);
+
+  Py_BEGIN_ALLOW_THREADS
+
+  // With "prefetch" files are read ahead by other threads, if the threads
+  // can't be started the files are simply read here.
+  if (prefetch > 0 && count > 0)
+    prefetching = prefetcher_start(
+        &prefetcher,
+        paths,
+        count,
+        prefetch,
+        prefetch_threads > 0 ? prefetch_threads : yr_min(prefetch, 4),
+        read_threshold);
+
+  for (scanned = 0; scanned < count && !write_failed; scanned++)
+  {
+    int error;
+
+    json_output_reset(&json_output);
+
+    if (prefetching)
+    {
+      PREFETCH_SLOT* slot = prefetcher_wait(&prefetcher, scanned);
+      bool skipped = slot->skipped;
+
+      if (skipped)
+        error = scan_file_with_options(
+            scanner, paths[scanned], &read_options);
+      else if (slot->error != ERROR_SUCCESS)
+        error = slot->error;
+      else
+        error = yr_scanner_scan_mem(scanner, slot->data, slot->size);
+
+      prefetcher_release(&prefetcher, scanned);
+
+      #if defined(POSIX_FADV_DONTNEED)
+      if (read_options.dontneed && !skipped)
+      {
+        int file_fd = open(paths[scanned], O_RDONLY);
+
+        if (file_fd >= 0)
+        {
+          posix_fadvise(file_fd, 0, 0, POSIX_FADV_DONTNEED);
+          close(file_fd);
+        }
+      }
+      #endif
+    }
+    else
+    {
+      error = scan_file_with_options(scanner, paths[scanned], &read_options);
+    }
+
+    line.length = 0;
+
+    json_append_raw(&line, "{\"path\":");
+    json_append_cstring(&line, paths[scanned]);
+    json_append_raw(&line, ",");
+
+    if (error == ERROR_SUCCESS)
+    {
+      json_output_finish(&json_output, &line);
+    }
+    else
+    {
+      json_append_raw(&line, "\"error\":");
+      json_append_int(&line, error);
+      json_append_raw(&line, "}");
+    }
+
+    json_append_raw(&line, "\n");
+
+    if (line.failed || !write_all(fd, line.data, line.length))
+      write_failed = true;
+  }
+
+  if (prefetching)
+    prefetcher_stop(&prefetcher);
+
+  Py_END_ALLOW_THREADS
+
+  json_output_destroy(&json_output);
+  read_options_destroy(&read_options);
+  yr_scanner_destroy(scanner);
+
+  if (line.failed)
+    PyErr_NoMemory();
+  else if (write_failed)
+    PyErr_SetFromErrno(PyExc_OSError);
+  else
+    result = PyLong_FromSsize_t(scanned);
+
+_exit:
+
+  free(line.data);
+  PyMem_Free(paths);
+  Py_XDECREF(encoded_paths);
+  Py_XDECREF(callback_data.modules_fields);
+
+  return result;
+}
+
+
+// Splits a list of matches produced by rules compiled with the "sets"
+// argument of compile() into a dictionary keyed by rule set name.
+static PyObject* Rules_group_matches(
+    PyObject* self,
+    PyObject* matches)
+{
+  Rules* rules = (Rules*) self;
+
+  PyObject* iterator;
+  PyObject* item;
+  PyObject* groups;
+
+  if (rules->rule_sets == NULL)
+    return PyErr_Format(
+        PyExc_TypeError,
+        "these rules were not compiled from rule sets");
+
+  groups = PyDict_New();
+
+  if (groups == NULL)
+    return NULL;
+
+  iterator = PyObject_GetIter(matches);
+
+  if (iterator == NULL)
+  {
+    Py_DECREF(groups);
+    return NULL;
+  }
+
+  while ((item = PyIter_Next(iterator)) != NULL)
+  {
+    PyObject* set_name;
+    PyObject* group;
+
+    if (!PyObject_TypeCheck(item, &Match_Type))
+    {
+      Py_DECREF(item);
+      PyErr_Format(PyExc_TypeError, "expecting a sequence of Match objects");
+      break;
+    }
+
+    set_name = PyDict_GetItem(rules->rule_sets, ((Match*) item)->ns);
+
+    if (set_name == NULL)
+    {
+      Py_DECREF(item);
+      continue;
+    }
+
+    group = PyDict_GetItem(groups, set_name);
+
+    if (group == NULL)
+    {
+      group = PyList_New(0);
+
+      if (group == NULL || PyDict_SetItem(groups, set_name, group) != 0)
+      {
+        Py_XDECREF(group);
+        Py_DECREF(item);
+        break;
+      }
+
+      Py_DECREF(group);
+    }
+
+    if (PyList_Append(group, item) != 0)
+    {
+      Py_DECREF(item);
+      break;
+    }
+
+    Py_DECREF(item);
+  }
+
+  Py_DECREF(iterator);
+
+  if (PyErr_Occurred())
+  {
+    Py_DECREF(groups);
+    return NULL;
+  }
+
+  return groups;
+}
+
+
+static PyObject* Rules_save(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "filepath", "file",  NULL
+      };
+
+  char* filepath = NULL;
+  PyObject* file = NULL;
+  Rules* rules = (Rules*) self;
+
+  int error;
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args,
+      keywords,
+      "|sO",
+      kwlist,
+      &filepath,
+      &file))
+  {
+    return NULL;
+  }
+
+  if (filepath != NULL)
+  {
+    Py_BEGIN_ALLOW_THREADS
+    error = yr_rules_save(rules->rules, filepath);
+    Py_END_ALLOW_THREADS
+
+    if (error != ERROR_SUCCESS)
+      return handle_error(error, filepath);
+  }
+  else if (file != NULL && PyObject_HasAttrString(file, "write"))
+  {
+    YR_STREAM stream;
+
+    stream.user_data = file;
+    stream.write = flo_write;
+
+    Py_BEGIN_ALLOW_THREADS;
+    error = yr_rules_save_stream(rules->rules, &stream);
+    Py_END_ALLOW_THREADS;
+
+    if (error != ERROR_SUCCESS)
+      return handle_error(error, "<file-like-object>");
+  }
+  else
+  {
+    return PyErr_Format(
+      PyExc_TypeError,
+      "load() expects either a file path or a file-like object");
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+// Limits set here apply to the scans performed with these rules only, as
+// opposed to yara.set_config, which changes them for the whole process. They
+// can't go beyond the global limits, as libyara enforces those while
+// scanning, but they avoid converting the data in excess to Python objects.
+// Note that they don't reduce the memory used by the scan itself: libyara
+// keeps copying up to YR_CONFIG_MAX_MATCH_DATA bytes for every match.
+static PyObject* Rules_set_config(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char *kwlist[] = {
+    "max_match_data", "max_matches_per_string", NULL};
+
+  Rules* rules = (Rules*) self;
+
+  unsigned int max_match_data = rules->max_match_data;
+  unsigned int max_matches_per_string = rules->max_matches_per_string;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "|II",
+        kwlist,
+        &max_match_data,
+        &max_matches_per_string))
+  {
+    return NULL;
+  }
+
+  rules->max_match_data = max_match_data;
+  rules->max_matches_per_string = max_matches_per_string;
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject* Rules_profiling_info(
+    PyObject* self,
+    PyObject* args)
+{
+
+#ifdef PROFILING_ENABLED
+  PyObject* object;
+  PyObject* result;
+
+  YR_RULES* rules = ((Rules*) self)->rules;
+  YR_RULE* rule;
+  YR_STRING* string;
+
+  char key[512];
+  uint64_t clock_ticks;
+
+  result = PyDict_New();
+
+  yr_rules_foreach(rules, rule)
+  {
+    clock_ticks = rule->clock_ticks;
+
+    yr_rule_strings_foreach(rule, string)
+    {
+      clock_ticks += string->clock_ticks;
+    }
+
+    snprintf(key, sizeof(key), "%s:%s", rule->ns->name, rule->identifier);
+
+    object = PyLong_FromLongLong(clock_ticks);
+    PyDict_SetItemString(result, key, object);
+    Py_DECREF(object);
+  }
+
+  return result;
+#else
+  return PyErr_Format(YaraError, "libyara compiled without profiling support");
+#endif
+}
+
+
+// Atoms are not stored as such in compiled rules, they are the paths in the
+// Aho-Corasick automaton leading to states that have matches. Rules_atoms
+// walks the goto transitions of the automaton from the root state and
+// collects, for each state, the matches that belong to that state and not to
+// the states reachable through its failure link, which are appended at the
+// end of the state's match list.
+
+typedef struct _ATOM_RECORD
+{
+  uint32_t string_idx;
+  uint32_t seq;
+  uint16_t backtrack;
+  uint8_t length;
+  uint8_t bytes[YR_MAX_ATOM_LENGTH];
+
+} ATOM_RECORD;
+
+
+typedef struct _ATOM_RECORDS
+{
+  ATOM_RECORD* items;
+  size_t count;
+  size_t capacity;
+
+} ATOM_RECORDS;
+
+
+static int atom_records_append(
+    ATOM_RECORDS* records,
+    YR_AC_MATCH* match,
+    const uint8_t* path,
+    int depth)
+{
+  if (records->count == records->capacity)
+  {
+    size_t capacity = records->capacity == 0 ? 256 : records->capacity * 2;
+    ATOM_RECORD* items = (ATOM_RECORD*) realloc(
+        records->items, capacity * sizeof(ATOM_RECORD));
+
+    if (items == NULL)
+      return ERROR_INSUFFICIENT_MEMORY;
+
+    records->items = items;
+    records->capacity = capacity;
+  }
+
+  ATOM_RECORD* record = &records->items[records->count];
+
+  record->string_idx = match->string->idx;
+  record->seq = (uint32_t) records->count;
+  record->backtrack = match->backtrack;
+  record->length = (uint8_t) depth;
+
+  memcpy(record->bytes, path, depth);
+  records->count++;
+
+  return ERROR_SUCCESS;
+}
+
+
+static int collect_atoms(
+    YR_RULES* rules,
+    uint32_t state,
+    uint8_t* path,
+    int depth,
+    ATOM_RECORDS* records)
+{
+  YR_AC_TRANSITION* transition_table = rules->ac_transition_table;
+  uint32_t* match_table = rules->ac_match_table;
+
+  YR_AC_MATCH* match = NULL;
+  YR_AC_MATCH* failure_matches = NULL;
+
+  if (match_table[state] != 0)
+    match = &rules->ac_match_pool[match_table[state] - 1];
+
+  if (state != YR_AC_ROOT_STATE)
+  {
+    uint32_t failure = YR_AC_NEXT_STATE(transition_table[state]);
+
+    if (match_table[failure] != 0)
+      failure_matches = &rules->ac_match_pool[match_table[failure] - 1];
+  }
+
+  while (match != NULL && match != failure_matches)
+  {
+    if (atom_records_append(records, match, path, depth) != ERROR_SUCCESS)
+      return ERROR_INSUFFICIENT_MEMORY;
+
+    match = match->next;
+  }
+
+  if (depth == YR_MAX_ATOM_LENGTH)
+    return ERROR_SUCCESS;
+
+  for (int c = 0; c < 256; c++)
+  {
+    YR_AC_TRANSITION transition = transition_table[state + c + 1];
+
+    if (YR_AC_INVALID_TRANSITION(transition, c + 1))
+      continue;
+
+    path[depth] = (uint8_t) c;
+
+    int error = collect_atoms(
+        rules, YR_AC_NEXT_STATE(transition), path, depth + 1, records);
+
+    if (error != ERROR_SUCCESS)
+      return error;
+  }
+
+  return ERROR_SUCCESS;
+}
+
+
+static int compare_atom_records(
+    const void* a,
+    const void* b)
+{
+  const ATOM_RECORD* r1 = (const ATOM_RECORD*) a;
+  const ATOM_RECORD* r2 = (const ATOM_RECORD*) b;
+
+  if (r1->string_idx != r2->string_idx)
+    return r1->string_idx < r2->string_idx ? -1 : 1;
+
+  return r1->seq < r2->seq ? -1 : (r1->seq > r2->seq);
+}
+
+
+static PyObject* string_atoms_new(
+    YR_RULES* rules,
+    YR_STRING* string,
+    ATOM_RECORD* records,
+    size_t count)
+{
+  YR_RULE* rule = &rules->rules_table[string->rule_idx];
+
+  size_t atoms_size = 0;
+
+  for (size_t i = 0; i < count; i++)
+    atoms_size += records[i].length;
+
+  PyObject* atoms = PyBytes_FromStringAndSize(NULL, atoms_size);
+  PyObject* lengths = PyBytes_FromStringAndSize(NULL, count);
+  PyObject* backtracks = PyBytes_FromStringAndSize(
+      NULL, count * sizeof(uint16_t));
+
+  if (atoms == NULL || lengths == NULL || backtracks == NULL)
+  {
+    Py_XDECREF(atoms);
+    Py_XDECREF(lengths);
+    Py_XDECREF(backtracks);
+    return NULL;
+  }
+
+  uint8_t* atoms_ptr = (uint8_t*) PyBytes_AS_STRING(atoms);
+  uint8_t* lengths_ptr = (uint8_t*) PyBytes_AS_STRING(lengths);
+  uint16_t* backtracks_ptr = (uint16_t*) PyBytes_AS_STRING(backtracks);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    memcpy(atoms_ptr, records[i].bytes, records[i].length);
+    atoms_ptr += records[i].length;
+    lengths_ptr[i] = records[i].length;
+    backtracks_ptr[i] = records[i].backtrack;
+  }
+
+  // Expose backtracks as a typed view so that they can be used directly with
+  // array.array, numpy.frombuffer, etc.
+  PyObject* view = PyMemoryView_FromObject(backtracks);
+  Py_DECREF(backtracks);
+
+  backtracks = view != NULL
+      ? PyObject_CallMethod(view, "cast", "s", "H")
+      : NULL;
+
+  Py_XDECREF(view);
+
+  PyObject* result = PyStructSequence_New(&StringAtoms_Type);
+
+  if (result == NULL || backtracks == NULL)
+  {
+    Py_XDECREF(result);
+    Py_DECREF(atoms);
+    Py_DECREF(lengths);
+    Py_XDECREF(backtracks);
+    return NULL;
+  }
+
+  PyStructSequence_SET_ITEM(result, 0, PY_STRING(rule->ns->name));
+  PyStructSequence_SET_ITEM(result, 1, PY_STRING(rule->identifier));
+  PyStructSequence_SET_ITEM(result, 2, PY_STRING(string->identifier));
+  PyStructSequence_SET_ITEM(result, 3, atoms);
+  PyStructSequence_SET_ITEM(result, 4, lengths);
+  PyStructSequence_SET_ITEM(result, 5, backtracks);
+
+  return result;
+}
+
+
+// Collects the atoms for all the strings in the rules, sorted by string
+// index. This doesn't touch any Python object and can be called without
+// holding the GIL.
+static int rules_collect_atoms(
+    YR_RULES* rules,
+    ATOM_RECORDS* records)
+{
+  uint8_t path[YR_MAX_ATOM_LENGTH];
+
+  int error = collect_atoms(rules, YR_AC_ROOT_STATE, path, 0, records);
+
+  if (error == ERROR_SUCCESS && records->count > 0)
+    qsort(
+        records->items,
+        records->count,
+        sizeof(ATOM_RECORD),
+        compare_atom_records);
+
+  return error;
+}
+
+
+static PyObject* Rules_atoms(
+    PyObject* self,
+    PyObject* args)
+{
+  YR_RULES* rules = ((Rules*) self)->rules;
+  ATOM_RECORDS records = {0};
+
+  int error;
+
+  Py_BEGIN_ALLOW_THREADS
+  error = rules_collect_atoms(rules, &records);
+  Py_END_ALLOW_THREADS
+
+  if (error != ERROR_SUCCESS)
+  {
+    free(records.items);
+    return handle_error(error, NULL);
+  }
+
+  PyObject* result = PyList_New(rules->num_strings);
+
+  if (result == NULL)
+  {
+    free(records.items);
+    return NULL;
+  }
+
+  size_t r = 0;
+
+  for (uint32_t i = 0; i < rules->num_strings; i++)
+  {
+    size_t first = r;
+
+    while (r < records.count && records.items[r].string_idx == i)
+      r++;
+
+    PyObject* string_atoms = string_atoms_new(
+        rules, &rules->strings_table[i], &records.items[first], r - first);
+
+    if (string_atoms == NULL)
+    {
+      Py_DECREF(result);
+      free(records.items);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(result, i, string_atoms);
+  }
+
+  free(records.items);
+
+  return result;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+#define INDEX_ALIGN(x) (((x) + 7) & ~((uint64_t) 7))
+
+
+static int compare_uint32(
+    const void* a,
+    const void* b)
+{
+  uint32_t x = *(const uint32_t*) a;
+  uint32_t y = *(const uint32_t*) b;
+
+  return x < y ? -1 : (x > y);
+}
+
+
+static int compare_uint64(
+    const void* a,
+    const void* b)
+{
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+
+  return x < y ? -1 : (x > y);
+}
+
+
+// Appends to "pairs" one (gram << 32 | file_id) item for each distinct gram
+// in the given data.
+static int index_add_file_grams(
+    const uint8_t* data,
+    size_t size,
+    uint32_t file_id,
+    uint64_t** pairs,
+    size_t* num_pairs,
+    size_t* capacity)
+{
+  if (size < INDEX_GRAM_LENGTH)
+    return ERROR_SUCCESS;
+
+  size_t count = size - INDEX_GRAM_LENGTH + 1;
+  uint32_t* grams = (uint32_t*) malloc(count * sizeof(uint32_t));
+
+  if (grams == NULL)
+    return ERROR_INSUFFICIENT_MEMORY;
+
+  uint32_t gram = ((uint32_t) data[0] << 16) |
+                  ((uint32_t) data[1] << 8) |
+                  ((uint32_t) data[2]);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    gram = (gram << 8) | data[i + INDEX_GRAM_LENGTH - 1];
+    grams[i] = gram;
+  }
+
+  qsort(grams, count, sizeof(uint32_t), compare_uint32);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (i > 0 && grams[i] == grams[i - 1])
+      continue;
+
+    if (*num_pairs == *capacity)
+    {
+      size_t new_capacity = *capacity == 0 ? 65536 : *capacity * 2;
+      uint64_t* new_pairs = (uint64_t*) realloc(
+          *pairs, new_capacity * sizeof(uint64_t));
+
+      if (new_pairs == NULL)
+      {
+        free(grams);
+        return ERROR_INSUFFICIENT_MEMORY;
+      }
+
+      *pairs = new_pairs;
+      *capacity = new_capacity;
+    }
+
+    (*pairs)[(*num_pairs)++] = ((uint64_t) grams[i] << 32) | file_id;
+  }
+
+  free(grams);
+
+  return ERROR_SUCCESS;
+}
+
+
+static int index_write_padding(
+    FILE* fh,
+    uint64_t* offset)
+{
+  static const uint8_t zeroes[8] = {0};
+  uint64_t padding = INDEX_ALIGN(*offset) - *offset;
+
+  if (padding > 0 && fwrite(zeroes, 1, padding, fh) != padding)
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  *offset += padding;
+
+  return ERROR_SUCCESS;
+}
+
+
+static int index_write(
+    const char* index_path,
+    const char** paths,
+    uint32_t num_files,
+    const uint64_t* pairs,
+    size_t num_pairs)
+{
+  INDEX_HEADER header;
+  uint64_t offset;
+  uint64_t path_offset = 0;
+  uint32_t num_grams = 0;
+
+  for (size_t i = 0; i < num_pairs; i++)
+    if (i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32))
+      num_grams++;
+
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.num_files = num_files;
+  header.num_grams = num_grams;
+  header.num_postings = num_pairs;
+  header.paths_offset = INDEX_ALIGN(sizeof(INDEX_HEADER));
+
+  uint64_t paths_size = (num_files + 1) * sizeof(uint64_t);
+
+  for (uint32_t i = 0; i < num_files; i++)
+    paths_size += strlen(paths[i]);
+
+  header.grams_offset = INDEX_ALIGN(header.paths_offset + paths_size);
+  header.starts_offset = INDEX_ALIGN(
+      header.grams_offset + num_grams * sizeof(uint32_t));
+  header.postings_offset = INDEX_ALIGN(
+      header.starts_offset + (num_grams + 1) * sizeof(uint64_t));
+
+  FILE* fh = fopen(index_path, "wb");
+
+  if (fh == NULL)
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  int error = ERROR_SUCCESS;
+
+  if (fwrite(&header, sizeof(header), 1, fh) != 1)
+    error = ERROR_COULD_NOT_OPEN_FILE;
+
+  offset = sizeof(header);
+
+  if (error == ERROR_SUCCESS)
+    error = index_write_padding(fh, &offset);
+
+  for (uint32_t i = 0; i <= num_files && error == ERROR_SUCCESS; i++)
+  {
+    if (fwrite(&path_offset, sizeof(path_offset), 1, fh) != 1)
+      error = ERROR_COULD_NOT_OPEN_FILE;
+
+    if (i < num_files)
+      path_offset += strlen(paths[i]);
+  }
+
+  for (uint32_t i = 0; i < num_files && error == ERROR_SUCCESS; i++)
+  {
+    size_t length = strlen(paths[i]);
+
+    if (fwrite(paths[i], 1, length, fh) != length)
+      error = ERROR_COULD_NOT_OPEN_FILE;
+  }
+
+  offset = header.paths_offset + paths_size;
+
+  if (error == ERROR_SUCCESS)
+    error = index_write_padding(fh, &offset);
+
+  for (size_t i = 0; i < num_pairs && error == ERROR_SUCCESS; i++)
+  {
+    uint32_t gram = (uint32_t) (pairs[i] >> 32);
+
+    if (i > 0 && gram == (uint32_t) (pairs[i - 1] >> 32))
+      continue;
+
+    if (fwrite(&gram, sizeof(gram), 1, fh) != 1)
+      error = ERROR_COULD_NOT_OPEN_FILE;
+  }
+
+  offset = header.grams_offset + num_grams * sizeof(uint32_t);
+
+  if (error == ERROR_SUCCESS)
+    error = index_write_padding(fh, &offset);
+
+  for (size_t i = 0; i <= num_pairs && error == ERROR_SUCCESS; i++)
+  {
+    uint64_t start = i;
+
+    if (i > 0 && i < num_pairs && (pairs[i] >> 32) == (pairs[i - 1] >> 32))
+      continue;
+
+    if (fwrite(&start, sizeof(start), 1, fh) != 1)
+      error = ERROR_COULD_NOT_OPEN_FILE;
+  }
+
+  offset = header.starts_offset + (num_grams + 1) * sizeof(uint64_t);
+
+  if (error == ERROR_SUCCESS)
+    error = index_write_padding(fh, &offset);
+
+  for (size_t i = 0; i < num_pairs && error == ERROR_SUCCESS; i++)
+  {
+    uint32_t file_id = (uint32_t) pairs[i];
+
+    if (fwrite(&file_id, sizeof(file_id), 1, fh) != 1)
+      error = ERROR_COULD_NOT_OPEN_FILE;
+  }
+
+  if (fclose(fh) != 0 && error == ERROR_SUCCESS)
+    error = ERROR_COULD_NOT_OPEN_FILE;
+
+  return error;
+}
+
+
+static PyObject* yara_build_index(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "filepaths", "index_path", NULL
+      };
+
+  PyObject* filepaths = NULL;
+  char* index_path = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args,
+      keywords,
+      "Os",
+      kwlist,
+      &filepaths,
+      &index_path))
+  {
+    return NULL;
+  }
+
+  PyObject* paths_tuple = PySequence_Tuple(filepaths);
+
+  if (paths_tuple == NULL)
+    return NULL;
+
+  Py_ssize_t num_files = PyTuple_GET_SIZE(paths_tuple);
+
+  if (num_files > UINT32_MAX)
+  {
+    Py_DECREF(paths_tuple);
+    return PyErr_Format(PyExc_ValueError, "too many files for a single index");
+  }
+
+  const char** paths = (const char**) calloc(
+      num_files + 1, sizeof(const char*));
+
+  if (paths == NULL)
+  {
+    Py_DECREF(paths_tuple);
+    return PyErr_NoMemory();
+  }
+
+  for (Py_ssize_t i = 0; i < num_files; i++)
+  {
+    PyObject* path = PyTuple_GET_ITEM(paths_tuple, i);
+
+    if (!PY_STRING_CHECK(path) || (paths[i] = PY_STRING_TO_C(path)) == NULL)
+    {
+      free(paths);
+      Py_DECREF(paths_tuple);
+      return PyErr_Format(
+          PyExc_TypeError,
+          "'filepaths' must be a sequence of strings");
+    }
+  }
+
+  uint64_t* pairs = NULL;
+  size_t num_pairs = 0;
+  size_t capacity = 0;
+  Py_ssize_t failed = -1;
+
+  int error = ERROR_SUCCESS;
+
+  Py_BEGIN_ALLOW_THREADS
+
+  for (Py_ssize_t i = 0; i < num_files && error == ERROR_SUCCESS; i++)
+  {
+    YR_MAPPED_FILE mapped_file;
+
+    error = yr_filemap_map(paths[i], &mapped_file);
+
+    if (error == ERROR_SUCCESS)
+    {
+      error = index_add_file_grams(
+          mapped_file.data,
+          mapped_file.size,
+          (uint32_t) i,
+          &pairs,
+          &num_pairs,
+          &capacity);
+
+      yr_filemap_unmap(&mapped_file);
+    }
+
+    if (error != ERROR_SUCCESS)
+      failed = i;
+  }
+
+  if (error == ERROR_SUCCESS)
+  {
+    if (num_pairs > 0)
+      qsort(pairs, num_pairs, sizeof(uint64_t), compare_uint64);
+
+    error = index_write(
+        index_path, paths, (uint32_t) num_files, pairs, num_pairs);
+  }
+
+  Py_END_ALLOW_THREADS
+
+  free(pairs);
+
+  PyObject* result = NULL;
+
+  if (error == ERROR_SUCCESS)
+  {
+    result = Py_None;
+    Py_INCREF(result);
+  }
+  else if (failed >= 0)
+  {
+    handle_error(error, (char*) paths[failed]);
+  }
+  else
+  {
+    handle_error(error, index_path);
+  }
+
+  free(paths);
+  Py_DECREF(paths_tuple);
+
+  return result;
+}
+
+
+// Returns true if a section of "count" items of "item_size" bytes starting at
+// "offset" is aligned and fits in a file of "size" bytes.
+static bool index_section_fits(
+    uint64_t offset,
+    uint64_t count,
+    uint64_t item_size,
+    size_t size)
+{
+  return offset % 8 == 0 &&
+         offset <= size &&
+         count <= (size - offset) / item_size;
+}
+
+
+// Checks that an index file is well formed, so that looking it up can't
+// read out of bounds. Besides the section bounds it checks that the grams
+// are sorted, that the postings offsets are monotonic and within the
+// postings section, and that every posting list is sorted and only refers
+// to existing files, as lookups rely on binary searches.
+static bool index_validate(
+    const uint8_t* base,
+    size_t size)
+{
+  const INDEX_HEADER* header = (const INDEX_HEADER*) base;
+
+  if (size < sizeof(INDEX_HEADER) ||
+      memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != INDEX_VERSION)
+    return false;
+
+  uint64_t num_files = header->num_files;
+  uint64_t num_grams = header->num_grams;
+  uint64_t num_postings = header->num_postings;
+
+  if (!index_section_fits(
+          header->paths_offset, num_files + 1, sizeof(uint64_t), size) ||
+      !index_section_fits(
+          header->grams_offset, num_grams, sizeof(uint32_t), size) ||
+      !index_section_fits(
+          header->starts_offset, num_grams + 1, sizeof(uint64_t), size) ||
+      !index_section_fits(
+          header->postings_offset, num_postings, sizeof(uint32_t), size))
+    return false;
+
+  const uint64_t* path_offsets = (const uint64_t*) (
+      base + header->paths_offset);
+
+  uint64_t path_data = header->paths_offset +
+      (num_files + 1) * sizeof(uint64_t);
+
+  for (uint64_t i = 0; i < num_files; i++)
+  {
+    if (path_offsets[i] > path_offsets[i + 1])
+      return false;
+  }
+
+  if (path_offsets[0] != 0 || path_offsets[num_files] > size - path_data)
+    return false;
+
+  const uint32_t* grams = (const uint32_t*) (base + header->grams_offset);
+  const uint64_t* starts = (const uint64_t*) (base + header->starts_offset);
+  const uint32_t* postings = (const uint32_t*) (
+      base + header->postings_offset);
+
+  for (uint64_t i = 1; i < num_grams; i++)
+  {
+    if (grams[i - 1] >= grams[i])
+      return false;
+  }
+
+  if (starts[0] != 0 || starts[num_grams] != num_postings)
+    return false;
+
+  for (uint64_t i = 0; i < num_grams; i++)
+  {
+    if (starts[i] > starts[i + 1])
+      return false;
+
+    for (uint64_t j = starts[i]; j < starts[i + 1]; j++)
+    {
+      if (postings[j] >= num_files ||
+          (j > starts[i] && postings[j - 1] >= postings[j]))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+
+static PyObject* yara_load_index(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "index_path", NULL
+      };
+
+  char* index_path = NULL;
+
+  int error;
+
+  if (!PyArg_ParseTupleAndKeywords(
+      args,
+      keywords,
+      "s",
+      kwlist,
+      &index_path))
+  {
+    return NULL;
+  }
+
+  Index* index = PyObject_NEW(Index, &Index_Type);
+
+  if (index == NULL)
+    return PyErr_NoMemory();
+
+  index->filepaths = NULL;
+  index->header = NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  error = yr_filemap_map(index_path, &index->mapped_file);
+  Py_END_ALLOW_THREADS
+
+  if (error != ERROR_SUCCESS)
+  {
+    Py_DECREF(index);
+    return handle_error(error, index_path);
+  }
+
+  const uint8_t* base = index->mapped_file.data;
+  size_t size = index->mapped_file.size;
+
+  const INDEX_HEADER* header = (const INDEX_HEADER*) base;
+
+  bool valid;
+
+  Py_BEGIN_ALLOW_THREADS
+  valid = index_validate(base, size);
+  Py_END_ALLOW_THREADS
+
+  if (!valid)
+  {
+    yr_filemap_unmap(&index->mapped_file);
+    Py_DECREF(index);
+    return handle_error(ERROR_INVALID_FILE, index_path);
+  }
+
+  index->header = header;
+  index->grams = (const uint32_t*) (base + header->grams_offset);
+  index->starts = (const uint64_t*) (base + header->starts_offset);
+  index->postings = (const uint32_t*) (base + header->postings_offset);
+
+  const uint64_t* path_offsets = (const uint64_t*) (
+      base + header->paths_offset);
+
+  const char* path_data = (const char*) (
+      path_offsets + header->num_files + 1);
+
+  index->filepaths = PyList_New(header->num_files);
+
+  if (index->filepaths == NULL)
+  {
+    Py_DECREF(index);
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < header->num_files; i++)
+  {
+    PyObject* path = PyUnicode_DecodeUTF8(
+        path_data + path_offsets[i],
+        path_offsets[i + 1] - path_offsets[i],
+        "surrogateescape");
+
+    if (path == NULL)
+    {
+      Py_DECREF(index);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(index->filepaths, i, path);
+  }
+
+  return (PyObject*) index;
+}
+
+
+static void Index_dealloc(
+    PyObject* self)
+{
+  Index* index = (Index*) self;
+
+  Py_XDECREF(index->filepaths);
+
+  if (index->header != NULL)
+    yr_filemap_unmap(&index->mapped_file);
+
+  PyObject_Del(self);
+}
+
+
+// Returns the sorted list of files containing the given gram.
+static const uint32_t* index_lookup(
+    Index* index,
+    uint32_t gram,
+    size_t* count)
+{
+  uint32_t lo = 0;
+  uint32_t hi = index->header->num_grams;
+
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (index->grams[mid] < gram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == index->header->num_grams || index->grams[lo] != gram)
+  {
+    *count = 0;
+    return NULL;
+  }
+
+  *count = index->starts[lo + 1] - index->starts[lo];
+
+  return index->postings + index->starts[lo];
+}
+
+
+static bool postings_contain(
+    const uint32_t* postings,
+    size_t count,
+    uint32_t file_id)
+{
+  size_t lo = 0;
+  size_t hi = count;
+
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (postings[mid] < file_id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo < count && postings[lo] == file_id;
+}
+
+
+// Per-file counters used by index_rule_candidates. Instead of clearing them
+// for every string and rule, entries are valid only if their stamp matches
+// the current string or rule epoch, so the cost of evaluating a rule depends
+// on the number of files its atoms appear in, not on the size of the index.
+typedef struct _INDEX_MARKS
+{
+  uint32_t* string_stamps;
+  uint32_t* rule_stamps;
+  uint32_t* counts;
+  uint32_t* touched;
+  uint32_t num_touched;
+  uint32_t string_epoch;
+  uint32_t rule_epoch;
+  uint32_t num_files;
+
+} INDEX_MARKS;
+
+
+static bool index_marks_init(
+    INDEX_MARKS* marks,
+    uint32_t num_files)
+{
+  size_t n = (size_t) num_files + 1;
+
+  memset(marks, 0, sizeof(INDEX_MARKS));
+
+  marks->num_files = num_files;
+  marks->string_stamps = (uint32_t*) calloc(n, sizeof(uint32_t));
+  marks->rule_stamps = (uint32_t*) calloc(n, sizeof(uint32_t));
+  marks->counts = (uint32_t*) calloc(n, sizeof(uint32_t));
+  marks->touched = (uint32_t*) calloc(n, sizeof(uint32_t));
+
+  return marks->string_stamps != NULL &&
+         marks->rule_stamps != NULL &&
+         marks->counts != NULL &&
+         marks->touched != NULL;
+}
+
+
+static void index_marks_destroy(
+    INDEX_MARKS* marks)
+{
+  free(marks->string_stamps);
+  free(marks->rule_stamps);
+  free(marks->counts);
+  free(marks->touched);
+}
+
+
+// Advances an epoch, clearing the stamps when it wraps around.
+static void index_marks_next_epoch(
+    uint32_t* epoch,
+    uint32_t* stamps,
+    uint32_t num_files)
+{
+  if (++(*epoch) == 0)
+  {
+    memset(stamps, 0, ((size_t) num_files + 1) * sizeof(uint32_t));
+    *epoch = 1;
+  }
+}
+
+
+// Counts a match of the current string in a file, at most once per string.
+static void index_marks_add(
+    INDEX_MARKS* marks,
+    uint32_t file_id)
+{
+  if (marks->string_stamps[file_id] == marks->string_epoch)
+    return;
+
+  marks->string_stamps[file_id] = marks->string_epoch;
+
+  if (marks->rule_stamps[file_id] != marks->rule_epoch)
+  {
+    marks->rule_stamps[file_id] = marks->rule_epoch;
+    marks->counts[file_id] = 0;
+    marks->touched[marks->num_touched++] = file_id;
+  }
+
+  marks->counts[file_id]++;
+}
+
+
+// Counts the current string in the files that contain every gram of the
+// atom, which must be at least INDEX_GRAM_LENGTH bytes long.
+static void index_mark_atom(
+    Index* index,
+    ATOM_RECORD* atom,
+    INDEX_MARKS* marks)
+{
+  const uint32_t* postings[YR_MAX_ATOM_LENGTH];
+  size_t counts[YR_MAX_ATOM_LENGTH];
+  int num_windows = 0;
+
+  for (int i = 0; i + INDEX_GRAM_LENGTH <= atom->length; i++)
+  {
+    uint32_t gram = ((uint32_t) atom->bytes[i] << 24) |
+                    ((uint32_t) atom->bytes[i + 1] << 16) |
+                    ((uint32_t) atom->bytes[i + 2] << 8) |
+                    ((uint32_t) atom->bytes[i + 3]);
+
+    postings[num_windows] = index_lookup(index, gram, &counts[num_windows]);
+
+    if (counts[num_windows] == 0)
+      return;
+
+    num_windows++;
+  }
+
+  for (size_t i = 0; i < counts[0]; i++)
+  {
+    bool all = true;
+
+    for (int w = 1; w < num_windows && all; w++)
+      all = postings_contain(postings[w], counts[w], postings[0][i]);
+
+    if (all)
+      index_marks_add(marks, postings[0][i]);
+  }
+}
+
+
+// A rule can match a file only if at least rule->required_strings of its
+// strings can match, and a string can match only if the file contains at
+// least one of its atoms. Atoms shorter than the indexed grams can't be
+// ruled out, so they make the string a candidate in every file. Returns the
+// number of such strings, the files where other strings can match are left
+// sorted in marks->touched, with their number of strings in marks->counts.
+static uint32_t index_rule_candidates(
+    Index* index,
+    YR_RULE* rule,
+    ATOM_RECORDS* atoms,
+    size_t* atoms_start,
+    INDEX_MARKS* marks)
+{
+  YR_STRING* string;
+  uint32_t any_file_strings = 0;
+
+  index_marks_next_epoch(
+      &marks->rule_epoch, marks->rule_stamps, marks->num_files);
+
+  marks->num_touched = 0;
+
+  yr_rule_strings_foreach(rule, string)
+  {
+    size_t first = atoms_start[string->idx];
+    size_t last = atoms_start[string->idx + 1];
+    bool any_file = first == last;
+
+    for (size_t i = first; i < last && !any_file; i++)
+      any_file = atoms->items[i].length < INDEX_GRAM_LENGTH;
+
+    if (any_file)
+    {
+      any_file_strings++;
+      continue;
+    }
+
+    index_marks_next_epoch(
+        &marks->string_epoch, marks->string_stamps, marks->num_files);
+
+    for (size_t i = first; i < last; i++)
+      index_mark_atom(index, &atoms->items[i], marks);
+  }
+
+  qsort(
+      marks->touched,
+      marks->num_touched,
+      sizeof(uint32_t),
+      compare_uint32);
+
+  return any_file_strings;
+}
+
+
+static PyObject* Rules_candidates(
+    PyObject* self,
+    PyObject* args)
+{
+  YR_RULES* rules = ((Rules*) self)->rules;
+  YR_RULE* rule;
+
+  PyObject* indexes = NULL;
+  PyObject* result = NULL;
+
+  ATOM_RECORDS atoms = {0};
+  size_t* atoms_start = NULL;
+
+  int error;
+
+  if (!PyArg_ParseTuple(args, "O", &indexes))
+    return NULL;
+
+  if (PyObject_TypeCheck(indexes, &Index_Type))
+    indexes = PyTuple_Pack(1, indexes);
+  else
+    indexes = PySequence_Tuple(indexes);
+
+  if (indexes == NULL)
+    return NULL;
+
+  for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(indexes); i++)
+  {
+    if (!PyObject_TypeCheck(PyTuple_GET_ITEM(indexes, i), &Index_Type))
+    {
+      Py_DECREF(indexes);
+      return PyErr_Format(
+          PyExc_TypeError,
+          "candidates() expects an Index or a sequence of Index objects");
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  error = rules_collect_atoms(rules, &atoms);
+  Py_END_ALLOW_THREADS
+
+  if (error != ERROR_SUCCESS)
+  {
+    handle_error(error, NULL);
+    goto _exit;
+  }
+
+  atoms_start = (size_t*) calloc(rules->num_strings + 1, sizeof(size_t));
+
+  if (atoms_start == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
+  }
+
+  for (size_t i = 0, s = 0; s <= rules->num_strings; s++)
+  {
+    while (i < atoms.count && atoms.items[i].string_idx < s)
+      i++;
+
+    atoms_start[s] = i;
+  }
+
+  result = PyDict_New();
+
+  if (result == NULL)
+    goto _exit;
+
+  for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(indexes); i++)
+  {
+    Index* index = (Index*) PyTuple_GET_ITEM(indexes, i);
+    uint32_t num_files = index->header->num_files;
+
+    INDEX_MARKS marks;
+
+    if (!index_marks_init(&marks, num_files))
+    {
+      index_marks_destroy(&marks);
+      Py_CLEAR(result);
+      PyErr_NoMemory();
+      goto _exit;
+    }
+
+    yr_rules_foreach(rules, rule)
+    {
+      char key[512];
+
+      if (rule->flags & RULE_FLAGS_PRIVATE)
+        continue;
+
+      uint32_t any_file_strings;
+
+      Py_BEGIN_ALLOW_THREADS
+      any_file_strings = index_rule_candidates(
+          index, rule, &atoms, atoms_start, &marks);
+      Py_END_ALLOW_THREADS
+
+      snprintf(key, sizeof(key), "%s:%s", rule->ns->name, rule->identifier);
+
+      PyObject* files = PyDict_GetItemString(result, key);
+
+      if (files == NULL)
+      {
+        files = PyList_New(0);
+
+        if (files == NULL || PyDict_SetItemString(result, key, files) != 0)
+        {
+          Py_XDECREF(files);
+          Py_CLEAR(result);
+          break;
+        }
+
+        Py_DECREF(files);
+      }
+
+      if (any_file_strings >= (uint32_t) rule->required_strings)
+      {
+        for (uint32_t f = 0; f < num_files; f++)
+        {
+          if (PyList_Append(files, PyList_GET_ITEM(index->filepaths, f)) != 0)
+          {
+            Py_CLEAR(result);
+            break;
+          }
+        }
+      }
+      else
+      {
+        for (uint32_t t = 0; t < marks.num_touched; t++)
+        {
+          uint32_t f = marks.touched[t];
+
+          if (marks.counts[f] + any_file_strings >=
+                  (uint32_t) rule->required_strings &&
+              PyList_Append(files, PyList_GET_ITEM(index->filepaths, f)) != 0)
+          {
+            Py_CLEAR(result);
+            break;
+          }
+        }
+      }
+
+      if (result == NULL)
+        break;
+    }
+
+    index_marks_destroy(&marks);
+
+    if (result == NULL)
+      break;
+  }
+
+_exit:
+
+  free(atoms.items);
+  free(atoms_start);
+  Py_DECREF(indexes);
+
+  return result;
+}
+
+
+static PyObject* Rules_get_rule_names(
+    PyObject* self,
+    void* closure)
+{
+  Rules* object = (Rules*) self;
+
+  if (object->rule_names == NULL)
+  {
+    YR_RULES* rules = object->rules;
+    PyObject* names = PyTuple_New(rules->num_rules);
+
+    if (names == NULL)
+      return NULL;
+
+    for (uint32_t i = 0; i < rules->num_rules; i++)
+    {
+      YR_RULE* rule = &rules->rules_table[i];
+      PyObject* name = Py_BuildValue(
+          "(ss)", rule->ns->name, rule->identifier);
+
+      if (name == NULL)
+      {
+        Py_DECREF(names);
+        return NULL;
+      }
+
+      PyTuple_SET_ITEM(names, i, name);
+    }
+
+    object->rule_names = names;
+  }
+
+  Py_INCREF(object->rule_names);
+  return object->rule_names;
+}
+
+
+static PyObject* Rules_get_string_names(
+    PyObject* self,
+    void* closure)
+{
+  Rules* object = (Rules*) self;
+
+  if (object->string_names == NULL)
+  {
+    YR_RULES* rules = object->rules;
+    YR_RULE* rule;
+    YR_STRING* string;
+
+    PyObject* names = PyTuple_New(rules->num_strings);
+
+    if (names == NULL)
+      return NULL;
+
+    yr_rules_foreach(rules, rule)
+    {
+      yr_rule_strings_foreach(rule, string)
+      {
+        PyObject* name = Py_BuildValue(
+            "(Is)",
+            (unsigned int) (rule - rules->rules_table),
+            string->identifier);
+
+        if (name == NULL)
+        {
+          Py_DECREF(names);
+          return NULL;
+        }
+
+        PyTuple_SET_ITEM(names, string - rules->strings_table, name);
+      }
+    }
+
+    object->string_names = names;
+  }
+
+  Py_INCREF(object->string_names);
+  return object->string_names;
+}
+
+
+static PyObject* Rules_getattro(
+    PyObject* self,
+    PyObject* name)
+{
+  return PyObject_GenericGetAttr(self, name);
+}
 
-  PyObject* callback_result = PyObject_CallFunctionObjArgs(
-      data->modules_callback,
-      module_info_dict,
-      NULL);
 
-  int result = CALLBACK_CONTINUE;
+void raise_exception_on_error(
+    int error_level,
+    const char* file_name,
+    int line_number,
+    const YR_RULE* rule,
+    const char* message,
+    void* user_data)
+{
+  PyGILState_STATE gil_state = PyGILState_Ensure();
 
-  if (callback_result != NULL)
+  if (error_level == YARA_ERROR_LEVEL_ERROR)
   {
-    #if PY_MAJOR_VERSION >= 3
-    if (PyLong_Check(callback_result))
-    #else
-    if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
-    #endif
-    {
-      result = (int) PyLong_AsLong(callback_result);
-    }
+    if (file_name != NULL)
+      PyErr_Format(
+          YaraSyntaxError,
+          "%s(%d): %s",
+          file_name,
+          line_number,
+          message);
+    else
+      PyErr_Format(
+          YaraSyntaxError,
+          "line %d: %s",
+          line_number,
+          message);
   }
   else
   {
-    result = CALLBACK_ERROR;
+    PyObject* warnings = (PyObject*)user_data;
+    PyObject* warning_msg;
+    if (file_name != NULL)
+      warning_msg = PY_STRING_FORMAT(
+          "%s(%d): %s",
+          file_name,
+          line_number,
+          message);
+    else
+      warning_msg = PY_STRING_FORMAT(
+          "line %d: %s",
+          line_number,
+          message);
+    PyList_Append(warnings, warning_msg);
+    Py_DECREF(warning_msg);
   }
 
-  Py_XDECREF(callback_result);
-  Py_DECREF(module_info_dict);
-  Py_DECREF(data->modules_callback);
-
   PyGILState_Release(gil_state);
-
-  return result;
 }
 
 
-static int handle_console_log(
-    void* message_data,
-    CALLBACK_DATA* data)
+////////////////////////////////////////////////////////////////////////////////
+
+const char* yara_include_callback(
+    const char* include_name,
+    const char* calling_rule_filename,
+    const char* calling_rule_namespace,
+    void* user_data)
 {
+  PyObject* result;
+  PyObject* callback = (PyObject*) user_data;
+  PyObject* py_incl_name = NULL;
+  PyObject* py_calling_fn = NULL;
+  PyObject* py_calling_ns = NULL;
+  PyObject* type = NULL;
+  PyObject* value = NULL;
+  PyObject* traceback = NULL;
+
+  const char* cstring_result = NULL;
+
   PyGILState_STATE gil_state = PyGILState_Ensure();
-  int result = CALLBACK_CONTINUE;
 
-  if (data->console_callback == NULL)
+  if (include_name != NULL)
   {
-    // If the user does not specify a console callback we dump to stdout.
-    // If we want to support 3.2 and newer only we can use
-    // https://docs.python.org/3/c-api/sys.html?highlight=stdout#c.PySys_FormatStdout
-    // instead of this call with the limit.
-    PySys_WriteStdout("%.1000s\n", (char*) message_data);
+    py_incl_name = PY_STRING(include_name);
+  }
+  else //safeguard: should never happen for 'include_name'
+  {
+    py_incl_name = Py_None;
+    Py_INCREF(py_incl_name);
+  }
+
+  if (calling_rule_filename != NULL)
+  {
+    py_calling_fn = PY_STRING(calling_rule_filename);
   }
   else
   {
-    PyObject* log_string = PY_STRING((char*) message_data);
-    Py_INCREF(data->console_callback);
+    py_calling_fn = Py_None;
+    Py_INCREF(py_calling_fn);
+  }
 
-    PyObject* callback_result = PyObject_CallFunctionObjArgs(
-        data->console_callback,
-        log_string,
-        NULL);
+  if (calling_rule_namespace != NULL)
+  {
+    py_calling_ns = PY_STRING(calling_rule_namespace);
+  }
+  else
+  {
+    py_calling_ns = Py_None;
+    Py_INCREF(py_calling_ns);
+  }
 
-    if (callback_result != NULL)
+  PyErr_Fetch(&type, &value, &traceback);
+
+  result = PyObject_CallFunctionObjArgs(
+      callback,
+      py_incl_name,
+      py_calling_fn,
+      py_calling_ns,
+      NULL);
+
+  PyErr_Restore(type, value, traceback);
+
+  Py_DECREF(py_incl_name);
+  Py_DECREF(py_calling_fn);
+  Py_DECREF(py_calling_ns);
+
+  if (result != NULL && result != Py_None && PY_STRING_CHECK(result))
+  {
+    //transferring string ownership to C code
+    cstring_result = strdup(PY_STRING_TO_C(result));
+  }
+  else
+  {
+    if (PyErr_Occurred() == NULL)
     {
-      #if PY_MAJOR_VERSION >= 3
-      if (PyLong_Check(callback_result))
-      #else
-      if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
-      #endif
-      {
-        result = (int) PyLong_AsLong(callback_result);
-      }
+      PyErr_Format(PyExc_TypeError,
+          "'include_callback' function must return a yara rules as an ascii "
+          "or unicode string");
     }
-    else
+  }
+
+  Py_XDECREF(result);
+  PyGILState_Release(gil_state);
+
+  return cstring_result;
+}
+
+void yara_include_free(
+    const char* result_ptr,
+    void* user_data)
+{
+  if (result_ptr != NULL)
+  {
+    free((void*) result_ptr);
+  }
+}
+
+// Include cache, it lives while a compilation is in progress and serves
+// repeated includes from memory. Sources returned by include_callback are
+// cached by include name and calling namespace, and sources read from the
+// filesystem by the path of the included file. An include_cache_key callable
+// can provide other keys, or None to bypass the cache for an include. The
+// included source is still parsed every time, as libyara parses includes in
+// the context of the including file. The cache must be enabled explicitly, as
+// it resolves included files on its own instead of through libyara.
+
+typedef struct _INCLUDE_CACHE_ENTRY
+{
+  char* key;
+  size_t key_length;
+  char* source;
+
+} INCLUDE_CACHE_ENTRY;
+
+
+typedef struct _INCLUDE_CACHE
+{
+  INCLUDE_CACHE_ENTRY* entries;
+  size_t count;
+  size_t capacity;
+  char** uncached;
+  size_t num_uncached;
+  PyObject* callback;
+  PyObject* key_callback;
+  PyObject* error_type;
+  PyObject* error_value;
+  PyObject* error_traceback;
+  uint64_t requests;
+  uint64_t hits;
+
+} INCLUDE_CACHE;
+
+
+static INCLUDE_CACHE_ENTRY* include_cache_lookup(
+    INCLUDE_CACHE* cache,
+    const char* key,
+    size_t key_length)
+{
+  if (cache->capacity == 0)
+    return NULL;
+
+  size_t i = xxh64((const uint8_t*) key, key_length, 0);
+
+  while (true)
+  {
+    INCLUDE_CACHE_ENTRY* entry = &cache->entries[i & (cache->capacity - 1)];
+
+    if (entry->key == NULL)
+      return entry;
+
+    if (entry->key_length == key_length &&
+        memcmp(entry->key, key, key_length) == 0)
+      return entry;
+
+    i++;
+  }
+}
+
+
+// Stores a source in the cache, which takes ownership of it. Returns false
+// if there's not enough memory, in which case the source is not freed.
+static bool include_cache_insert(
+    INCLUDE_CACHE* cache,
+    const char* key,
+    size_t key_length,
+    char* source)
+{
+  INCLUDE_CACHE_ENTRY* entry;
+
+  if (cache->count * 2 >= cache->capacity)
+  {
+    size_t capacity = cache->capacity == 0 ? 64 : cache->capacity * 2;
+    INCLUDE_CACHE_ENTRY* entries = cache->entries;
+    size_t old_capacity = cache->capacity;
+
+    cache->entries = (INCLUDE_CACHE_ENTRY*) calloc(
+        capacity, sizeof(INCLUDE_CACHE_ENTRY));
+
+    if (cache->entries == NULL)
     {
-      result = CALLBACK_ERROR;
+      cache->entries = entries;
+      return false;
     }
 
-    Py_DECREF(log_string);
-    Py_XDECREF(callback_result);
-    Py_DECREF(data->console_callback);
+    cache->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+      if (entries[i].key != NULL)
+        *include_cache_lookup(cache, entries[i].key, entries[i].key_length) =
+            entries[i];
+    }
+
+    free(entries);
   }
 
-  PyGILState_Release(gil_state);
+  entry = include_cache_lookup(cache, key, key_length);
+  entry->key = (char*) malloc(key_length);
 
-  return result;
+  if (entry->key == NULL)
+    return false;
+
+  memcpy(entry->key, key, key_length);
+
+  entry->key_length = key_length;
+  entry->source = source;
+
+  cache->count++;
+
+  return true;
 }
 
 
-static int handle_too_many_matches(
-    YR_SCAN_CONTEXT* context,
-    YR_STRING* string,
-    CALLBACK_DATA* data)
+// Reads an included file from the filesystem. Relative paths are resolved
+// from the directory of the including file, like libyara does.
+static char* include_cache_read_file(
+    const char* path)
+{
+  FILE* fh = fopen(path, "rb");
+  char* source = NULL;
+  long size;
+
+  if (fh == NULL)
+    return NULL;
+
+  if (fseek(fh, 0, SEEK_END) == 0 &&
+      (size = ftell(fh)) >= 0 &&
+      fseek(fh, 0, SEEK_SET) == 0)
+  {
+    source = (char*) malloc(size + 1);
+
+    if (source != NULL && fread(source, 1, size, fh) != (size_t) size)
+    {
+      free(source);
+      source = NULL;
+    }
+
+    if (source != NULL)
+      source[size] = '\0';
+  }
+
+  fclose(fh);
+
+  return source;
+}
+
+
+static char* include_cache_resolve_path(
+    const char* include_name,
+    const char* calling_rule_filename)
+{
+  const char* separator = NULL;
+  size_t prefix = 0;
+  char* path;
+
+  if (calling_rule_filename != NULL)
+  {
+    separator = strrchr(calling_rule_filename, '/');
+
+    #if defined(_WIN32) || defined(__CYGWIN__)
+    const char* backslash = strrchr(calling_rule_filename, '\\');
+
+    if (separator == NULL || (backslash != NULL && backslash > separator))
+      separator = backslash;
+    #endif
+  }
+
+  if (separator != NULL)
+    prefix = (size_t) (separator - calling_rule_filename) + 1;
+
+  path = (char*) malloc(prefix + strlen(include_name) + 1);
+
+  if (path != NULL)
+  {
+    memcpy(path, calling_rule_filename, prefix);
+    strcpy(path + prefix, include_name);
+  }
+
+  return path;
+}
+
+
+const char* include_cache_callback(
+    const char* include_name,
+    const char* calling_rule_filename,
+    const char* calling_rule_namespace,
+    void* user_data)
 {
-  PyGILState_STATE gil_state = PyGILState_Ensure();
+  INCLUDE_CACHE* cache = (INCLUDE_CACHE*) user_data;
+  INCLUDE_CACHE_ENTRY* entry;
 
-  PyObject* warning_type = NULL;
-  PyObject* string_identifier = NULL;
-  PyObject* rule_identifier = NULL;
-  PyObject* namespace_identifier = NULL;
-  PyObject* rule_string = NULL;
-  YR_RULE* rule = NULL;
+  char* key = NULL;
+  char* path = NULL;
+  char* source = NULL;
+  size_t key_length = 0;
+  bool cacheable = true;
 
-  int result = CALLBACK_CONTINUE;
+  cache->requests++;
 
-  if (data->warnings_callback == NULL)
+  if (cache->callback == NULL)
   {
-    char message[200];
-
-    snprintf(
-        message,
-        sizeof(message),
-        "too many matches for string %s in rule \"%s\"",
-        string->identifier,
-        context->rules->rules_table[string->rule_idx].identifier);
+    path = include_cache_resolve_path(include_name, calling_rule_filename);
 
-    if (PyErr_WarnEx(PyExc_RuntimeWarning, message, 1) == -1)
-      result = CALLBACK_ERROR;
+    if (path == NULL)
+      return NULL;
   }
-  else
+
+  if (cache->key_callback != NULL)
   {
-    Py_INCREF(data->warnings_callback);
+    PyGILState_STATE gil_state = PyGILState_Ensure();
 
-    string_identifier = PY_STRING(string->identifier);
+    PyObject* result = PyObject_CallFunction(
+        cache->key_callback,
+        "szz",
+        include_name,
+        calling_rule_filename,
+        calling_rule_namespace);
 
-    if (string_identifier == NULL)
+    if (result == Py_None)
     {
-      result = CALLBACK_ERROR;
-      goto _exit;
+      cacheable = false;
+    }
+    else if (result != NULL && PY_STRING_CHECK(result))
+    {
+      key = strdup(PY_STRING_TO_C(result));
+      key_length = key != NULL ? strlen(key) : 0;
+    }
+    else if (result != NULL)
+    {
+      PyErr_Format(
+          PyExc_TypeError,
+          "'include_cache_key' must return a string or None");
     }
 
-    rule = &context->rules->rules_table[string->rule_idx];
-    rule_identifier = PY_STRING(rule->identifier);
-
-    if (rule_identifier == NULL)
+    // libyara only sees a failed include, which aborts the compilation, the
+    // exception is kept until then to be raised by include_cache_raise.
+    if (PyErr_Occurred() != NULL)
     {
-      result = CALLBACK_ERROR;
-      goto _exit;
+      if (cache->error_type == NULL)
+        PyErr_Fetch(
+            &cache->error_type, &cache->error_value, &cache->error_traceback);
+      else
+        PyErr_Clear();
     }
 
-    namespace_identifier = PY_STRING(rule->ns->name);
+    Py_XDECREF(result);
+    PyGILState_Release(gil_state);
 
-    if (namespace_identifier == NULL)
+    if (cacheable && key == NULL)
     {
-      result = CALLBACK_ERROR;
-      goto _exit;
+      free(path);
+      return NULL;
     }
+  }
+  else if (path != NULL)
+  {
+    key = strdup(path);
+    key_length = key != NULL ? strlen(key) : 0;
+  }
+  else
+  {
+    const char* ns = calling_rule_namespace != NULL ?
+        calling_rule_namespace : "";
 
-    rule_string = PyStructSequence_New(&RuleString_Type);
+    // Include name and namespace separated by a NULL character, which can't
+    // appear in either of them.
+    key_length = strlen(include_name) + 1 + strlen(ns);
+    key = (char*) malloc(key_length + 1);
 
-    if (rule_string == NULL)
+    if (key != NULL)
     {
-      result = CALLBACK_ERROR;
-      goto _exit;
+      strcpy(key, include_name);
+      strcpy(key + strlen(include_name) + 1, ns);
     }
+  }
 
-    PyStructSequence_SET_ITEM(rule_string, 0, namespace_identifier);
-    PyStructSequence_SET_ITEM(rule_string, 1, rule_identifier);
-    PyStructSequence_SET_ITEM(rule_string, 2, string_identifier);
-
-    // PyStructSequenece steals the reference so we NULL these
-    // so that Py_XDECREF() can be used in _exit label
-    namespace_identifier = NULL;
-    rule_identifier = NULL;
-    string_identifier = NULL;
+  if (cacheable && key == NULL)
+  {
+    free(path);
+    return NULL;
+  }
 
-    warning_type = PyLong_FromLong(CALLBACK_MSG_TOO_MANY_MATCHES);
+  if (cacheable)
+  {
+    entry = include_cache_lookup(cache, key, key_length);
 
-    if (warning_type == NULL)
+    if (entry != NULL && entry->key != NULL)
     {
-      result = CALLBACK_ERROR;
-      goto _exit;
+      cache->hits++;
+      free(key);
+      free(path);
+      return entry->source;
     }
+  }
 
-    PyObject* callback_result = PyObject_CallFunctionObjArgs(
-        data->warnings_callback,
-        warning_type,
-        rule_string,
-        NULL);
+  if (path != NULL)
+    source = include_cache_read_file(path);
+  else
+    source = (char*) yara_include_callback(
+        include_name,
+        calling_rule_filename,
+        calling_rule_namespace,
+        cache->callback);
+
+  if (source != NULL &&
+      (!cacheable || !include_cache_insert(cache, key, key_length, source)))
+  {
+    // Sources that are not in the cache must be kept until the cache is
+    // destroyed too, as the free callback doesn't release them.
+    char** uncached = (char**) realloc(
+        cache->uncached, (cache->num_uncached + 1) * sizeof(char*));
 
-    if (callback_result != NULL)
+    if (uncached != NULL)
     {
-      #if PY_MAJOR_VERSION >= 3
-      if (PyLong_Check(callback_result))
-      #else
-      if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
-      #endif
-      {
-        result = (int) PyLong_AsLong(callback_result);
-      }
+      cache->uncached = uncached;
+      cache->uncached[cache->num_uncached++] = source;
     }
     else
     {
-      result = CALLBACK_ERROR;
+      free(source);
+      source = NULL;
     }
-
-    Py_XDECREF(callback_result);
   }
 
-_exit:
+  free(key);
+  free(path);
 
-  Py_XDECREF(namespace_identifier);
-  Py_XDECREF(rule_identifier);
-  Py_XDECREF(string_identifier);
-  Py_XDECREF(rule_string);
-  Py_XDECREF(warning_type);
-  Py_XDECREF(data->warnings_callback);
+  return source;
+}
 
-  PyGILState_Release(gil_state);
 
-  return result;
+// Sources are owned by the cache, they are released by include_cache_destroy.
+void include_cache_free(
+    const char* result_ptr,
+    void* user_data)
+{
 }
 
 
-#define CALLBACK_MATCHES 0x01
-#define CALLBACK_NON_MATCHES 0x02
-#define CALLBACK_ALL CALLBACK_MATCHES | CALLBACK_NON_MATCHES
+// Raises the exception kept by include_cache_callback, if any, replacing the
+// one raised for the failed include. Returns true if there was one.
+static bool include_cache_raise(
+    INCLUDE_CACHE* cache)
+{
+  if (cache->error_type == NULL)
+    return false;
 
-int yara_callback(
-    YR_SCAN_CONTEXT* context,
-    int message,
-    void* message_data,
-    void* user_data)
+  PyErr_Restore(cache->error_type, cache->error_value, cache->error_traceback);
+
+  cache->error_type = NULL;
+  cache->error_value = NULL;
+  cache->error_traceback = NULL;
+
+  return true;
+}
+
+
+static void include_cache_destroy(
+    INCLUDE_CACHE* cache)
 {
-  YR_STRING* string;
-  YR_MATCH* m;
-  YR_META* meta;
-  YR_RULE* rule;
+  for (size_t i = 0; i < cache->capacity; i++)
+  {
+    free(cache->entries[i].key);
+    free(cache->entries[i].source);
+  }
 
-  const char* tag;
+  for (size_t i = 0; i < cache->num_uncached; i++)
+    free(cache->uncached[i]);
 
-  PyObject* tag_list = NULL;
-  PyObject* string_instance_list = NULL;
-  PyObject* string_list = NULL;
-  PyObject* meta_list = NULL;
-  PyObject* string_match_instance = NULL;
-  PyObject* match;
-  PyObject* callback_dict;
-  PyObject* object;
-  PyObject* matches = ((CALLBACK_DATA*) user_data)->matches;
-  PyObject* callback = ((CALLBACK_DATA*) user_data)->callback;
-  PyObject* callback_result;
+  free(cache->entries);
+  free(cache->uncached);
 
-  int which = ((CALLBACK_DATA*) user_data)->which;
+  Py_XDECREF(cache->error_type);
+  Py_XDECREF(cache->error_value);
+  Py_XDECREF(cache->error_traceback);
+}
 
-  switch(message)
+
+static PyObject* include_cache_stats(
+    INCLUDE_CACHE* cache)
+{
+  return Py_BuildValue(
+      "{s:K,s:K,s:d}",
+      "include_requests",
+      (unsigned long long) cache->requests,
+      "include_cache_hits",
+      (unsigned long long) cache->hits,
+      "include_cache_hit_rate",
+      cache->requests > 0 ? (double) cache->hits / cache->requests : 0.0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static PyObject* yara_set_config(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+
+  /*
+   * It is recommended that this be kept up to date with the config
+   * options present in yara/libyara.c yr_set_configuration(...) - ck
+   */
+  static char *kwlist[] = {
+    "stack_size", "max_strings_per_rule", "max_match_data",
+    "max_process_memory_chunk", NULL};
+
+  unsigned int stack_size = 0;
+  unsigned int max_strings_per_rule = 0;
+  unsigned int max_match_data = 0;
+  unsigned long long max_process_memory_chunk = 0;
+
+  int error = 0;
+
+  if (PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "|IIIK",
+        kwlist,
+        &stack_size,
+        &max_strings_per_rule,
+  	&max_match_data,
+        &max_process_memory_chunk))
   {
-  case CALLBACK_MSG_IMPORT_MODULE:
-    return handle_import_module(message_data, user_data);
+    if (stack_size != 0)
+    {
+      error = yr_set_configuration(
+          YR_CONFIG_STACK_SIZE,
+          &stack_size);
 
-  case CALLBACK_MSG_MODULE_IMPORTED:
-    return handle_module_imported(message_data, user_data);
+      if ( error != ERROR_SUCCESS)
+        return handle_error(error, NULL);
+    }
 
-  case CALLBACK_MSG_TOO_MANY_MATCHES:
-    return handle_too_many_matches(context, message_data, user_data);
+    if (max_strings_per_rule != 0)
+    {
+      error = yr_set_configuration(
+          YR_CONFIG_MAX_STRINGS_PER_RULE,
+				  &max_strings_per_rule);
 
-  case CALLBACK_MSG_SCAN_FINISHED:
-    return CALLBACK_CONTINUE;
+      if (error != ERROR_SUCCESS)
+        return handle_error(error, NULL);
+    }
 
-  case CALLBACK_MSG_RULE_NOT_MATCHING:
-    // In cases where the rule doesn't match and the user didn't provided a
-    // callback function or is not interested in getting notified about
-    // non-matches, there's nothing more do to here, keep executing the function
-    // if otherwise.
+    if (max_match_data != 0)
+    {
+      error = yr_set_configuration(
+          YR_CONFIG_MAX_MATCH_DATA,
+				  &max_match_data);
 
-    if (callback == NULL ||
-        (which & CALLBACK_NON_MATCHES) != CALLBACK_NON_MATCHES)
-      return CALLBACK_CONTINUE;
-    break;
+      if (error != ERROR_SUCCESS)
+        return handle_error(error, NULL);
+    }
 
-  case CALLBACK_MSG_CONSOLE_LOG:
-    return handle_console_log(message_data, user_data);
+    if (max_process_memory_chunk != 0)
+    {
+      error = yr_set_configuration_uint64(
+          YR_CONFIG_MAX_PROCESS_MEMORY_CHUNK,
+          (uint64_t) max_process_memory_chunk);
+
+      if (error != ERROR_SUCCESS)
+        return handle_error(error, NULL);
+    }
   }
 
-  // At this point we have handled all the other cases of when this callback
-  // can be called. The only things left are:
-  //
-  // 1. A matching rule.
-  //
-  // 2 A non-matching rule and the user has requested to see non-matching rules.
-  //
-  // In both cases, we need to create the data that will be either passed back
-  // to the python callback or stored in the matches list.
+  Py_RETURN_NONE;
+}
 
-  int result = CALLBACK_CONTINUE;
+static void ShardedRules_dealloc(
+    PyObject* self)
+{
+  ShardedRules* object = (ShardedRules*) self;
 
-  rule = (YR_RULE*) message_data;
+  Py_XDECREF(object->shards);
+  Py_XDECREF(object->namespaces);
 
-  PyGILState_STATE gil_state = PyGILState_Ensure();
+  PyObject_Del(self);
+}
 
-  tag_list = PyList_New(0);
-  string_list = PyList_New(0);
-  meta_list = PyDict_New();
 
-  if (tag_list == NULL || string_list == NULL || meta_list == NULL)
-  {
-    Py_XDECREF(tag_list);
-    Py_XDECREF(string_list);
-    Py_XDECREF(meta_list);
-    PyGILState_Release(gil_state);
+typedef struct _SHARD_SCAN
+{
+  YR_SCANNER* scanner;
+  CALLBACK_DATA callback_data;
+  const uint8_t* data;
+  size_t size;
+  int error;
+
+} SHARD_SCAN;
+
+
+static THREAD_ROUTINE(shard_scan_thread, arg)
+{
+  SHARD_SCAN* scan = (SHARD_SCAN*) arg;
+
+  scan->error = yr_scanner_scan_mem(scan->scanner, scan->data, scan->size);
+
+  THREAD_RETURN;
+}
 
-    return CALLBACK_ERROR;
-  }
 
-  yr_rule_tags_foreach(rule, tag)
+// Merges the matches found by each shard. Namespaces are never split across
+// shards and each shard reports its matches in rule order, so picking the
+// match with the lowest namespace index among the heads of all the lists
+// gives the same order as if the rules were compiled together.
+static PyObject* merge_shard_matches(
+    ShardedRules* rules,
+    SHARD_SCAN* scans,
+    Py_ssize_t num_shards)
+{
+  Py_ssize_t* heads = (Py_ssize_t*) calloc(num_shards, sizeof(Py_ssize_t));
+  PyObject* result = PyList_New(0);
+
+  if (heads == NULL || result == NULL)
   {
-    object = PY_STRING(tag);
-    PyList_Append(tag_list, object);
-    Py_DECREF(object);
+    free(heads);
+    Py_XDECREF(result);
+    return PyErr_NoMemory();
   }
 
-  yr_rule_metas_foreach(rule, meta)
+  while (true)
   {
-    if (meta->type == META_TYPE_INTEGER)
-      object = Py_BuildValue("i", meta->integer);
-    else if (meta->type == META_TYPE_BOOLEAN)
-      object = PyBool_FromLong((long) meta->integer);
-    else
-      object = PY_STRING(meta->string);
+    Py_ssize_t best = -1;
+    long best_index = 0;
 
-    if (((CALLBACK_DATA*) user_data)->allow_duplicate_metadata){
-      // Check if we already have an array under this key
-      PyObject* existing_item = PyDict_GetItemString(meta_list, meta->identifier);
-      // Append object to existing list
-      if (existing_item)
-        PyList_Append(existing_item, object);
-      else{
-        //Otherwise, instantiate array and append object as first item
-        PyObject* new_list = PyList_New(0);
-        PyList_Append(new_list, object);
-        PyDict_SetItemString(meta_list, meta->identifier, new_list);
-        Py_DECREF(new_list);
+    for (Py_ssize_t i = 0; i < num_shards; i++)
+    {
+      PyObject* matches = scans[i].callback_data.matches;
+
+      if (heads[i] == PyList_GET_SIZE(matches))
+        continue;
+
+      Match* match = (Match*) PyList_GET_ITEM(matches, heads[i]);
+      PyObject* index = PyDict_GetItem(rules->namespaces, match->ns);
+      long ns_index = index != NULL ? PyLong_AsLong(index) : 0;
+
+      if (best == -1 || ns_index < best_index)
+      {
+        best = i;
+        best_index = ns_index;
       }
     }
-    else{
-      PyDict_SetItemString(meta_list, meta->identifier, object);
-      Py_DECREF(object);
+
+    if (best == -1)
+      break;
+
+    if (PyList_Append(
+          result,
+          PyList_GET_ITEM(scans[best].callback_data.matches, heads[best])) != 0)
+    {
+      free(heads);
+      Py_DECREF(result);
+      return NULL;
     }
+
+    heads[best]++;
   }
 
-  yr_rule_strings_foreach(rule, string)
-  {
-    // If this string is not a match, skip it. We have to check for this here
-    // and not rely on it in yr_string_matches_foreach macro because we need
-    // to create the string match instance list before we make the items that
-    // go in it.
-    if (context->matches[string->idx].head == NULL)
-      continue;
+  free(heads);
 
-    string_instance_list = PyList_New(0);
+  return result;
+}
 
-    if (string_instance_list == NULL)
-    {
-        PyErr_Format(PyExc_TypeError, "out of memory");
-        return CALLBACK_ERROR;
-    }
 
+// Scans the data with all the shards at the same time, each one in its own
+// thread. Files are mapped once and shared by all the scanners.
+static PyObject* ShardedRules_match(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "filepath", "data", "externals", "fast", "timeout", NULL
+      };
 
-    yr_string_matches_foreach(context, string, m)
-    {
-      object = PyBytes_FromStringAndSize((char*) m->data, m->data_length);
+  // Options accepted by Rules.match that can't be honored when the results
+  // of several independent scans are merged.
+  static const char* unsupported[] = {
+      "pid", "callback", "modules_data", "modules_callback",
+      "which_callbacks", "warnings_callback", "console_callback",
+      "allow_duplicate_metadata", "deadline", "cancellation_token",
+      "max_match_data", "max_matches_per_string", "lazy_modules",
+      "modules_fields", "output", "data_encoding", "cache", "chunk_size",
+      "chunk_overlap", "ranges", "read", "read_threshold", "fadvise_dontneed",
+      "process_chunk_size", "process_max_bytes", "process_max_region_size",
+      "process_region_timeout", "region_report", NULL
+      };
 
-      string_match_instance = StringMatchInstance_NEW(
-          m->base + m->offset,
-          object,
-          m->match_length,
-          m->xor_key);
+  ShardedRules* rules = (ShardedRules*) self;
 
-      if (string_match_instance == NULL)
+  char* filepath = NULL;
+  Py_buffer data = {0};
+
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
+  PyObject* result = NULL;
+
+  YR_MAPPED_FILE mapped_file;
+  SHARD_SCAN* scans = NULL;
+  THREAD* threads = NULL;
+
+  const uint8_t* buffer;
+  size_t size;
+  uint64_t timeout_ns;
+
+  Py_ssize_t num_shards = PyTuple_GET_SIZE(rules->shards);
+  Py_ssize_t num_ready = 0;
+  Py_ssize_t num_threads = 0;
+
+  int error = ERROR_SUCCESS;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "|ss*OOO",
+        kwlist,
+        &filepath,
+        &data,
+        &externals,
+        &fast,
+        &timeout))
+  {
+    for (int i = 0; keywords != NULL && unsupported[i] != NULL; i++)
+    {
+      if (PyDict_GetItemString(keywords, unsupported[i]) != NULL)
       {
-        Py_DECREF(object);
-        PyErr_Format(PyExc_TypeError, "out of memory");
-        return CALLBACK_ERROR;
+        PyErr_Format(
+            PyExc_TypeError,
+            "'%s' is not supported by ShardedRules.match()",
+            unsupported[i]);
+        break;
       }
+    }
 
-      PyList_Append(string_instance_list, string_match_instance);
+    return NULL;
+  }
 
-      Py_DECREF(object);
-      Py_DECREF(string_match_instance);
-    }
+  if (filepath == NULL && data.buf == NULL)
+    return PyErr_Format(
+        PyExc_TypeError,
+        "match() takes at least one argument");
 
-    object = StringMatch_NEW(
-        string->identifier,
-        string->flags,
-        string_instance_list);
+  if (filepath != NULL && data.buf != NULL)
+  {
+    PyBuffer_Release(&data);
+    return PyErr_Format(
+        PyExc_TypeError,
+        "match() takes either 'filepath' or 'data'");
+  }
 
-    if (object == NULL)
+  if (parse_timeout(timeout, "timeout", NULL, &timeout_ns) != 0)
+  {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  if (externals != NULL && externals != Py_None && !PyDict_Check(externals))
+  {
+    PyBuffer_Release(&data);
+    return PyErr_Format(
+        PyExc_TypeError,
+        "'externals' must be a dictionary");
+  }
+
+  if (filepath != NULL)
+  {
+    Py_BEGIN_ALLOW_THREADS
+    error = yr_filemap_map(filepath, &mapped_file);
+    Py_END_ALLOW_THREADS
+
+    if (error != ERROR_SUCCESS)
     {
-        PyErr_Format(PyExc_TypeError, "out of memory");
-        return CALLBACK_ERROR;
+      PyBuffer_Release(&data);
+      return handle_error(error, filepath);
     }
 
+    buffer = mapped_file.data;
+    size = mapped_file.size;
+  }
+  else
+  {
+    buffer = (const uint8_t*) data.buf;
+    size = (size_t) data.len;
+  }
 
-    Py_DECREF(string_instance_list);
+  scans = (SHARD_SCAN*) calloc(num_shards, sizeof(SHARD_SCAN));
+  threads = (THREAD*) calloc(num_shards, sizeof(THREAD));
 
-    PyList_Append(string_list, object);
-    Py_DECREF(object);
+  if (scans == NULL || threads == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
   }
 
-  if (message == CALLBACK_MSG_RULE_MATCHING)
+  for (; num_ready < num_shards; num_ready++)
   {
-    match = Match_NEW(
-        rule->identifier,
-        rule->ns->name,
-        tag_list,
-        meta_list,
-        string_list);
+    Rules* shard = (Rules*) PyTuple_GET_ITEM(rules->shards, num_ready);
+    SHARD_SCAN* scan = &scans[num_ready];
 
-    if (match != NULL)
+    if (yr_scanner_create(shard->rules, &scan->scanner) != ERROR_SUCCESS)
     {
-      PyList_Append(matches, match);
-      Py_DECREF(match);
+      PyErr_Format(PyExc_Exception, "could not create scanner");
+      goto _exit;
     }
-    else
-    {
-      Py_DECREF(tag_list);
-      Py_DECREF(string_list);
-      Py_DECREF(meta_list);
-      PyGILState_Release(gil_state);
 
-      return CALLBACK_ERROR;
+    scan->callback_data.matches = PyList_New(0);
+    scan->callback_data.which = CALLBACK_ALL;
+    scan->callback_data.max_match_data = shard->max_match_data;
+    scan->callback_data.max_matches_per_string = shard->max_matches_per_string;
+    scan->data = buffer;
+    scan->size = size;
+
+    if (scan->callback_data.matches == NULL ||
+        apply_externals((PyObject*) shard, scan->scanner, externals) != 0)
+    {
+      yr_scanner_destroy(scan->scanner);
+      Py_XDECREF(scan->callback_data.matches);
+      goto _exit;
     }
+
+    if (fast != NULL && PyObject_IsTrue(fast) == 1)
+      yr_scanner_set_flags(scan->scanner, SCAN_FLAGS_FAST_MODE);
+
+    scanner_set_timeout_ns(scan->scanner, timeout_ns);
+    yr_scanner_set_callback(
+        scan->scanner, yara_callback, &scan->callback_data);
   }
 
-  if (callback != NULL &&
-      ((message == CALLBACK_MSG_RULE_MATCHING && (which & CALLBACK_MATCHES)) ||
-       (message == CALLBACK_MSG_RULE_NOT_MATCHING && (which & CALLBACK_NON_MATCHES))))
-  {
-    Py_INCREF(callback);
+  Py_BEGIN_ALLOW_THREADS
 
-    callback_dict = PyDict_New();
+  // The first shard is scanned in the current thread, if a thread can't be
+  // created the shard is scanned here too once the others are done.
+  for (num_threads = 1; num_threads < num_shards; num_threads++)
+  {
+    if (thread_create(
+          &threads[num_threads],
+          shard_scan_thread,
+          &scans[num_threads]) != 0)
+      break;
+  }
 
-    object = PyBool_FromLong(message == CALLBACK_MSG_RULE_MATCHING);
-    PyDict_SetItemString(callback_dict, "matches", object);
-    Py_DECREF(object);
+  shard_scan_thread(&scans[0]);
 
-    object = PY_STRING(rule->identifier);
-    PyDict_SetItemString(callback_dict, "rule", object);
-    Py_DECREF(object);
+  for (Py_ssize_t i = 1; i < num_threads; i++)
+    thread_join(threads[i]);
 
-    object = PY_STRING(rule->ns->name);
-    PyDict_SetItemString(callback_dict, "namespace", object);
-    Py_DECREF(object);
+  for (Py_ssize_t i = num_threads; i < num_shards; i++)
+    shard_scan_thread(&scans[i]);
 
-    PyDict_SetItemString(callback_dict, "tags", tag_list);
-    PyDict_SetItemString(callback_dict, "meta", meta_list);
-    PyDict_SetItemString(callback_dict, "strings", string_list);
+  Py_END_ALLOW_THREADS
 
-    callback_result = PyObject_CallFunctionObjArgs(
-        callback,
-        callback_dict,
-        NULL);
+  for (Py_ssize_t i = 0; i < num_shards && error == ERROR_SUCCESS; i++)
+    error = scans[i].error;
 
-    if (callback_result != NULL)
-    {
-      #if PY_MAJOR_VERSION >= 3
-      if (PyLong_Check(callback_result))
-      #else
-      if (PyLong_Check(callback_result) || PyInt_Check(callback_result))
-      #endif
-      {
-        result = (int) PyLong_AsLong(callback_result);
-      }
+  if (error == ERROR_SUCCESS)
+    result = merge_shard_matches(rules, scans, num_shards);
+  else if (error != ERROR_CALLBACK_ERROR)
+    handle_error(error, filepath != NULL ? filepath : "<data>");
 
-      Py_DECREF(callback_result);
-    }
-    else
-    {
-      result = CALLBACK_ERROR;
-    }
+_exit:
 
-    Py_DECREF(callback_dict);
-    Py_DECREF(callback);
+  for (Py_ssize_t i = 0; i < num_ready; i++)
+  {
+    yr_scanner_destroy(scans[i].scanner);
+    Py_DECREF(scans[i].callback_data.matches);
   }
 
-  Py_DECREF(tag_list);
-  Py_DECREF(string_list);
-  Py_DECREF(meta_list);
-  PyGILState_Release(gil_state);
+  free(scans);
+  free(threads);
+
+  if (filepath != NULL)
+    yr_filemap_unmap(&mapped_file);
+
+  PyBuffer_Release(&data);
 
   return result;
 }
 
 
-/* YR_STREAM read method for "file-like objects" */
+// Pipelines scan data submitted from Python in a pool of native worker
+// threads, each one with its own scanner. Submitted buffers are pinned until
+// they are scanned, and the total size of the data submitted but not scanned
+// yet is limited by "max_inflight_bytes", submit() blocks while the limit is
+// exceeded. Results are retrieved in completion order with get() or by
+// iterating the pipeline, both stop waiting once every submission has been
+// returned, so results for data submitted later by other threads need
+// another call to get() or a new iteration. Workers only take the GIL for
+// building the Match objects and for releasing the buffers.
 
-static size_t flo_read(
-    void* ptr,
-    size_t size,
-    size_t count,
-    void* user_data)
+static THREAD_ROUTINE(pipeline_worker_thread, arg)
 {
-  size_t i;
+  PIPELINE_WORKER* worker = (PIPELINE_WORKER*) arg;
+  Pipeline* pipeline = worker->pipeline;
+  Rules* rules = (Rules*) pipeline->rules;
 
-  for (i = 0; i < count; i++)
+  while (true)
   {
-    PyGILState_STATE gil_state = PyGILState_Ensure();
+    CALLBACK_DATA callback_data;
+    PIPELINE_JOB* job;
+    PyGILState_STATE gil_state;
 
-    PyObject* bytes = PyObject_CallMethod(
-        (PyObject*) user_data, "read", "n", (Py_ssize_t) size);
+    int error;
 
-    if (bytes == NULL) 
+    mutex_lock(&pipeline->mutex);
+
+    while (pipeline->queue_head == NULL && !pipeline->closed)
+      cond_wait(&pipeline->cond, &pipeline->mutex);
+
+    job = pipeline->queue_head;
+
+    if (job != NULL)
+    {
+      pipeline->queue_head = job->next;
+
+      if (pipeline->queue_head == NULL)
+        pipeline->queue_tail = NULL;
+    }
+
+    mutex_unlock(&pipeline->mutex);
+
+    if (job == NULL)
+      break;
+
+    memset(&callback_data, 0, sizeof(callback_data));
+
+    callback_data.which = CALLBACK_ALL;
+    callback_data.max_match_data = rules->max_match_data;
+    callback_data.max_matches_per_string = rules->max_matches_per_string;
+
+    gil_state = PyGILState_Ensure();
+    callback_data.matches = PyList_New(0);
+    PyGILState_Release(gil_state);
+
+    if (callback_data.matches == NULL)
+      error = ERROR_INSUFFICIENT_MEMORY;
+    else
     {
-      PyGILState_Release(gil_state);
-      return i;
-    }
+      yr_scanner_set_callback(worker->scanner, yara_callback, &callback_data);
 
-    Py_ssize_t len;
-    char* buffer;
+      if (job->filepath != NULL)
+        error = yr_scanner_scan_file(worker->scanner, job->filepath);
+      else
+        error = yr_scanner_scan_mem(
+            worker->scanner,
+            (const uint8_t*) job->buffer.buf,
+            (size_t) job->buffer.len);
+    }
 
-    int result = PyBytes_AsStringAndSize(bytes, &buffer, &len);
+    gil_state = PyGILState_Ensure();
 
-    if (result == -1 || (size_t) len < size)
+    if (error == ERROR_SUCCESS)
     {
-      Py_DECREF(bytes);
-      PyGILState_Release(gil_state);
-      return i;
+      job->result = callback_data.matches;
     }
+    else
+    {
+      PyObject* type;
+      PyObject* value;
+      PyObject* traceback;
 
-    memcpy((char*) ptr + i * size, buffer, size);
+      Py_XDECREF(callback_data.matches);
 
-    Py_DECREF(bytes);
-    PyGILState_Release(gil_state);
-  }
+      if (error != ERROR_CALLBACK_ERROR || !PyErr_Occurred())
+        handle_error(
+            error, job->filepath != NULL ? job->filepath : "<data>");
 
-  return count;
-}
+      PyErr_Fetch(&type, &value, &traceback);
+      PyErr_NormalizeException(&type, &value, &traceback);
 
+      job->result = value;
 
-/* YR_STREAM write method for "file-like objects" */
+      Py_XDECREF(type);
+      Py_XDECREF(traceback);
+    }
 
-static size_t flo_write(
-    const void* ptr,
-    size_t size,
-    size_t count,
-    void* user_data)
-{
-  size_t i;
+    if (job->buffer.obj != NULL)
+      PyBuffer_Release(&job->buffer);
 
-  for (i = 0; i < count; i++)
-  {
-    PyGILState_STATE gil_state = PyGILState_Ensure();
+    PyGILState_Release(gil_state);
 
-    PyObject* result = PyObject_CallMethod(
-    #if PY_MAJOR_VERSION >= 3
-        (PyObject*) user_data, "write", "y#", (char*) ptr + i * size, size);
-    #else
-        (PyObject*) user_data, "write", "s#", (char*) ptr + i * size, size);
-    #endif
+    mutex_lock(&pipeline->mutex);
 
-    Py_XDECREF(result);
-    PyGILState_Release(gil_state);
+    pipeline->inflight_bytes -= job->size;
 
-    if (result == NULL)
-      return i;
+    if (pipeline->results_tail != NULL)
+      pipeline->results_tail->next = job;
+    else
+      pipeline->results_head = job;
+
+    pipeline->results_tail = job;
+    job->next = NULL;
+
+    cond_broadcast(&pipeline->cond);
+    mutex_unlock(&pipeline->mutex);
   }
 
-  return count;
+  THREAD_RETURN;
 }
 
 
-PyObject* handle_error(
-    int error,
-    char* extra)
+static void pipeline_free_job(
+    PIPELINE_JOB* job)
 {
-  switch(error)
-  {
-    case ERROR_COULD_NOT_ATTACH_TO_PROCESS:
-      return PyErr_Format(
-          YaraError,
-          "access denied");
-    case ERROR_INSUFFICIENT_MEMORY:
-      return PyErr_NoMemory();
-    case ERROR_COULD_NOT_OPEN_FILE:
-      return PyErr_Format(
-          YaraError,
-          "could not open file \"%s\"",
-          extra);
-    case ERROR_COULD_NOT_MAP_FILE:
-      return PyErr_Format(
-          YaraError,
-          "could not map file \"%s\" into memory",
-          extra);
-    case ERROR_INVALID_FILE:
-      return PyErr_Format(
-          YaraError,
-          "invalid rules file \"%s\"",
-          extra);
-    case ERROR_CORRUPT_FILE:
-      return PyErr_Format(
-          YaraError,
-          "corrupt rules file \"%s\"",
-          extra);
-    case ERROR_SCAN_TIMEOUT:
-      return PyErr_Format(
-          YaraTimeoutError,
-          "scanning timed out");
-    case ERROR_INVALID_EXTERNAL_VARIABLE_TYPE:
-      return PyErr_Format(
-          YaraError,
-          "external variable \"%s\" was already defined with a different type",
-          extra);
-    case ERROR_UNSUPPORTED_FILE_VERSION:
-      return PyErr_Format(
-          YaraError,
-          "rules file \"%s\" is incompatible with this version of YARA",
-          extra);
-    default:
-      return PyErr_Format(
-          YaraError,
-          "internal error: %d",
-          error);
-  }
+  Py_XDECREF(job->tag);
+  Py_XDECREF(job->result);
+
+  if (job->buffer.obj != NULL)
+    PyBuffer_Release(&job->buffer);
+
+  free(job->filepath);
+  free(job);
 }
 
 
-int process_compile_externals(
-    PyObject* externals,
-    YR_COMPILER* compiler)
+// Stops accepting jobs and waits for the workers to finish the queued ones.
+// Called with the GIL held, but it must be released while waiting because
+// the workers need it.
+static void pipeline_shutdown(
+    Pipeline* pipeline)
 {
-  PyObject* key;
-  PyObject* value;
-  Py_ssize_t pos = 0;
+  mutex_lock(&pipeline->mutex);
+  pipeline->closed = true;
+  cond_broadcast(&pipeline->cond);
+  mutex_unlock(&pipeline->mutex);
 
-  char* identifier = NULL;
-  int result;
+  Py_BEGIN_ALLOW_THREADS
 
-  while (PyDict_Next(externals, &pos, &key, &value))
-  {
-    if (!PY_STRING_CHECK(key)) {
-      PyErr_Format(
-          PyExc_TypeError,
-          "keys of externals dict must be strings");
+  for (int i = 0; i < pipeline->num_threads; i++)
+    thread_join(pipeline->threads[i]);
 
-      return ERROR_INVALID_ARGUMENT;
-    }
-    identifier = PY_STRING_TO_C(key);
+  Py_END_ALLOW_THREADS
 
-    if (PyBool_Check(value))
-    {
-      result = yr_compiler_define_boolean_variable(
-          compiler,
-          identifier,
-          PyObject_IsTrue(value));
-    }
-#if PY_MAJOR_VERSION >= 3
-    else if (PyLong_Check(value))
-#else
-    else if (PyLong_Check(value) || PyInt_Check(value))
-#endif
-    {
-      result = yr_compiler_define_integer_variable(
-          compiler,
-          identifier,
-          PyLong_AsLongLong(value));
-    }
-    else if (PyFloat_Check(value))
-    {
-      result = yr_compiler_define_float_variable(
-          compiler,
-          identifier,
-          PyFloat_AsDouble(value));
-    }
-    else if (PY_STRING_CHECK(value))
-    {
-      char* str = PY_STRING_TO_C(value);
+  pipeline->num_threads = 0;
+}
 
-      if (str == NULL)
-        return ERROR_INVALID_ARGUMENT;
 
-      result = yr_compiler_define_string_variable(
-          compiler, identifier, str);
-    }
-    else
-    {
-      PyErr_Format(
-          PyExc_TypeError,
-          "external values must be of type integer, float, boolean or string");
+static PyObject* Pipeline_new(
+    PyTypeObject* type,
+    PyObject* args,
+    PyObject* keywords)
+{
+  static char* kwlist[] = {
+      "rules", "workers", "max_inflight_bytes", "externals", "fast",
+      "timeout", NULL
+      };
 
-      return ERROR_INVALID_ARGUMENT;
-    }
+  PyObject* rules;
+  PyObject* externals = NULL;
+  PyObject* fast = NULL;
+  PyObject* timeout = NULL;
 
-    if (result != ERROR_SUCCESS)
-    {
-      handle_error(result, identifier);
-      return result;
-    }
+  int num_workers = 4;
+  unsigned long long max_inflight_bytes = 256 * 1024 * 1024;
+  uint64_t timeout_ns;
+
+  Pipeline* self;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "O!|iKOOO",
+        kwlist,
+        &Rules_Type,
+        &rules,
+        &num_workers,
+        &max_inflight_bytes,
+        &externals,
+        &fast,
+        &timeout))
+  {
+    return NULL;
   }
 
-  return ERROR_SUCCESS;
-}
+  if (num_workers < 1)
+    return PyErr_Format(PyExc_ValueError, "'workers' must be at least 1");
 
+  if (parse_timeout(timeout, "timeout", NULL, &timeout_ns) != 0)
+    return NULL;
 
-int process_match_externals(
-    PyObject* externals,
-    YR_SCANNER* scanner)
-{
-  PyObject* key;
-  PyObject* value;
-  Py_ssize_t pos = 0;
+  self = (Pipeline*) type->tp_alloc(type, 0);
 
-  char* identifier = NULL;
-  int result;
+  if (self == NULL)
+    return NULL;
 
-  while (PyDict_Next(externals, &pos, &key, &value))
-  {
-    if (!PY_STRING_CHECK(key)) {
-      PyErr_Format(
-          PyExc_TypeError,
-          "keys of externals dict must be strings");
+  Py_INCREF(rules);
 
-      return ERROR_INVALID_ARGUMENT;
-    }
-    identifier = PY_STRING_TO_C(key);
+  self->rules = rules;
+  self->max_inflight_bytes = max_inflight_bytes;
+  self->workers = (PIPELINE_WORKER*) calloc(
+      num_workers, sizeof(PIPELINE_WORKER));
+  self->threads = (THREAD*) calloc(num_workers, sizeof(THREAD));
 
-    if (PyBool_Check(value))
-    {
-      result = yr_scanner_define_boolean_variable(
-          scanner,
-          identifier,
-          PyObject_IsTrue(value));
-    }
-#if PY_MAJOR_VERSION >= 3
-    else if (PyLong_Check(value))
-#else
-    else if (PyLong_Check(value) || PyInt_Check(value))
-#endif
-    {
-      result = yr_scanner_define_integer_variable(
-          scanner,
-          identifier,
-          PyLong_AsLongLong(value));
-    }
-    else if (PyFloat_Check(value))
-    {
-      result = yr_scanner_define_float_variable(
-          scanner,
-          identifier,
-          PyFloat_AsDouble(value));
-    }
-    else if (PY_STRING_CHECK(value))
-    {
-      char* str = PY_STRING_TO_C(value);
+  mutex_init(&self->mutex);
+  cond_init(&self->cond);
 
-      if (str == NULL)
-        return ERROR_INVALID_ARGUMENT;
+  if (self->workers == NULL || self->threads == NULL)
+  {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
 
-      result = yr_scanner_define_string_variable(
-          scanner, identifier, str);
-    }
-    else
-    {
-      PyErr_Format(
-          PyExc_TypeError,
-          "external values must be of type integer, float, boolean or string");
+  for (; self->num_workers < num_workers; self->num_workers++)
+  {
+    PIPELINE_WORKER* worker = &self->workers[self->num_workers];
 
-      return ERROR_INVALID_ARGUMENT;
-    }
+    worker->pipeline = self;
 
-    // yr_scanner_define_xxx_variable returns ERROR_INVALID_ARGUMENT if the
-    // variable wasn't previously defined in the compilation phase. Ignore
-    // those errors because we don't want the "scan" method being aborted
-    // because of the "externals" dictionary having more keys than those used
-    // during compilation.
+    if (yr_scanner_create(
+          ((Rules*) rules)->rules, &worker->scanner) != ERROR_SUCCESS)
+    {
+      Py_DECREF(self);
+      return PyErr_Format(PyExc_Exception, "could not create scanner");
+    }
 
-    if (result != ERROR_SUCCESS &&
-        result != ERROR_INVALID_ARGUMENT)
+    if (apply_externals(rules, worker->scanner, externals) != 0)
     {
-      handle_error(result, identifier);
-      return result;
+      // Count this worker so that its scanner is destroyed.
+      self->num_workers++;
+      Py_DECREF(self);
+      return NULL;
     }
+
+    if (fast != NULL && PyObject_IsTrue(fast) == 1)
+      yr_scanner_set_flags(worker->scanner, SCAN_FLAGS_FAST_MODE);
+
+    scanner_set_timeout_ns(worker->scanner, timeout_ns);
   }
 
-  return ERROR_SUCCESS;
+  for (; self->num_threads < num_workers; self->num_threads++)
+  {
+    if (thread_create(
+          &self->threads[self->num_threads],
+          pipeline_worker_thread,
+          &self->workers[self->num_threads]) != 0)
+      break;
+  }
+
+  if (self->num_threads == 0)
+  {
+    Py_DECREF(self);
+    return PyErr_Format(PyExc_Exception, "could not start worker threads");
+  }
+
+  return (PyObject*) self;
 }
 
 
-static PyObject* Match_NEW(
-    const char* rule,
-    const char* ns,
-    PyObject* tags,
-    PyObject* meta,
-    PyObject* strings)
+// Tags and results can reference the pipeline itself, for example a tag
+// holding a callback that closes over it, so the type supports the cycle
+// collector. The job lists are modified by the workers without the GIL, the
+// mutex protects them while they are traversed.
+static int Pipeline_traverse(
+    PyObject* self,
+    visitproc visit,
+    void* arg)
 {
-  Match* object = PyObject_NEW(Match, &Match_Type);
+  Pipeline* pipeline = (Pipeline*) self;
+  PIPELINE_JOB* job;
 
-  if (object != NULL)
+  int result = 0;
+
+  Py_VISIT(pipeline->rules);
+
+  mutex_lock(&pipeline->mutex);
+
+  for (job = pipeline->queue_head; job != NULL && result == 0; job = job->next)
+    result = visit(job->tag, arg);
+
+  for (job = pipeline->results_head; job != NULL && result == 0; job = job->next)
   {
-    object->rule = PY_STRING(rule);
-    object->ns = PY_STRING(ns);
-    object->tags = tags;
-    object->meta = meta;
-    object->strings = strings;
+    result = visit(job->tag, arg);
 
-    Py_INCREF(tags);
-    Py_INCREF(meta);
-    Py_INCREF(strings);
+    if (result == 0 && job->result != NULL)
+      result = visit(job->result, arg);
   }
 
-  return (PyObject*) object;
+  mutex_unlock(&pipeline->mutex);
+
+  return result;
 }
 
 
-static void Match_dealloc(
+// Stops the workers, which finish the queued jobs first, and drops all the
+// results that haven't been retrieved.
+static int Pipeline_clear(
     PyObject* self)
 {
-  Match* object = (Match*) self;
+  Pipeline* pipeline = (Pipeline*) self;
+  PIPELINE_JOB* job;
 
-  Py_DECREF(object->rule);
-  Py_DECREF(object->ns);
-  Py_DECREF(object->tags);
-  Py_DECREF(object->meta);
-  Py_DECREF(object->strings);
+  pipeline_shutdown(pipeline);
 
-  PyObject_Del(self);
+  while ((job = pipeline->results_head) != NULL)
+  {
+    pipeline->results_head = job->next;
+    pipeline_free_job(job);
+  }
+
+  pipeline->results_tail = NULL;
+
+  Py_CLEAR(pipeline->rules);
+
+  return 0;
 }
 
 
-static PyObject* Match_repr(
+static void Pipeline_dealloc(
     PyObject* self)
 {
-  Match* object = (Match*) self;
-  Py_INCREF(object->rule);
-  return object->rule;
-}
+  Pipeline* pipeline = (Pipeline*) self;
 
+  PyObject_GC_UnTrack(self);
+  Pipeline_clear(self);
 
-static PyObject* Match_getattro(
-    PyObject* self,
-    PyObject* name)
-{
-  return PyObject_GenericGetAttr(self, name);
+  for (int i = 0; i < pipeline->num_workers; i++)
+    yr_scanner_destroy(pipeline->workers[i].scanner);
+
+  mutex_destroy(&pipeline->mutex);
+  cond_destroy(&pipeline->cond);
+
+  free(pipeline->workers);
+  free(pipeline->threads);
+
+  Py_TYPE(self)->tp_free(self);
 }
 
 
-static PyObject* Match_richcompare(
+static PyObject* Pipeline_submit(
     PyObject* self,
-    PyObject* other,
-    int op)
+    PyObject* args,
+    PyObject* keywords)
 {
-  PyObject* result = NULL;
+  static char* kwlist[] = {"tag", "data", "filepath", NULL};
 
-  Match* a = (Match*) self;
-  Match* b = (Match*) other;
+  Pipeline* pipeline = (Pipeline*) self;
+  PIPELINE_JOB* job;
 
-  if(PyObject_TypeCheck(other, &Match_Type))
+  PyObject* tag;
+  char* filepath = NULL;
+  Py_buffer data = {0};
+
+  bool closed;
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args, keywords, "O|s*s", kwlist, &tag, &data, &filepath))
+    return NULL;
+
+  if ((data.buf == NULL) == (filepath == NULL))
   {
-    switch(op)
-    {
-    case Py_EQ:
-      if (PyObject_RichCompareBool(a->rule, b->rule, Py_EQ) &&
-          PyObject_RichCompareBool(a->ns, b->ns, Py_EQ))
-        result = Py_True;
-      else
-        result = Py_False;
+    PyBuffer_Release(&data);
+    return PyErr_Format(
+        PyExc_TypeError,
+        "submit() takes either 'data' or 'filepath'");
+  }
 
-      Py_INCREF(result);
-      break;
+  job = (PIPELINE_JOB*) calloc(1, sizeof(PIPELINE_JOB));
 
-    case Py_NE:
-      if (PyObject_RichCompareBool(a->rule, b->rule, Py_NE) ||
-          PyObject_RichCompareBool(a->ns, b->ns, Py_NE))
-          result = Py_True;
-      else
-          result = Py_False;
+  if (job == NULL)
+  {
+    PyBuffer_Release(&data);
+    return PyErr_NoMemory();
+  }
 
-      Py_INCREF(result);
-      break;
+  Py_INCREF(tag);
 
-    case Py_LT:
-    case Py_LE:
-    case Py_GT:
-    case Py_GE:
-      if (PyObject_RichCompareBool(a->rule, b->rule, Py_EQ))
-        result = PyObject_RichCompare(a->ns, b->ns, op);
-      else
-        result = PyObject_RichCompare(a->rule, b->rule, op);
+  job->tag = tag;
+  job->buffer = data;
 
-      break;
+  if (filepath != NULL)
+  {
+    struct stat st;
+
+    job->filepath = strdup(filepath);
+
+    if (job->filepath == NULL)
+    {
+      pipeline_free_job(job);
+      return PyErr_NoMemory();
     }
+
+    if (stat(filepath, &st) == 0)
+      job->size = (size_t) st.st_size;
   }
   else
   {
-    result = PyErr_Format(
-        PyExc_TypeError,
-        "'Match' objects must be compared with objects of the same class");
+    job->size = (size_t) data.len;
   }
 
-  return result;
+  Py_BEGIN_ALLOW_THREADS
+
+  mutex_lock(&pipeline->mutex);
+
+  // A job larger than the whole budget is accepted when nothing else is in
+  // flight, otherwise it could never be submitted.
+  while (!pipeline->closed &&
+         pipeline->inflight_bytes > 0 &&
+         pipeline->inflight_bytes + job->size > pipeline->max_inflight_bytes)
+    cond_wait(&pipeline->cond, &pipeline->mutex);
+
+  closed = pipeline->closed;
+
+  if (!closed)
+  {
+    if (pipeline->queue_tail != NULL)
+      pipeline->queue_tail->next = job;
+    else
+      pipeline->queue_head = job;
+
+    pipeline->queue_tail = job;
+    pipeline->inflight_bytes += job->size;
+    pipeline->pending++;
+
+    cond_broadcast(&pipeline->cond);
+  }
+
+  mutex_unlock(&pipeline->mutex);
+
+  Py_END_ALLOW_THREADS
+
+  if (closed)
+  {
+    pipeline_free_job(job);
+    return PyErr_Format(PyExc_ValueError, "the pipeline is closed");
+  }
+
+  Py_RETURN_NONE;
 }
 
 
-static Py_hash_t Match_hash(
-    PyObject* self)
+// Returns the next result as a (tag, matches) tuple, where "matches" is the
+// exception raised by the scan if it failed. Returns NULL without an
+// exception set if nothing is pending, or if "block" is false and no result
+// is ready yet. Waiting while nothing is pending would block forever unless
+// another thread submits something, and that can't be known here.
+static PyObject* pipeline_next_result(
+    Pipeline* pipeline,
+    bool block)
 {
-  Match* match = (Match*) self;
-  return PyObject_Hash(match->rule) + PyObject_Hash(match->ns);
-}
+  PIPELINE_JOB* job = NULL;
+  PyObject* result;
 
+  Py_BEGIN_ALLOW_THREADS
 
-////////////////////////////////////////////////////////////////////////////////
+  mutex_lock(&pipeline->mutex);
 
+  while (block &&
+         pipeline->results_head == NULL &&
+         pipeline->pending > 0)
+    cond_wait(&pipeline->cond, &pipeline->mutex);
 
-static PyObject* StringMatch_NEW(
-    const char* identifier,
-    uint64_t flags,
-    PyObject* instance_list)
-{
-  StringMatch* object = PyObject_NEW(StringMatch, &StringMatch_Type);
+  job = pipeline->results_head;
 
-  if (object != NULL)
+  if (job != NULL)
   {
-    object->identifier = PY_STRING(identifier);
-    object->flags = flags;
-    object->instances = instance_list;
+    pipeline->results_head = job->next;
 
-    Py_INCREF(instance_list);
+    if (pipeline->results_head == NULL)
+      pipeline->results_tail = NULL;
+
+    pipeline->pending--;
   }
 
-  return (PyObject*) object;
-}
+  mutex_unlock(&pipeline->mutex);
 
+  Py_END_ALLOW_THREADS
 
-static void StringMatch_dealloc(
-    PyObject* self)
-{
-  StringMatch* object = (StringMatch*) self;
+  if (job == NULL)
+    return NULL;
 
-  Py_DECREF(object->identifier);
-  Py_DECREF(object->instances);
+  result = Py_BuildValue("(OO)", job->tag, job->result);
+  pipeline_free_job(job);
 
-  PyObject_Del(self);
+  return result;
 }
 
 
-static PyObject* StringMatch_repr(
-    PyObject* self)
+static PyObject* Pipeline_get(
+    PyObject* self,
+    PyObject* args,
+    PyObject* keywords)
 {
-  StringMatch* object = (StringMatch*) self;
-  Py_INCREF(object->identifier);
-  return object->identifier;
+  static char* kwlist[] = {"block", NULL};
+
+  PyObject* block = NULL;
+  PyObject* result;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywords, "|O", kwlist, &block))
+    return NULL;
+
+  result = pipeline_next_result(
+      (Pipeline*) self, block == NULL || PyObject_IsTrue(block) == 1);
+
+  if (result == NULL && !PyErr_Occurred())
+    Py_RETURN_NONE;
+
+  return result;
 }
 
 
-static PyObject* StringMatch_getattro(
+static PyObject* Pipeline_close(
     PyObject* self,
-    PyObject* name)
+    PyObject* args)
 {
-  return PyObject_GenericGetAttr(self, name);
+  Pipeline* pipeline = (Pipeline*) self;
+
+  mutex_lock(&pipeline->mutex);
+  pipeline->closed = true;
+  cond_broadcast(&pipeline->cond);
+  mutex_unlock(&pipeline->mutex);
+
+  Py_RETURN_NONE;
 }
 
 
-// Hashing on just identifiers can be tricky as there can be duplicate
-// identifiers between rules and there are anonymous strings too. Be careful
-// when using this!
-static Py_hash_t StringMatch_hash(
+// Iterating a pipeline yields results until all the submitted data has been
+// scanned and returned, the pipeline doesn't need to be closed.
+static PyObject* Pipeline_next(
     PyObject* self)
 {
-  return PyObject_Hash(((StringMatch*) self)->identifier);
+  return pipeline_next_result((Pipeline*) self, true);
 }
 
 
-static PyObject* StringMatch_is_xor(
+static PyObject* yara_compile(
     PyObject* self,
-    PyObject* args)
-{
-  if (((StringMatch*) self)->flags & STRING_FLAGS_XOR)
-    Py_RETURN_TRUE;
+    PyObject* args,
+    PyObject* keywords);
 
-  Py_RETURN_FALSE;
-}
 
+// Compiles the namespaces in "sources" or "filepaths" into "num_shards"
+// separate Rules objects. A namespace is the unit of partitioning, as rules
+// can only reference rules and be affected by global rules in their own
+// namespace. Namespaces are assigned to shards largest first, each one to the
+// shard with less source code so far. The remaining arguments are passed to
+// compile() for every shard. Rules in a namespace are never split, so asking
+// for more shards than namespaces is an error instead of silently producing
+// fewer shards.
+static PyObject* compile_sharded(
+    PyObject* self,
+    PyObject* keywords,
+    int num_shards)
+{
+  PyObject* namespaces = NULL;
+  PyObject* shard_dicts = NULL;
+  PyObject* shard_kwargs = NULL;
+  PyObject* shards = NULL;
+  PyObject* empty_args = NULL;
+  PyObject* key;
+  PyObject* value;
 
-////////////////////////////////////////////////////////////////////////////////
+  ShardedRules* result = NULL;
 
+  const char* argument = "sources";
+  PyObject* dict = PyDict_GetItemString(keywords, "sources");
 
-static PyObject* StringMatchInstance_NEW(
-    uint64_t offset,
-    PyObject* matched_data,
-    int32_t match_length,
-    uint8_t xor_key)
-{
-  StringMatchInstance* object = PyObject_NEW(StringMatchInstance, &StringMatchInstance_Type);
+  Py_ssize_t num_namespaces;
+  Py_ssize_t pos = 0;
 
-  if (object != NULL)
-  {
-    object->offset = PyLong_FromLongLong(offset);
-    object->matched_data = matched_data;
-    object->matched_length = PyLong_FromLong(match_length);
-    object->xor_key = PyLong_FromUnsignedLong((uint32_t) xor_key);
+  long long* weights = NULL;
+  long long* loads = NULL;
+  int* assignments = NULL;
 
-    Py_INCREF(matched_data);
+  if (dict == NULL)
+  {
+    argument = "filepaths";
+    dict = PyDict_GetItemString(keywords, "filepaths");
   }
 
-  return (PyObject*) object;
-}
-
-
-static void StringMatchInstance_dealloc(
-    PyObject* self)
-{
-  StringMatchInstance* object = (StringMatchInstance*) self;
+  if (dict == NULL || !PyDict_Check(dict))
+    return PyErr_Format(
+        PyExc_TypeError,
+        "'shards' requires 'sources' or 'filepaths' dictionaries, rules are "
+        "partitioned by namespace");
 
-  Py_DECREF(object->offset);
-  Py_DECREF(object->matched_data);
-  Py_DECREF(object->matched_length);
-  Py_DECREF(object->xor_key);
+  num_namespaces = PyDict_Size(dict);
 
-  PyObject_Del(self);
-}
+  if (num_shards > num_namespaces)
+    return PyErr_Format(
+        PyExc_ValueError,
+        "can't split %zd namespace(s) into %d shards, rules are partitioned "
+        "by namespace",
+        num_namespaces,
+        num_shards);
+
+  weights = (long long*) calloc(num_namespaces + 1, sizeof(long long));
+  loads = (long long*) calloc(num_shards, sizeof(long long));
+  assignments = (int*) calloc(num_namespaces + 1, sizeof(int));
+  namespaces = PyDict_New();
+  shard_dicts = PyList_New(0);
+
+  if (weights == NULL || loads == NULL || assignments == NULL ||
+      namespaces == NULL || shard_dicts == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
+  }
 
+  for (Py_ssize_t i = 0; PyDict_Next(dict, &pos, &key, &value); i++)
+  {
+    PyObject* index = PyLong_FromSsize_t(i);
 
-static PyObject* StringMatchInstance_repr(
-    PyObject* self)
-{
-  StringMatchInstance* object = (StringMatchInstance*) self;
-  return PyCodec_Decode(object->matched_data, "utf-8", "backslashreplace");
-}
+    if (index == NULL || PyDict_SetItem(namespaces, key, index) != 0)
+    {
+      Py_XDECREF(index);
+      goto _exit;
+    }
 
+    Py_DECREF(index);
 
-static PyObject* StringMatchInstance_getattro(
-    PyObject* self,
-    PyObject* name)
-{
-  return PyObject_GenericGetAttr(self, name);
-}
+    if (!PY_STRING_CHECK(value))
+    {
+      PyErr_Format(
+          PyExc_TypeError,
+          "keys and values of the '%s' dictionary must be of string type",
+          argument);
+      goto _exit;
+    }
 
+    if (argument[0] == 's')
+    {
+      weights[i] = (long long) PyObject_Length(value);
+    }
+    else
+    {
+      struct stat st;
 
-static Py_hash_t StringMatchInstance_hash(
-    PyObject* self)
-{
-  return PyObject_Hash(((StringMatchInstance*) self)->matched_data);
-}
+      if (stat(PY_STRING_TO_C(value), &st) == 0)
+        weights[i] = (long long) st.st_size;
+    }
+  }
 
+  // Greedy assignment, heaviest namespaces first.
+  for (Py_ssize_t n = 0; n < num_namespaces; n++)
+  {
+    Py_ssize_t heaviest = -1;
+    int lightest = 0;
 
-static PyObject* StringMatchInstance_plaintext(
-    PyObject* self,
-    PyObject* args)
-{
-  char* pb;
-  Py_ssize_t length;
+    for (Py_ssize_t i = 0; i < num_namespaces; i++)
+    {
+      if (weights[i] >= 0 && (heaviest == -1 || weights[i] > weights[heaviest]))
+        heaviest = i;
+    }
 
-  StringMatchInstance* instance = (StringMatchInstance*) self;
-  uint64_t xor_key = PyLong_AsUnsignedLongLong(instance->xor_key);
-  if (xor_key == 0)
-  {
-      Py_INCREF(instance->matched_data);
-      return instance->matched_data;
+    for (int s = 1; s < num_shards; s++)
+    {
+      if (loads[s] < loads[lightest])
+        lightest = s;
+    }
+
+    assignments[heaviest] = lightest;
+    loads[lightest] += weights[heaviest] + 1;
+    weights[heaviest] = -1;
   }
 
-  int result = PyBytes_AsStringAndSize(instance->matched_data, &pb, &length);
-  if (result == -1)
-    return NULL;
+  for (int s = 0; s < num_shards; s++)
+  {
+    PyObject* shard_dict = PyDict_New();
 
-  // pb points to an internal buffer of the bytes object which we can not
-  // modify. Allocate a new buffer, copy the contents over and do the xor, then
-  // create a new bytes object to return.
-  uint8_t* buf = (uint8_t*) calloc(length, sizeof(uint8_t));
-  if (buf == NULL)
-    return PyErr_Format(PyExc_TypeError, "Out of memory");
+    if (shard_dict == NULL || PyList_Append(shard_dicts, shard_dict) != 0)
+    {
+      Py_XDECREF(shard_dict);
+      goto _exit;
+    }
 
-  memcpy(buf, pb, length);
-  for (size_t i = 0; i < length; i++) {
-    buf[i] = ((uint8_t) pb[i]) ^ xor_key;
+    Py_DECREF(shard_dict);
   }
 
-  PyObject* object = PyBytes_FromStringAndSize((char*) buf, length);
-  free(buf);
+  // Iterating in the original order keeps namespaces in the same relative
+  // order inside each shard.
+  pos = 0;
 
-  return object;
-}
+  for (Py_ssize_t i = 0; PyDict_Next(dict, &pos, &key, &value); i++)
+  {
+    if (PyDict_SetItem(
+          PyList_GET_ITEM(shard_dicts, assignments[i]), key, value) != 0)
+      goto _exit;
+  }
 
+  shards = PyTuple_New(num_shards);
+  empty_args = PyTuple_New(0);
+  shard_kwargs = PyDict_Copy(keywords);
 
-////////////////////////////////////////////////////////////////////////////////
+  if (shards == NULL || empty_args == NULL || shard_kwargs == NULL)
+    goto _exit;
 
+  PyDict_DelItemString(shard_kwargs, "shards");
 
-static void Rule_dealloc(
-    PyObject* self)
-{
-  Rule* object = (Rule*) self;
-  Py_XDECREF(object->identifier);
-  Py_XDECREF(object->tags);
-  Py_XDECREF(object->meta);
-  Py_XDECREF(object->global);
-  Py_XDECREF(object->private);
-  PyObject_Del(self);
-}
+  for (int s = 0; s < num_shards; s++)
+  {
+    if (PyDict_SetItemString(
+          shard_kwargs, argument, PyList_GET_ITEM(shard_dicts, s)) != 0)
+      goto _exit;
 
-static PyObject* Rule_getattro(
-    PyObject* self,
-    PyObject* name)
-{
-  return PyObject_GenericGetAttr(self, name);
-}
+    PyObject* shard = yara_compile(self, empty_args, shard_kwargs);
 
+    if (shard == NULL)
+      goto _exit;
 
-static Rules* Rules_NEW(void)
-{
-  Rules* rules = PyObject_NEW(Rules, &Rules_Type);
+    PyTuple_SET_ITEM(shards, s, shard);
+  }
 
-  if (rules != NULL)
+  result = PyObject_NEW(ShardedRules, &ShardedRules_Type);
+
+  if (result != NULL)
   {
-    rules->rules = NULL;
-    rules->externals = NULL;
-    rules->warnings = NULL;
+    result->shards = shards;
+    result->namespaces = namespaces;
+    shards = NULL;
+    namespaces = NULL;
   }
 
-  return rules;
-}
-
-static void Rules_dealloc(
-    PyObject* self)
-{
-  Rules* object = (Rules*) self;
+_exit:
 
-  Py_XDECREF(object->externals);
-  Py_XDECREF(object->warnings);
+  free(weights);
+  free(loads);
+  free(assignments);
 
-  if (object->rules != NULL)
-    yr_rules_destroy(object->rules);
+  Py_XDECREF(namespaces);
+  Py_XDECREF(shard_dicts);
+  Py_XDECREF(shard_kwargs);
+  Py_XDECREF(shards);
+  Py_XDECREF(empty_args);
 
-  PyObject_Del(self);
+  return (PyObject*) result;
 }
 
-static PyObject* Rules_next(
-    PyObject* self)
+
+// Adds to the compiler the rules of a set passed to compile() in the "sets"
+// argument. A set is either a source string, which goes to a namespace with
+// the set's name, or a dictionary of namespace-source pairs, whose namespaces
+// are prefixed with "<set name>:". Every namespace created is recorded in
+// "rule_sets" with the set it belongs to. Returns a libyara error code, or -1
+// if a Python exception was raised.
+static int compile_rule_set(
+    YR_COMPILER* compiler,
+    PyObject* set_name,
+    PyObject* set,
+    PyObject* rule_sets)
 {
-  PyObject* tag_list;
-  PyObject* object;
-  PyObject* meta_list;
+  PyObject* key;
+  PyObject* value;
+  PyObject* ns;
 
-  YR_META* meta;
-  const char* tag;
+  Py_ssize_t pos = 0;
 
-  Rule* rule;
-  Rules* rules = (Rules *) self;
+  int error = ERROR_SUCCESS;
 
-  // Generate new Rule object based upon iter_current_rule and increment
-  // iter_current_rule.
+  if (!PY_STRING_CHECK(set_name))
+  {
+    PyErr_Format(
+        PyExc_TypeError,
+        "keys of the 'sets' dictionary must be of string type");
+    return -1;
+  }
 
-  if (RULE_IS_NULL(rules->iter_current_rule))
+  if (PY_STRING_CHECK(set))
   {
-    rules->iter_current_rule = rules->rules->rules_table;
-    PyErr_SetNone(PyExc_StopIteration);
-    return NULL;
+    const char* source = PY_STRING_TO_C(set);
+    const char* ns_name = PY_STRING_TO_C(set_name);
+
+    if (source == NULL || ns_name == NULL)
+      return -1;
+
+    if (PyDict_SetItem(rule_sets, set_name, set_name) != 0)
+      return -1;
+
+    Py_BEGIN_ALLOW_THREADS
+    error = yr_compiler_add_string(compiler, source, ns_name);
+    Py_END_ALLOW_THREADS
+
+    return error;
   }
 
-  rule = PyObject_NEW(Rule, &Rule_Type);
-  tag_list = PyList_New(0);
-  meta_list = PyDict_New();
+  if (!PyDict_Check(set))
+  {
+    PyErr_Format(
+        PyExc_TypeError,
+        "values of the 'sets' dictionary must be strings or dictionaries");
+    return -1;
+  }
 
-  if (rule != NULL && tag_list != NULL && meta_list != NULL)
+  while (PyDict_Next(set, &pos, &key, &value))
   {
-    yr_rule_tags_foreach(rules->iter_current_rule, tag)
+    const char* source;
+
+    if (!PY_STRING_CHECK(key) || !PY_STRING_CHECK(value))
     {
-      object = PY_STRING(tag);
-      PyList_Append(tag_list, object);
-      Py_DECREF(object);
+      PyErr_Format(
+          PyExc_TypeError,
+          "keys and values of rule set dictionaries must be of string type");
+      return -1;
     }
 
-    yr_rule_metas_foreach(rules->iter_current_rule, meta)
-    {
-      if (meta->type == META_TYPE_INTEGER)
-        object = Py_BuildValue("i", meta->integer);
-      else if (meta->type == META_TYPE_BOOLEAN)
-        object = PyBool_FromLong((long) meta->integer);
-      else
-        object = PY_STRING(meta->string);
+    source = PY_STRING_TO_C(value);
+    ns = PY_STRING_FORMAT(
+        "%s:%s", PY_STRING_TO_C(set_name), PY_STRING_TO_C(key));
 
-        PyDict_SetItemString(meta_list, meta->identifier, object);
-        Py_DECREF(object);
+    if (source == NULL || ns == NULL || PyErr_Occurred())
+    {
+      Py_XDECREF(ns);
+      return -1;
+    }
 
+    if (PyDict_SetItem(rule_sets, ns, set_name) != 0)
+    {
+      Py_DECREF(ns);
+      return -1;
     }
 
-    rule->global = PyBool_FromLong(rules->iter_current_rule->flags & RULE_FLAGS_GLOBAL);
-    rule->private = PyBool_FromLong(rules->iter_current_rule->flags & RULE_FLAGS_PRIVATE);
-    rule->identifier = PY_STRING(rules->iter_current_rule->identifier);
-    rule->tags = tag_list;
-    rule->meta = meta_list;
-    rules->iter_current_rule++;
-    return (PyObject*) rule;
-  }
-  else
-  {
-    Py_XDECREF(tag_list);
-    Py_XDECREF(meta_list);
-    return PyErr_Format(PyExc_TypeError, "Out of memory");
+    const char* ns_name = PY_STRING_TO_C(ns);
+
+    Py_BEGIN_ALLOW_THREADS
+    error = yr_compiler_add_string(compiler, source, ns_name);
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(ns);
+
+    if (error > 0)
+      break;
   }
+
+  return error;
 }
 
-static PyObject* Rules_match(
+
+static PyObject* yara_compile(
     PyObject* self,
     PyObject* args,
     PyObject* keywords)
 {
-  static char* kwlist[] = {
-      "filepath", "pid", "data", "externals",
-      "callback", "fast", "timeout", "modules_data",
-      "modules_callback", "which_callbacks", "warnings_callback",
-      "console_callback", "allow_duplicate_metadata", NULL
-      };
+  static char *kwlist[] = {
+    "filepath", "source", "file", "filepaths", "sources",
+    "includes", "externals", "error_on_warning", "strict_escape", "include_callback",
+    "sets", "shards", "include_cache", "include_cache_key", NULL};
 
-  char* filepath = NULL;
-  Py_buffer data = {0};
+  YR_COMPILER* compiler;
+  YR_RULES* yara_rules;
+  FILE* fh;
 
-  int pid = -1;
-  int timeout = 0;
-  int error = ERROR_SUCCESS;
+  Rules* rules;
 
+  PyObject* key;
+  PyObject* value;
+  PyObject* result = NULL;
+  PyObject* file = NULL;
+  PyObject* sources_dict = NULL;
+  PyObject* filepaths_dict = NULL;
+  PyObject* includes = NULL;
   PyObject* externals = NULL;
-  PyObject* fast = NULL;
+  PyObject* error_on_warning = NULL;
+  PyObject* strict_escape = NULL;
+  PyObject* include_callback = NULL;
+  PyObject* sets_dict = NULL;
+  PyObject* rule_sets = NULL;
+  PyObject* use_include_cache = NULL;
+  PyObject* include_cache_key = NULL;
+
+  INCLUDE_CACHE include_cache;
+  bool include_cache_enabled = false;
+
+  Py_ssize_t pos = 0;
+
+  int fd;
+  int error = 0;
+  int num_shards = 0;
+
+  char* filepath = NULL;
+  char* source = NULL;
+  char* ns = NULL;
+  PyObject* warnings = PyList_New(0);
+  bool warning_error = false;
+
+  if (PyArg_ParseTupleAndKeywords(
+        args,
+        keywords,
+        "|ssOOOOOOOOOiOO",
+        kwlist,
+        &filepath,
+        &source,
+        &file,
+        &filepaths_dict,
+        &sources_dict,
+        &includes,
+        &externals,
+        &error_on_warning,
+        &strict_escape,
+        &include_callback,
+        &sets_dict,
+        &num_shards,
+        &use_include_cache,
+        &include_cache_key))
+  {
+    if (num_shards > 1)
+    {
+      Py_DECREF(warnings);
+
+      if (PyTuple_Size(args) > 0)
+        return PyErr_Format(
+            PyExc_TypeError,
+            "'shards' requires keyword arguments");
+
+      return compile_sharded(self, keywords, num_shards);
+    }
+
+    char num_args = 0;
+
+    if (filepath != NULL)
+      num_args++;
+
+    if (source != NULL)
+      num_args++;
+
+    if (file != NULL)
+      num_args++;
 
-  Rules* object = (Rules*) self;
+    if (filepaths_dict != NULL)
+      num_args++;
 
-  YR_SCANNER* scanner;
-  CALLBACK_DATA callback_data;
+    if (sources_dict != NULL)
+      num_args++;
 
-  callback_data.matches = NULL;
-  callback_data.callback = NULL;
-  callback_data.modules_data = NULL;
-  callback_data.modules_callback = NULL;
-  callback_data.warnings_callback = NULL;
-  callback_data.console_callback = NULL;
-  callback_data.which = CALLBACK_ALL;
-  callback_data.allow_duplicate_metadata = false;
+    if (sets_dict != NULL)
+      num_args++;
 
-  if (PyArg_ParseTupleAndKeywords(
-        args,
-        keywords,
-        "|sis*OOOiOOiOOb",
-        kwlist,
-        &filepath,
-        &pid,
-        &data,
-        &externals,
-        &callback_data.callback,
-        &fast,
-        &timeout,
-        &callback_data.modules_data,
-        &callback_data.modules_callback,
-        &callback_data.which,
-        &callback_data.warnings_callback,
-        &callback_data.console_callback,
-        &callback_data.allow_duplicate_metadata))
-  {
-    if (filepath == NULL && data.buf == NULL && pid == -1)
-    {
+    if (num_args > 1)
       return PyErr_Format(
           PyExc_TypeError,
-          "match() takes at least one argument");
-    }
+          "compile is receiving too many arguments");
 
-    if (callback_data.callback != NULL)
+    error = yr_compiler_create(&compiler);
+
+    if (error != ERROR_SUCCESS)
+      return handle_error(error, NULL);
+
+    yr_compiler_set_callback(compiler, raise_exception_on_error, warnings);
+
+    if (error_on_warning != NULL)
     {
-      if (!PyCallable_Check(callback_data.callback))
+      if (PyBool_Check(error_on_warning))
       {
-        PyBuffer_Release(&data);
-        return PyErr_Format(
-            PyExc_TypeError,
-            "'callback' must be callable");
+        if (PyObject_IsTrue(error_on_warning) == 1)
+        {
+          warning_error = true;
+        }
       }
-    }
-
-    if (callback_data.modules_callback != NULL)
-    {
-      if (!PyCallable_Check(callback_data.modules_callback))
+      else
       {
-        PyBuffer_Release(&data);
+        yr_compiler_destroy(compiler);
         return PyErr_Format(
             PyExc_TypeError,
-            "'modules_callback' must be callable");
+            "'error_on_warning' param must be of boolean type");
       }
     }
 
-    if (callback_data.warnings_callback != NULL)
+    if (strict_escape != NULL)
     {
-      if (!PyCallable_Check(callback_data.warnings_callback))
+      if (PyBool_Check(strict_escape))
       {
-        PyBuffer_Release(&data);
+        compiler->strict_escape = PyObject_IsTrue(strict_escape);
+      }
+      else
+      {
+        yr_compiler_destroy(compiler);
         return PyErr_Format(
             PyExc_TypeError,
-            "'warnings_callback' must be callable");
+            "'strict_escape' param must be of boolean type");
       }
     }
 
-    if (callback_data.console_callback != NULL)
+    if (includes != NULL)
     {
-      if (!PyCallable_Check(callback_data.console_callback))
+      if (PyBool_Check(includes))
       {
-        PyBuffer_Release(&data);
+        // PyObject_IsTrue can return -1 in case of error
+        if (PyObject_IsTrue(includes) == 0)
+          yr_compiler_set_include_callback(compiler, NULL, NULL, NULL);
+      }
+      else
+      {
+        yr_compiler_destroy(compiler);
         return PyErr_Format(
             PyExc_TypeError,
-            "'console_callback' must be callable");
+            "'includes' param must be of boolean type");
       }
     }
 
-    if (callback_data.modules_data != NULL)
+    if (include_callback != NULL)
     {
-      if (!PyDict_Check(callback_data.modules_data))
+      if (!PyCallable_Check(include_callback))
       {
-        PyBuffer_Release(&data);
+        yr_compiler_destroy(compiler);
         return PyErr_Format(
             PyExc_TypeError,
-            "'modules_data' must be a dictionary");
+            "'include_callback' must be callable");
       }
+
+      yr_compiler_set_include_callback(
+          compiler,
+          yara_include_callback,
+          yara_include_free,
+          include_callback);
     }
 
-    if (callback_data.allow_duplicate_metadata == NULL)
-      callback_data.allow_duplicate_metadata = false;
+    if (include_cache_key != NULL &&
+        include_cache_key != Py_None &&
+        !PyCallable_Check(include_cache_key))
+    {
+      yr_compiler_destroy(compiler);
+      return PyErr_Format(
+          PyExc_TypeError,
+          "'include_cache_key' must be callable");
+    }
 
-    if (yr_scanner_create(object->rules, &scanner) != 0)
+    if (include_cache_key != NULL &&
+        include_cache_key != Py_None &&
+        (use_include_cache == NULL || PyObject_IsTrue(use_include_cache) != 1))
     {
+      yr_compiler_destroy(compiler);
       return PyErr_Format(
-          PyExc_Exception,
-          "could not create scanner");
+          PyExc_ValueError,
+          "'include_cache_key' requires 'include_cache'");
+    }
+
+    // The cache replaces the include callback set above, if any, and is
+    // not used when includes are disabled.
+    if (use_include_cache != NULL && PyObject_IsTrue(use_include_cache) == 1 &&
+        (include_callback != NULL ||
+         includes == NULL ||
+         PyObject_IsTrue(includes) == 1))
+    {
+      memset(&include_cache, 0, sizeof(include_cache));
+
+      include_cache.callback = include_callback;
+
+      if (include_cache_key != Py_None)
+        include_cache.key_callback = include_cache_key;
+
+      include_cache_enabled = true;
+
+      yr_compiler_set_include_callback(
+          compiler,
+          include_cache_callback,
+          include_cache_free,
+          &include_cache);
     }
 
     if (externals != NULL && externals != Py_None)
     {
       if (PyDict_Check(externals))
       {
-        if (process_match_externals(externals, scanner) != ERROR_SUCCESS)
+        if (process_compile_externals(externals, compiler) != ERROR_SUCCESS)
         {
-          PyBuffer_Release(&data);
-          yr_scanner_destroy(scanner);
+          yr_compiler_destroy(compiler);
           return NULL;
         }
       }
       else
       {
-        PyBuffer_Release(&data);
-        yr_scanner_destroy(scanner);
+        yr_compiler_destroy(compiler);
         return PyErr_Format(
             PyExc_TypeError,
             "'externals' must be a dictionary");
       }
     }
 
-    if (fast != NULL && PyObject_IsTrue(fast) == 1)
-    {
-      yr_scanner_set_flags(scanner, SCAN_FLAGS_FAST_MODE);
-    }
-
-    yr_scanner_set_timeout(scanner, timeout);
-    yr_scanner_set_callback(scanner, yara_callback, &callback_data);
+    Py_XINCREF(include_callback);
 
     if (filepath != NULL)
     {
-      callback_data.matches = PyList_New(0);
+      fh = fopen(filepath, "r");
 
+      if (fh != NULL)
+      {
+        Py_BEGIN_ALLOW_THREADS
+        error = yr_compiler_add_file(compiler, fh, NULL, filepath);
+        fclose(fh);
+        Py_END_ALLOW_THREADS
+      }
+      else
+      {
+        result = PyErr_SetFromErrno(YaraError);
+      }
+    }
+    else if (source != NULL)
+    {
       Py_BEGIN_ALLOW_THREADS
+      error = yr_compiler_add_string(compiler, source, NULL);
+      Py_END_ALLOW_THREADS
+    }
+    else if (file != NULL)
+    {
+      fd = PyObject_AsFileDescriptor(file);
+
+      if (fd != -1)
+      {
+        Py_BEGIN_ALLOW_THREADS
+        fh = fdopen(dup(fd), "r");
+        error = yr_compiler_add_file(compiler, fh, NULL, NULL);
+        fclose(fh);
+        Py_END_ALLOW_THREADS
+      }
+      else
+      {
+        result = PyErr_Format(
+            PyExc_TypeError,
+            "'file' is not a file object");
+      }
+    }
+    else if (sources_dict != NULL)
+    {
+      if (PyDict_Check(sources_dict))
+      {
+        while (PyDict_Next(sources_dict, &pos, &key, &value))
+        {
+          source = PY_STRING_TO_C(value);
+          ns = PY_STRING_TO_C(key);
 
-      error = yr_scanner_scan_file(scanner, filepath);
+          if (source != NULL && ns != NULL)
+          {
+            Py_BEGIN_ALLOW_THREADS
+            error = yr_compiler_add_string(compiler, source, ns);
+            Py_END_ALLOW_THREADS
 
-      Py_END_ALLOW_THREADS
+            if (error > 0)
+              break;
+          }
+          else
+          {
+            result = PyErr_Format(
+                PyExc_TypeError,
+                "keys and values of the 'sources' dictionary must be "
+                "of string type");
+            break;
+          }
+        }
+      }
+      else
+      {
+        result = PyErr_Format(
+            PyExc_TypeError,
+            "'sources' must be a dictionary");
+      }
     }
-    else if (data.buf != NULL)
+    else if (filepaths_dict != NULL)
     {
-      callback_data.matches = PyList_New(0);
+      if (PyDict_Check(filepaths_dict))
+      {
+        while (PyDict_Next(filepaths_dict, &pos, &key, &value))
+        {
+          filepath = PY_STRING_TO_C(value);
+          ns = PY_STRING_TO_C(key);
 
-      Py_BEGIN_ALLOW_THREADS
+          if (filepath != NULL && ns != NULL)
+          {
+            fh = fopen(filepath, "r");
 
-      error = yr_scanner_scan_mem(
-          scanner,
-          (unsigned char*) data.buf,
-          (size_t) data.len);
+            if (fh != NULL)
+            {
+              Py_BEGIN_ALLOW_THREADS
+              error = yr_compiler_add_file(compiler, fh, ns, filepath);
+              fclose(fh);
+              Py_END_ALLOW_THREADS
 
-      Py_END_ALLOW_THREADS
+              if (error > 0)
+                break;
+            }
+            else
+            {
+              result = PyErr_SetFromErrno(YaraError);
+              break;
+            }
+          }
+          else
+          {
+            result = PyErr_Format(
+                PyExc_TypeError,
+                "keys and values of the filepaths dictionary must be of "
+                "string type");
+            break;
+          }
+        }
+      }
+      else
+      {
+        result = PyErr_Format(
+            PyExc_TypeError,
+            "filepaths must be a dictionary");
+      }
     }
-    else if (pid != -1)
+    else if (sets_dict != NULL)
     {
-      callback_data.matches = PyList_New(0);
+      // Rule sets are compiled together so that a single scan evaluates all
+      // of them, and modules parse the scanned data only once. Global rules
+      // only affect rules in their own namespace, so sets don't interfere
+      // with each other.
+      if (PyDict_Check(sets_dict))
+      {
+        rule_sets = PyDict_New();
 
-      Py_BEGIN_ALLOW_THREADS
+        while (rule_sets != NULL && PyDict_Next(sets_dict, &pos, &key, &value))
+        {
+          error = compile_rule_set(compiler, key, value, rule_sets);
 
-      error = yr_scanner_scan_proc(scanner, pid);
+          if (error != ERROR_SUCCESS)
+            break;
+        }
+      }
+      else
+      {
+        result = PyErr_Format(
+            PyExc_TypeError,
+            "'sets' must be a dictionary");
+      }
+    }
+    else
+    {
+      result = PyErr_Format(
+          PyExc_TypeError,
+          "compile() takes 1 argument");
+    }
 
-      Py_END_ALLOW_THREADS
+    if (warning_error && PyList_Size(warnings) > 0)
+    {
+      PyErr_SetObject(YaraWarningError, warnings);
     }
 
-    PyBuffer_Release(&data);
-    yr_scanner_destroy(scanner);
+    if (include_cache_enabled && include_cache_raise(&include_cache))
+    {
+      result = NULL;
+    }
 
-    if (error != ERROR_SUCCESS)
+    if (PyErr_Occurred() == NULL)
     {
-      Py_DECREF(callback_data.matches);
+      rules = Rules_NEW();
 
-      if (error != ERROR_CALLBACK_ERROR)
+      if (rules != NULL)
       {
-        if (filepath != NULL)
-        {
-          handle_error(error, filepath);
-        }
-        else if (pid != -1)
-        {
-          handle_error(error, "<proc>");
-        }
-        else
+        Py_BEGIN_ALLOW_THREADS
+        error = yr_compiler_get_rules(compiler, &yara_rules);
+        Py_END_ALLOW_THREADS
+
+        if (error == ERROR_SUCCESS)
         {
-          handle_error(error, "<data>");
-        }
+          rules->rules = yara_rules;
+          rules->iter_current_rule = rules->rules->rules_table;
+          rules->warnings = warnings;
+          rules->rule_sets = rule_sets;
+          rule_sets = NULL;
 
-        #ifdef PROFILING_ENABLED
-        PyObject* exception = PyErr_Occurred();
+          if (include_cache_enabled)
+            rules->compile_stats = include_cache_stats(&include_cache);
 
-        if (exception != NULL && error == ERROR_SCAN_TIMEOUT)
+          if (externals != NULL && externals != Py_None)
+            rules->externals = PyDict_Copy(externals);
+
+          result = (PyObject*) rules;
+        }
+        else
         {
-          PyObject_SetAttrString(
-              exception,
-              "profiling_info",
-              Rules_profiling_info(self, NULL));
+          Py_DECREF(rules);
+          result = handle_error(error, NULL);
         }
-        #endif
       }
-
-      return NULL;
+      else
+      {
+        result = handle_error(ERROR_INSUFFICIENT_MEMORY, NULL);
+      }
     }
+
+    yr_compiler_destroy(compiler);
+    Py_XDECREF(include_callback);
+    Py_XDECREF(rule_sets);
+
+    if (include_cache_enabled)
+      include_cache_destroy(&include_cache);
   }
 
-  return callback_data.matches;
+  return result;
 }
 
 
-static PyObject* Rules_save(
+static PyObject* yara_load(
     PyObject* self,
     PyObject* args,
     PyObject* keywords)
@@ -2325,9 +14497,11 @@ static PyObject* Rules_save(
       "filepath", "file",  NULL
       };
 
-  char* filepath = NULL;
+  YR_EXTERNAL_VARIABLE* external;
+
+  Rules* rules = NULL;
   PyObject* file = NULL;
-  Rules* rules = (Rules*) self;
+  char* filepath = NULL;
 
   int error;
 
@@ -2344,26 +14518,42 @@ static PyObject* Rules_save(
 
   if (filepath != NULL)
   {
-    Py_BEGIN_ALLOW_THREADS
-    error = yr_rules_save(rules->rules, filepath);
-    Py_END_ALLOW_THREADS
+    rules = Rules_NEW();
+
+    if (rules == NULL)
+      return PyErr_NoMemory();
+
+    Py_BEGIN_ALLOW_THREADS;
+    error = yr_rules_load(filepath, &rules->rules);
+    Py_END_ALLOW_THREADS;
 
     if (error != ERROR_SUCCESS)
+    {
+      Py_DECREF(rules);
       return handle_error(error, filepath);
+    }
   }
-  else if (file != NULL && PyObject_HasAttrString(file, "write"))
+  else if (file != NULL && PyObject_HasAttrString(file, "read"))
   {
     YR_STREAM stream;
 
     stream.user_data = file;
-    stream.write = flo_write;
+    stream.read = flo_read;
+
+    rules = Rules_NEW();
+
+    if (rules == NULL)
+      return PyErr_NoMemory();
 
     Py_BEGIN_ALLOW_THREADS;
-    error = yr_rules_save_stream(rules->rules, &stream);
+    error = yr_rules_load_stream(&stream, &rules->rules);
     Py_END_ALLOW_THREADS;
 
     if (error != ERROR_SUCCESS)
+    {
+      Py_DECREF(rules);
       return handle_error(error, "<file-like-object>");
+    }
   }
   else
   {
@@ -2372,735 +14562,989 @@ static PyObject* Rules_save(
       "load() expects either a file path or a file-like object");
   }
 
-  Py_RETURN_NONE;
-}
-
-
-static PyObject* Rules_profiling_info(
-    PyObject* self,
-    PyObject* args)
-{
-
-#ifdef PROFILING_ENABLED
-  PyObject* object;
-  PyObject* result;
-
-  YR_RULES* rules = ((Rules*) self)->rules;
-  YR_RULE* rule;
-  YR_STRING* string;
-
-  char key[512];
-  uint64_t clock_ticks;
+  external = rules->rules->ext_vars_table;
+  rules->iter_current_rule = rules->rules->rules_table;
 
-  result = PyDict_New();
+  if (!EXTERNAL_VARIABLE_IS_NULL(external))
+    rules->externals = PyDict_New();
 
-  yr_rules_foreach(rules, rule)
+  while (!EXTERNAL_VARIABLE_IS_NULL(external))
   {
-    clock_ticks = rule->clock_ticks;
-
-    yr_rule_strings_foreach(rule, string)
+    switch(external->type)
     {
-      clock_ticks += string->clock_ticks;
+      case EXTERNAL_VARIABLE_TYPE_BOOLEAN:
+        PyDict_SetItemString(
+            rules->externals,
+            external->identifier,
+            PyBool_FromLong((long) external->value.i));
+        break;
+      case EXTERNAL_VARIABLE_TYPE_INTEGER:
+        PyDict_SetItemString(
+            rules->externals,
+            external->identifier,
+            PyLong_FromLong((long) external->value.i));
+        break;
+      case EXTERNAL_VARIABLE_TYPE_FLOAT:
+        PyDict_SetItemString(
+            rules->externals,
+            external->identifier,
+            PyFloat_FromDouble(external->value.f));
+        break;
+      case EXTERNAL_VARIABLE_TYPE_STRING:
+        PyDict_SetItemString(
+            rules->externals,
+            external->identifier,
+            PY_STRING(external->value.s));
+        break;
     }
 
-    snprintf(key, sizeof(key), "%s:%s", rule->ns->name, rule->identifier);
-
-    object = PyLong_FromLongLong(clock_ticks);
-    PyDict_SetItemString(result, key, object);
-    Py_DECREF(object);
+    external++;
   }
 
-  return result;
-#else
-  return PyErr_Format(YaraError, "libyara compiled without profiling support");
-#endif
-}
-
-
-static PyObject* Rules_getattro(
-    PyObject* self,
-    PyObject* name)
-{
-  return PyObject_GenericGetAttr(self, name);
+  return (PyObject*) rules;
 }
 
 
-void raise_exception_on_error(
-    int error_level,
-    const char* file_name,
-    int line_number,
-    const YR_RULE* rule,
-    const char* message,
-    void* user_data)
+void finalize(void)
 {
-  PyGILState_STATE gil_state = PyGILState_Ensure();
-
-  if (error_level == YARA_ERROR_LEVEL_ERROR)
-  {
-    if (file_name != NULL)
-      PyErr_Format(
-          YaraSyntaxError,
-          "%s(%d): %s",
-          file_name,
-          line_number,
-          message);
-    else
-      PyErr_Format(
-          YaraSyntaxError,
-          "line %d: %s",
-          line_number,
-          message);
-  }
-  else
-  {
-    PyObject* warnings = (PyObject*)user_data;
-    PyObject* warning_msg;
-    if (file_name != NULL)
-      warning_msg = PY_STRING_FORMAT(
-          "%s(%d): %s",
-          file_name,
-          line_number,
-          message);
-    else
-      warning_msg = PY_STRING_FORMAT(
-          "line %d: %s",
-          line_number,
-          message);
-    PyList_Append(warnings, warning_msg);
-    Py_DECREF(warning_msg);
-  }
-
-  PyGILState_Release(gil_state);
+  yr_finalize();
 }
 
 
-////////////////////////////////////////////////////////////////////////////////
+// compile_dir compiles every file matching a pattern in a directory tree.
+// Without shards all the files are compiled by a single compiler into one
+// Rules object, as libyara can't link separately compiled rules. As that stops
+// at the first error, when it fails every namespace is compiled again in
+// parallel as a unit with its own compiler, only to report the errors of all
+// the files. With shards the files are distributed among that many units,
+// keeping the files of a namespace together, and the units are compiled in
+// parallel, the rules of each unit forming one shard of the ShardedRules
+// object returned.
 
-const char* yara_include_callback(
-    const char* include_name,
-    const char* calling_rule_filename,
-    const char* calling_rule_namespace,
-    void* user_data)
-{
-  PyObject* result;
-  PyObject* callback = (PyObject*) user_data;
-  PyObject* py_incl_name = NULL;
-  PyObject* py_calling_fn = NULL;
-  PyObject* py_calling_ns = NULL;
-  PyObject* type = NULL;
-  PyObject* value = NULL;
-  PyObject* traceback = NULL;
+typedef struct _COMPILE_DIR_FILE
+{
+  char* path;
+  char* ns;
+  long long size;
+  char* error;
+  char** warnings;
+  int num_warnings;
 
-  const char* cstring_result = NULL;
+} COMPILE_DIR_FILE;
 
-  PyGILState_STATE gil_state = PyGILState_Ensure();
 
-  if (include_name != NULL)
-  {
-    py_incl_name = PY_STRING(include_name);
-  }
-  else //safeguard: should never happen for 'include_name'
-  {
-    py_incl_name = Py_None;
-    Py_INCREF(py_incl_name);
-  }
+typedef struct _COMPILE_DIR_UNIT
+{
+  YR_COMPILER* compiler;
+  YR_RULES* rules;
+  INCLUDE_CACHE include_cache;
+  int* files;
+  int num_files;
+  int error;
 
-  if (calling_rule_filename != NULL)
-  {
-    py_calling_fn = PY_STRING(calling_rule_filename);
-  }
-  else
-  {
-    py_calling_fn = Py_None;
-    Py_INCREF(py_calling_fn);
-  }
+} COMPILE_DIR_UNIT;
 
-  if (calling_rule_namespace != NULL)
-  {
-    py_calling_ns = PY_STRING(calling_rule_namespace);
-  }
-  else
-  {
-    py_calling_ns = Py_None;
-    Py_INCREF(py_calling_ns);
-  }
 
-  PyErr_Fetch(&type, &value, &traceback);
+typedef struct _COMPILE_DIR
+{
+  COMPILE_DIR_FILE* files;
+  COMPILE_DIR_UNIT* units;
+  int num_files;
+  int num_units;
+  int next_unit;
+  bool link;
+  bool cache_includes;
+  MUTEX mutex;
 
-  result = PyObject_CallFunctionObjArgs(
-      callback,
-      py_incl_name,
-      py_calling_fn,
-      py_calling_ns,
-      NULL);
+} COMPILE_DIR;
 
-  PyErr_Restore(type, value, traceback);
 
-  Py_DECREF(py_incl_name);
-  Py_DECREF(py_calling_fn);
-  Py_DECREF(py_calling_ns);
+// Compiler callback used while compiling in parallel, it records errors and
+// warnings in the COMPILE_DIR_FILE being compiled without touching Python.
+static void compile_dir_callback(
+    int error_level,
+    const char* file_name,
+    int line_number,
+    const YR_RULE* rule,
+    const char* message,
+    void* user_data)
+{
+  COMPILE_DIR_FILE* file = (COMPILE_DIR_FILE*) user_data;
+  char buffer[1024];
 
-  if (result != NULL && result != Py_None && PY_STRING_CHECK(result))
+  snprintf(
+      buffer,
+      sizeof(buffer),
+      "%s(%d): %s",
+      file_name != NULL ? file_name : file->path,
+      line_number,
+      message);
+
+  if (error_level == YARA_ERROR_LEVEL_ERROR)
   {
-    //transferring string ownership to C code
-    cstring_result = strdup(PY_STRING_TO_C(result));
+    if (file->error == NULL)
+      file->error = strdup(buffer);
   }
   else
   {
-    if (PyErr_Occurred() == NULL)
-    {
-      PyErr_Format(PyExc_TypeError,
-          "'include_callback' function must return a yara rules as an ascii "
-          "or unicode string");
-    }
-  }
-
-  Py_XDECREF(result);
-  PyGILState_Release(gil_state);
+    char** warnings = (char**) realloc(
+        file->warnings, (file->num_warnings + 1) * sizeof(char*));
 
-  return cstring_result;
-}
+    if (warnings != NULL)
+    {
+      file->warnings = warnings;
+      file->warnings[file->num_warnings] = strdup(buffer);
 
-void yara_include_free(
-    const char* result_ptr,
-    void* user_data)
-{
-  if (result_ptr != NULL)
-  {
-    free((void*) result_ptr);
+      if (file->warnings[file->num_warnings] != NULL)
+        file->num_warnings++;
+    }
   }
 }
 
-////////////////////////////////////////////////////////////////////////////////
 
-static PyObject* yara_set_config(
-    PyObject* self,
-    PyObject* args,
-    PyObject* keywords)
+static THREAD_ROUTINE(compile_dir_thread, arg)
 {
+  COMPILE_DIR* dir = (COMPILE_DIR*) arg;
 
-  /*
-   * It is recommended that this be kept up to date with the config
-   * options present in yara/libyara.c yr_set_configuration(...) - ck
-   */
-  static char *kwlist[] = {
-    "stack_size", "max_strings_per_rule", "max_match_data", NULL};
+  while (true)
+  {
+    mutex_lock(&dir->mutex);
+    int i = dir->next_unit++;
+    mutex_unlock(&dir->mutex);
 
-  unsigned int stack_size = 0;
-  unsigned int max_strings_per_rule = 0;
-  unsigned int max_match_data = 0;
+    if (i >= dir->num_units)
+      break;
 
-  int error = 0;
+    COMPILE_DIR_UNIT* unit = &dir->units[i];
 
-  if (PyArg_ParseTupleAndKeywords(
-        args,
-        keywords,
-        "|III",
-        kwlist,
-        &stack_size,
-        &max_strings_per_rule,
-  	&max_match_data))
-  {
-    if (stack_size != 0)
+    for (int j = 0; j < unit->num_files; j++)
     {
-      error = yr_set_configuration(
-          YR_CONFIG_STACK_SIZE,
-          &stack_size);
+      COMPILE_DIR_FILE* file = &dir->files[unit->files[j]];
+      FILE* fh = fopen(file->path, "r");
 
-      if ( error != ERROR_SUCCESS)
-        return handle_error(error, NULL);
-    }
+      if (fh == NULL)
+      {
+        file->error = strdup("could not open file");
+        unit->error = ERROR_COULD_NOT_OPEN_FILE;
+        break;
+      }
 
-    if (max_strings_per_rule != 0)
-    {
-      error = yr_set_configuration(
-          YR_CONFIG_MAX_STRINGS_PER_RULE,
-				  &max_strings_per_rule);
+      yr_compiler_set_callback(unit->compiler, compile_dir_callback, file);
 
-      if (error != ERROR_SUCCESS)
-        return handle_error(error, NULL);
-    }
+      // After an error the compiler can't be used anymore, the remaining
+      // files of the unit are left unchecked.
+      if (yr_compiler_add_file(unit->compiler, fh, file->ns, file->path) > 0)
+        unit->error = ERROR_INVALID_FILE;
 
-    if (max_match_data != 0)
-    {
-      error = yr_set_configuration(
-          YR_CONFIG_MAX_MATCH_DATA,
-				  &max_match_data);
+      fclose(fh);
 
-      if (error != ERROR_SUCCESS)
-        return handle_error(error, NULL);
+      if (unit->error != ERROR_SUCCESS)
+        break;
     }
+
+    if (unit->error == ERROR_SUCCESS && !dir->link)
+      unit->error = yr_compiler_get_rules(unit->compiler, &unit->rules);
   }
 
-  Py_RETURN_NONE;
+  THREAD_RETURN;
 }
 
-static PyObject* yara_compile(
-    PyObject* self,
-    PyObject* args,
-    PyObject* keywords)
-{
-  static char *kwlist[] = {
-    "filepath", "source", "file", "filepaths", "sources",
-    "includes", "externals", "error_on_warning", "strict_escape", "include_callback", NULL};
 
-  YR_COMPILER* compiler;
-  YR_RULES* yara_rules;
-  FILE* fh;
+// Fills dir->files with the files under "path" whose names match "pattern",
+// sorted by path, and their namespaces.
+static int compile_dir_find_files(
+    PyObject* path,
+    const char* pattern,
+    const char* namespace_from,
+    COMPILE_DIR* dir)
+{
+  PyObject* os = PyImport_ImportModule("os");
+  PyObject* fnmatch = PyImport_ImportModule("fnmatch");
+  PyObject* os_path = NULL;
+  PyObject* walk = NULL;
+  PyObject* iterator = NULL;
+  PyObject* entry;
+  PyObject* paths = PyList_New(0);
 
-  Rules* rules;
+  int result = -1;
 
-  PyObject* key;
-  PyObject* value;
-  PyObject* result = NULL;
-  PyObject* file = NULL;
-  PyObject* sources_dict = NULL;
-  PyObject* filepaths_dict = NULL;
-  PyObject* includes = NULL;
-  PyObject* externals = NULL;
-  PyObject* error_on_warning = NULL;
-  PyObject* strict_escape = NULL;
-  PyObject* include_callback = NULL;
+  if (os == NULL || fnmatch == NULL || paths == NULL)
+    goto _exit;
 
-  Py_ssize_t pos = 0;
+  os_path = PyObject_GetAttrString(os, "path");
+  walk = PyObject_CallMethod(os, "walk", "O", path);
 
-  int fd;
-  int error = 0;
+  if (os_path == NULL || walk == NULL)
+    goto _exit;
 
-  char* filepath = NULL;
-  char* source = NULL;
-  char* ns = NULL;
-  PyObject* warnings = PyList_New(0);
-  bool warning_error = false;
+  iterator = PyObject_GetIter(walk);
 
-  if (PyArg_ParseTupleAndKeywords(
-        args,
-        keywords,
-        "|ssOOOOOOOO",
-        kwlist,
-        &filepath,
-        &source,
-        &file,
-        &filepaths_dict,
-        &sources_dict,
-        &includes,
-        &externals,
-        &error_on_warning,
-        &strict_escape,
-        &include_callback))
+  while (iterator != NULL && (entry = PyIter_Next(iterator)) != NULL)
   {
-    char num_args = 0;
+    PyObject* root;
+    PyObject* dirs;
+    PyObject* names;
+    PyObject* matched;
 
-    if (filepath != NULL)
-      num_args++;
+    if (!PyArg_ParseTuple(entry, "OOO", &root, &dirs, &names))
+    {
+      Py_DECREF(entry);
+      goto _exit;
+    }
 
-    if (source != NULL)
-      num_args++;
+    matched = PyObject_CallMethod(fnmatch, "filter", "Os", names, pattern);
 
-    if (file != NULL)
-      num_args++;
+    for (Py_ssize_t i = 0; matched != NULL && i < PyList_Size(matched); i++)
+    {
+      PyObject* joined = PyObject_CallMethod(
+          os_path, "join", "OO", root, PyList_GET_ITEM(matched, i));
 
-    if (filepaths_dict != NULL)
-      num_args++;
+      if (joined == NULL || PyList_Append(paths, joined) != 0)
+        Py_CLEAR(matched);
 
-    if (sources_dict != NULL)
-      num_args++;
+      Py_XDECREF(joined);
+    }
 
-    if (num_args > 1)
-      return PyErr_Format(
-          PyExc_TypeError,
-          "compile is receiving too many arguments");
+    Py_DECREF(entry);
 
-    error = yr_compiler_create(&compiler);
+    if (matched == NULL)
+      goto _exit;
 
-    if (error != ERROR_SUCCESS)
-      return handle_error(error, NULL);
+    Py_DECREF(matched);
+  }
 
-    yr_compiler_set_callback(compiler, raise_exception_on_error, warnings);
+  if (PyErr_Occurred() || PyList_Sort(paths) != 0)
+    goto _exit;
 
-    if (error_on_warning != NULL)
-    {
-      if (PyBool_Check(error_on_warning))
-      {
-        if (PyObject_IsTrue(error_on_warning) == 1)
-        {
-          warning_error = true;
-        }
-      }
-      else
-      {
-        yr_compiler_destroy(compiler);
-        return PyErr_Format(
-            PyExc_TypeError,
-            "'error_on_warning' param must be of boolean type");
-      }
-    }
+  dir->num_files = (int) PyList_Size(paths);
+  dir->files = (COMPILE_DIR_FILE*) calloc(
+      yr_max(dir->num_files, 1), sizeof(COMPILE_DIR_FILE));
 
-    if (strict_escape != NULL)
+  if (dir->files == NULL)
+  {
+    PyErr_NoMemory();
+    goto _exit;
+  }
+
+  for (int i = 0; i < dir->num_files; i++)
+  {
+    PyObject* file_path = PyList_GET_ITEM(paths, i);
+    PyObject* name = NULL;
+    PyObject* ns = NULL;
+    struct stat st;
+
+    if (namespace_from == NULL || strcmp(namespace_from, "default") == 0)
+      ns = PY_STRING("default");
+    else if (strcmp(namespace_from, "filename") == 0)
+      name = PyObject_CallMethod(os_path, "basename", "O", file_path);
+    else
+      name = PyObject_CallMethod(os_path, "relpath", "OO", file_path, path);
+
+    if (ns == NULL && name != NULL)
     {
-      if (PyBool_Check(strict_escape))
-      {
-        compiler->strict_escape = PyObject_IsTrue(strict_escape);
-      }
-      else
-      {
-        yr_compiler_destroy(compiler);
-        return PyErr_Format(
-            PyExc_TypeError,
-            "'strict_escape' param must be of boolean type");
-      }
+      PyObject* parts = PyObject_CallMethod(os_path, "splitext", "O", name);
+      PyObject* sep = PyObject_GetAttrString(os, "sep");
+
+      if (parts != NULL && sep != NULL)
+        ns = PyObject_CallMethod(
+            PyTuple_GET_ITEM(parts, 0), "replace", "Os", sep, "/");
+
+      Py_XDECREF(parts);
+      Py_XDECREF(sep);
+      Py_DECREF(name);
     }
 
-    if (includes != NULL)
+    if (ns == NULL)
+      goto _exit;
+
+    dir->files[i].path = strdup(PY_STRING_TO_C(file_path));
+    dir->files[i].ns = strdup(PY_STRING_TO_C(ns));
+
+    Py_DECREF(ns);
+
+    if (dir->files[i].path == NULL || dir->files[i].ns == NULL)
     {
-      if (PyBool_Check(includes))
-      {
-        // PyObject_IsTrue can return -1 in case of error
-        if (PyObject_IsTrue(includes) == 0)
-          yr_compiler_set_include_callback(compiler, NULL, NULL, NULL);
-      }
-      else
-      {
-        yr_compiler_destroy(compiler);
-        return PyErr_Format(
-            PyExc_TypeError,
-            "'includes' param must be of boolean type");
-      }
+      PyErr_NoMemory();
+      goto _exit;
     }
 
-    if (include_callback != NULL)
-    {
-      if (!PyCallable_Check(include_callback))
-      {
-        yr_compiler_destroy(compiler);
-        return PyErr_Format(
-            PyExc_TypeError,
-            "'include_callback' must be callable");
-      }
+    if (stat(dir->files[i].path, &st) == 0)
+      dir->files[i].size = (long long) st.st_size;
+  }
 
-      yr_compiler_set_include_callback(
-          compiler,
-          yara_include_callback,
-          yara_include_free,
-          include_callback);
-    }
+  result = 0;
 
-    if (externals != NULL && externals != Py_None)
+_exit:
+
+  Py_XDECREF(os);
+  Py_XDECREF(fnmatch);
+  Py_XDECREF(os_path);
+  Py_XDECREF(walk);
+  Py_XDECREF(iterator);
+  Py_XDECREF(paths);
+
+  return result;
+}
+
+
+// Distributes the files among the units. Without linking every namespace is a
+// unit, so rules can use the ones defined in other files of their namespace,
+// otherwise namespaces are assigned to the least loaded unit, largest first,
+// like compile_sharded does.
+static int compile_dir_assign_units(
+    COMPILE_DIR* dir,
+    int num_shards)
+{
+  int* assignments = (int*) calloc(yr_max(dir->num_files, 1), sizeof(int));
+  long long* loads = (long long*) calloc(
+      yr_max(num_shards, 1), sizeof(long long));
+  long long* weights = (long long*) calloc(
+      yr_max(dir->num_files, 1), sizeof(long long));
+
+  int result = -1;
+
+  if (assignments == NULL || loads == NULL || weights == NULL)
+    goto _exit;
+
+  if (dir->link)
+  {
+    dir->num_units = 0;
+
+    for (int i = 0; i < dir->num_files; i++)
     {
-      if (PyDict_Check(externals))
+      int first = i;
+
+      for (int j = 0; j < i; j++)
       {
-        if (process_compile_externals(externals, compiler) != ERROR_SUCCESS)
+        if (strcmp(dir->files[j].ns, dir->files[i].ns) == 0)
         {
-          yr_compiler_destroy(compiler);
-          return NULL;
+          first = j;
+          break;
         }
       }
-      else
-      {
-        yr_compiler_destroy(compiler);
-        return PyErr_Format(
-            PyExc_TypeError,
-            "'externals' must be a dictionary");
-      }
-    }
 
-    Py_XINCREF(include_callback);
+      assignments[i] = first == i ? dir->num_units++ : assignments[first];
+    }
+  }
+  else
+  {
+    dir->num_units = num_shards;
 
-    if (filepath != NULL)
+    // The weight of a namespace is accumulated in its first file.
+    for (int i = 0; i < dir->num_files; i++)
     {
-      fh = fopen(filepath, "r");
+      int first = i;
 
-      if (fh != NULL)
-      {
-        Py_BEGIN_ALLOW_THREADS
-        error = yr_compiler_add_file(compiler, fh, NULL, filepath);
-        fclose(fh);
-        Py_END_ALLOW_THREADS
-      }
-      else
+      for (int j = 0; j < i; j++)
       {
-        result = PyErr_SetFromErrno(YaraError);
+        if (strcmp(dir->files[j].ns, dir->files[i].ns) == 0)
+        {
+          first = j;
+          break;
+        }
       }
+
+      assignments[i] = first;
+      weights[first] += dir->files[i].size + 1;
     }
-    else if (source != NULL)
-    {
-      Py_BEGIN_ALLOW_THREADS
-      error = yr_compiler_add_string(compiler, source, NULL);
-      Py_END_ALLOW_THREADS
-    }
-    else if (file != NULL)
+
+    for (int n = 0; n < dir->num_files; n++)
     {
-      fd = PyObject_AsFileDescriptor(file);
+      int heaviest = -1;
+      int lightest = 0;
 
-      if (fd != -1)
+      for (int i = 0; i < dir->num_files; i++)
       {
-        Py_BEGIN_ALLOW_THREADS
-        fh = fdopen(dup(fd), "r");
-        error = yr_compiler_add_file(compiler, fh, NULL, NULL);
-        fclose(fh);
-        Py_END_ALLOW_THREADS
+        if (weights[i] > 0 && (heaviest == -1 || weights[i] > weights[heaviest]))
+          heaviest = i;
       }
-      else
+
+      if (heaviest == -1)
+        break;
+
+      for (int u = 1; u < num_shards; u++)
       {
-        result = PyErr_Format(
-            PyExc_TypeError,
-            "'file' is not a file object");
+        if (loads[u] < loads[lightest])
+          lightest = u;
       }
+
+      loads[lightest] += weights[heaviest];
+      weights[heaviest] = -(long long) lightest - 1;
     }
-    else if (sources_dict != NULL)
+
+    for (int i = 0; i < dir->num_files; i++)
+      assignments[i] = (int) -weights[assignments[i]] - 1;
+  }
+
+  dir->units = (COMPILE_DIR_UNIT*) calloc(
+      yr_max(dir->num_units, 1), sizeof(COMPILE_DIR_UNIT));
+
+  if (dir->units == NULL)
+    goto _exit;
+
+  for (int u = 0; u < dir->num_units; u++)
+  {
+    dir->units[u].files = (int*) malloc(
+        yr_max(dir->num_files, 1) * sizeof(int));
+
+    if (dir->units[u].files == NULL)
+      goto _exit;
+  }
+
+  for (int i = 0; i < dir->num_files; i++)
+  {
+    COMPILE_DIR_UNIT* unit = &dir->units[assignments[i]];
+    unit->files[unit->num_files++] = i;
+  }
+
+  result = 0;
+
+_exit:
+
+  free(assignments);
+  free(loads);
+  free(weights);
+
+  return result;
+}
+
+
+static void compile_dir_destroy(
+    COMPILE_DIR* dir)
+{
+  for (int u = 0; dir->units != NULL && u < dir->num_units; u++)
+  {
+    if (dir->units[u].compiler != NULL)
+      yr_compiler_destroy(dir->units[u].compiler);
+
+    if (dir->units[u].rules != NULL)
+      yr_rules_destroy(dir->units[u].rules);
+
+    include_cache_destroy(&dir->units[u].include_cache);
+    free(dir->units[u].files);
+  }
+
+  for (int i = 0; dir->files != NULL && i < dir->num_files; i++)
+  {
+    free(dir->files[i].path);
+    free(dir->files[i].ns);
+    free(dir->files[i].error);
+
+    for (int j = 0; j < dir->files[i].num_warnings; j++)
+      free(dir->files[i].warnings[j]);
+
+    free(dir->files[i].warnings);
+  }
+
+  free(dir->units);
+  free(dir->files);
+
+  mutex_destroy(&dir->mutex);
+}
+
+
+// Creates a compiler configured with the arguments of compile_dir. Included
+// files are read through "include_cache", which must be zeroed, or by libyara
+// if it's NULL.
+static YR_COMPILER* compile_dir_create_compiler(
+    PyObject* externals,
+    bool includes,
+    INCLUDE_CACHE* include_cache)
+{
+  YR_COMPILER* compiler;
+
+  int error = yr_compiler_create(&compiler);
+
+  if (error != ERROR_SUCCESS)
+  {
+    handle_error(error, NULL);
+    return NULL;
+  }
+
+  if (!includes)
+    yr_compiler_set_include_callback(compiler, NULL, NULL, NULL);
+  else if (include_cache != NULL)
+    yr_compiler_set_include_callback(
+        compiler, include_cache_callback, include_cache_free, include_cache);
+
+  if (externals != NULL && externals != Py_None &&
+      process_compile_externals(externals, compiler) != ERROR_SUCCESS)
+  {
+    if (!PyErr_Occurred())
+      PyErr_Format(PyExc_TypeError, "invalid external variables");
+
+    yr_compiler_destroy(compiler);
+    return NULL;
+  }
+
+  return compiler;
+}
+
+
+// Raises a yara.SyntaxError listing the errors of every file, the "errors"
+// attribute of the exception maps the path of each file to its error.
+static void compile_dir_raise_errors(
+    COMPILE_DIR* dir)
+{
+  PyObject* errors = PyDict_New();
+  PyObject* lines = PyList_New(0);
+  PyObject* message = NULL;
+  PyObject* separator = PY_STRING("\n");
+  PyObject* exception = NULL;
+
+  for (int i = 0;
+       errors != NULL && lines != NULL && i < dir->num_files;
+       i++)
+  {
+    PyObject* error;
+
+    if (dir->files[i].error == NULL)
+      continue;
+
+    error = PY_STRING(dir->files[i].error);
+
+    if (error == NULL ||
+        PyDict_SetItemString(errors, dir->files[i].path, error) != 0 ||
+        PyList_Append(lines, error) != 0)
+      Py_CLEAR(errors);
+
+    Py_XDECREF(error);
+  }
+
+  if (errors != NULL && lines != NULL && separator != NULL)
+    message = PyObject_CallMethod(separator, "join", "O", lines);
+
+  if (message != NULL)
+    exception = PyObject_CallFunctionObjArgs(YaraSyntaxError, message, NULL);
+
+  if (exception != NULL &&
+      PyObject_SetAttrString(exception, "errors", errors) == 0)
+    PyErr_SetObject(YaraSyntaxError, exception);
+
+  Py_XDECREF(errors);
+  Py_XDECREF(lines);
+  Py_XDECREF(message);
+  Py_XDECREF(separator);
+  Py_XDECREF(exception);
+}
+
+
+static PyObject* compile_dir_warnings(
+    COMPILE_DIR* dir,
+    COMPILE_DIR_UNIT* unit)
+{
+  PyObject* warnings = PyList_New(0);
+
+  for (int j = 0; warnings != NULL && j < unit->num_files; j++)
+  {
+    COMPILE_DIR_FILE* file = &dir->files[unit->files[j]];
+
+    for (int k = 0; warnings != NULL && k < file->num_warnings; k++)
     {
-      if (PyDict_Check(sources_dict))
-      {
-        while (PyDict_Next(sources_dict, &pos, &key, &value))
-        {
-          source = PY_STRING_TO_C(value);
-          ns = PY_STRING_TO_C(key);
+      PyObject* warning = PY_STRING(file->warnings[k]);
 
-          if (source != NULL && ns != NULL)
-          {
-            Py_BEGIN_ALLOW_THREADS
-            error = yr_compiler_add_string(compiler, source, ns);
-            Py_END_ALLOW_THREADS
+      if (warning == NULL || PyList_Append(warnings, warning) != 0)
+        Py_CLEAR(warnings);
 
-            if (error > 0)
-              break;
-          }
-          else
-          {
-            result = PyErr_Format(
-                PyExc_TypeError,
-                "keys and values of the 'sources' dictionary must be "
-                "of string type");
-            break;
-          }
-        }
-      }
-      else
-      {
-        result = PyErr_Format(
-            PyExc_TypeError,
-            "'sources' must be a dictionary");
-      }
+      Py_XDECREF(warning);
     }
-    else if (filepaths_dict != NULL)
-    {
-      if (PyDict_Check(filepaths_dict))
-      {
-        while (PyDict_Next(filepaths_dict, &pos, &key, &value))
-        {
-          filepath = PY_STRING_TO_C(value);
-          ns = PY_STRING_TO_C(key);
+  }
 
-          if (filepath != NULL && ns != NULL)
-          {
-            fh = fopen(filepath, "r");
+  return warnings;
+}
 
-            if (fh != NULL)
-            {
-              Py_BEGIN_ALLOW_THREADS
-              error = yr_compiler_add_file(compiler, fh, ns, filepath);
-              fclose(fh);
-              Py_END_ALLOW_THREADS
 
-              if (error > 0)
-                break;
-            }
-            else
-            {
-              result = PyErr_SetFromErrno(YaraError);
-              break;
-            }
-          }
-          else
-          {
-            result = PyErr_Format(
-                PyExc_TypeError,
-                "keys and values of the filepaths dictionary must be of "
-                "string type");
-            break;
-          }
-        }
-      }
-      else
-      {
-        result = PyErr_Format(
-            PyExc_TypeError,
-            "filepaths must be a dictionary");
-      }
-    }
-    else
+// Compiles the units of "dir" in parallel using up to "num_threads" threads.
+// Returns -1 with an exception set if the compilers couldn't be created, the
+// errors found while compiling are left in the files and units.
+static int compile_dir_run(
+    COMPILE_DIR* dir,
+    int num_threads,
+    PyObject* externals,
+    bool includes)
+{
+  THREAD* threads;
+
+  for (int u = 0; u < dir->num_units; u++)
+  {
+    dir->units[u].compiler = compile_dir_create_compiler(
+        externals,
+        includes,
+        dir->cache_includes ? &dir->units[u].include_cache : NULL);
+
+    if (dir->units[u].compiler == NULL)
+      return -1;
+  }
+
+  if (num_threads < 1)
+    num_threads = 1;
+
+  threads = (THREAD*) calloc(num_threads, sizeof(THREAD));
+
+  if (threads == NULL)
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+
+  int num_started = 1;
+
+  for (; num_started < num_threads; num_started++)
+  {
+    if (thread_create(
+          &threads[num_started], compile_dir_thread, dir) != 0)
+      break;
+  }
+
+  compile_dir_thread(dir);
+
+  for (int i = 1; i < num_started; i++)
+    thread_join(threads[i]);
+
+  Py_END_ALLOW_THREADS
+
+  free(threads);
+
+  return 0;
+}
+
+
+// Raises the errors left by compile_dir_run, and the warnings too if
+// "warning_error" is true. Returns 0 if there were none.
+static int compile_dir_check(
+    COMPILE_DIR* dir,
+    bool warning_error)
+{
+  for (int i = 0; i < dir->num_files; i++)
+  {
+    if (dir->files[i].error != NULL)
     {
-      result = PyErr_Format(
-          PyExc_TypeError,
-          "compile() takes 1 argument");
+      compile_dir_raise_errors(dir);
+      return -1;
     }
+  }
 
-    if (warning_error && PyList_Size(warnings) > 0)
+  for (int u = 0; u < dir->num_units; u++)
+  {
+    if (dir->units[u].error != ERROR_SUCCESS)
     {
-      PyErr_SetObject(YaraWarningError, warnings);
+      handle_error(dir->units[u].error, NULL);
+      return -1;
     }
 
-    if (PyErr_Occurred() == NULL)
+    if (warning_error)
     {
-      rules = Rules_NEW();
-
-      if (rules != NULL)
+      for (int j = 0; j < dir->units[u].num_files; j++)
       {
-        Py_BEGIN_ALLOW_THREADS
-        error = yr_compiler_get_rules(compiler, &yara_rules);
-        Py_END_ALLOW_THREADS
-
-        if (error == ERROR_SUCCESS)
+        if (dir->files[dir->units[u].files[j]].num_warnings > 0)
         {
-          rules->rules = yara_rules;
-          rules->iter_current_rule = rules->rules->rules_table;
-          rules->warnings = warnings;
+          PyObject* warnings = compile_dir_warnings(dir, &dir->units[u]);
 
-          if (externals != NULL && externals != Py_None)
-            rules->externals = PyDict_Copy(externals);
+          if (warnings != NULL)
+          {
+            PyErr_SetObject(YaraWarningError, warnings);
+            Py_DECREF(warnings);
+          }
 
-          result = (PyObject*) rules;
+          return -1;
         }
-        else
-        {
-          Py_DECREF(rules);
-          result = handle_error(error, NULL);
-        }
-      }
-      else
-      {
-        result = handle_error(ERROR_INSUFFICIENT_MEMORY, NULL);
       }
     }
-
-    yr_compiler_destroy(compiler);
-    Py_XDECREF(include_callback);
   }
 
-  return result;
+  return 0;
 }
 
 
-static PyObject* yara_load(
+static PyObject* yara_compile_dir(
     PyObject* self,
     PyObject* args,
     PyObject* keywords)
 {
-  static char* kwlist[] = {
-      "filepath", "file",  NULL
-      };
+  static char *kwlist[] = {
+    "path", "pattern", "namespace_from", "threads", "shards", "includes",
+    "externals", "error_on_warning", "include_cache", NULL};
 
-  YR_EXTERNAL_VARIABLE* external;
+  PyObject* path;
+  PyObject* includes = NULL;
+  PyObject* externals = NULL;
+  PyObject* error_on_warning = NULL;
+  PyObject* use_include_cache = NULL;
+  PyObject* warnings = NULL;
+  PyObject* result = NULL;
 
-  Rules* rules = NULL;
-  PyObject* file = NULL;
-  char* filepath = NULL;
+  const char* pattern = "*.yar";
+  const char* namespace_from = "filename";
 
-  int error;
+  int num_threads = 4;
+  int num_shards = 0;
+  int error = ERROR_SUCCESS;
+
+  bool use_includes;
+  bool warning_error;
+
+  COMPILE_DIR dir;
+  YR_COMPILER* compiler = NULL;
+  YR_RULES* yara_rules;
+
+  INCLUDE_CACHE include_cache;
+
+  memset(&include_cache, 0, sizeof(include_cache));
 
   if (!PyArg_ParseTupleAndKeywords(
-      args,
-      keywords,
-      "|sO",
-      kwlist,
-      &filepath,
-      &file))
+        args,
+        keywords,
+        "O|sziiOOOO",
+        kwlist,
+        &path,
+        &pattern,
+        &namespace_from,
+        &num_threads,
+        &num_shards,
+        &includes,
+        &externals,
+        &error_on_warning,
+        &use_include_cache))
   {
     return NULL;
   }
 
-  if (filepath != NULL)
+  if (namespace_from != NULL &&
+      strcmp(namespace_from, "filename") != 0 &&
+      strcmp(namespace_from, "path") != 0 &&
+      strcmp(namespace_from, "default") != 0)
   {
-    rules = Rules_NEW();
+    return PyErr_Format(
+        PyExc_ValueError,
+        "'namespace_from' must be \"filename\", \"path\" or \"default\"");
+  }
 
-    if (rules == NULL)
-      return PyErr_NoMemory();
+  if (externals != NULL && externals != Py_None && !PyDict_Check(externals))
+    return PyErr_Format(
+        PyExc_TypeError,
+        "'externals' must be a dictionary");
 
-    Py_BEGIN_ALLOW_THREADS;
-    error = yr_rules_load(filepath, &rules->rules);
-    Py_END_ALLOW_THREADS;
+  use_includes = includes == NULL || PyObject_IsTrue(includes) == 1;
+  warning_error =
+      error_on_warning != NULL && PyObject_IsTrue(error_on_warning) == 1;
 
-    if (error != ERROR_SUCCESS)
-    {
-      Py_DECREF(rules);
-      return handle_error(error, filepath);
-    }
+  memset(&dir, 0, sizeof(dir));
+  mutex_init(&dir.mutex);
+
+  dir.link = num_shards < 1;
+  dir.cache_includes =
+      use_include_cache != NULL && PyObject_IsTrue(use_include_cache) == 1;
+
+  if (compile_dir_find_files(path, pattern, namespace_from, &dir) != 0)
+    goto _exit;
+
+  if (num_shards > dir.num_files)
+    num_shards = yr_max(dir.num_files, 1);
+
+  if (compile_dir_assign_units(&dir, num_shards) != 0)
+  {
+    PyErr_NoMemory();
+    goto _exit;
   }
-  else if (file != NULL && PyObject_HasAttrString(file, "read"))
+
+  if (!dir.link)
   {
-    YR_STREAM stream;
+    ShardedRules* sharded;
+    PyObject* shards;
+    PyObject* namespaces;
 
-    stream.user_data = file;
-    stream.read = flo_read;
+    if (compile_dir_run(&dir, num_threads, externals, use_includes) != 0 ||
+        compile_dir_check(&dir, warning_error) != 0)
+      goto _exit;
 
-    rules = Rules_NEW();
+    shards = PyTuple_New(dir.num_units);
+    namespaces = PyDict_New();
 
-    if (rules == NULL)
-      return PyErr_NoMemory();
+    if (shards == NULL || namespaces == NULL)
+    {
+      Py_XDECREF(shards);
+      Py_XDECREF(namespaces);
+      goto _exit;
+    }
 
-    Py_BEGIN_ALLOW_THREADS;
-    error = yr_rules_load_stream(&stream, &rules->rules);
-    Py_END_ALLOW_THREADS;
+    for (int i = 0; i < dir.num_files; i++)
+    {
+      PyObject* index = PyLong_FromLong(i);
 
-    if (error != ERROR_SUCCESS)
+      if (PyDict_GetItemString(namespaces, dir.files[i].ns) != NULL)
+      {
+        Py_XDECREF(index);
+        continue;
+      }
+
+      if (index == NULL ||
+          PyDict_SetItemString(namespaces, dir.files[i].ns, index) != 0)
+      {
+        Py_XDECREF(index);
+        Py_DECREF(shards);
+        Py_DECREF(namespaces);
+        goto _exit;
+      }
+
+      Py_DECREF(index);
+    }
+
+    for (int u = 0; u < dir.num_units; u++)
     {
-      Py_DECREF(rules);
-      return handle_error(error, "<file-like-object>");
+      Rules* rules = Rules_NEW();
+
+      if (rules == NULL)
+      {
+        Py_DECREF(shards);
+        Py_DECREF(namespaces);
+        goto _exit;
+      }
+
+      rules->rules = dir.units[u].rules;
+      rules->iter_current_rule = rules->rules->rules_table;
+      rules->warnings = compile_dir_warnings(&dir, &dir.units[u]);
+
+      if (dir.cache_includes)
+        rules->compile_stats = include_cache_stats(
+            &dir.units[u].include_cache);
+
+      dir.units[u].rules = NULL;
+
+      if (externals != NULL && externals != Py_None)
+        rules->externals = PyDict_Copy(externals);
+
+      PyTuple_SET_ITEM(shards, u, (PyObject*) rules);
+
+      if (rules->warnings == NULL)
+      {
+        Py_DECREF(shards);
+        Py_DECREF(namespaces);
+        goto _exit;
+      }
     }
-  }
-  else
-  {
-    return PyErr_Format(
-      PyExc_TypeError,
-      "load() expects either a file path or a file-like object");
+
+    sharded = PyObject_NEW(ShardedRules, &ShardedRules_Type);
+
+    if (sharded == NULL)
+    {
+      Py_DECREF(shards);
+      Py_DECREF(namespaces);
+      goto _exit;
+    }
+
+    sharded->shards = shards;
+    sharded->namespaces = namespaces;
+
+    result = (PyObject*) sharded;
+    goto _exit;
   }
 
-  external = rules->rules->ext_vars_table;
-  rules->iter_current_rule = rules->rules->rules_table;
+  warnings = PyList_New(0);
+  compiler = compile_dir_create_compiler(
+      externals,
+      use_includes,
+      dir.cache_includes ? &include_cache : NULL);
 
-  if (!EXTERNAL_VARIABLE_IS_NULL(external))
-    rules->externals = PyDict_New();
+  if (warnings == NULL || compiler == NULL)
+    goto _exit;
 
-  while (!EXTERNAL_VARIABLE_IS_NULL(external))
+  yr_compiler_set_callback(compiler, raise_exception_on_error, warnings);
+
+  for (int i = 0; i < dir.num_files; i++)
   {
-    switch(external->type)
+    FILE* fh = fopen(dir.files[i].path, "r");
+
+    if (fh == NULL)
     {
-      case EXTERNAL_VARIABLE_TYPE_BOOLEAN:
-        PyDict_SetItemString(
-            rules->externals,
-            external->identifier,
-            PyBool_FromLong((long) external->value.i));
-        break;
-      case EXTERNAL_VARIABLE_TYPE_INTEGER:
-        PyDict_SetItemString(
-            rules->externals,
-            external->identifier,
-            PyLong_FromLong((long) external->value.i));
-        break;
-      case EXTERNAL_VARIABLE_TYPE_FLOAT:
-        PyDict_SetItemString(
-            rules->externals,
-            external->identifier,
-            PyFloat_FromDouble(external->value.f));
-        break;
-      case EXTERNAL_VARIABLE_TYPE_STRING:
-        PyDict_SetItemString(
-            rules->externals,
-            external->identifier,
-            PY_STRING(external->value.s));
-        break;
+      PyErr_SetFromErrno(YaraError);
+      goto _exit;
     }
 
-    external++;
+    Py_BEGIN_ALLOW_THREADS
+    error = yr_compiler_add_file(
+        compiler, fh, dir.files[i].ns, dir.files[i].path);
+    fclose(fh);
+    Py_END_ALLOW_THREADS
+
+    if (error > 0)
+    {
+      PyObject* type;
+      PyObject* value;
+      PyObject* traceback;
+
+      // Look for the errors of every file, keeping the one already raised if
+      // compiling the namespaces separately doesn't find any.
+      PyErr_Fetch(&type, &value, &traceback);
+
+      if (compile_dir_run(&dir, num_threads, externals, use_includes) == 0 &&
+          compile_dir_check(&dir, false) != 0)
+      {
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+      }
+      else
+      {
+        PyErr_Clear();
+        PyErr_Restore(type, value, traceback);
+      }
+
+      goto _exit;
+    }
   }
 
-  return (PyObject*) rules;
-}
+  if (warning_error && PyList_Size(warnings) > 0)
+  {
+    PyErr_SetObject(YaraWarningError, warnings);
+    goto _exit;
+  }
 
+  Py_BEGIN_ALLOW_THREADS
+  error = yr_compiler_get_rules(compiler, &yara_rules);
+  Py_END_ALLOW_THREADS
 
-void finalize(void)
-{
-  yr_finalize();
+  if (error != ERROR_SUCCESS)
+  {
+    handle_error(error, NULL);
+    goto _exit;
+  }
+
+  Rules* rules = Rules_NEW();
+
+  if (rules == NULL)
+  {
+    yr_rules_destroy(yara_rules);
+    goto _exit;
+  }
+
+  rules->rules = yara_rules;
+  rules->iter_current_rule = rules->rules->rules_table;
+  rules->warnings = warnings;
+
+  if (dir.cache_includes)
+    rules->compile_stats = include_cache_stats(&include_cache);
+
+  warnings = NULL;
+
+  if (externals != NULL && externals != Py_None)
+    rules->externals = PyDict_Copy(externals);
+
+  result = (PyObject*) rules;
+
+_exit:
+
+  if (compiler != NULL)
+    yr_compiler_destroy(compiler);
+
+  include_cache_destroy(&include_cache);
+
+  compile_dir_destroy(&dir);
+
+  Py_XDECREF(warnings);
+
+  return result;
 }
 
 
@@ -3111,18 +15555,42 @@ static PyMethodDef yara_methods[] = {
     METH_VARARGS | METH_KEYWORDS,
     "Compiles a YARA rules file and returns an instance of class Rules"
   },
+  {
+    "compile_dir",
+    (PyCFunction) yara_compile_dir,
+    METH_VARARGS | METH_KEYWORDS,
+    "Compiles the YARA rules files in a directory tree"
+  },
   {
     "load",
     (PyCFunction) yara_load,
     METH_VARARGS | METH_KEYWORDS,
     "Loads a previously saved YARA rules file and returns an instance of class Rules"
   },
+  {
+    "build_index",
+    (PyCFunction) yara_build_index,
+    METH_VARARGS | METH_KEYWORDS,
+    "Builds a n-gram index for a set of files and writes it to index_path"
+  },
+  {
+    "load_index",
+    (PyCFunction) yara_load_index,
+    METH_VARARGS | METH_KEYWORDS,
+    "Loads an index created with build_index and returns an instance of class Index"
+  },
   {
     "set_config",
     (PyCFunction) yara_set_config,
     METH_VARARGS | METH_KEYWORDS,
     "Set a yara configuration variable (stack_size, max_strings_per_rule, or max_match_data)"
   },
+  {
+    "_restore_match",
+    (PyCFunction) yara_restore_match,
+    METH_VARARGS,
+    "Recreates a pickled Match, StringMatch or StringMatchInstance"
+  },
   { NULL, NULL }
 };
 
@@ -3189,6 +15657,7 @@ MOD_INIT(yara)
   YaraSyntaxError = PyErr_NewException("yara.SyntaxError", YaraError, NULL);
   YaraTimeoutError = PyErr_NewException("yara.TimeoutError", YaraError, NULL);
   YaraWarningError = PyErr_NewException("yara.WarningError", YaraError, NULL);
+  YaraCancelledError = PyErr_NewException("yara.CancelledError", YaraError, NULL);
 
   PyTypeObject *YaraWarningError_type = (PyTypeObject *) YaraWarningError;
   PyObject* descr = PyDescr_NewGetSet(YaraWarningError_type, YaraWarningError_getsetters);
@@ -3205,6 +15674,7 @@ MOD_INIT(yara)
   YaraSyntaxError = Py_BuildValue("s", "yara.SyntaxError");
   YaraTimeoutError = Py_BuildValue("s", "yara.TimeoutError");
   YaraWarningError = Py_BuildValue("s", "yara.WarningError");
+  YaraCancelledError = Py_BuildValue("s", "yara.CancelledError");
 #endif
 
   if (PyType_Ready(&Rule_Type) < 0)
@@ -3222,18 +15692,60 @@ MOD_INIT(yara)
   if (PyType_Ready(&StringMatchInstance_Type) < 0)
     return MOD_ERROR_VAL;
 
+  if (PyType_Ready(&Index_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&CancellationToken_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&Externals_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&ObjectView_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&ResultCache_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&DiskResultCache_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&ShardedRules_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&Pipeline_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&MatchIterator_Type) < 0)
+    return MOD_ERROR_VAL;
+
+  if (PyType_Ready(&MatchTable_Type) < 0)
+    return MOD_ERROR_VAL;
+
   PyStructSequence_InitType(&RuleString_Type, &RuleString_Desc);
+  PyStructSequence_InitType(&StringAtoms_Type, &StringAtoms_Desc);
 
   PyModule_AddObject(m, "Rule", (PyObject*) &Rule_Type);
   PyModule_AddObject(m, "Rules", (PyObject*) &Rules_Type);
   PyModule_AddObject(m, "Match",  (PyObject*) &Match_Type);
   PyModule_AddObject(m, "StringMatch",  (PyObject*) &StringMatch_Type);
   PyModule_AddObject(m, "StringMatchInstance",  (PyObject*) &StringMatchInstance_Type);
+  PyModule_AddObject(m, "Index",  (PyObject*) &Index_Type);
+  PyModule_AddObject(m, "CancellationToken",  (PyObject*) &CancellationToken_Type);
+  PyModule_AddObject(m, "Externals",  (PyObject*) &Externals_Type);
+  PyModule_AddObject(m, "ObjectView",  (PyObject*) &ObjectView_Type);
+  PyModule_AddObject(m, "ResultCache",  (PyObject*) &ResultCache_Type);
+  PyModule_AddObject(m, "DiskResultCache",  (PyObject*) &DiskResultCache_Type);
+  PyModule_AddObject(m, "ShardedRules",  (PyObject*) &ShardedRules_Type);
+  PyModule_AddObject(m, "Pipeline",  (PyObject*) &Pipeline_Type);
+  PyModule_AddObject(m, "MatchIterator",  (PyObject*) &MatchIterator_Type);
+  PyModule_AddObject(m, "MatchTable",  (PyObject*) &MatchTable_Type);
 
   PyModule_AddObject(m, "Error", YaraError);
   PyModule_AddObject(m, "SyntaxError", YaraSyntaxError);
   PyModule_AddObject(m, "TimeoutError", YaraTimeoutError);
   PyModule_AddObject(m, "WarningError", YaraWarningError);
+  PyModule_AddObject(m, "CancelledError", YaraCancelledError);
 
   if (yr_initialize() != ERROR_SUCCESS)
   {